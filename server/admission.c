@@ -0,0 +1,75 @@
+#include "server_internal.h"
+
+#include <pthread.h>
+
+/*
+ * Per-account write rate limit. Accounts hash into a fixed table of token
+ * buckets instead of each getting its own entry, so the table never grows
+ * and needs no eviction; two accounts that collide share one budget, which
+ * can only make the limit stricter for them, never looser.
+ */
+
+#define ADMISSION_BUCKETS 4096
+
+typedef struct {
+    pthread_mutex_t mutex;
+    double tokens;
+    uint64_t refill_ns;
+} rate_bucket_t;
+
+static rate_bucket_t g_buckets[ADMISSION_BUCKETS];
+static pthread_once_t g_buckets_once = PTHREAD_ONCE_INIT;
+static admission_config_t g_config;
+
+static void init_buckets(void) {
+    for (int i = 0; i < ADMISSION_BUCKETS; i++) pthread_mutex_init(&g_buckets[i].mutex, NULL);
+}
+
+void admission_configure(const admission_config_t *config) {
+    if (!config) return;
+    pthread_once(&g_buckets_once, init_buckets);
+    g_config = *config;
+    if (g_config.account_write_rate < 0) g_config.account_write_rate = 0;
+    if (g_config.account_write_burst <= 0) g_config.account_write_burst = g_config.account_write_rate;
+    for (int i = 0; i < ADMISSION_BUCKETS; i++) {
+        pthread_mutex_lock(&g_buckets[i].mutex);
+        g_buckets[i].refill_ns = 0;
+        pthread_mutex_unlock(&g_buckets[i].mutex);
+    }
+}
+
+int admission_take_write(const char *account_id, int *out_retry_after_s) {
+    double rate = g_config.account_write_rate;
+    if (rate <= 0 || !account_id) return 0;
+    double burst = g_config.account_write_burst;
+
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)account_id; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    rate_bucket_t *bucket = &g_buckets[hash & (ADMISSION_BUCKETS - 1)];
+
+    uint64_t now_ns = metrics_now_ns();
+    pthread_mutex_lock(&bucket->mutex);
+    if (bucket->refill_ns == 0) {
+        bucket->tokens = burst;
+    } else {
+        bucket->tokens += (double)(now_ns - bucket->refill_ns) * rate / 1e9;
+        if (bucket->tokens > burst) bucket->tokens = burst;
+    }
+    bucket->refill_ns = now_ns;
+    if (bucket->tokens >= 1.0) {
+        bucket->tokens -= 1.0;
+        pthread_mutex_unlock(&bucket->mutex);
+        return 0;
+    }
+    double wait_s = (1.0 - bucket->tokens) / rate;
+    pthread_mutex_unlock(&bucket->mutex);
+
+    if (out_retry_after_s) {
+        int seconds = (int)(wait_s + 0.999);
+        *out_retry_after_s = seconds < 1 ? 1 : seconds;
+    }
+    return -1;
+}
@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+#include "server_internal.h"
+#include "logger.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+/*
+ * Thread placement. configure() lists the CPUs this process may run on,
+ * in the order workers should take them: by CPU number, or round-robin
+ * across NUMA nodes when interleaving. The last dispatcher_cpus entries go
+ * to the write dispatchers, one each, and the workers wrap around the rest,
+ * so a dispatcher never shares its core with a worker unless there are not
+ * enough CPUs to keep one free for every shard.
+ */
+
+#define AFFINITY_MAX_CPUS 1024
+
+static affinity_config_t g_config;
+static int g_order[AFFINITY_MAX_CPUS];
+static int g_cpu_count;
+static int g_reserved;
+
+#if defined(__linux__)
+/* Parses a sysfs cpulist such as "0-3,8-11" into node_of[cpu] = node. */
+static void read_node_cpulist(const char *path, int node, int *node_of) {
+    FILE *f = fopen(path, "r");
+    if (!f) return;
+    char line[4096];
+    if (fgets(line, sizeof(line), f)) {
+        char *p = line;
+        while (*p && *p != '\n') {
+            char *end = NULL;
+            long first = strtol(p, &end, 10);
+            if (end == p) break;
+            long last = first;
+            if (*end == '-') {
+                p = end + 1;
+                last = strtol(p, &end, 10);
+                if (end == p) break;
+            }
+            for (long cpu = first; cpu <= last && cpu < AFFINITY_MAX_CPUS; cpu++) {
+                if (cpu >= 0) node_of[cpu] = node;
+            }
+            p = *end == ',' ? end + 1 : end;
+        }
+    }
+    fclose(f);
+}
+
+/* Without sysfs every CPU is taken to be on node 0. */
+static int read_numa_nodes(int *node_of) {
+    memset(node_of, 0, sizeof(int) * AFFINITY_MAX_CPUS);
+    DIR *dir = opendir("/sys/devices/system/node");
+    if (!dir) return 1;
+    int nodes = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strncmp(ent->d_name, "node", 4) != 0) continue;
+        char *end = NULL;
+        long node = strtol(ent->d_name + 4, &end, 10);
+        if (end == ent->d_name + 4 || *end != '\0' || node < 0 || node >= AFFINITY_MAX_CPUS) continue;
+        char path[320];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", ent->d_name);
+        read_node_cpulist(path, (int)node, node_of);
+        if ((int)node + 1 > nodes) nodes = (int)node + 1;
+    }
+    closedir(dir);
+    return nodes > 0 ? nodes : 1;
+}
+#endif
+
+void affinity_configure(const affinity_config_t *config) {
+    if (config) g_config = *config;
+    if (g_config.dispatcher_cpus < 0) g_config.dispatcher_cpus = 0;
+    g_cpu_count = 0;
+
+#if defined(__linux__)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE && cpu < AFFINITY_MAX_CPUS; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) g_order[g_cpu_count++] = cpu;
+        }
+    }
+    if (g_cpu_count > 1 && g_config.numa_interleave) {
+        static int node_of[AFFINITY_MAX_CPUS];
+        int nodes = read_numa_nodes(node_of);
+        if (nodes > 1) {
+            /* Deal the CPUs out node by node: each pass takes the next CPU of every node. */
+            int interleaved[AFFINITY_MAX_CPUS];
+            int taken[AFFINITY_MAX_CPUS];
+            memset(taken, 0, sizeof(taken));
+            int filled = 0;
+            while (filled < g_cpu_count) {
+                for (int node = 0; node < nodes; node++) {
+                    for (int i = 0; i < g_cpu_count; i++) {
+                        if (taken[i] || node_of[g_order[i]] != node) continue;
+                        taken[i] = 1;
+                        interleaved[filled++] = g_order[i];
+                        break;
+                    }
+                }
+            }
+            memcpy(g_order, interleaved, sizeof(int) * (size_t)g_cpu_count);
+        }
+    }
+#endif
+    if (g_cpu_count == 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        if (online < 1) online = 1;
+        if (online > AFFINITY_MAX_CPUS) online = AFFINITY_MAX_CPUS;
+        for (int cpu = 0; cpu < (int)online; cpu++) g_order[g_cpu_count++] = cpu;
+    }
+    g_reserved = g_config.dispatcher_cpus < g_cpu_count ? g_config.dispatcher_cpus : 0;
+}
+
+int affinity_cpu_count(void) {
+    if (g_cpu_count == 0) affinity_configure(NULL);
+    return g_config.pin_threads ? g_cpu_count - g_reserved : g_cpu_count;
+}
+
+int affinity_worker_cpu(int worker) {
+    if (!g_config.pin_threads || worker < 0 || g_cpu_count == 0) return -1;
+    return g_order[worker % (g_cpu_count - g_reserved)];
+}
+
+int affinity_dispatcher_cpu(int shard) {
+    if (!g_config.pin_threads || shard < 0 || g_cpu_count == 0) return -1;
+    if (g_reserved == 0) return g_order[g_cpu_count - 1 - shard % g_cpu_count];
+    return g_order[g_cpu_count - 1 - shard % g_reserved];
+}
+
+static void pin_self(int cpu, const char *role, int index) {
+    if (cpu < 0) return;
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc != 0) log_warn("failed to pin %s %d to cpu %d: errno=%d", role, index, cpu, rc);
+#else
+    (void)role;
+    (void)index;
+#endif
+}
+
+void affinity_pin_worker(int worker) {
+    pin_self(affinity_worker_cpu(worker), "worker", worker);
+}
+
+void affinity_pin_dispatcher(int shard) {
+    pin_self(affinity_dispatcher_cpu(shard), "write dispatcher", shard);
+}
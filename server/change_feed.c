@@ -0,0 +1,159 @@
+#include "server_internal.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * The change feed: a ring of the most recently committed changes, each a
+ * storage key, the version it now holds and a feed seq. Dispatchers of all
+ * shards append under one mutex after their COMMIT, so seq order is commit
+ * order and a reader that has seen seq N has seen every change up to N.
+ *
+ * Seqs start at the process start time in microseconds. Unless an earlier
+ * process averaged more than a million changes a second, a cursor it handed
+ * out is below this process's window and reads as a reset instead of
+ * silently skipping the changes made while the client was away.
+ */
+
+#define CHANGE_FEED_MAX_WAITERS 1024
+
+typedef struct {
+    uint64_t version;
+    char storage_key[CHANGE_FEED_KEY_MAX];
+} change_slot_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    change_slot_t *slots;
+    size_t capacity;
+    /* The seq before the first one this process hands out. */
+    uint64_t base;
+    _Atomic uint64_t last_seq;
+    /* Completion queues of workers that have watches parked. */
+    write_completion_queue_t *waiters[CHANGE_FEED_MAX_WAITERS];
+    int waiter_count;
+} change_feed_t;
+
+static change_feed_t g_feed = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+static size_t g_capacity = DEFAULT_CHANGE_FEED_ENTRIES;
+static pthread_once_t g_feed_once = PTHREAD_ONCE_INIT;
+
+/* Called with the mutex held. */
+static void reset_feed(size_t capacity) {
+    free(g_feed.slots);
+    g_feed.slots = capacity > 0 ? (change_slot_t *)calloc(capacity, sizeof(change_slot_t)) : NULL;
+    g_feed.capacity = g_feed.slots ? capacity : 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t base = (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+    /* A reconfigured feed never reissues a seq of the one it replaces. */
+    if (base <= g_feed.base) base = g_feed.base + 1;
+    if (base <= atomic_load(&g_feed.last_seq)) base = atomic_load(&g_feed.last_seq) + 1;
+    g_feed.base = base;
+    atomic_store(&g_feed.last_seq, base);
+}
+
+static void init_feed(void) {
+    pthread_mutex_lock(&g_feed.mutex);
+    reset_feed(g_capacity);
+    pthread_mutex_unlock(&g_feed.mutex);
+}
+
+void change_feed_configure(const change_feed_config_t *config) {
+    if (!config) return;
+    pthread_once(&g_feed_once, init_feed);
+    pthread_mutex_lock(&g_feed.mutex);
+    g_capacity = config->entries;
+    reset_feed(g_capacity);
+    pthread_mutex_unlock(&g_feed.mutex);
+}
+
+int change_feed_enabled(void) {
+    pthread_once(&g_feed_once, init_feed);
+    pthread_mutex_lock(&g_feed.mutex);
+    int enabled = g_feed.capacity > 0;
+    pthread_mutex_unlock(&g_feed.mutex);
+    return enabled;
+}
+
+uint64_t change_feed_last_seq(void) {
+    pthread_once(&g_feed_once, init_feed);
+    return atomic_load_explicit(&g_feed.last_seq, memory_order_acquire);
+}
+
+void change_feed_append(const char *storage_key, uint64_t version) {
+    size_t key_len = strlen(storage_key);
+    if (key_len >= CHANGE_FEED_KEY_MAX) return;
+    pthread_once(&g_feed_once, init_feed);
+    pthread_mutex_lock(&g_feed.mutex);
+    if (g_feed.capacity > 0) {
+        uint64_t seq = atomic_load_explicit(&g_feed.last_seq, memory_order_relaxed) + 1;
+        change_slot_t *slot = &g_feed.slots[(seq - g_feed.base - 1) % g_feed.capacity];
+        slot->version = version;
+        memcpy(slot->storage_key, storage_key, key_len + 1);
+        atomic_store_explicit(&g_feed.last_seq, seq, memory_order_release);
+    }
+    pthread_mutex_unlock(&g_feed.mutex);
+}
+
+void change_feed_notify(void) {
+    pthread_mutex_lock(&g_feed.mutex);
+    for (int i = 0; i < g_feed.waiter_count; i++) write_completion_queue_signal(g_feed.waiters[i]);
+    pthread_mutex_unlock(&g_feed.mutex);
+}
+
+void change_feed_set_waiting(write_completion_queue_t *queue, int waiting) {
+    pthread_mutex_lock(&g_feed.mutex);
+    int found = -1;
+    for (int i = 0; i < g_feed.waiter_count; i++) {
+        if (g_feed.waiters[i] == queue) found = i;
+    }
+    if (waiting && found < 0 && g_feed.waiter_count < CHANGE_FEED_MAX_WAITERS) {
+        g_feed.waiters[g_feed.waiter_count++] = queue;
+    } else if (!waiting && found >= 0) {
+        g_feed.waiters[found] = g_feed.waiters[--g_feed.waiter_count];
+    }
+    pthread_mutex_unlock(&g_feed.mutex);
+}
+
+int change_feed_read(const char *prefix, uint64_t since, change_feed_entry_t *out, int max, uint64_t *out_next) {
+    pthread_once(&g_feed_once, init_feed);
+    size_t prefix_len = strlen(prefix);
+    pthread_mutex_lock(&g_feed.mutex);
+    uint64_t last = atomic_load_explicit(&g_feed.last_seq, memory_order_relaxed);
+    uint64_t oldest = g_feed.base + 1;
+    if (last - g_feed.base > g_feed.capacity) oldest = last - g_feed.capacity + 1;
+    *out_next = last;
+    if (g_feed.capacity == 0 || since + 1 < oldest || since > last) {
+        pthread_mutex_unlock(&g_feed.mutex);
+        return CHANGE_FEED_RESET;
+    }
+
+    int count = 0;
+    uint64_t seq = since + 1;
+    for (; seq <= last && count < max; seq++) {
+        const change_slot_t *slot = &g_feed.slots[(seq - g_feed.base - 1) % g_feed.capacity];
+        if (strncmp(slot->storage_key, prefix, prefix_len) != 0) continue;
+        out[count].seq = seq;
+        out[count].version = slot->version;
+        snprintf(out[count].key, sizeof(out[count].key), "%s", slot->storage_key + prefix_len);
+        count++;
+    }
+    /* A full page stops at its last change; the rest is for the next read. */
+    if (count == max) *out_next = out[count - 1].seq;
+    pthread_mutex_unlock(&g_feed.mutex);
+    return count;
+}
+
+void change_feed_reset(void) {
+    pthread_once(&g_feed_once, init_feed);
+    pthread_mutex_lock(&g_feed.mutex);
+    reset_feed(g_capacity);
+    pthread_mutex_unlock(&g_feed.mutex);
+    change_feed_notify();
+}
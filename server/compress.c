@@ -0,0 +1,94 @@
+#include "server_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+/* windowBits 15 plus 16 selects the gzip wrapper instead of zlib's. */
+#define GZIP_WINDOW_BITS (15 + 16)
+
+static compress_config_t g_config = {
+    .min_bytes = DEFAULT_GZIP_MIN_BYTES,
+    .level = DEFAULT_GZIP_LEVEL,
+};
+
+void compress_configure(const compress_config_t *config) {
+    if (!config) return;
+    g_config = *config;
+    if (g_config.level < 1 || g_config.level > 9) g_config.level = DEFAULT_GZIP_LEVEL;
+}
+
+size_t compress_min_bytes(void) {
+    return g_config.min_bytes;
+}
+
+int gzip_compress(const char *in, size_t in_len, char **out, size_t *out_len) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, g_config.level, Z_DEFLATED, GZIP_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+    uLong cap = deflateBound(&zs, (uLong)in_len);
+    char *buf = (char *)malloc(cap);
+    if (!buf) {
+        deflateEnd(&zs);
+        return -1;
+    }
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = (uInt)in_len;
+    zs.next_out = (Bytef *)buf;
+    zs.avail_out = (uInt)cap;
+    int rc = deflate(&zs, Z_FINISH);
+    size_t len = (size_t)zs.total_out;
+    deflateEnd(&zs);
+    if (rc != Z_STREAM_END) {
+        free(buf);
+        return -1;
+    }
+    *out = buf;
+    *out_len = len;
+    return 0;
+}
+
+/*
+ * Output grows by doubling up to max_len, so a small body that claims to
+ * expand without bound costs at most max_len bytes before it is refused.
+ */
+int gzip_decompress(const char *in, size_t in_len, size_t max_len, char **out, size_t *out_len) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, GZIP_WINDOW_BITS) != Z_OK) return -1;
+    size_t cap = in_len * 4 < 4096 ? 4096 : in_len * 4;
+    if (cap > max_len + 1) cap = max_len + 1;
+    char *buf = (char *)malloc(cap + 1);
+    if (!buf) {
+        inflateEnd(&zs);
+        return -1;
+    }
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = (uInt)in_len;
+    int rc = Z_OK;
+    while (rc == Z_OK) {
+        if (zs.total_out == cap) {
+            if (cap > max_len) break;
+            size_t grown_cap = cap * 2 > max_len + 1 ? max_len + 1 : cap * 2;
+            char *grown = (char *)realloc(buf, grown_cap + 1);
+            if (!grown) break;
+            buf = grown;
+            cap = grown_cap;
+        }
+        zs.next_out = (Bytef *)buf + zs.total_out;
+        zs.avail_out = (uInt)(cap - zs.total_out);
+        rc = inflate(&zs, Z_NO_FLUSH);
+        if (rc == Z_BUF_ERROR && zs.avail_out > 0) break;
+        if (rc == Z_BUF_ERROR) rc = Z_OK;
+    }
+    size_t len = (size_t)zs.total_out;
+    inflateEnd(&zs);
+    if (rc != Z_STREAM_END || len > max_len) {
+        free(buf);
+        return len > max_len ? -2 : -1;
+    }
+    buf[len] = '\0';
+    *out = buf;
+    *out_len = len;
+    return 0;
+}
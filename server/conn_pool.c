@@ -0,0 +1,207 @@
+#define _GNU_SOURCE
+#include "server_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Request buffers come in three heap classes, recycled through per-class
+ * free lists (the link lives in the buffer itself), and a mapped class for
+ * anything above the largest one. Mapped buffers grow in place with mremap
+ * where available and go straight back to the kernel on release, so a
+ * burst of big uploads leaves no holes in the worker's heap.
+ */
+
+static const size_t class_bytes[CONN_BUF_CLASSES] = {CONN_INIT_BUF, 64 * 1024, 1024 * 1024};
+/* At most this many idle buffers are kept per class (8 MB, 4 MB, 8 MB). */
+static const size_t class_keep[CONN_BUF_CLASSES] = {1024, 64, 8};
+
+typedef struct conn_slab {
+    struct conn_slab *next;
+    conn_t conns[CONN_POOL_SLAB_CONNS];
+} conn_slab_t;
+
+static size_t page_round(size_t n) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (n + page - 1) / page * page;
+}
+
+/* Bytes reserved for a buffer of the given class and capacity, including the NUL slot. */
+static size_t class_footprint(int cls, size_t cap) {
+    return cls < CONN_BUF_CLASSES ? cap + 1 : page_round(cap + 1);
+}
+
+void conn_pool_init(conn_pool_t *pool, size_t max_buffered_bytes) {
+    memset(pool, 0, sizeof(*pool));
+    pool->max_buffered_bytes = max_buffered_bytes;
+}
+
+void conn_pool_destroy(conn_pool_t *pool) {
+    for (int cls = 0; cls < CONN_BUF_CLASSES; cls++) {
+        void *buf = pool->free_bufs[cls];
+        while (buf) {
+            void *next = *(void **)buf;
+            free(buf);
+            buf = next;
+        }
+    }
+    conn_slab_t *slab = (conn_slab_t *)pool->slabs;
+    while (slab) {
+        conn_slab_t *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    memset(pool, 0, sizeof(*pool));
+}
+
+static int within_budget(const conn_pool_t *pool, size_t release, size_t reserve) {
+    if (pool->max_buffered_bytes == 0) return 1;
+    return pool->buffered_bytes - release + reserve <= pool->max_buffered_bytes;
+}
+
+static char *class_take(conn_pool_t *pool, int cls) {
+    void *buf = pool->free_bufs[cls];
+    if (buf) {
+        pool->free_bufs[cls] = *(void **)buf;
+        pool->free_buf_count[cls]--;
+        return (char *)buf;
+    }
+    return (char *)malloc(class_bytes[cls] + 1);
+}
+
+static void class_give(conn_pool_t *pool, int cls, char *buf) {
+    if (pool->free_buf_count[cls] >= class_keep[cls]) {
+        free(buf);
+        return;
+    }
+    *(void **)buf = pool->free_bufs[cls];
+    pool->free_bufs[cls] = buf;
+    pool->free_buf_count[cls]++;
+}
+
+static void release_buf(conn_pool_t *pool, conn_t *conn) {
+    if (!conn->buf) return;
+    size_t footprint = class_footprint(conn->buf_class, conn->cap);
+    if (conn->buf_class < CONN_BUF_CLASSES) {
+        class_give(pool, conn->buf_class, conn->buf);
+    } else {
+        munmap(conn->buf, footprint);
+    }
+    pool->buffered_bytes -= footprint;
+    conn->buf = NULL;
+    conn->cap = 0;
+}
+
+conn_t *conn_pool_get(conn_pool_t *pool) {
+    if (!within_budget(pool, 0, class_footprint(0, class_bytes[0]))) {
+        pool->over_budget++;
+        return NULL;
+    }
+    if (!pool->free_conns) {
+        conn_slab_t *slab = (conn_slab_t *)malloc(sizeof(conn_slab_t));
+        if (!slab) return NULL;
+        slab->next = (conn_slab_t *)pool->slabs;
+        pool->slabs = slab;
+        for (size_t i = 0; i < CONN_POOL_SLAB_CONNS; i++) {
+            slab->conns[i].idle_next = pool->free_conns;
+            pool->free_conns = &slab->conns[i];
+        }
+    }
+    char *buf = class_take(pool, 0);
+    if (!buf) return NULL;
+
+    conn_t *conn = pool->free_conns;
+    pool->free_conns = conn->idle_next;
+    memset(conn, 0, sizeof(*conn));
+    conn->buf = buf;
+    conn->cap = class_bytes[0];
+    conn->buf_class = 0;
+    pool->buffered_bytes += class_footprint(0, conn->cap);
+    pool->live_conns++;
+    return conn;
+}
+
+void conn_pool_put(conn_pool_t *pool, conn_t *conn) {
+    release_buf(pool, conn);
+    conn->idle_next = pool->free_conns;
+    pool->free_conns = conn;
+    pool->live_conns--;
+}
+
+static int map_grow(conn_t *conn, size_t next, char **out_buf) {
+    size_t old_map = class_footprint(CONN_BUF_CLASSES, conn->cap);
+    size_t new_map = class_footprint(CONN_BUF_CLASSES, next);
+#if defined(__linux__)
+    if (conn->buf_class == CONN_BUF_CLASSES) {
+        void *moved = mremap(conn->buf, old_map, new_map, MREMAP_MAYMOVE);
+        if (moved == MAP_FAILED) return -1;
+        *out_buf = (char *)moved;
+        return 0;
+    }
+#endif
+    void *mapped = mmap(NULL, new_map, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (mapped == MAP_FAILED) return -1;
+    memcpy(mapped, conn->buf, conn->len);
+    if (conn->buf_class == CONN_BUF_CLASSES) munmap(conn->buf, old_map);
+    *out_buf = (char *)mapped;
+    return 0;
+}
+
+/* The class and capacity conn_pool_grow picks for want. */
+static int grow_class(size_t want, size_t *out_cap) {
+    if (want > REQ_BUF_SIZE) want = REQ_BUF_SIZE;
+    int cls = 0;
+    while (cls < CONN_BUF_CLASSES && class_bytes[cls] < want) cls++;
+    *out_cap = cls < CONN_BUF_CLASSES ? class_bytes[cls] : want;
+    return cls;
+}
+
+int conn_pool_can_grow(const conn_pool_t *pool, const conn_t *conn, size_t want) {
+    if (want <= conn->cap) return 1;
+    size_t next = 0;
+    int cls = grow_class(want, &next);
+    return within_budget(pool, class_footprint(conn->buf_class, conn->cap), class_footprint(cls, next));
+}
+
+int conn_pool_grow(conn_pool_t *pool, conn_t *conn, size_t want) {
+    if (want <= conn->cap) return 0;
+
+    size_t next = 0;
+    int cls = grow_class(want, &next);
+    size_t old_footprint = class_footprint(conn->buf_class, conn->cap);
+    size_t new_footprint = class_footprint(cls, next);
+    if (!within_budget(pool, old_footprint, new_footprint)) {
+        pool->over_budget++;
+        return CONN_POOL_OVER_BUDGET;
+    }
+
+    char *buf = NULL;
+    if (cls < CONN_BUF_CLASSES) {
+        buf = class_take(pool, cls);
+        if (!buf) return -1;
+        memcpy(buf, conn->buf, conn->len);
+        class_give(pool, conn->buf_class, conn->buf);
+    } else {
+        if (map_grow(conn, next, &buf) != 0) return -1;
+        if (conn->buf_class < CONN_BUF_CLASSES) class_give(pool, conn->buf_class, conn->buf);
+    }
+    pool->buffered_bytes = pool->buffered_bytes - old_footprint + new_footprint;
+    conn->buf = buf;
+    conn->cap = next;
+    conn->buf_class = cls;
+    return 0;
+}
+
+void conn_pool_shrink(conn_pool_t *pool, conn_t *conn) {
+    if (conn->buf_class == 0 || conn->len > class_bytes[0]) return;
+    char *buf = class_take(pool, 0);
+    if (!buf) return;
+    memcpy(buf, conn->buf, conn->len);
+    release_buf(pool, conn);
+    conn->buf = buf;
+    conn->cap = class_bytes[0];
+    conn->buf_class = 0;
+    pool->buffered_bytes += class_footprint(0, conn->cap);
+}
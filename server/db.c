@@ -7,8 +7,11 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <sqlite3.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,6 +19,9 @@
 #include <unistd.h>
 
 #define PENDING_WRITES_DIR "pending_writes"
+#define REPLAY_BATCH_WRITES 4096
+#define REPLAY_READ_WINDOW 256
+#define REPLAY_READERS 8
 
 static int fsync_directory(const char *dir_path) {
     DIR *d = opendir(dir_path);
@@ -30,15 +36,20 @@ static int fsync_directory(const char *dir_path) {
     return rc;
 }
 
-static int ensure_pending_writes_dir(void) {
+typedef struct {
+    int count;
+    sqlite3 *dbs[MAX_WRITE_SHARDS];
+    kv_writer_t writers[MAX_WRITE_SHARDS];
+    /* Versions for legacy pending_writes files, which carry no journal seq. */
+    uint64_t next_version;
+    /* Writes in each shard's open replay transaction. */
+    int batch_writes[MAX_WRITE_SHARDS];
+} shard_set_t;
+
+/* pending_writes/ is the pre-journal layout; it only exists on upgraded data dirs. */
+static int legacy_pending_writes_present(void) {
     struct stat st;
-    if (stat(PENDING_WRITES_DIR, &st) == 0) {
-        if (!S_ISDIR(st.st_mode)) return -1;
-        return 0;
-    }
-    if (errno != ENOENT) return -1;
-    if (mkdir(PENDING_WRITES_DIR, 0700) != 0 && errno != EEXIST) return -1;
-    return fsync_directory(".");
+    return stat(PENDING_WRITES_DIR, &st) == 0 && S_ISDIR(st.st_mode);
 }
 
 static void extract_log_id_from_pending_name(const char *name, char *out, size_t out_len) {
@@ -63,7 +74,8 @@ static void extract_log_id_from_pending_name(const char *name, char *out, size_t
     out[len] = '\0';
 }
 
-static int extract_pending_key_from_name(const char *name, char *out_key, size_t out_key_len) {
+/* Parses "<key>-<pid>-<sec>-<nsec>[-lid-<log id>].json"; stamp gets sec, nsec, pid so it sorts by write time. */
+static int extract_pending_key_from_name(const char *name, char *out_key, size_t out_key_len, unsigned long long stamp[3]) {
     if (!name || !out_key || out_key_len == 0) return 0;
     out_key[0] = '\0';
 
@@ -83,6 +95,7 @@ static int extract_pending_key_from_name(const char *name, char *out_key, size_t
     }
 
     char *cursor = local + strlen(local);
+    unsigned long long parts[3] = {0};
     for (int i = 0; i < 3; i++) {
         char *dash = strrchr(local, '-');
         if (!dash || dash >= cursor) return 0;
@@ -93,6 +106,7 @@ static int extract_pending_key_from_name(const char *name, char *out_key, size_t
                 return 0;
             }
         }
+        parts[i] = strtoull(digits, NULL, 10);
         *dash = '\0';
         cursor = dash;
     }
@@ -100,123 +114,466 @@ static int extract_pending_key_from_name(const char *name, char *out_key, size_t
     size_t key_len = strlen(local);
     if (key_len == 0 || key_len >= out_key_len) return 0;
     memcpy(out_key, local, key_len + 1);
+    stamp[0] = parts[1];
+    stamp[1] = parts[0];
+    stamp[2] = parts[2];
     return 1;
 }
 
-static int replay_pending_writes(sqlite3 *db) {
-    if (ensure_pending_writes_dir() != 0) {
-        log_error("failed to ensure pending writes dir");
-        return -1;
+/*
+ * Replay applies writes inside transactions of up to REPLAY_BATCH_WRITES
+ * per shard, so a backlog costs one fsync per batch rather than per write.
+ * A failure rolls back only the open batch; everything replay reads stays
+ * on disk until the whole pass has committed, and rerunning it converges.
+ */
+static int replay_txn_begin(shard_set_t *set) {
+    for (int i = 0; i < set->count; i++) {
+        if (sqlite3_exec(set->dbs[i], "BEGIN IMMEDIATE", NULL, NULL, NULL) != SQLITE_OK) return -1;
+        set->batch_writes[i] = 0;
     }
+    return 0;
+}
 
-    sqlite3_stmt *stmt = NULL;
-    const char *upsert_sql =
-        "INSERT INTO kv_store (data_key, data_value, updated_at) VALUES (?1, ?2, strftime('%s', 'now'))"
-        " ON CONFLICT(data_key) DO UPDATE SET data_value=excluded.data_value, updated_at=excluded.updated_at";
-    if (sqlite3_prepare_v2(db, upsert_sql, -1, &stmt, NULL) != SQLITE_OK) {
-        log_error("failed to prepare replay upsert: %s", sqlite3_errmsg(db));
-        return -1;
+static int replay_txn_note_write(shard_set_t *set, int shard) {
+    if (++set->batch_writes[shard] < REPLAY_BATCH_WRITES) return 0;
+    set->batch_writes[shard] = 0;
+    if (sqlite3_exec(set->dbs[shard], "COMMIT", NULL, NULL, NULL) != SQLITE_OK) return -1;
+    return sqlite3_exec(set->dbs[shard], "BEGIN IMMEDIATE", NULL, NULL, NULL) == SQLITE_OK ? 0 : -1;
+}
+
+static int replay_txn_commit(shard_set_t *set) {
+    int rc = 0;
+    for (int i = 0; i < set->count; i++) {
+        if (!sqlite3_get_autocommit(set->dbs[i]) && sqlite3_exec(set->dbs[i], "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+            log_error("replay commit failed on shard %d: %s", i, sqlite3_errmsg(set->dbs[i]));
+            rc = -1;
+        }
     }
+    return rc;
+}
 
-    DIR *dir = opendir(PENDING_WRITES_DIR);
-    if (!dir) {
-        sqlite3_finalize(stmt);
-        return -1;
+static void replay_txn_rollback(shard_set_t *set) {
+    for (int i = 0; i < set->count; i++) {
+        if (!sqlite3_get_autocommit(set->dbs[i])) sqlite3_exec(set->dbs[i], "ROLLBACK", NULL, NULL, NULL);
+    }
+}
+
+typedef struct {
+    char name[256];
+    char key[256];
+    char log_id[96];
+    unsigned long long stamp[3];
+    char *payload;
+    size_t payload_len;
+} pending_file_t;
+
+static int compare_pending_files(const void *a, const void *b) {
+    const pending_file_t *x = (const pending_file_t *)a;
+    const pending_file_t *y = (const pending_file_t *)b;
+    int c = strcmp(x->key, y->key);
+    if (c != 0) return c;
+    for (int i = 0; i < 3; i++) {
+        if (x->stamp[i] != y->stamp[i]) return x->stamp[i] < y->stamp[i] ? -1 : 1;
     }
+    return strcmp(x->name, y->name);
+}
 
-    int rc = 0;
+static int list_pending_files(pending_file_t **out_files, size_t *out_count) {
+    *out_files = NULL;
+    *out_count = 0;
+    DIR *dir = opendir(PENDING_WRITES_DIR);
+    if (!dir) return -1;
+
+    pending_file_t *files = NULL;
+    size_t count = 0;
+    size_t cap = 0;
     struct dirent *ent = NULL;
     while ((ent = readdir(dir)) != NULL) {
         if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+        if (strlen(ent->d_name) >= sizeof(files[0].name)) continue;
 
-        char dash_key[256] = {0};
-        if (!extract_pending_key_from_name(ent->d_name, dash_key, sizeof(dash_key)) ||
-            !is_valid_storage_key(dash_key)) {
+        pending_file_t file;
+        memset(&file, 0, sizeof(file));
+        if (!extract_pending_key_from_name(ent->d_name, file.key, sizeof(file.key), file.stamp) || !is_valid_storage_key(file.key)) {
             continue;
         }
-
-        char path[512] = {0};
-        if (snprintf(path, sizeof(path), "%s/%s", PENDING_WRITES_DIR, ent->d_name) >= (int)sizeof(path)) {
-            rc = -1;
-            break;
+        memcpy(file.name, ent->d_name, strlen(ent->d_name) + 1);
+        extract_log_id_from_pending_name(ent->d_name, file.log_id, sizeof(file.log_id));
+        if (count == cap) {
+            size_t grown_cap = cap ? cap * 2 : 64;
+            pending_file_t *grown = (pending_file_t *)realloc(files, grown_cap * sizeof(*files));
+            if (!grown) {
+                free(files);
+                closedir(dir);
+                return -1;
+            }
+            files = grown;
+            cap = grown_cap;
         }
-        char log_id[96] = {0};
-        extract_log_id_from_pending_name(ent->d_name, log_id, sizeof(log_id));
-        const char *effective_log_id = log_id[0] != '\0' ? log_id : "-";
-        log_info("DATA WRITE replaying key=%s pending=%s logid=%s", dash_key, path, effective_log_id);
+        files[count++] = file;
+    }
+    closedir(dir);
 
-        FILE *f = fopen(path, "rb");
-        if (!f) {
-            rc = -1;
-            break;
-        }
-        if (fseek(f, 0, SEEK_END) != 0) {
-            fclose(f);
-            rc = -1;
-            break;
-        }
-        long file_len = ftell(f);
-        if (file_len < 0 || file_len > 4 * 1024 * 1024) {
-            fclose(f);
-            rc = -1;
-            break;
+    if (count > 1) qsort(files, count, sizeof(*files), compare_pending_files);
+    *out_files = files;
+    *out_count = count;
+    return 0;
+}
+
+static int read_pending_file(pending_file_t *file) {
+    char path[512];
+    if (snprintf(path, sizeof(path), "%s/%s", PENDING_WRITES_DIR, file->name) >= (int)sizeof(path)) return -1;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 0 || (size_t)st.st_size > REQ_BUF_SIZE) {
+        close(fd);
+        return -1;
+    }
+    size_t len = (size_t)st.st_size;
+    char *payload = (char *)malloc(len + 1);
+    if (!payload) {
+        close(fd);
+        return -1;
+    }
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = pread(fd, payload + off, len - off, (off_t)off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        off += (size_t)n;
+    }
+    close(fd);
+    if (off != len) {
+        free(payload);
+        return -1;
+    }
+    payload[len] = '\0';
+    file->payload = payload;
+    file->payload_len = len;
+    return 0;
+}
+
+typedef struct {
+    pending_file_t **files;
+    size_t count;
+    atomic_size_t next;
+    atomic_int failed;
+} pending_read_t;
+
+static void *pending_reader_main(void *arg) {
+    pending_read_t *job = (pending_read_t *)arg;
+    while (1) {
+        size_t i = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed);
+        if (i >= job->count) break;
+        if (read_pending_file(job->files[i]) != 0) {
+            log_error("failed to read pending write %s/%s", PENDING_WRITES_DIR, job->files[i]->name);
+            atomic_store_explicit(&job->failed, 1, memory_order_relaxed);
         }
-        if (fseek(f, 0, SEEK_SET) != 0) {
-            fclose(f);
-            rc = -1;
-            break;
+    }
+    return NULL;
+}
+
+/* Reads a window of files with up to REPLAY_READERS threads; the caller's thread is one of them. */
+static int read_pending_files(pending_file_t **files, size_t count) {
+    pending_read_t job = {.files = files, .count = count};
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, 0);
+    pthread_t threads[REPLAY_READERS - 1];
+    int started = 0;
+    while (started < REPLAY_READERS - 1 && (size_t)started + 1 < count) {
+        if (pthread_create(&threads[started], NULL, pending_reader_main, &job) != 0) break;
+        started++;
+    }
+    pending_reader_main(&job);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    return atomic_load_explicit(&job.failed, memory_order_relaxed) ? -1 : 0;
+}
+
+/*
+ * Legacy files hold whole-value PUTs, so only the newest file per storage
+ * key (by the timestamp in its name) is applied; older ones are removed
+ * with it. Files are read in parallel a window at a time and applied in
+ * batched transactions, and nothing is unlinked until everything committed.
+ */
+static int replay_pending_writes(shard_set_t *set) {
+    if (!legacy_pending_writes_present()) return 0;
+
+    pending_file_t *files = NULL;
+    size_t count = 0;
+    if (list_pending_files(&files, &count) != 0) return -1;
+
+    pending_file_t **newest = (pending_file_t **)malloc((count ? count : 1) * sizeof(*newest));
+    if (!newest) {
+        free(files);
+        return -1;
+    }
+    size_t newest_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (i + 1 == count || strcmp(files[i].key, files[i + 1].key) != 0) {
+            newest[newest_count++] = &files[i];
+        } else {
+            log_info("DATA WRITE replay superseded key=%s pending=%s/%s", files[i].key, PENDING_WRITES_DIR, files[i].name);
         }
+    }
 
-        char *payload = (char *)malloc((size_t)file_len + 1);
-        if (!payload) {
-            fclose(f);
-            rc = -1;
-            break;
+    uint64_t started_ns = metrics_now_ns();
+    uint64_t reported_ns = started_ns;
+    int rc = newest_count > 0 ? replay_txn_begin(set) : 0;
+    for (size_t w = 0; rc == 0 && w < newest_count; w += REPLAY_READ_WINDOW) {
+        size_t n = newest_count - w < REPLAY_READ_WINDOW ? newest_count - w : REPLAY_READ_WINDOW;
+        rc = read_pending_files(newest + w, n);
+        for (size_t j = 0; j < n; j++) {
+            pending_file_t *file = newest[w + j];
+            const char *effective_log_id = file->log_id[0] != '\0' ? file->log_id : "-";
+            if (rc == 0) {
+                int shard = storage_key_shard(file->key, set->count);
+                int step_rc = kv_write_apply(&set->writers[shard], WRITE_OP_PUT, file->key, file->payload, file->payload_len, set->next_version++);
+                if (step_rc != SQLITE_DONE) {
+                    log_error(
+                        "DATA WRITE replay failed key=%s pending=%s/%s logid=%s reason=sqlite_step_error errmsg=%s",
+                        file->key,
+                        PENDING_WRITES_DIR,
+                        file->name,
+                        effective_log_id,
+                        sqlite3_errmsg(set->dbs[shard]));
+                    rc = -1;
+                } else {
+                    rc = replay_txn_note_write(set, shard);
+                    log_info(
+                        "DATA WRITE replayed key=%s status=stored pending=%s/%s logid=%s", file->key, PENDING_WRITES_DIR, file->name, effective_log_id);
+                }
+            }
+            free(file->payload);
+            file->payload = NULL;
         }
-        size_t nread = fread(payload, 1, (size_t)file_len, f);
-        fclose(f);
-        if (nread != (size_t)file_len) {
-            free(payload);
-            rc = -1;
-            break;
+        uint64_t now_ns = metrics_now_ns();
+        if (rc == 0 && now_ns - reported_ns >= 1000000000ull) {
+            log_info("pending write replay progress applied=%zu/%zu", w + n, newest_count);
+            reported_ns = now_ns;
         }
-        payload[file_len] = '\0';
+    }
+    if (rc == 0) {
+        rc = replay_txn_commit(set);
+    }
+    if (rc != 0) {
+        replay_txn_rollback(set);
+    }
 
-        sqlite3_reset(stmt);
-        sqlite3_clear_bindings(stmt);
-        sqlite3_bind_text(stmt, 1, dash_key, -1, SQLITE_TRANSIENT);
-        sqlite3_bind_text(stmt, 2, payload, -1, SQLITE_TRANSIENT);
-        int step_rc = sqlite3_step(stmt);
-        free(payload);
-        if (step_rc != SQLITE_DONE) {
+    for (size_t i = 0; rc == 0 && i < count; i++) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", PENDING_WRITES_DIR, files[i].name);
+        if (unlink(path) != 0) rc = -1;
+    }
+    if (rc == 0 && fsync_directory(PENDING_WRITES_DIR) != 0) rc = -1;
+    if (rc == 0 && count > 0) {
+        log_info(
+            "pending write replay files=%zu applied=%zu superseded=%zu elapsed_ms=%llu",
+            count,
+            newest_count,
+            count - newest_count,
+            (unsigned long long)((metrics_now_ns() - started_ns) / 1000000ull));
+    }
+    free(newest);
+    free(files);
+    return rc;
+}
+
+/*
+ * A batch was committed whole or not at all, so any of its rows carrying
+ * its seq or a later one means there is nothing left to do for it.
+ */
+static int replay_journal_batch(shard_set_t *set, uint64_t seq, const char *prefix, const char *log_id, const char *payload, size_t payload_len) {
+    size_t prefix_len = strlen(prefix);
+    if (prefix_len < 3 || strcmp(prefix + prefix_len - 2, "::") != 0) {
+        log_warn("DATA WRITE replay skipped key=%s logid=%s reason=invalid_key", prefix, log_id);
+        return 0;
+    }
+    int shard = storage_key_shard(prefix, set->count);
+    kv_writer_t *writer = &set->writers[shard];
+    size_t pos = 0;
+    kv_batch_entry_t entry;
+    int next = 0;
+    while ((next = kv_batch_next(payload, payload_len, &pos, &entry)) == 1) {
+        char storage_key[256];
+        uint64_t current = 0;
+        if (kv_batch_storage_key(prefix, &entry, storage_key, sizeof(storage_key)) != 0 || !is_valid_storage_key(storage_key)) {
+            log_warn("DATA WRITE replay skipped key=%s logid=%s reason=invalid_key", prefix, log_id);
+            return 0;
+        }
+        if (kv_read_version(writer, storage_key, &current) != SQLITE_DONE) {
             log_error(
-                "DATA WRITE replay failed key=%s pending=%s logid=%s reason=sqlite_step_error errmsg=%s",
-                dash_key,
-                path,
-                effective_log_id,
-                sqlite3_errmsg(db));
-            rc = -1;
-            break;
+                "DATA WRITE replay failed key=%s pending=journal logid=%s reason=version_read_error errmsg=%s",
+                storage_key,
+                log_id,
+                sqlite3_errmsg(set->dbs[shard]));
+            return -1;
         }
+        if (current >= seq) return 0;
+    }
+    if (next < 0) {
+        log_warn("DATA WRITE replay skipped key=%s logid=%s reason=malformed_batch", prefix, log_id);
+        return 0;
+    }
 
-        if (unlink(path) != 0) {
-            rc = -1;
-            break;
-        }
-        log_info("DATA WRITE replayed key=%s status=stored pending=%s logid=%s", dash_key, path, effective_log_id);
+    uint64_t current = 0;
+    int step_rc = kv_write_apply_batch(writer, prefix, payload, payload_len, seq, &current);
+    if (step_rc == KV_WRITE_PRECONDITION_FAILED || step_rc == KV_WRITE_NOT_LIST) {
+        log_warn(
+            "DATA WRITE replay skipped key=%s logid=%s reason=%s",
+            prefix,
+            log_id,
+            step_rc == KV_WRITE_NOT_LIST ? "not_a_list" : "precondition_failed");
+        return 0;
     }
+    if (step_rc != SQLITE_DONE) {
+        log_error(
+            "DATA WRITE replay failed key=%s pending=journal logid=%s reason=sqlite_step_error errmsg=%s",
+            prefix,
+            log_id,
+            sqlite3_errmsg(set->dbs[shard]));
+        return -1;
+    }
+    log_info("DATA WRITE replayed key=%s status=stored pending=journal bytes=%zu logid=%s", prefix, payload_len, log_id);
+    return replay_txn_note_write(set, shard);
+}
 
-    closedir(dir);
-    sqlite3_finalize(stmt);
-    if (rc == 0 && fsync_directory(PENDING_WRITES_DIR) != 0) return -1;
+/*
+ * Records newer than the checkpoint may already be in the db. A record is
+ * skipped when the row already carries its seq or a later one (appends are
+ * not idempotent); otherwise a conditional one is re-evaluated against the
+ * row, which by then holds every earlier write in seq order.
+ */
+static int replay_journal_record(
+    void *arg,
+    uint64_t seq,
+    const char *storage_key,
+    const char *log_id,
+    int op,
+    int64_t if_match,
+    const char *payload,
+    size_t payload_len) {
+    shard_set_t *set = (shard_set_t *)arg;
+    const char *effective_log_id = log_id[0] != '\0' ? log_id : "-";
+    if (op == WRITE_OP_BATCH) return replay_journal_batch(set, seq, storage_key, effective_log_id, payload, payload_len);
+    if (op == WRITE_OP_RIDE_CHUNK ? !ride_storage_key_is_valid(storage_key) : !is_valid_storage_key(storage_key)) {
+        log_warn("DATA WRITE replay skipped key=%s logid=%s reason=invalid_key", storage_key, effective_log_id);
+        return 0;
+    }
+
+    int shard = storage_key_shard(storage_key, set->count);
+    kv_writer_t *writer = &set->writers[shard];
+    uint64_t current = 0;
+    if (kv_read_version(writer, storage_key, &current) != SQLITE_DONE) {
+        log_error(
+            "DATA WRITE replay failed key=%s pending=journal logid=%s reason=version_read_error errmsg=%s",
+            storage_key,
+            effective_log_id,
+            sqlite3_errmsg(set->dbs[shard]));
+        return -1;
+    }
+    if (current >= seq) return 0;
+    if (!write_precondition_holds(if_match, current)) {
+        log_warn(
+            "DATA WRITE replay skipped key=%s logid=%s reason=precondition_failed if_match=%lld version=%llu",
+            storage_key,
+            effective_log_id,
+            (long long)if_match,
+            (unsigned long long)current);
+        return 0;
+    }
+
+    int step_rc = kv_write_apply(writer, op, storage_key, payload, payload_len, seq);
+    if (step_rc == KV_WRITE_NOT_LIST) {
+        log_warn("DATA WRITE replay skipped key=%s logid=%s reason=not_a_list", storage_key, effective_log_id);
+        return 0;
+    }
+    if (step_rc != SQLITE_DONE) {
+        log_error(
+            "DATA WRITE replay failed key=%s pending=journal logid=%s reason=sqlite_step_error errmsg=%s",
+            storage_key,
+            effective_log_id,
+            sqlite3_errmsg(set->dbs[shard]));
+        return -1;
+    }
+    log_info("DATA WRITE replayed key=%s status=stored pending=journal bytes=%zu logid=%s", storage_key, payload_len, effective_log_id);
+    return replay_txn_note_write(set, shard);
+}
+
+static int commit_replayed_journal(void *arg) {
+    return replay_txn_commit((shard_set_t *)arg);
+}
+
+static int replay_journal(shard_set_t *set) {
+    journal_replay_stats_t stats;
+    uint64_t started_ns = metrics_now_ns();
+    if (replay_txn_begin(set) != 0) {
+        replay_txn_rollback(set);
+        return -1;
+    }
+    int rc = journal_replay(replay_journal_record, commit_replayed_journal, set, &stats);
+    replay_txn_rollback(set);
+    if (rc == 0 && stats.segments > 0) {
+        log_info(
+            "journal replay segments=%zu applied=%zu skipped=%zu superseded=%zu checkpoint=%llu elapsed_ms=%llu",
+            stats.segments,
+            stats.applied,
+            stats.skipped,
+            stats.superseded,
+            (unsigned long long)stats.checkpoint_seq,
+            (unsigned long long)((metrics_now_ns() - started_ns) / 1000000ull));
+    }
     return rc;
 }
 
-int init_db(const char *db_path) {
-    sqlite3 *db = NULL;
-    if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, NULL) != SQLITE_OK) {
-        log_error("failed to open db: %s", sqlite3_errmsg(db));
-        if (db) sqlite3_close(db);
+static void shard_set_close(shard_set_t *set) {
+    for (int i = 0; i < set->count; i++) {
+        kv_writer_finalize(&set->writers[i]);
+        if (set->dbs[i]) sqlite3_close(set->dbs[i]);
+    }
+    memset(set, 0, sizeof(*set));
+}
+
+/*
+ * Tables created before a column existed get it appended (after the value,
+ * so reading it there walks the value's overflow pages; new tables keep it
+ * in front). Existing kv_store rows start at version 1 with no items;
+ * existing kv_items rows have no item_ts.
+ */
+static int add_missing_column(sqlite3 *db, const char *path, const char *table, const char *column, const char *definition) {
+    char sql[160];
+    sqlite3_stmt *stmt = NULL;
+    snprintf(sql, sizeof(sql), "SELECT %s FROM %s LIMIT 0", column, table);
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) == SQLITE_OK) {
+        sqlite3_finalize(stmt);
+        return 0;
+    }
+    char *err = NULL;
+    snprintf(sql, sizeof(sql), "ALTER TABLE %s ADD COLUMN %s %s", table, column, definition);
+    if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
+        log_error("failed to add %s column %s: %s", column, path, err ? err : "unknown");
+        sqlite3_free(err);
+        return -1;
+    }
+    log_info("added %s column to %s in %s", column, table, path);
+    return 0;
+}
+
+static int max_version(const shard_set_t *set, uint64_t *out_version) {
+    *out_version = 0;
+    for (int i = 0; i < set->count; i++) {
+        sqlite3_stmt *stmt = NULL;
+        if (sqlite3_prepare_v2(set->dbs[i], "SELECT COALESCE(MAX(version), 0) FROM kv_store", -1, &stmt, NULL) != SQLITE_OK) return -1;
+        uint64_t version = sqlite3_step(stmt) == SQLITE_ROW ? (uint64_t)sqlite3_column_int64(stmt, 0) : 0;
+        sqlite3_finalize(stmt);
+        if (version > *out_version) *out_version = version;
+    }
+    return 0;
+}
+
+static int open_shard(sqlite3 **out_db, const char *path) {
+    if (sqlite3_open_v2(path, out_db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, NULL) != SQLITE_OK) {
+        log_error("failed to open db %s: %s", path, sqlite3_errmsg(*out_db));
         return -1;
     }
 
@@ -229,41 +586,97 @@ int init_db(const char *db_path) {
         "PRAGMA mmap_size=268435456;"
         "CREATE TABLE IF NOT EXISTS kv_store ("
         "data_key TEXT PRIMARY KEY,"
+        "version INTEGER NOT NULL DEFAULT 1,"
+        "items INTEGER NOT NULL DEFAULT 0,"
         "data_value TEXT NOT NULL,"
         "updated_at INTEGER NOT NULL"
-        ");";
+        ");"
+        "CREATE TABLE IF NOT EXISTS kv_items ("
+        "data_key TEXT NOT NULL,"
+        "position INTEGER NOT NULL,"
+        "item_id TEXT,"
+        "item_ts INTEGER,"
+        "item_value TEXT NOT NULL,"
+        "PRIMARY KEY (data_key, position)"
+        ");"
+        "CREATE INDEX IF NOT EXISTS kv_items_by_id ON kv_items (data_key, item_id);"
+        "CREATE TABLE IF NOT EXISTS ride_chunks ("
+        "stream_key TEXT NOT NULL,"
+        "version INTEGER NOT NULL,"
+        "t_first INTEGER NOT NULL,"
+        "t_last INTEGER NOT NULL,"
+        "samples INTEGER NOT NULL,"
+        "crc32 INTEGER NOT NULL,"
+        "columns BLOB NOT NULL,"
+        "PRIMARY KEY (stream_key, version)"
+        ");"
+        "CREATE INDEX IF NOT EXISTS ride_chunks_by_time ON ride_chunks (stream_key, t_last);";
 
     char *err = NULL;
-    if (sqlite3_exec(db, schema_sql, NULL, NULL, &err) != SQLITE_OK) {
-        log_error("failed to init schema: %s", err ? err : "unknown");
+    if (sqlite3_exec(*out_db, schema_sql, NULL, NULL, &err) != SQLITE_OK) {
+        log_error("failed to init schema %s: %s", path, err ? err : "unknown");
         sqlite3_free(err);
-        sqlite3_close(db);
         return -1;
     }
+    if (add_missing_column(*out_db, path, "kv_store", "version", "INTEGER NOT NULL DEFAULT 1") != 0 ||
+        add_missing_column(*out_db, path, "kv_store", "items", "INTEGER NOT NULL DEFAULT 0") != 0 ||
+        add_missing_column(*out_db, path, "kv_items", "item_ts", "INTEGER") != 0) {
+        return -1;
+    }
+    return sqlite3_exec(*out_db, "CREATE INDEX IF NOT EXISTS kv_items_by_ts ON kv_items (data_key, item_ts);", NULL, NULL, NULL) == SQLITE_OK ? 0 : -1;
+}
 
-    if (replay_pending_writes(db) != 0) {
-        log_error("failed to replay pending writes");
-        sqlite3_close(db);
+/*
+ * Records the shard count in the primary db the first time it is opened and
+ * refuses to start with a different one, since rows would no longer be found
+ * on the shard their account hashes to. Data dirs that predate sharding are
+ * treated as single-shard.
+ */
+static int check_shard_count(sqlite3 *db, int shard_count) {
+    const char *meta_sql = "CREATE TABLE IF NOT EXISTS kv_meta (name TEXT PRIMARY KEY, value TEXT NOT NULL);";
+    if (sqlite3_exec(db, meta_sql, NULL, NULL, NULL) != SQLITE_OK) return -1;
+
+    int stored = 0;
+    sqlite3_stmt *stmt = NULL;
+    if (sqlite3_prepare_v2(db, "SELECT value FROM kv_meta WHERE name='write_shards'", -1, &stmt, NULL) != SQLITE_OK) return -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW) stored = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    if (stored == 0) {
+        if (sqlite3_prepare_v2(db, "SELECT 1 FROM kv_store WHERE data_key LIKE '%::%' LIMIT 1", -1, &stmt, NULL) != SQLITE_OK) return -1;
+        int has_account_rows = sqlite3_step(stmt) == SQLITE_ROW;
+        sqlite3_finalize(stmt);
+        stored = has_account_rows ? 1 : shard_count;
+
+        if (sqlite3_prepare_v2(db, "INSERT INTO kv_meta (name, value) VALUES ('write_shards', ?1)", -1, &stmt, NULL) != SQLITE_OK) return -1;
+        sqlite3_bind_int(stmt, 1, stored);
+        int rc = sqlite3_step(stmt);
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE) return -1;
+    }
+
+    if (stored != shard_count) {
+        log_error("db was created with write_shards=%d but FRICU_WRITE_SHARDS=%d", stored, shard_count);
         return -1;
     }
+    return 0;
+}
 
+static int seed_data_keys(sqlite3 *db) {
     sqlite3_stmt *stmt = NULL;
     const char *upsert = "INSERT OR IGNORE INTO kv_store (data_key, data_value, updated_at) VALUES (?1, ?2, strftime('%s', 'now'));";
     if (sqlite3_prepare_v2(db, upsert, -1, &stmt, NULL) != SQLITE_OK) {
         log_error("failed to prepare init insert: %s", sqlite3_errmsg(db));
-        sqlite3_close(db);
         return -1;
     }
 
-    for (size_t i = 0; i < DATA_KEYS_COUNT; i++) {
-        int is_object_key = strcmp(DATA_KEYS[i], "profile") == 0 || strcmp(DATA_KEYS[i], "app_settings") == 0;
-        const char *default_json = is_object_key ? "{}" : "[]";
-        sqlite3_bind_text(stmt, 1, DATA_KEYS[i], -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 2, default_json, -1, SQLITE_STATIC);
+    for (int id = 0; id < DATA_KEY_EXPORTED_FILE; id++) {
+        const data_key_t *desc = &DATA_KEY_TABLE[id];
+        sqlite3_bind_text(stmt, 1, desc->name, (int)desc->name_len, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, desc->default_body, -1, SQLITE_STATIC);
         if (sqlite3_step(stmt) != SQLITE_DONE) {
-            log_error("failed to seed key %s: %s", DATA_KEYS[i], sqlite3_errmsg(db));
+            log_error("failed to seed key %s: %s", desc->name, sqlite3_errmsg(db));
             sqlite3_finalize(stmt);
-            sqlite3_close(db);
             return -1;
         }
         sqlite3_reset(stmt);
@@ -271,16 +684,119 @@ int init_db(const char *db_path) {
     }
 
     sqlite3_finalize(stmt);
-    sqlite3_close(db);
+    return 0;
+}
+
+int init_db(const char *db_path) {
+    shard_set_t set;
+    memset(&set, 0, sizeof(set));
+    set.count = write_dispatch_shard_count();
+
+    for (int i = 0; i < set.count; i++) {
+        char path[512];
+        if (shard_db_path(db_path, i, path, sizeof(path)) != 0 || open_shard(&set.dbs[i], path) != 0) {
+            shard_set_close(&set);
+            return -1;
+        }
+        if (kv_writer_prepare(&set.writers[i], set.dbs[i]) != 0) {
+            log_error("failed to prepare replay statements: %s", sqlite3_errmsg(set.dbs[i]));
+            shard_set_close(&set);
+            return -1;
+        }
+    }
+
+    if (check_shard_count(set.dbs[0], set.count) != 0) {
+        shard_set_close(&set);
+        return -1;
+    }
+
+    uint64_t version = 0;
+    if (max_version(&set, &version) != 0) {
+        shard_set_close(&set);
+        return -1;
+    }
+    set.next_version = version + 1;
+
+    if (replay_pending_writes(&set) != 0) {
+        log_error("failed to replay pending writes");
+        shard_set_close(&set);
+        return -1;
+    }
+
+    if (replay_journal(&set) != 0) {
+        log_error("failed to replay write journal");
+        shard_set_close(&set);
+        return -1;
+    }
+
+    /* New writes are versioned by journal seq, which must stay above every stored version. */
+    int rc = max_version(&set, &version);
+    if (rc == 0) {
+        journal_reserve_seq(version + 1);
+        rc = seed_data_keys(set.dbs[0]);
+    }
+    shard_set_close(&set);
+    /* Replay wrote behind the cache's back. */
+    value_cache_clear();
+    return rc;
+}
+
+static int worker_shard_open(worker_db_t *db, int shard, const char *path) {
+    sqlite3 **handle = &db->shards[shard];
+    if (sqlite3_open_v2(path, handle, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+        log_error("worker failed to open db %s: %s", path, sqlite3_errmsg(*handle));
+        return -1;
+    }
+
+    sqlite3_exec(*handle, "PRAGMA busy_timeout=5000;", NULL, NULL, NULL);
+    sqlite3_exec(*handle, "PRAGMA synchronous=FULL;", NULL, NULL, NULL);
+    sqlite3_exec(*handle, "PRAGMA fullfsync=ON;", NULL, NULL, NULL);
+    sqlite3_exec(*handle, "PRAGMA checkpoint_fullfsync=ON;", NULL, NULL, NULL);
+    sqlite3_exec(*handle, "PRAGMA temp_store=MEMORY;", NULL, NULL, NULL);
+    sqlite3_exec(*handle, "PRAGMA mmap_size=268435456;", NULL, NULL, NULL);
+    sqlite3_exec(*handle, "PRAGMA cache_size=-32768;", NULL, NULL, NULL);
+
+    if (sqlite3_prepare_v2(*handle, "SELECT version, data_value, items FROM kv_store WHERE data_key=?1", -1, &db->get_stmts[shard], NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(*handle, "SELECT version FROM kv_store WHERE data_key=?1", -1, &db->version_stmts[shard], NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(
+            *handle,
+            "SELECT item_value FROM kv_items WHERE data_key=?1 ORDER BY position",
+            -1,
+            &db->item_stmts[shard],
+            NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(
+            *handle,
+            "SELECT position, item_value FROM kv_items WHERE data_key=?1 AND position>?2 ORDER BY position LIMIT ?3",
+            -1,
+            &db->page_stmts[shard],
+            NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(
+            *handle,
+            "SELECT position, item_value FROM kv_items WHERE data_key=?1 AND position>?2 AND item_ts>=?4 ORDER BY position LIMIT ?3",
+            -1,
+            &db->since_stmts[shard],
+            NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(
+            *handle,
+            "SELECT t_first, t_last, crc32, columns FROM ride_chunks WHERE stream_key=?1 AND t_last>=?2 AND version<=?3 ORDER BY t_last LIMIT ?4",
+            -1,
+            &db->chunk_stmts[shard],
+            NULL) != SQLITE_OK) {
+        log_error("worker failed to prepare statements: %s", sqlite3_errmsg(*handle));
+        return -1;
+    }
     return 0;
 }
 
 int worker_db_open(worker_db_t *db, const char *db_path) {
     memset(db, 0, sizeof(*db));
-    if (sqlite3_open_v2(db_path, &db->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
-        log_error("worker failed to open db: %s", sqlite3_errmsg(db->db));
-        if (db->db) sqlite3_close(db->db);
-        return -1;
+    db->shard_count = write_dispatch_shard_count();
+    for (int i = 0; i < db->shard_count; i++) {
+        char path[512];
+        if (shard_db_path(db_path, i, path, sizeof(path)) != 0 || worker_shard_open(db, i, path) != 0) {
+            worker_db_close(db);
+            return -1;
+        }
     }
 
     char resolved_path[PATH_MAX] = {0};
@@ -290,21 +806,7 @@ int worker_db_open(worker_db_t *db, const char *db_path) {
     }
     if (snprintf(db->db_path, sizeof(db->db_path), "%s", effective_path) <= 0 ||
         strlen(effective_path) >= sizeof(db->db_path)) {
-        worker_db_close(db);
-        return -1;
-    }
-
-    sqlite3_exec(db->db, "PRAGMA busy_timeout=5000;", NULL, NULL, NULL);
-    sqlite3_exec(db->db, "PRAGMA synchronous=FULL;", NULL, NULL, NULL);
-    sqlite3_exec(db->db, "PRAGMA fullfsync=ON;", NULL, NULL, NULL);
-    sqlite3_exec(db->db, "PRAGMA checkpoint_fullfsync=ON;", NULL, NULL, NULL);
-    sqlite3_exec(db->db, "PRAGMA temp_store=MEMORY;", NULL, NULL, NULL);
-    sqlite3_exec(db->db, "PRAGMA mmap_size=268435456;", NULL, NULL, NULL);
-    sqlite3_exec(db->db, "PRAGMA cache_size=-32768;", NULL, NULL, NULL);
-
-    if (sqlite3_prepare_v2(db->db, "SELECT data_value FROM kv_store WHERE data_key=?1", -1, &db->get_stmt, NULL) != SQLITE_OK ||
-        sqlite3_prepare_v2(db->db, "SELECT json_valid(?1)", -1, &db->json_valid_stmt, NULL) != SQLITE_OK) {
-        log_error("worker failed to prepare statements: %s", sqlite3_errmsg(db->db));
+        db->db_path[0] = '\0';
         worker_db_close(db);
         return -1;
     }
@@ -319,9 +821,15 @@ int worker_db_open(worker_db_t *db, const char *db_path) {
 }
 
 void worker_db_close(worker_db_t *db) {
-    sqlite3_finalize(db->get_stmt);
-    sqlite3_finalize(db->json_valid_stmt);
-    if (db->db) sqlite3_close(db->db);
+    for (int i = 0; i < db->shard_count; i++) {
+        sqlite3_finalize(db->get_stmts[i]);
+        sqlite3_finalize(db->version_stmts[i]);
+        sqlite3_finalize(db->item_stmts[i]);
+        sqlite3_finalize(db->page_stmts[i]);
+        sqlite3_finalize(db->since_stmts[i]);
+        sqlite3_finalize(db->chunk_stmts[i]);
+        if (db->shards[i]) sqlite3_close(db->shards[i]);
+    }
     if (db->db_path[0] != '\0') {
         write_dispatcher_release();
     }
@@ -5,9 +5,11 @@
 #include <errno.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 #if defined(__linux__)
@@ -19,21 +21,256 @@
 #error "Unsupported platform: only Linux and macOS are supported"
 #endif
 
-static void close_conn(int qfd, conn_t **conns, int fd) {
-    if (fd < 0) return;
+/*
+ * Connections live in a dense slot table and are named in the event queue
+ * by a handle of (generation << 32 | slot). Closing a connection bumps its
+ * slot's generation, so an event already fetched for it, or one for a new
+ * connection that reused the fd, can never reach the wrong conn_t.
+ */
+#define LISTEN_HANDLE UINT64_MAX
+#define COMPLETION_HANDLE (UINT64_MAX - 1)
+#define CONN_TABLE_INIT_SLOTS 256
+
+/*
+ * io_uring user_data: a connection handle with the operation in its top two
+ * bits (the generation gives them up, leaving a 30-bit stale check), or a
+ * RING_TAG_* for the loop's own requests.
+ */
+#define RING_OP_SHIFT 62
+#define RING_OP_RECV 1ULL
+#define RING_OP_POLLOUT 2ULL
+#define RING_OP_LOOP 3ULL
+#define RING_GENERATION_MASK 0x3fffffffU
+#define RING_TAG_IGNORE (RING_OP_LOOP << RING_OP_SHIFT)
+#define RING_TAG_ACCEPT (RING_TAG_IGNORE | 1)
+#define RING_TAG_COMPLETIONS (RING_TAG_IGNORE | 2)
+
+typedef struct {
+    /* epoll/kqueue descriptor, or -1 when the loop runs on ring. */
+    int qfd;
+    io_ring_t *ring;
+    worker_db_t *db;
+    int listen_fd;
+    int max_requests;
+    conn_table_t table;
+    const worker_config_t *config;
+    conn_pool_t pool;
+    /* Live connections ordered by last activity, oldest first. */
+    conn_t *idle_head;
+    conn_t *idle_tail;
+    /*
+     * Connections parked on the change feed, the feed seq they were last
+     * looked at for, and when the earliest of them is next due.
+     */
+    conn_t *watch_head;
+    uint64_t watch_seq;
+    int64_t watch_due_ms;
+} worker_loop_t;
+
+static int64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void idle_unlink(worker_loop_t *loop, conn_t *conn) {
+    if (conn->idle_prev) {
+        conn->idle_prev->idle_next = conn->idle_next;
+    } else if (loop->idle_head == conn) {
+        loop->idle_head = conn->idle_next;
+    }
+    if (conn->idle_next) {
+        conn->idle_next->idle_prev = conn->idle_prev;
+    } else if (loop->idle_tail == conn) {
+        loop->idle_tail = conn->idle_prev;
+    }
+    conn->idle_prev = NULL;
+    conn->idle_next = NULL;
+}
+
+static void idle_touch(worker_loop_t *loop, conn_t *conn, int64_t now_ms) {
+    conn->last_active_ms = now_ms;
+    if (loop->idle_tail == conn) return;
+    idle_unlink(loop, conn);
+    conn->idle_prev = loop->idle_tail;
+    if (loop->idle_tail) {
+        loop->idle_tail->idle_next = conn;
+    } else {
+        loop->idle_head = conn;
+    }
+    loop->idle_tail = conn;
+}
+
+/* The first parked watch marks the worker as waiting, so the dispatchers wake it on new changes. */
+static void watch_link(worker_loop_t *loop, conn_t *conn) {
+    if (conn->watch_linked) return;
+    conn->watch_linked = 1;
+    conn->watch_prev = NULL;
+    conn->watch_next = loop->watch_head;
+    if (loop->watch_head) {
+        loop->watch_head->watch_prev = conn;
+    } else {
+        change_feed_set_waiting(loop->db->completions, 1);
+    }
+    loop->watch_head = conn;
+    loop->watch_due_ms = 0;
+}
+
+static void watch_unlink(worker_loop_t *loop, conn_t *conn) {
+    if (!conn->watch_linked) return;
+    if (conn->watch_prev) {
+        conn->watch_prev->watch_next = conn->watch_next;
+    } else {
+        loop->watch_head = conn->watch_next;
+    }
+    if (conn->watch_next) conn->watch_next->watch_prev = conn->watch_prev;
+    conn->watch_prev = NULL;
+    conn->watch_next = NULL;
+    conn->watch_linked = 0;
+    if (!loop->watch_head) change_feed_set_waiting(loop->db->completions, 0);
+}
+
+void conn_table_init(conn_table_t *table) {
+    table->slots = NULL;
+    table->slot_count = 0;
+    table->free_slot = CONN_SLOT_NONE;
+}
+
+void conn_table_destroy(conn_table_t *table) {
+    free(table->slots);
+    conn_table_init(table);
+}
+
+int conn_table_insert(conn_table_t *table, conn_t *conn) {
+    if (table->free_slot == CONN_SLOT_NONE) {
+        uint32_t count = table->slot_count ? table->slot_count * 2 : CONN_TABLE_INIT_SLOTS;
+        if (count <= table->slot_count || count == CONN_SLOT_NONE) return -1;
+        conn_slot_t *slots = (conn_slot_t *)realloc(table->slots, count * sizeof(conn_slot_t));
+        if (!slots) return -1;
+        for (uint32_t i = count; i-- > table->slot_count;) {
+            slots[i].conn = NULL;
+            slots[i].generation = 0;
+            slots[i].next_free = table->free_slot;
+            table->free_slot = i;
+        }
+        table->slots = slots;
+        table->slot_count = count;
+    }
+    uint32_t slot = table->free_slot;
+    table->free_slot = table->slots[slot].next_free;
+    table->slots[slot].conn = conn;
+    conn->handle = (uint64_t)table->slots[slot].generation << 32 | slot;
+    return 0;
+}
+
+void conn_table_remove(conn_table_t *table, conn_t *conn) {
+    uint32_t slot = (uint32_t)conn->handle;
+    table->slots[slot].conn = NULL;
+    table->slots[slot].generation++;
+    table->slots[slot].next_free = table->free_slot;
+    table->free_slot = slot;
+}
+
+conn_t *conn_table_lookup(const conn_table_t *table, uint64_t handle) {
+    uint32_t slot = (uint32_t)handle;
+    if (slot >= table->slot_count || table->slots[slot].generation != (uint32_t)(handle >> 32)) return NULL;
+    return table->slots[slot].conn;
+}
+
+static uint64_t ring_tag(uint64_t handle, uint64_t op) {
+    return (handle & ~(3ULL << RING_OP_SHIFT)) | op << RING_OP_SHIFT;
+}
+
+static conn_t *ring_conn_lookup(const worker_loop_t *loop, uint64_t tag) {
+    uint32_t slot = (uint32_t)tag;
+    const conn_table_t *table = &loop->table;
+    if (slot >= table->slot_count) return NULL;
+    if ((table->slots[slot].generation & RING_GENERATION_MASK) != ((uint32_t)(tag >> 32) & RING_GENERATION_MASK)) return NULL;
+    return table->slots[slot].conn;
+}
+
+static void close_conn(worker_loop_t *loop, conn_t *conn) {
+    int fd = conn->fd;
+    watch_unlink(loop, conn);
+    conn_watch_free(conn);
+    if (loop->ring) {
+        /* A cancelled recv still completes, by then under a stale handle. */
+        if (conn->ring_armed) io_ring_prep_cancel(loop->ring, ring_tag(conn->handle, (uint64_t)conn->ring_armed), RING_TAG_IGNORE);
+        if (io_ring_prep_close(loop->ring, fd, RING_TAG_IGNORE) == 0) fd = -1;
+    } else {
 #if defined(__linux__)
-    epoll_ctl(qfd, EPOLL_CTL_DEL, fd, NULL);
+        /*
+         * The kernel may still be reading zerocopy pages; keep their buffers
+         * until the completions arrive (or close_idle_conns gives up on them).
+         */
+        if (!conn->zc_draining && conn_output_zerocopy_pending(conn)) {
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.data.u64 = conn->handle;
+            if (epoll_ctl(loop->qfd, EPOLL_CTL_MOD, fd, &ev) == 0) {
+                conn->zc_draining = 1;
+                return;
+            }
+        }
+
+        epoll_ctl(loop->qfd, EPOLL_CTL_DEL, fd, NULL);
 #elif defined(__APPLE__)
-    struct kevent ev;
-    EV_SET(&ev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
-    kevent(qfd, &ev, 1, NULL, 0, NULL);
+        struct kevent ev[2];
+        EV_SET(&ev[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+        EV_SET(&ev[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+        kevent(loop->qfd, ev, 2, NULL, 0, NULL);
 #endif
-    if (conns[fd]) {
-        free(conns[fd]->buf);
-        free(conns[fd]);
-        conns[fd] = NULL;
     }
-    close(fd);
+    idle_unlink(loop, conn);
+    conn_admission_release(loop->db, conn);
+    conn_stream_free(conn);
+    conn_pending_write_free(conn);
+    conn_output_reset(conn);
+    conn_table_remove(&loop->table, conn);
+    conn_pool_put(&loop->pool, conn);
+    metrics_set_open_conns(loop->pool.live_conns);
+    if (fd >= 0) close(fd);
+}
+
+/*
+ * Walks the connections least recently active first. One between requests
+ * is closed after keepalive_idle_ms. One still sending a response, or
+ * waiting on zerocopy completions to close, has a slow reader rather than
+ * nothing to do: it is only dropped, and logged, once no event moved it
+ * for send_timeout_ms.
+ */
+static void close_idle_conns(worker_loop_t *loop, int64_t now_ms) {
+    int idle_ms = loop->config->keepalive_idle_ms;
+    int send_ms = loop->config->send_timeout_ms;
+    int first_ms = idle_ms > 0 && (send_ms <= 0 || idle_ms < send_ms) ? idle_ms : send_ms;
+    if (first_ms <= 0) return;
+    conn_t *conn = loop->idle_head;
+    while (conn && now_ms - conn->last_active_ms >= first_ms) {
+        conn_t *next = conn->idle_next;
+        int64_t quiet_ms = now_ms - conn->last_active_ms;
+        if (conn->pending_write || conn->watch) {
+            /* Waiting on the dispatcher or the change feed is not idling. */
+            idle_touch(loop, conn, now_ms);
+        } else if (conn->out_head || conn->stream || conn->zc_draining) {
+            /* Pinned buffers must be freed eventually, even with no send timeout. */
+            int stall_ms = send_ms > 0 || !conn->zc_draining ? send_ms : idle_ms;
+            if (stall_ms > 0 && quiet_ms >= stall_ms) {
+                log_warn(
+                    "closing stalled connection fd=%d unsent_bytes=%zu streaming=%d zerocopy_pending=%d quiet_ms=%lld",
+                    conn->fd,
+                    conn->out_bytes,
+                    conn->stream != NULL,
+                    conn_output_zerocopy_pending(conn),
+                    (long long)quiet_ms);
+                conn->zc_draining = 1;
+                close_conn(loop, conn);
+            }
+        } else if (idle_ms > 0 && quiet_ms >= idle_ms) {
+            conn->zc_draining = 1;
+            close_conn(loop, conn);
+        }
+        conn = next;
+    }
 }
 
 static int register_listen_fd(int qfd, int listen_fd) {
@@ -44,46 +281,125 @@ static int register_listen_fd(int qfd, int listen_fd) {
 #ifdef EPOLLEXCLUSIVE
     ev.events |= EPOLLEXCLUSIVE;
 #endif
-    ev.data.fd = listen_fd;
+    ev.data.u64 = LISTEN_HANDLE;
     return epoll_ctl(qfd, EPOLL_CTL_ADD, listen_fd, &ev);
 #elif defined(__APPLE__)
     struct kevent ev;
-    EV_SET(&ev, listen_fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, NULL);
+    EV_SET(&ev, listen_fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, (void *)(uintptr_t)LISTEN_HANDLE);
     return kevent(qfd, &ev, 1, NULL, 0, NULL);
 #endif
 }
 
-static int register_client_fd(int qfd, int fd) {
+static int register_completions(int qfd, int fd) {
 #if defined(__linux__)
     struct epoll_event ev;
     memset(&ev, 0, sizeof(ev));
-    ev.events = EPOLLIN | EPOLLRDHUP;
-    ev.data.fd = fd;
+    ev.events = EPOLLIN;
+    ev.data.u64 = COMPLETION_HANDLE;
     return epoll_ctl(qfd, EPOLL_CTL_ADD, fd, &ev);
 #elif defined(__APPLE__)
     struct kevent ev;
-    EV_SET(&ev, fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, NULL);
+    EV_SET(&ev, fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, (void *)(uintptr_t)COMPLETION_HANDLE);
     return kevent(qfd, &ev, 1, NULL, 0, NULL);
 #endif
 }
 
-static int queue_wait(int qfd, int listen_fd, int *fds, int *is_err, int max_events) {
+static int register_client(int qfd, const conn_t *conn) {
+#if defined(__linux__)
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.u64 = conn->handle;
+    return epoll_ctl(qfd, EPOLL_CTL_ADD, conn->fd, &ev);
+#elif defined(__APPLE__)
+    struct kevent ev[2];
+    void *udata = (void *)(uintptr_t)conn->handle;
+    EV_SET(&ev[0], conn->fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, udata);
+    EV_SET(&ev[1], conn->fd, EVFILT_WRITE, EV_ADD | EV_DISABLE, 0, 0, udata);
+    return kevent(qfd, ev, 2, NULL, 0, NULL);
+#endif
+}
+
+/*
+ * On ring, interest is served by one request at a time: a provided-buffer
+ * recv for READ, a oneshot POLLOUT for WRITE. Each completion disarms the
+ * connection, and whoever handles it re-arms it for whatever comes next.
+ */
+static int ring_arm(worker_loop_t *loop, conn_t *conn) {
+    if (conn->ring_armed || conn->interest == CONN_INTEREST_NONE) return 0;
+    int rc = conn->interest == CONN_INTEREST_READ
+                 ? io_ring_prep_recv(loop->ring, conn->fd, ring_tag(conn->handle, RING_OP_RECV))
+                 : io_ring_prep_poll(loop->ring, conn->fd, POLLOUT, 0, ring_tag(conn->handle, RING_OP_POLLOUT));
+    if (rc == 0) conn->ring_armed = conn->interest + 1;
+    return rc;
+}
+
+/*
+ * While a response is pending the connection only waits for writability;
+ * input stays in the kernel until the queued output drains. While a write
+ * completion is outstanding it waits for neither.
+ */
+static int set_client_interest(worker_loop_t *loop, conn_t *conn, int interest) {
+    if (loop->ring) {
+        conn->interest = interest;
+        return ring_arm(loop, conn);
+    }
+    if (conn->interest == interest) return 0;
+    int qfd = loop->qfd;
+#if defined(__linux__)
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLRDHUP;
+    if (interest == CONN_INTEREST_READ) ev.events |= EPOLLIN;
+    if (interest == CONN_INTEREST_WRITE) ev.events |= EPOLLOUT;
+    ev.data.u64 = conn->handle;
+    int rc = epoll_ctl(qfd, EPOLL_CTL_MOD, conn->fd, &ev);
+#elif defined(__APPLE__)
+    struct kevent ev[2];
+    void *udata = (void *)(uintptr_t)conn->handle;
+    EV_SET(&ev[0], conn->fd, EVFILT_READ, interest == CONN_INTEREST_READ ? EV_ENABLE : EV_DISABLE, 0, 0, udata);
+    EV_SET(&ev[1], conn->fd, EVFILT_WRITE, interest == CONN_INTEREST_WRITE ? EV_ENABLE : EV_DISABLE, 0, 0, udata);
+    int rc = kevent(qfd, ev, 2, NULL, 0, NULL);
+#endif
+    if (rc == 0) conn->interest = interest;
+    return rc;
+}
+
+typedef struct {
+    uint64_t handle;
+    int readable;
+    int writable;
+    int error;
+    int error_queue;
+} queue_event_t;
+
+static int queue_wait(int qfd, queue_event_t *out, int max_events, int timeout_ms) {
 #if defined(__linux__)
     struct epoll_event events[EVENT_MAX_EVENTS];
-    int n = epoll_wait(qfd, events, max_events, -1);
+    int n = epoll_wait(qfd, events, max_events, timeout_ms);
     if (n < 0) return n;
     for (int i = 0; i < n; i++) {
-        fds[i] = events[i].data.fd;
-        is_err[i] = (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) != 0 && events[i].data.fd != listen_fd;
+        uint32_t flags = events[i].events;
+        out[i].handle = events[i].data.u64;
+        out[i].readable = (flags & EPOLLIN) != 0;
+        out[i].writable = (flags & EPOLLOUT) != 0;
+        out[i].error = (flags & (EPOLLHUP | EPOLLRDHUP)) != 0 && out[i].handle < COMPLETION_HANDLE;
+        out[i].error_queue = (flags & EPOLLERR) != 0 && out[i].handle < COMPLETION_HANDLE;
     }
     return n;
 #elif defined(__APPLE__)
     struct kevent events[EVENT_MAX_EVENTS];
-    int n = kevent(qfd, NULL, 0, events, max_events, NULL);
+    struct timespec timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+    int n = kevent(qfd, NULL, 0, events, max_events, timeout_ms >= 0 ? &timeout : NULL);
     if (n < 0) return n;
     for (int i = 0; i < n; i++) {
-        fds[i] = (int)events[i].ident;
-        is_err[i] = ((events[i].flags & EV_EOF) != 0 || events[i].filter == EV_ERROR) && (int)events[i].ident != listen_fd;
+        out[i].handle = (uint64_t)(uintptr_t)events[i].udata;
+        out[i].readable = events[i].filter == EVFILT_READ;
+        out[i].writable = events[i].filter == EVFILT_WRITE;
+        out[i].error = ((events[i].flags & EV_EOF) != 0 || events[i].filter == EV_ERROR) && out[i].handle < COMPLETION_HANDLE;
+        out[i].error_queue = 0;
     }
     return n;
 #endif
@@ -105,142 +421,466 @@ static int accept_client(int listen_fd) {
     return fd;
 }
 
-int run_worker_loop(int listen_fd, const char *db_path, size_t max_fds) {
-    worker_db_t db;
-    if (worker_db_open(&db, db_path) != 0) return -1;
+/* Takes ownership of client_fd, which is already non-blocking. */
+static void admit_client(worker_loop_t *loop, int client_fd, int64_t now_ms) {
+    /* On ring the listener carries TCP_NODELAY, which accepted sockets inherit. */
+    if (!loop->ring) {
+        int nodelay = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    }
+    if (configure_socket_after_accept(client_fd) != 0) {
+        close(client_fd);
+        return;
+    }
 
-#if defined(__linux__)
-    int qfd = epoll_create1(0);
-#else
-    int qfd = kqueue();
-#endif
-    if (qfd < 0) {
-        log_error("failed to create event queue: errno=%d", errno);
-        worker_db_close(&db);
+    conn_t *conn = conn_pool_get(&loop->pool);
+    if (!conn) {
+        close(client_fd);
+        return;
+    }
+    if (conn_table_insert(&loop->table, conn) != 0) {
+        conn_pool_put(&loop->pool, conn);
+        close(client_fd);
+        return;
+    }
+    conn->fd = client_fd;
+    conn->max_requests = loop->max_requests;
+    /* Zerocopy completions arrive on the error queue, which only the epoll loop watches. */
+    if (!loop->ring) conn_output_enable_zerocopy(client_fd, conn, loop->config->zerocopy_min_bytes);
+    idle_touch(loop, conn, now_ms);
+    metrics_set_open_conns(loop->pool.live_conns);
+
+    if ((loop->ring ? ring_arm(loop, conn) : register_client(loop->qfd, conn)) != 0) {
+        close_conn(loop, conn);
+    }
+}
+
+/*
+ * Makes room in a full conn->buf. Returns -1 after answering and closing the
+ * connection when the worker's buffer budget or memory runs out.
+ */
+static int reserve_input(worker_loop_t *loop, conn_t *conn) {
+    if (conn->len < conn->cap || conn->cap >= REQ_BUF_SIZE) return 0;
+    /* Once the headers are in, grow straight to the size of the whole request. */
+    size_t want = conn->cap * 2;
+    size_t request_len = conn->parse.header_len + conn->parse.content_length;
+    if (conn->parse.header_len && request_len > conn->cap) want = request_len;
+    int grow_rc = conn_pool_grow(&loop->pool, conn, want);
+    if (grow_rc == CONN_POOL_OVER_BUDGET) {
+        send_response(conn->fd, 503, "Service Unavailable", "{\"error\":\"server busy\"}");
+        close_conn(loop, conn);
         return -1;
     }
+    if (grow_rc != 0) {
+        send_response(conn->fd, 500, "Internal Server Error", "{\"error\":\"oom\"}");
+        close_conn(loop, conn);
+        return -1;
+    }
+    return 0;
+}
 
-    conn_t **conns = (conn_t **)calloc(max_fds + 1, sizeof(conn_t *));
-    if (!conns) {
-        close(qfd);
-        worker_db_close(&db);
+static int process_buffered_requests(worker_loop_t *loop, worker_db_t *db, conn_t *conn);
+
+/* Accounts for n bytes just stored after conn->len and serves them. Returns 1 when the connection was closed. */
+static int take_input(worker_loop_t *loop, worker_db_t *db, conn_t *conn, size_t n) {
+    conn->len += n;
+    if (conn->len >= REQ_BUF_SIZE) {
+        send_response(conn->fd, 413, "Payload Too Large", "{\"error\":\"request too large\"}");
+        close_conn(loop, conn);
+        return 1;
+    }
+    return process_buffered_requests(loop, db, conn);
+}
+
+/*
+ * Feeds buffered bytes to try_process_client until it wants more input, a
+ * response is still waiting for the socket, or a write is waiting for its
+ * completion. Pipelined requests already in conn->buf are served back to
+ * back, in order. Returns 1 when the connection was closed.
+ */
+static int process_buffered_requests(worker_loop_t *loop, worker_db_t *db, conn_t *conn) {
+    while (!conn->out_head && !conn->stream && !conn->pending_write && !conn->watch && !conn->close_after_flush && conn->len > 0) {
+        if (try_process_client(conn->fd, db, conn) != 1) break;
+        if (!conn->keep_alive) conn->close_after_flush = 1;
+    }
+    if (conn->len == 0) conn_pool_shrink(&loop->pool, conn);
+    if (conn->watch) watch_link(loop, conn);
+    /* An event stream with events still queued waits for writability like any response. */
+    if (conn->out_head || conn->stream) {
+        if (set_client_interest(loop, conn, CONN_INTEREST_WRITE) != 0) {
+            close_conn(loop, conn);
+            return 1;
+        }
+        return 0;
+    }
+    if (conn->pending_write || conn->watch) {
+        if (set_client_interest(loop, conn, CONN_INTEREST_NONE) != 0) {
+            close_conn(loop, conn);
+            return 1;
+        }
+        return 0;
+    }
+    if (conn->close_after_flush) {
+        close_conn(loop, conn);
+        return 1;
+    }
+    if (set_client_interest(loop, conn, CONN_INTEREST_READ) != 0) {
+        close_conn(loop, conn);
+        return 1;
+    }
+    return 0;
+}
+
+/* Answers every write whose completion came back, then serves what was pipelined behind it. */
+static void deliver_completions(worker_loop_t *loop, worker_db_t *db, write_completion_queue_t *completions, int64_t now_ms) {
+    write_completion_t *completion = write_completion_queue_take(completions);
+    while (completion) {
+        write_completion_t *next = completion->next;
+        /* The connection may have closed, and its slot been reused, meanwhile. */
+        conn_t *conn = conn_table_lookup(&loop->table, completion->owner_handle);
+        if (conn && conn == completion->owner && conn->pending_write && !conn->zc_draining) {
+            idle_touch(loop, conn, now_ms);
+            try_complete_write(conn->fd, conn, &completion->result);
+            if (!conn->keep_alive) conn->close_after_flush = 1;
+            if (conn->out_head || conn->stream) {
+                if (set_client_interest(loop, conn, CONN_INTEREST_WRITE) != 0) close_conn(loop, conn);
+            } else {
+                process_buffered_requests(loop, db, conn);
+            }
+        }
+        write_completion_release(completion);
+        completion = next;
+    }
+}
+
+/*
+ * Gives the parked change watches a look whenever the feed moved on since
+ * the last pass or one of them is due (a long-poll running out of time or
+ * an event stream owing a heartbeat). A watch that got its answer resumes
+ * the connection's pipelined requests like a finished write does.
+ */
+static void poll_watches(worker_loop_t *loop, worker_db_t *db, int64_t now_ms) {
+    if (!loop->watch_head) return;
+    uint64_t last = change_feed_last_seq();
+    if (last == loop->watch_seq && now_ms < loop->watch_due_ms) return;
+    loop->watch_seq = last;
+    loop->watch_due_ms = INT64_MAX;
+    conn_t *conn = loop->watch_head;
+    while (conn) {
+        conn_t *next = conn->watch_next;
+        int64_t due_ms = INT64_MAX;
+        if (conn->zc_draining || conn_watch_poll(conn->fd, conn, now_ms, &due_ms) != 0) {
+            close_conn(loop, conn);
+        } else if (!conn->watch) {
+            watch_unlink(loop, conn);
+            idle_touch(loop, conn, now_ms);
+            if (!conn->keep_alive) conn->close_after_flush = 1;
+            if (conn->out_head || conn->stream) {
+                if (set_client_interest(loop, conn, CONN_INTEREST_WRITE) != 0) close_conn(loop, conn);
+            } else {
+                process_buffered_requests(loop, db, conn);
+            }
+        } else {
+            if (due_ms < loop->watch_due_ms) loop->watch_due_ms = due_ms;
+            if (conn->out_head && set_client_interest(loop, conn, CONN_INTEREST_WRITE) != 0) close_conn(loop, conn);
+        }
+        conn = next;
+    }
+}
+
+/* With watches parked the loop wakes at least once a second to check their deadlines. */
+static int loop_timeout_ms(const worker_loop_t *loop, int wait_timeout_ms) {
+    if (loop->watch_head && (wait_timeout_ms < 0 || wait_timeout_ms > 1000)) return 1000;
+    return wait_timeout_ms;
+}
+
+/* Copies a provided receive buffer into conn->buf and serves it. Returns 1 when the connection was closed. */
+static int ring_ingest(worker_loop_t *loop, worker_db_t *db, conn_t *conn, const char *data, size_t len) {
+    while (len > 0) {
+        if (reserve_input(loop, conn) != 0) return 1;
+        size_t n = conn->cap - conn->len;
+        if (n > len) n = len;
+        memcpy(conn->buf + conn->len, data, n);
+        if (take_input(loop, db, conn, n)) return 1;
+        /* Turned away: whatever else the client sent is not going to be read. */
+        if (conn->close_after_flush) return 0;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void ring_conn_event(worker_loop_t *loop, worker_db_t *db, const io_ring_cqe_t *cqe, int64_t now_ms) {
+    conn_t *conn = ring_conn_lookup(loop, cqe->user_data);
+    /* A stale tag belongs to a request cancelled when its connection closed. */
+    if (!conn) {
+        io_ring_recycle(loop->ring, cqe->buf_id);
+        return;
+    }
+    conn->ring_armed = 0;
+    idle_touch(loop, conn, now_ms);
+
+    if (cqe->user_data >> RING_OP_SHIFT == RING_OP_RECV) {
+        if (cqe->res > 0 && cqe->buf) {
+            /* Whether or not that closed the connection, the bytes are copied out. */
+            ring_ingest(loop, db, conn, cqe->buf, (size_t)cqe->res);
+            io_ring_recycle(loop->ring, cqe->buf_id);
+            return;
+        }
+        io_ring_recycle(loop->ring, cqe->buf_id);
+        /* Out of provided buffers: try again once others are recycled. */
+        if (cqe->res == -ENOBUFS || cqe->res == -EINTR || cqe->res == -EAGAIN) {
+            if (ring_arm(loop, conn) != 0) close_conn(loop, conn);
+            return;
+        }
+        close_conn(loop, conn);
+        return;
+    }
+
+    if (cqe->res < 0 || (cqe->res & (POLLERR | POLLHUP))) {
+        close_conn(loop, conn);
+        return;
+    }
+    int flush_rc = conn_output_flush(conn->fd, conn);
+    if (flush_rc < 0) {
+        close_conn(loop, conn);
+        return;
+    }
+    if (flush_rc == 0 && conn->stream) {
+        if (conn_stream_resume(db, conn) < 0 || (flush_rc = conn_output_flush(conn->fd, conn)) < 0) {
+            close_conn(loop, conn);
+            return;
+        }
+    }
+    if (conn->out_head || conn->stream) {
+        if (ring_arm(loop, conn) != 0) close_conn(loop, conn);
+        return;
+    }
+    process_buffered_requests(loop, db, conn);
+}
+
+/*
+ * The io_uring flavour of the worker loop: one multishot accept, one
+ * multishot poll on the completion fd, and per connection a single recv or
+ * POLLOUT in flight. Responses are still written synchronously. Returns only
+ * when the standing requests cannot be armed at startup.
+ */
+static int run_ring_loop(worker_loop_t *loop, worker_db_t *db, write_completion_queue_t *completions, int wait_timeout_ms) {
+    if (io_ring_prep_accept_multishot(loop->ring, loop->listen_fd, RING_TAG_ACCEPT) != 0 ||
+        io_ring_prep_poll(loop->ring, completions->fd, POLLIN, 1, RING_TAG_COMPLETIONS) != 0 ||
+        io_ring_wait(loop->ring, 0) != 0) {
         return -1;
     }
 
-    if (register_listen_fd(qfd, listen_fd) != 0) {
+    while (1) {
+        if (io_ring_wait(loop->ring, loop_timeout_ms(loop, wait_timeout_ms)) != 0) {
+            log_warn("io_uring wait error: errno=%d", errno);
+            continue;
+        }
+
+        int64_t now_ms = monotonic_ms();
+        io_ring_cqe_t cqe;
+        while (io_ring_next(loop->ring, &cqe)) {
+            if (cqe.user_data == RING_TAG_ACCEPT) {
+                if (cqe.res >= 0) admit_client(loop, cqe.res, now_ms);
+                if (!cqe.more && io_ring_prep_accept_multishot(loop->ring, loop->listen_fd, RING_TAG_ACCEPT) != 0) {
+                    log_warn("failed to re-arm io_uring accept");
+                }
+                continue;
+            }
+            if (cqe.user_data == RING_TAG_COMPLETIONS) {
+                deliver_completions(loop, db, completions, now_ms);
+                if (!cqe.more && io_ring_prep_poll(loop->ring, completions->fd, POLLIN, 1, RING_TAG_COMPLETIONS) != 0) {
+                    log_warn("failed to re-arm io_uring completion poll");
+                }
+                continue;
+            }
+            if (cqe.user_data >> RING_OP_SHIFT == RING_OP_LOOP) continue;
+            ring_conn_event(loop, db, &cqe, now_ms);
+        }
+
+        poll_watches(loop, db, monotonic_ms());
+        close_idle_conns(loop, monotonic_ms());
+    }
+}
+
+static int run_queue_loop(worker_loop_t *loop, worker_db_t *db, write_completion_queue_t *completions, int wait_timeout_ms) {
+    if (register_listen_fd(loop->qfd, loop->listen_fd) != 0) {
         log_error("failed to register listen fd in event queue: errno=%d", errno);
-        free(conns);
-        close(qfd);
-        worker_db_close(&db);
+        return -1;
+    }
+    if (register_completions(loop->qfd, completions->fd) != 0) {
+        log_error("failed to register write completions in event queue: errno=%d", errno);
         return -1;
     }
 
-    int fds[EVENT_MAX_EVENTS];
-    int errs[EVENT_MAX_EVENTS];
+    queue_event_t events[EVENT_MAX_EVENTS];
 
     while (1) {
-        int n = queue_wait(qfd, listen_fd, fds, errs, EVENT_MAX_EVENTS);
+        int n = queue_wait(loop->qfd, events, EVENT_MAX_EVENTS, loop_timeout_ms(loop, wait_timeout_ms));
         if (n < 0) {
             if (errno == EINTR) continue;
             log_warn("event wait error: errno=%d", errno);
             continue;
         }
 
+        int64_t now_ms = monotonic_ms();
         for (int i = 0; i < n; i++) {
-            int fd = fds[i];
-            if (fd == listen_fd) {
+            if (events[i].handle == LISTEN_HANDLE) {
                 while (1) {
-                    int client_fd = accept_client(listen_fd);
+                    int client_fd = accept_client(loop->listen_fd);
                     if (client_fd < 0) {
                         if (errno == EAGAIN || errno == EWOULDBLOCK) break;
                         if (errno == EINTR) continue;
                         break;
                     }
-
-                    if ((size_t)client_fd > max_fds) {
-                        close(client_fd);
-                        continue;
-                    }
-
-                    int nodelay = 1;
-                    setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
-                    if (configure_socket_after_accept(client_fd) != 0) {
-                        close(client_fd);
-                        continue;
-                    }
-
-                    conn_t *conn = (conn_t *)calloc(1, sizeof(conn_t));
-                    if (!conn) {
-                        close(client_fd);
-                        continue;
-                    }
-                    conn->cap = CONN_INIT_BUF;
-                    conn->buf = (char *)malloc(conn->cap + 1);
-                    if (!conn->buf) {
-                        free(conn);
-                        close(client_fd);
-                        continue;
-                    }
-                    conn->fd = client_fd;
-                    conns[client_fd] = conn;
-
-                    if (register_client_fd(qfd, client_fd) != 0) {
-                        close_conn(qfd, conns, client_fd);
-                    }
+                    admit_client(loop, client_fd, now_ms);
                 }
                 continue;
             }
+            if (events[i].handle == COMPLETION_HANDLE) {
+                deliver_completions(loop, db, completions, now_ms);
+                continue;
+            }
 
-            if (errs[i]) {
-                close_conn(qfd, conns, fd);
+            /* A stale handle belongs to a connection closed earlier in this batch. */
+            conn_t *conn = conn_table_lookup(&loop->table, events[i].handle);
+            if (!conn) continue;
+            int fd = conn->fd;
+            if (events[i].error_queue && conn->zerocopy) {
+                if (conn_output_reap_zerocopy(fd, conn) != 0) {
+                    conn->zc_draining = 1;
+                    close_conn(loop, conn);
+                    continue;
+                }
+                /* Completions are progress, even for a connection only draining them. */
+                idle_touch(loop, conn, now_ms);
+            } else if (events[i].error_queue) {
+                events[i].error = 1;
+            }
+
+            if (events[i].error) {
+                /* Peer is gone: don't wait for zerocopy completions. */
+                conn->zc_draining = 1;
+                close_conn(loop, conn);
                 continue;
             }
 
-            conn_t *conn = (fd >= 0 && (size_t)fd <= max_fds) ? conns[fd] : NULL;
-            if (!conn) {
-                close(fd);
+            if (conn->zc_draining) {
+                if (!conn_output_zerocopy_pending(conn)) close_conn(loop, conn);
                 continue;
             }
+            idle_touch(loop, conn, now_ms);
 
-            while (1) {
-                if (conn->len == conn->cap && conn->cap < REQ_BUF_SIZE) {
-                    size_t next = conn->cap * 2;
-                    if (next > REQ_BUF_SIZE) next = REQ_BUF_SIZE;
-                    char *nb = (char *)realloc(conn->buf, next + 1);
-                    if (!nb) {
-                        send_response(fd, 500, "Internal Server Error", "{\"error\":\"oom\"}");
-                        close_conn(qfd, conns, fd);
-                        break;
+            if (events[i].writable) {
+                int flush_rc = conn_output_flush(fd, conn);
+                if (flush_rc < 0) {
+                    close_conn(loop, conn);
+                    continue;
+                }
+                if (flush_rc > 0) continue;
+                if (conn->stream) {
+                    if (conn_stream_resume(db, conn) < 0 || conn_output_flush(fd, conn) < 0) {
+                        close_conn(loop, conn);
+                        continue;
                     }
-                    conn->buf = nb;
-                    conn->cap = next;
+                    if (conn->out_head || conn->stream) continue;
                 }
+                if (process_buffered_requests(loop, db, conn)) continue;
+                if (!events[i].readable) continue;
+            }
+            if (conn->out_head || conn->stream || conn->pending_write || conn->watch) continue;
 
+            while (1) {
+                if (reserve_input(loop, conn) != 0) break;
                 ssize_t r = recv(fd, conn->buf + conn->len, conn->cap - conn->len, 0);
                 if (r > 0) {
-                    conn->len += (size_t)r;
-                    if (conn->len >= REQ_BUF_SIZE) {
-                        send_response(fd, 413, "Payload Too Large", "{\"error\":\"request too large\"}");
-                        close_conn(qfd, conns, fd);
-                        break;
-                    }
-
-                    int done = try_process_client(fd, &db, conn);
-                    if (done == 1) {
-                        close_conn(qfd, conns, fd);
-                        break;
-                    }
+                    if (take_input(loop, db, conn, (size_t)r)) break;
+                    if (conn->out_head || conn->stream || conn->pending_write || conn->watch) break;
                     continue;
                 }
                 if (r == 0) {
-                    close_conn(qfd, conns, fd);
+                    close_conn(loop, conn);
                     break;
                 }
                 if (errno == EAGAIN || errno == EWOULDBLOCK) break;
                 if (errno == EINTR) continue;
-                close_conn(qfd, conns, fd);
+                close_conn(loop, conn);
                 break;
             }
         }
+
+        poll_watches(loop, db, monotonic_ms());
+        close_idle_conns(loop, monotonic_ms());
     }
 }
+
+int run_worker_loop(int listen_fd, const char *db_path, const worker_config_t *config) {
+    worker_db_t db;
+    if (worker_db_open(&db, db_path) != 0) return -1;
+
+    write_completion_queue_t completions;
+    if (write_completion_queue_init(&completions) != 0) {
+        log_error("failed to create write completion queue: errno=%d", errno);
+        worker_db_close(&db);
+        return -1;
+    }
+    db.completions = &completions;
+
+    worker_loop_t loop;
+    memset(&loop, 0, sizeof(loop));
+    loop.qfd = -1;
+    loop.db = &db;
+    loop.listen_fd = listen_fd;
+    loop.max_requests = config->keepalive_idle_ms > 0 ? config->keepalive_max_requests : 1;
+    conn_table_init(&loop.table);
+    loop.config = config;
+    conn_pool_init(&loop.pool, config->max_buffered_bytes);
+    db.pool = &loop.pool;
+    db.max_large_uploads = config->max_large_uploads;
+    metrics_set_open_conns(0);
+
+    /* The sweep in close_idle_conns runs at least this often. */
+    int wait_timeout_ms = -1;
+    if (config->keepalive_idle_ms > 0) {
+        wait_timeout_ms = config->keepalive_idle_ms < 1000 ? config->keepalive_idle_ms : 1000;
+    }
+    if (config->send_timeout_ms > 0 && (wait_timeout_ms < 0 || config->send_timeout_ms < wait_timeout_ms)) {
+        wait_timeout_ms = config->send_timeout_ms < 1000 ? config->send_timeout_ms : 1000;
+    }
+
+    if (config->backend == WORKER_BACKEND_IO_URING) {
+        loop.ring = io_ring_create(IO_RING_ENTRIES, IO_RING_BUFS, IO_RING_BUF_SIZE);
+        if (loop.ring) {
+            int nodelay = 1;
+            setsockopt(listen_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+            run_ring_loop(&loop, &db, &completions, wait_timeout_ms);
+            io_ring_destroy(loop.ring);
+            loop.ring = NULL;
+        }
+        static atomic_int fallback_logged;
+        if (atomic_exchange(&fallback_logged, 1) == 0) {
+            log_warn("io_uring backend unavailable (errno=%d), falling back to epoll", errno);
+        }
+    }
+
+#if defined(__linux__)
+    loop.qfd = epoll_create1(0);
+#else
+    loop.qfd = kqueue();
+#endif
+    if (loop.qfd < 0) {
+        log_error("failed to create event queue: errno=%d", errno);
+        write_completion_queue_destroy(&completions);
+        worker_db_close(&db);
+        return -1;
+    }
+
+    run_queue_loop(&loop, &db, &completions, wait_timeout_ms);
+    close(loop.qfd);
+    conn_table_destroy(&loop.table);
+    change_feed_set_waiting(&completions, 0);
+    write_completion_queue_destroy(&completions);
+    worker_db_close(&db);
+    return -1;
+}
@@ -4,7 +4,6 @@
 #include "server_internal.h"
 #include "logger.h"
 
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
@@ -19,7 +18,6 @@
 #include <time.h>
 #include <unistd.h>
 
-#define PENDING_WRITES_DIR "pending_writes"
 #define LOG_ID_MAX_LEN 96
 #define ACCOUNT_ID_MAX_LEN 128
 
@@ -27,31 +25,86 @@ typedef struct {
     char log_id[LOG_ID_MAX_LEN];
     char account_id[ACCOUNT_ID_MAX_LEN];
     int retry_attempt;
+    int keep_alive;
+    /* HTTP/1.1 request, so the response may use chunked transfer encoding. */
+    int http11;
 } request_log_context_t;
 
-static int fsync_directory(const char *dir_path) {
-    DIR *d = opendir(dir_path);
-    if (!d) return -1;
-    int fd = dirfd(d);
-    if (fd < 0) {
-        closedir(d);
-        return -1;
-    }
-    int rc = fsync(fd);
-    closedir(d);
-    return rc;
-}
+/* Parsed ?since=&limit=&cursor= of a paged list read; limit -1 means no limit. */
+typedef struct {
+    int has_since;
+    int64_t since;
+    int64_t limit;
+    int64_t cursor;
+} list_page_query_t;
 
-static int ensure_pending_writes_dir(void) {
-    struct stat st;
-    if (stat(PENDING_WRITES_DIR, &st) == 0) {
-        if (!S_ISDIR(st.st_mode)) return -1;
-        return 0;
-    }
-    if (errno != ENOENT) return -1;
-    if (mkdir(PENDING_WRITES_DIR, 0700) != 0 && errno != EEXIST) return -1;
-    return fsync_directory(".");
-}
+#define LIST_STREAM_BATCH_ROWS 256
+#define LIST_STREAM_CHUNK_BYTES (64 * 1024)
+#define LIST_STREAM_HIGH_WATER (256 * 1024)
+#define RIDE_STREAM_BATCH_CHUNKS 16
+
+/*
+ * A paged read of a list key in per-element form. Rows are fetched a batch
+ * at a time (each batch in its own read snapshot, resuming after the last
+ * position sent) and only while the connection's queued output is below
+ * LIST_STREAM_HIGH_WATER; the event loop resumes it as the socket drains.
+ */
+struct list_stream {
+    char storage_key[256];
+    int shard;
+    int chunked;
+    list_page_query_t query;
+    int64_t emitted;
+    /*
+     * A GET /v1/streams/<ride-id> instead: the samples with ride_from <= t
+     * < ride_to of the chunks up to ride_version, ride_from advancing past
+     * each chunk sent.
+     */
+    int ride;
+    int ride_binary;
+    int64_t ride_from;
+    int64_t ride_to;
+    uint64_t ride_version;
+    char *scratch;
+    size_t scratch_len;
+    size_t scratch_cap;
+};
+
+/*
+ * A write handed to the dispatcher from the event loop. The connection
+ * reads nothing further until the completion arrives and try_complete_write
+ * answers the request with this context.
+ */
+struct pending_write {
+    request_log_context_t ctx;
+    char method[8];
+    char path[512];
+    char key[256];
+    size_t payload_len;
+    /* The 200 body a ride chunk is acknowledged with; empty for every other write. */
+    char ack[160];
+};
+
+/* Longest a GET /v1/changes?wait= may park, and the most changes one answer carries. */
+#define CHANGES_WAIT_MAX_S 60
+#define CHANGES_PAGE_MAX 256
+/* An idle event stream gets a comment line this often, which also finds dead peers. */
+#define CHANGES_HEARTBEAT_MS 15000
+
+/*
+ * A GET /v1/changes waiting on the feed: a long-poll until the account has
+ * a change or deadline_ms passes, or an event stream (sse) that stays
+ * parked until the client goes away, with deadline_ms as its next
+ * heartbeat. cursor is the feed seq already looked through.
+ */
+struct change_watch {
+    request_log_context_t ctx;
+    char path[512];
+    char prefix[ACCOUNT_ID_MAX_LEN + 2];
+    uint64_t cursor;
+    int sse;
+    int64_t deadline_ms;
+};
 
 static void sanitize_log_id(const char *input, char *out, size_t out_len) {
     if (!out || out_len == 0) return;
@@ -67,22 +120,6 @@ static void sanitize_log_id(const char *input, char *out, size_t out_len) {
     out[idx] = '\0';
 }
 
-static void sanitize_log_id_for_filename(const char *input, char *out, size_t out_len) {
-    if (!out || out_len == 0) return;
-    size_t idx = 0;
-    if (input) {
-        for (size_t i = 0; input[i] != '\0' && idx + 1 < out_len; i++) {
-            unsigned char ch = (unsigned char)input[i];
-            if (isalnum(ch) || ch == '-' || ch == '_') {
-                out[idx++] = (char)ch;
-            } else {
-                out[idx++] = '_';
-            }
-        }
-    }
-    out[idx] = '\0';
-}
-
 static void sanitize_account_id(const char *input, char *out, size_t out_len) {
     if (!out || out_len == 0) return;
     size_t idx = 0;
@@ -107,69 +144,28 @@ static void generate_server_log_id(char *out, size_t out_len) {
     }
 }
 
-static int read_header_value(
-    const char *req,
-    const char *header_end,
-    const char *header_name,
-    char *out_value,
-    size_t out_value_len) {
-    if (!req || !header_end || !header_name || !out_value || out_value_len == 0) return 0;
-    out_value[0] = '\0';
-
-    size_t name_len = strlen(header_name);
-    const char *line = strstr(req, "\r\n");
-    if (!line) return 0;
-    line += 2;
-
-    while (line < header_end) {
-        const char *line_end = strstr(line, "\r\n");
-        if (!line_end || line_end > header_end) {
-            line_end = header_end;
-        }
-
-        const char *colon = memchr(line, ':', (size_t)(line_end - line));
-        if (colon) {
-            size_t key_len = (size_t)(colon - line);
-            if (key_len == name_len && strncasecmp(line, header_name, name_len) == 0) {
-                const char *value_start = colon + 1;
-                while (value_start < line_end && (*value_start == ' ' || *value_start == '\t')) {
-                    value_start++;
-                }
-                const char *value_end = line_end;
-                while (value_end > value_start && (value_end[-1] == ' ' || value_end[-1] == '\t')) {
-                    value_end--;
-                }
-                size_t copy_len = (size_t)(value_end - value_start);
-                if (copy_len >= out_value_len) {
-                    copy_len = out_value_len - 1;
-                }
-                memcpy(out_value, value_start, copy_len);
-                out_value[copy_len] = '\0';
-                return copy_len > 0;
-            }
-        }
-
-        if (line_end >= header_end) break;
-        line = line_end + 2;
-    }
-
-    return 0;
+static void copy_span(const char *buf, http_span_t span, char *out, size_t out_len) {
+    size_t copy_len = span.len < out_len ? span.len : out_len - 1;
+    memcpy(out, buf + span.off, copy_len);
+    out[copy_len] = '\0';
 }
 
-static request_log_context_t build_request_log_context(const char *req, const char *header_end) {
+static request_log_context_t build_request_log_context(const char *req, const http_parse_state_t *parse) {
     request_log_context_t context;
     memset(&context, 0, sizeof(context));
 
-    char raw_log_id[256] = {0};
-    if (read_header_value(req, header_end, "X-Log-Id", raw_log_id, sizeof(raw_log_id))) {
+    if (parse->log_id.len > 0) {
+        char raw_log_id[256];
+        copy_span(req, parse->log_id, raw_log_id, sizeof(raw_log_id));
         sanitize_log_id(raw_log_id, context.log_id, sizeof(context.log_id));
     }
     if (context.log_id[0] == '\0') {
         generate_server_log_id(context.log_id, sizeof(context.log_id));
     }
 
-    char raw_retry_attempt[32] = {0};
-    if (read_header_value(req, header_end, "X-Retry-Attempt", raw_retry_attempt, sizeof(raw_retry_attempt))) {
+    if (parse->retry_attempt.len > 0) {
+        char raw_retry_attempt[32];
+        copy_span(req, parse->retry_attempt, raw_retry_attempt, sizeof(raw_retry_attempt));
         char *end = NULL;
         long parsed = strtol(raw_retry_attempt, &end, 10);
         if (end != raw_retry_attempt && *end == '\0' && parsed >= 0 && parsed <= 100000) {
@@ -177,14 +173,43 @@ static request_log_context_t build_request_log_context(const char *req, const ch
         }
     }
 
-    char raw_account_id[256] = {0};
-    if (read_header_value(req, header_end, "X-Account-Id", raw_account_id, sizeof(raw_account_id))) {
+    if (parse->account_id.len > 0) {
+        char raw_account_id[256];
+        copy_span(req, parse->account_id, raw_account_id, sizeof(raw_account_id));
         sanitize_account_id(raw_account_id, context.account_id, sizeof(context.account_id));
     }
 
     return context;
 }
 
+static int header_value_has_token(const char *value, const char *token) {
+    size_t token_len = strlen(token);
+    const char *p = value;
+    while (*p != '\0') {
+        while (*p == ' ' || *p == '\t' || *p == ',') p++;
+        const char *start = p;
+        while (*p != '\0' && *p != ',') p++;
+        const char *end = p;
+        while (end > start && (end[-1] == ' ' || end[-1] == '\t')) end--;
+        if ((size_t)(end - start) == token_len && strncasecmp(start, token, token_len) == 0) return 1;
+    }
+    return 0;
+}
+
+static int request_wants_keep_alive(const char *req, const http_parse_state_t *parse, const char *version) {
+    int keep_alive = strcmp(version, "HTTP/1.1") == 0;
+    if (parse->connection.len > 0) {
+        char connection[128];
+        copy_span(req, parse->connection, connection, sizeof(connection));
+        if (header_value_has_token(connection, "close")) {
+            keep_alive = 0;
+        } else if (header_value_has_token(connection, "keep-alive")) {
+            keep_alive = 1;
+        }
+    }
+    return keep_alive;
+}
+
 static int build_storage_key(
     const char *account_id,
     const char *logical_key,
@@ -196,148 +221,447 @@ static int build_storage_key(
     return 0;
 }
 
-static int create_pending_write(
-    const char *key,
-    const char *payload,
-    size_t payload_len,
-    const request_log_context_t *ctx,
-    char *out_path,
-    size_t out_path_len) {
-    if (ensure_pending_writes_dir() != 0) return -1;
+/*
+ * ETags are the quoted row version, e.g. "42", and "42-gz" for the gzip
+ * variant: a strong validator has to tell content codings apart.
+ */
+static int format_etag(char *out, size_t out_len, uint64_t version, int gzip) {
+    int n = snprintf(out, out_len, "\"%" PRIu64 "%s\"", version, gzip ? "-gz" : "");
+    if (n <= 0 || (size_t)n >= out_len) return -1;
+    return n;
+}
 
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    unsigned long tid = (unsigned long)getpid();
-    char log_id_token[64] = {0};
-    sanitize_log_id_for_filename(ctx ? ctx->log_id : NULL, log_id_token, sizeof(log_id_token));
-    if (log_id_token[0] == '\0') {
-        memcpy(log_id_token, "none", 5);
-    }
-    int tmp_len = snprintf(
-        out_path,
-        out_path_len,
-        "%s/%s-%lu-%jd-%ld-lid-%s.tmp",
-        PENDING_WRITES_DIR,
-        key,
-        tid,
-        (intmax_t)ts.tv_sec,
-        ts.tv_nsec,
-        log_id_token);
-    if (tmp_len <= 0 || (size_t)tmp_len >= out_path_len) return -1;
-
-    int fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
-    if (fd < 0) return -1;
-    ssize_t wr = write(fd, payload, payload_len);
-    if (wr < 0 || (size_t)wr != payload_len || fsync(fd) != 0 || close(fd) != 0) {
-        close(fd);
-        unlink(out_path);
-        return -1;
+/*
+ * Parses one quoted ETag of ours into the row version it names; weak ones
+ * ("W/...") and gzip variants are reported through *out_weak and *out_gzip.
+ */
+static int parse_etag(const char *start, const char *end, uint64_t *out_version, int *out_weak, int *out_gzip) {
+    *out_weak = 0;
+    *out_gzip = 0;
+    if (end - start >= 2 && start[0] == 'W' && start[1] == '/') {
+        *out_weak = 1;
+        start += 2;
     }
-
-    char final_path[512] = {0};
-    int final_len = snprintf(
-        final_path,
-        sizeof(final_path),
-        "%s/%s-%lu-%jd-%ld-lid-%s.json",
-        PENDING_WRITES_DIR,
-        key,
-        tid,
-        (intmax_t)ts.tv_sec,
-        ts.tv_nsec,
-        log_id_token);
-    if (final_len <= 0 || (size_t)final_len >= sizeof(final_path)) {
-        unlink(out_path);
-        return -1;
+    if (end - start < 3 || start[0] != '"' || end[-1] != '"') return -1;
+    end--;
+    if (end - start > 4 && memcmp(end - 3, "-gz", 3) == 0) {
+        *out_gzip = 1;
+        end -= 3;
     }
-    if (rename(out_path, final_path) != 0 || fsync_directory(PENDING_WRITES_DIR) != 0) {
-        unlink(out_path);
-        unlink(final_path);
-        return -1;
+    uint64_t version = 0;
+    for (const char *p = start + 1; p < end; p++) {
+        if (*p < '0' || *p > '9' || version > (UINT64_MAX - 9) / 10) return -1;
+        version = version * 10 + (uint64_t)(*p - '0');
     }
-
-    size_t copy_len = (size_t)final_len;
-    if (copy_len + 1 > out_path_len) return -1;
-    memcpy(out_path, final_path, copy_len + 1);
+    *out_version = version;
     return 0;
 }
 
-static int send_all(int fd, const char *buf, size_t len) {
-    size_t sent = 0;
-    int retry = 0;
-    while (sent < len) {
-        ssize_t n = send(fd, buf + sent, len - sent, socket_send_flags());
-        if (n > 0) {
-            sent += (size_t)n;
-            continue;
+/*
+ * Walks a comma-separated If-None-Match list with weak comparison. Returns 1
+ * when "*" or any listed ETag names version; *out_gzip, if not NULL, tells
+ * whether that ETag was the gzip variant's.
+ */
+static int if_none_match_hits(const char *buf, http_span_t span, uint64_t version, int *out_gzip) {
+    const char *p = buf + span.off;
+    const char *end = p + span.len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        const char *start = p;
+        while (p < end && *p != ',') p++;
+        const char *token_end = p;
+        while (token_end > start && (token_end[-1] == ' ' || token_end[-1] == '\t')) token_end--;
+        if (token_end - start == 1 && *start == '*') return 1;
+        uint64_t listed = 0;
+        int weak = 0;
+        int gzip = 0;
+        if (token_end > start && parse_etag(start, token_end, &listed, &weak, &gzip) == 0 && listed == version) {
+            if (out_gzip) *out_gzip = gzip;
+            return 1;
         }
-        if (n < 0 && errno == EINTR) continue;
-        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && retry < 4) {
-            retry++;
-            struct timespec ts = {.tv_sec = 0, .tv_nsec = 50000};
-            nanosleep(&ts, NULL);
-            continue;
+    }
+    return 0;
+}
+
+/*
+ * Whether an Accept-Encoding list admits gzip: "gzip", "x-gzip" or "*" with
+ * a q-value other than 0. Other codings are ignored; identity is always
+ * acceptable to us since it is the fallback.
+ */
+static int accepts_gzip(const char *buf, http_span_t span) {
+    const char *p = buf + span.off;
+    const char *end = p + span.len;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        const char *start = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+        size_t token_len = (size_t)(p - start);
+        int named = (token_len == 4 && strncasecmp(start, "gzip", 4) == 0) ||
+                    (token_len == 6 && strncasecmp(start, "x-gzip", 6) == 0) || (token_len == 1 && *start == '*');
+        int zero_q = 0;
+        while (p < end && *p != ',') {
+            if (*p == ';') {
+                const char *param = p + 1;
+                while (param < end && (*param == ' ' || *param == '\t')) param++;
+                if (end - param >= 3 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                    const char *q = param + 2;
+                    zero_q = *q == '0';
+                    for (q++; zero_q && q < end && *q != ',' && *q != ';' && *q != ' '; q++) {
+                        if (*q != '.' && *q != '0') zero_q = 0;
+                    }
+                }
+            }
+            p++;
         }
-        return -1;
+        if (named && !zero_q) return 1;
     }
     return 0;
 }
 
-static void send_response_with_log_context(
-    int fd,
+/*
+ * Maps If-Match to the precondition the dispatcher checks: "*" or a single
+ * strong ETag of either variant. Anything else can never match one of our ETags, so -1 tells
+ * the caller to answer 412 straight away.
+ */
+static int parse_if_match(const char *buf, http_span_t span, int64_t *out_if_match) {
+    *out_if_match = WRITE_IF_MATCH_NONE;
+    if (span.len == 0) return 0;
+    const char *start = buf + span.off;
+    const char *end = start + span.len;
+    if (span.len == 1 && *start == '*') {
+        *out_if_match = WRITE_IF_MATCH_ANY;
+        return 0;
+    }
+    uint64_t version = 0;
+    int weak = 0;
+    int gzip = 0;
+    if (parse_etag(start, end, &version, &weak, &gzip) != 0 || weak || version > INT64_MAX) return -1;
+    *out_if_match = (int64_t)version;
+    return 0;
+}
+
+/* extra_headers, if not NULL, is a block of complete "Name: value\r\n" lines. */
+static int render_response_header(
+    char *header,
+    size_t header_cap,
     int code,
     const char *status,
-    const char *body,
+    size_t body_len,
+    const char *extra_headers,
     const request_log_context_t *ctx) {
-    size_t body_len = body ? strlen(body) : 0;
-    char header[HEADER_BUF_SIZE];
     const char *log_id = (ctx && ctx->log_id[0] != '\0') ? ctx->log_id : NULL;
+    const char *connection = (ctx && ctx->keep_alive) ? "keep-alive" : "close";
+    const char *extra = extra_headers ? extra_headers : "";
     int header_len = 0;
     if (log_id) {
         header_len = snprintf(
             header,
-            sizeof(header),
+            header_cap,
             "HTTP/1.1 %d %s\r\n"
             "Content-Type: application/json\r\n"
-            "X-Log-Id: %s\r\n"
             "Content-Length: %zu\r\n"
-            "Connection: close\r\n\r\n",
+            "%s"
+            "X-Log-Id: %s\r\n"
+            "Connection: %s\r\n\r\n",
             code,
             status,
+            body_len,
+            extra,
             log_id,
-            body_len);
+            connection);
     } else {
         header_len = snprintf(
             header,
-            sizeof(header),
+            header_cap,
             "HTTP/1.1 %d %s\r\n"
             "Content-Type: application/json\r\n"
             "Content-Length: %zu\r\n"
-            "Connection: close\r\n\r\n",
+            "%s"
+            "Connection: %s\r\n\r\n",
             code,
             status,
-            body_len);
+            body_len,
+            extra,
+            connection);
     }
-    if (header_len > 0 && (size_t)header_len < sizeof(header)) {
-        send_all(fd, header, (size_t)header_len);
+    if (header_len <= 0 || (size_t)header_len >= header_cap) return -1;
+    return header_len;
+}
+
+/*
+ * Queues a response whose body is a reference to an existing shared buffer.
+ * Takes ownership of the caller's reference to body.
+ */
+static int queue_response_ref(
+    conn_t *conn,
+    int code,
+    const char *status,
+    shared_buf_t *body,
+    const request_log_context_t *ctx) {
+    char header[HEADER_BUF_SIZE];
+    int header_len = render_response_header(header, sizeof(header), code, status, body->len, NULL, ctx);
+    if (header_len < 0) {
+        shared_buf_release(body);
+        return -1;
     }
-    if (body_len > 0) {
-        send_all(fd, body, body_len);
+    if (conn_output_append(conn, shared_buf_copy(header, (size_t)header_len), 0, (size_t)header_len) != 0) {
+        shared_buf_release(body);
+        return -1;
     }
+    return conn_output_append(conn, body, 0, body->len);
 }
 
-void send_response(int fd, int code, const char *status, const char *body) {
-    send_response_with_log_context(fd, code, status, body, NULL);
+/*
+ * Builds "status line + Content-Type + Content-Length + ETag" followed by
+ * the body in one buffer. The per-request headers are queued separately by
+ * queue_cached_response, so the buffer can be shared through the value cache.
+ * encoding_headers is "" or complete Content-Encoding/Vary lines.
+ */
+static shared_buf_t *render_cacheable_response(
+    const char *body, size_t body_len, uint64_t version, int gzip, const char *encoding_headers, size_t *out_body_off) {
+    char etag[32];
+    if (format_etag(etag, sizeof(etag), version, gzip) < 0) return NULL;
+    char head[224];
+    int head_len = snprintf(
+        head,
+        sizeof(head),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/json\r\n"
+        "Content-Length: %zu\r\n"
+        "%s"
+        "ETag: %s\r\n",
+        body_len,
+        encoding_headers,
+        etag);
+    if (head_len <= 0 || (size_t)head_len >= sizeof(head)) return NULL;
+    shared_buf_t *response = shared_buf_new((size_t)head_len + body_len);
+    if (!response) return NULL;
+    memcpy(response->data, head, (size_t)head_len);
+    if (body_len > 0) memcpy(response->data + head_len, body, body_len);
+    *out_body_off = (size_t)head_len;
+    return response;
+}
+
+/*
+ * Renders the value's identity response and, when need_gzip is set and the
+ * body is at least compress_min_bytes long, its gzip variant into *out_gzip.
+ * The variant is only kept if it is smaller; once there is one, both carry
+ * Vary: Accept-Encoding. Both ETags name the row version that If-Match and
+ * If-None-Match are checked against; the variant's is marked "-gz".
+ */
+static shared_buf_t *render_value_responses(
+    const char *body,
+    size_t body_len,
+    uint64_t version,
+    int need_gzip,
+    size_t *out_body_off,
+    shared_buf_t **out_gzip,
+    size_t *out_gzip_off) {
+    *out_gzip = NULL;
+    size_t min_bytes = compress_min_bytes();
+    char *packed = NULL;
+    size_t packed_len = 0;
+    if (need_gzip && min_bytes > 0 && body_len >= min_bytes && gzip_compress(body, body_len, &packed, &packed_len) == 0 &&
+        packed_len >= body_len) {
+        free(packed);
+        packed = NULL;
+    }
+    if (packed) {
+        *out_gzip = render_cacheable_response(packed, packed_len, version, 1, "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n", out_gzip_off);
+        free(packed);
+    }
+    return render_cacheable_response(body, body_len, version, 0, *out_gzip ? "Vary: Accept-Encoding\r\n" : "", out_body_off);
 }
 
-static int json_is_valid(worker_db_t *db, const char *json) {
-    sqlite3_stmt *stmt = db->json_valid_stmt;
-    if (!stmt) return 0;
+/*
+ * Reassembles a list key stored as kv_items rows into a malloc'd body. Called
+ * while the caller's kv_store row is still stepped, so both reads see the
+ * same snapshot.
+ */
+static char *render_list_body(sqlite3_stmt *stmt, const char *storage_key, size_t *out_len) {
+    size_t cap = 4096;
+    size_t len = 0;
+    char *body = (char *)malloc(cap);
+    if (!body) return NULL;
+    body[len++] = '[';
+
     sqlite3_reset(stmt);
-    sqlite3_clear_bindings(stmt);
-    sqlite3_bind_text(stmt, 1, json, -1, SQLITE_TRANSIENT);
-    int ok = 0;
-    if (sqlite3_step(stmt) == SQLITE_ROW) ok = sqlite3_column_int(stmt, 0);
-    return ok;
+    sqlite3_bind_text(stmt, 1, storage_key, -1, SQLITE_TRANSIENT);
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const char *item = (const char *)sqlite3_column_text(stmt, 0);
+        size_t item_len = item ? (size_t)sqlite3_column_bytes(stmt, 0) : 0;
+        if (len + item_len + 2 > cap) {
+            while (len + item_len + 2 > cap) cap *= 2;
+            char *grown = (char *)realloc(body, cap);
+            if (!grown) {
+                rc = SQLITE_NOMEM;
+                break;
+            }
+            body = grown;
+        }
+        if (len > 1) body[len++] = ',';
+        if (item_len > 0) memcpy(body + len, item, item_len);
+        len += item_len;
+    }
+    sqlite3_reset(stmt);
+
+    if (rc != SQLITE_DONE) {
+        free(body);
+        return NULL;
+    }
+    body[len++] = ']';
+    *out_len = len;
+    return body;
+}
+
+/* Takes ownership of one reference to response. */
+static int queue_cached_response(conn_t *conn, shared_buf_t *response, size_t body_off, const request_log_context_t *ctx) {
+    char tail[HEADER_BUF_SIZE];
+    const char *connection = (ctx && ctx->keep_alive) ? "keep-alive" : "close";
+    int tail_len = (ctx && ctx->log_id[0] != '\0')
+        ? snprintf(tail, sizeof(tail), "X-Log-Id: %s\r\nConnection: %s\r\n\r\n", ctx->log_id, connection)
+        : snprintf(tail, sizeof(tail), "Connection: %s\r\n\r\n", connection);
+    if (tail_len <= 0 || (size_t)tail_len >= sizeof(tail) ||
+        conn_output_append(conn, shared_buf_retain(response), 0, body_off) != 0 ||
+        conn_output_append(conn, shared_buf_copy(tail, (size_t)tail_len), 0, (size_t)tail_len) != 0) {
+        shared_buf_release(response);
+        return -1;
+    }
+    return conn_output_append(conn, response, body_off, response->len - body_off);
+}
+
+static void send_response_with_headers(
+    conn_t *conn,
+    int code,
+    const char *status,
+    const char *body,
+    const char *extra_headers,
+    const request_log_context_t *ctx) {
+    size_t body_len = body ? strlen(body) : 0;
+    if (body_len > OUT_INLINE_BODY_MAX) {
+        shared_buf_t *copy = shared_buf_copy(body, body_len);
+        if (!copy || queue_response_ref(conn, code, status, copy, ctx) != 0) {
+            conn->close_after_flush = 1;
+        }
+        return;
+    }
+
+    char header[HEADER_BUF_SIZE];
+    int header_len = render_response_header(header, sizeof(header), code, status, body_len, extra_headers, ctx);
+    shared_buf_t *out = header_len > 0 ? shared_buf_new((size_t)header_len + body_len) : NULL;
+    if (!out) {
+        conn->close_after_flush = 1;
+        return;
+    }
+    memcpy(out->data, header, (size_t)header_len);
+    if (body_len > 0) memcpy(out->data + header_len, body, body_len);
+    if (conn_output_append(conn, out, 0, out->len) != 0) {
+        conn->close_after_flush = 1;
+    }
+}
+
+static void send_response_with_log_context(
+    conn_t *conn,
+    int code,
+    const char *status,
+    const char *body,
+    const request_log_context_t *ctx) {
+    send_response_with_headers(conn, code, status, body, NULL, ctx);
+}
+
+/* Sends code with an ETag header for version. */
+static void send_response_with_etag(
+    conn_t *conn,
+    int code,
+    const char *status,
+    const char *body,
+    uint64_t version,
+    const request_log_context_t *ctx) {
+    char etag[32];
+    char extra[48];
+    if (format_etag(etag, sizeof(etag), version, 0) < 0) {
+        send_response_with_log_context(conn, code, status, body, ctx);
+        return;
+    }
+    snprintf(extra, sizeof(extra), "ETag: %s\r\n", etag);
+    send_response_with_headers(conn, code, status, body, extra, ctx);
+}
+
+/* A load-shedding answer the client may retry after retry_after_s seconds. */
+static void send_retry_after(
+    conn_t *conn,
+    int code,
+    const char *status,
+    const char *body,
+    int retry_after_s,
+    const request_log_context_t *ctx) {
+    char extra[32];
+    snprintf(extra, sizeof(extra), "Retry-After: %d\r\n", retry_after_s);
+    send_response_with_headers(conn, code, status, body, extra, ctx);
+}
+
+/* 304 carries no body and therefore no Content-Type/Content-Length; gzip picks the variant's ETag. */
+static void send_not_modified(conn_t *conn, uint64_t version, int gzip, const request_log_context_t *ctx) {
+    char etag[32];
+    if (format_etag(etag, sizeof(etag), version, gzip) < 0) {
+        conn->close_after_flush = 1;
+        return;
+    }
+    char header[HEADER_BUF_SIZE];
+    const char *connection = (ctx && ctx->keep_alive) ? "keep-alive" : "close";
+    int header_len = (ctx && ctx->log_id[0] != '\0')
+        ? snprintf(header, sizeof(header), "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nX-Log-Id: %s\r\nConnection: %s\r\n\r\n", etag, ctx->log_id, connection)
+        : snprintf(header, sizeof(header), "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nConnection: %s\r\n\r\n", etag, connection);
+    if (header_len <= 0 || (size_t)header_len >= sizeof(header) ||
+        conn_output_append(conn, shared_buf_copy(header, (size_t)header_len), 0, (size_t)header_len) != 0) {
+        conn->close_after_flush = 1;
+    }
+}
+
+/*
+ * Best-effort reply on a connection that is about to be torn down. Never
+ * waits for the socket: whatever does not fit in the send buffer is dropped.
+ */
+void send_response(int fd, int code, const char *status, const char *body) {
+    conn_t conn;
+    memset(&conn, 0, sizeof(conn));
+    send_response_with_log_context(&conn, code, status, body, NULL);
+    conn_output_flush(fd, &conn);
+    conn_output_reset(&conn);
+}
+
+static int is_batch_path(const char *path) {
+    return strncmp(path, "/v1/batch", 9) == 0 && (path[9] == '\0' || path[9] == '?');
+}
+
+static int is_changes_path(const char *path) {
+    return strncmp(path, "/v1/changes", 11) == 0 && (path[11] == '\0' || path[11] == '?');
+}
+
+static int is_streams_path(const char *path) {
+    return strncmp(path, "/v1/streams/", 12) == 0;
+}
+
+static int request_route(const char *method, const char *path) {
+    const char *data_prefix = "/v1/data/";
+    size_t data_prefix_len = strlen(data_prefix);
+    if (strncmp(path, data_prefix, data_prefix_len) == 0) {
+        const char *query = strchr(path, '?');
+        size_t key_len = query ? (size_t)(query - path) : strlen(path);
+        if (key_len >= 7 && strncmp(path + key_len - 7, ":append", 7) == 0) return METRICS_ROUTE_DATA_APPEND;
+        if (strcmp(method, "PUT") == 0) return METRICS_ROUTE_DATA_PUT;
+        if (strcmp(method, "PATCH") == 0) return METRICS_ROUTE_DATA_PATCH;
+        if (strcmp(method, "GET") == 0) return query && query[1] != '\0' ? METRICS_ROUTE_DATA_PAGE : METRICS_ROUTE_DATA_GET;
+        return METRICS_ROUTE_OTHER;
+    }
+    if (is_batch_path(path)) return strcmp(method, "POST") == 0 ? METRICS_ROUTE_BATCH_WRITE : METRICS_ROUTE_BATCH_GET;
+    if (is_changes_path(path)) return METRICS_ROUTE_CHANGES;
+    if (is_streams_path(path)) return strcmp(method, "POST") == 0 ? METRICS_ROUTE_STREAM_WRITE : METRICS_ROUTE_STREAM_READ;
+    if (strcmp(path, "/health") == 0) return METRICS_ROUTE_HEALTH;
+    if (strcmp(path, "/metrics") == 0) return METRICS_ROUTE_METRICS;
+    if (strncmp(path, "/debug/", 7) == 0 || strncmp(path, "/v1/debug/", 10) == 0) return METRICS_ROUTE_DEBUG;
+    return METRICS_ROUTE_OTHER;
 }
 
 static void log_http_request(
@@ -346,6 +670,7 @@ static void log_http_request(
     int status_code,
     size_t payload_bytes,
     const request_log_context_t *ctx) {
+    metrics_count_request(request_route(method, path), status_code);
     const char *log_id = (ctx && ctx->log_id[0] != '\0') ? ctx->log_id : "-";
     const char *account_id = (ctx && ctx->account_id[0] != '\0') ? ctx->account_id : "-";
     int retry_attempt = ctx ? ctx->retry_attempt : 0;
@@ -358,209 +683,1870 @@ static void log_http_request(
     }
 }
 
-static int handle_get_data(int fd, worker_db_t *db, const char *key, const request_log_context_t *ctx) {
-    sqlite3_stmt *stmt = db->get_stmt;
-    if (!stmt) {
-        send_response_with_log_context(fd, 500, "Internal Server Error", "{\"error\":\"database error\"}", ctx);
-        return 500;
+static int percent_decode(const char *s, size_t len, char *out, size_t out_len) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (n + 1 >= out_len) return -1;
+        if (s[i] == '%') {
+            if (i + 2 >= len) return -1;
+            char hex[3] = {s[i + 1], s[i + 2], '\0'};
+            if (!isxdigit((unsigned char)hex[0]) || !isxdigit((unsigned char)hex[1])) return -1;
+            out[n++] = (char)strtol(hex, NULL, 16);
+            i += 2;
+        } else {
+            out[n++] = s[i];
+        }
     }
+    out[n] = '\0';
+    return (int)n;
+}
 
-    sqlite3_reset(stmt);
-    sqlite3_clear_bindings(stmt);
-    char storage_key[256] = {0};
-    if (build_storage_key(ctx->account_id, key, storage_key, sizeof(storage_key)) != 0) {
-        send_response_with_log_context(fd, 500, "Internal Server Error", "{\"error\":\"invalid account key\"}", ctx);
-        return 500;
+static int parse_nonnegative(const char *s, int64_t *out) {
+    if (*s == '\0') return -1;
+    int64_t value = 0;
+    for (const char *p = s; *p != '\0'; p++) {
+        if (*p < '0' || *p > '9' || value > (INT64_MAX - 9) / 10) return -1;
+        value = value * 10 + (*p - '0');
     }
-    sqlite3_bind_text(stmt, 1, storage_key, -1, SQLITE_TRANSIENT);
-    int rc = sqlite3_step(stmt);
-    if (rc == SQLITE_ROW) {
-        const unsigned char *value = sqlite3_column_text(stmt, 0);
-        send_response_with_log_context(fd, 200, "OK", (const char *)value, ctx);
-        log_info("DATA READ key=%s source=db account=%s logid=%s", key, ctx->account_id, ctx->log_id);
-        return 200;
-    } else {
-        int is_object_key = strcmp(key, "profile") == 0 || strcmp(key, "app_settings") == 0;
-        const char *default_json = is_object_key ? "{}" : "[]";
-        send_response_with_log_context(fd, 200, "OK", default_json, ctx);
-        log_info("DATA READ key=%s source=default account=%s logid=%s", key, ctx->account_id, ctx->log_id);
-        return 200;
+    *out = value;
+    return 0;
+}
+
+/* Unknown parameters are ignored; a malformed known one fails the request. */
+static int parse_list_page_query(const char *query, list_page_query_t *out) {
+    memset(out, 0, sizeof(*out));
+    out->limit = -1;
+    const char *p = query;
+    while (*p != '\0') {
+        const char *end = strchr(p, '&');
+        if (!end) end = p + strlen(p);
+        const char *eq = memchr(p, '=', (size_t)(end - p));
+        char value[64];
+        if (eq && percent_decode(eq + 1, (size_t)(end - eq - 1), value, sizeof(value)) >= 0) {
+            size_t name_len = (size_t)(eq - p);
+            if (name_len == 5 && strncmp(p, "since", 5) == 0) {
+                if (parse_timestamp(value, strlen(value), &out->since) != 0) return -1;
+                out->has_since = 1;
+            } else if (name_len == 5 && strncmp(p, "limit", 5) == 0) {
+                if (parse_nonnegative(value, &out->limit) != 0 || out->limit == 0) return -1;
+            } else if (name_len == 6 && strncmp(p, "cursor", 6) == 0) {
+                if (parse_nonnegative(value, &out->cursor) != 0) return -1;
+            }
+        } else if (eq) {
+            return -1;
+        }
+        p = *end == '&' ? end + 1 : end;
     }
+    return 0;
 }
 
-static int handle_get_write_queue_diagnostics(int fd, const request_log_context_t *ctx) {
-    write_dispatch_diagnostics_t diag;
-    write_dispatch_diagnostics_snapshot(&diag);
+static int stream_put(list_stream_t *st, const char *data, size_t len) {
+    if (st->scratch_len + len > st->scratch_cap) {
+        size_t cap = st->scratch_cap > 0 ? st->scratch_cap : LIST_STREAM_CHUNK_BYTES;
+        while (st->scratch_len + len > cap) cap *= 2;
+        char *grown = (char *)realloc(st->scratch, cap);
+        if (!grown) return -1;
+        st->scratch = grown;
+        st->scratch_cap = cap;
+    }
+    if (len > 0) memcpy(st->scratch + st->scratch_len, data, len);
+    st->scratch_len += len;
+    return 0;
+}
 
-    char body[512] = {0};
-    snprintf(
-        body,
-        sizeof(body),
-        "{\"running\":%s,\"queue_depth\":%d,\"last_success_logid\":\"%s\",\"last_error_logid\":\"%s\"}",
-        diag.running ? "true" : "false",
-        diag.queue_depth,
-        diag.last_success_logid,
-        diag.last_error_logid);
-    send_response_with_log_context(fd, 200, "OK", body, ctx);
-    return 200;
+/* Queues the scratch bytes, framed as one chunk when chunked. */
+static int stream_emit(conn_t *conn, list_stream_t *st) {
+    if (st->scratch_len == 0) return 0;
+    char head[24];
+    int head_len = st->chunked ? snprintf(head, sizeof(head), "%zx\r\n", st->scratch_len) : 0;
+    size_t tail_len = st->chunked ? 2 : 0;
+    shared_buf_t *chunk = shared_buf_new((size_t)head_len + st->scratch_len + tail_len);
+    if (!chunk) return -1;
+    memcpy(chunk->data, head, (size_t)head_len);
+    memcpy(chunk->data + head_len, st->scratch, st->scratch_len);
+    if (tail_len > 0) memcpy(chunk->data + head_len + st->scratch_len, "\r\n", 2);
+    st->scratch_len = 0;
+    return conn_output_append(conn, chunk, 0, chunk->len);
+}
+
+static int stream_element(conn_t *conn, list_stream_t *st, const char *elem, size_t elem_len) {
+    if ((st->emitted > 0 && stream_put(st, ",", 1) != 0) || stream_put(st, elem, elem_len) != 0) return -1;
+    st->emitted++;
+    if (st->query.limit > 0) st->query.limit--;
+    return st->scratch_len >= LIST_STREAM_CHUNK_BYTES ? stream_emit(conn, st) : 0;
+}
+
+/* Queues what is left and, when chunked, the last chunk. */
+static int stream_end(conn_t *conn, list_stream_t *st) {
+    if (stream_emit(conn, st) != 0) return -1;
+    if (!st->chunked) return 0;
+    return conn_output_append(conn, shared_buf_copy("0\r\n\r\n", 5), 0, 5);
+}
+
+/* next_cursor is the position to resume after, or 0 when the list is exhausted. */
+static int stream_finish(conn_t *conn, list_stream_t *st, int64_t next_cursor) {
+    char tail[64];
+    int tail_len = next_cursor > 0 ? snprintf(tail, sizeof(tail), "],\"next_cursor\":\"%lld\"}", (long long)next_cursor)
+                                   : snprintf(tail, sizeof(tail), "],\"next_cursor\":null}");
+    if (stream_put(st, tail, (size_t)tail_len) != 0) return -1;
+    return stream_end(conn, st);
+}
+
+static int element_in_page(const list_stream_t *st, const char *elem, size_t elem_len) {
+    int64_t ts = 0;
+    return !st->query.has_since || (kv_element_timestamp(elem, elem_len, &ts) == 0 && ts >= st->query.since);
+}
+
+/* Pages through a value still stored as one array; positions are 1-based indices. */
+static int stream_stored_array(conn_t *conn, list_stream_t *st, const char *value, size_t value_len) {
+    size_t pos = 0;
+    size_t elem_off = 0;
+    size_t elem_len = 0;
+    int64_t position = 0;
+    int64_t last_sent = 0;
+    int next;
+    while ((next = json_array_next(value, value_len, &pos, &elem_off, &elem_len)) == 1) {
+        if (++position <= st->query.cursor || !element_in_page(st, value + elem_off, elem_len)) continue;
+        if (st->query.limit == 0) return stream_finish(conn, st, last_sent);
+        if (stream_element(conn, st, value + elem_off, elem_len) != 0) return -1;
+        last_sent = position;
+    }
+    return next == 0 ? stream_finish(conn, st, 0) : -1;
+}
+
+void conn_stream_free(conn_t *conn) {
+    list_stream_t *st = conn->stream;
+    if (!st) return;
+    free(st->scratch);
+    free(st);
+    conn->stream = NULL;
+}
+
+/*
+ * Chunks come a batch at a time in time order, each batch in its own read
+ * snapshot; a chunk whose checksum does not match its columns aborts the
+ * response rather than sending samples that were never written.
+ */
+static int ride_stream_resume(worker_db_t *db, conn_t *conn) {
+    list_stream_t *st = conn->stream;
+    sqlite3_stmt *stmt = db->chunk_stmts[st->shard];
+    while (conn->out_bytes < LIST_STREAM_HIGH_WATER) {
+        sqlite3_reset(stmt);
+        sqlite3_bind_text(stmt, 1, st->storage_key, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, (sqlite3_int64)st->ride_from);
+        sqlite3_bind_int64(stmt, 3, (sqlite3_int64)st->ride_version);
+        sqlite3_bind_int64(stmt, 4, RIDE_STREAM_BATCH_CHUNKS);
+
+        int rows = 0;
+        int past_window = 0;
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            rows++;
+            if (sqlite3_column_int64(stmt, 0) >= st->ride_to) {
+                past_window = 1;
+                break;
+            }
+            const char *chunk = (const char *)sqlite3_column_blob(stmt, 3);
+            size_t chunk_len = (size_t)sqlite3_column_bytes(stmt, 3);
+            if (!chunk || (uint32_t)sqlite3_column_int64(stmt, 2) != ride_chunk_crc32(chunk, chunk_len)) {
+                log_error("RIDE READ key=%s reason=chunk_checksum_mismatch t_last=%lld", st->storage_key, (long long)sqlite3_column_int64(stmt, 1));
+                rc = SQLITE_CORRUPT;
+                break;
+            }
+            if (ride_chunk_render(chunk, chunk_len, st->ride_from, st->ride_to, st->ride_binary, &st->scratch, &st->scratch_len, &st->scratch_cap) < 0) {
+                rc = SQLITE_NOMEM;
+                break;
+            }
+            st->ride_from = sqlite3_column_int64(stmt, 1) + 1;
+            if (st->scratch_len >= LIST_STREAM_CHUNK_BYTES && stream_emit(conn, st) != 0) {
+                rc = SQLITE_NOMEM;
+                break;
+            }
+        }
+        sqlite3_reset(stmt);
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) return -1;
+        if (past_window || rows < RIDE_STREAM_BATCH_CHUNKS) {
+            int end_rc = stream_end(conn, st);
+            conn_stream_free(conn);
+            return end_rc == 0 ? 0 : -1;
+        }
+        if (stream_emit(conn, st) != 0) return -1;
+    }
+    return 1;
+}
+
+int conn_stream_resume(worker_db_t *db, conn_t *conn) {
+    list_stream_t *st = conn->stream;
+    if (!st) return 0;
+    if (st->ride) return ride_stream_resume(db, conn);
+    sqlite3_stmt *stmt = st->query.has_since ? db->since_stmts[st->shard] : db->page_stmts[st->shard];
+    while (conn->out_bytes < LIST_STREAM_HIGH_WATER) {
+        /* One row past the limit tells whether another page exists. */
+        int64_t want = LIST_STREAM_BATCH_ROWS;
+        if (st->query.limit >= 0 && st->query.limit < want) want = st->query.limit + 1;
+        sqlite3_reset(stmt);
+        sqlite3_bind_text(stmt, 1, st->storage_key, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt, 2, (sqlite3_int64)st->query.cursor);
+        sqlite3_bind_int64(stmt, 3, (sqlite3_int64)want);
+        if (st->query.has_since) sqlite3_bind_int64(stmt, 4, (sqlite3_int64)st->query.since);
+
+        int64_t rows = 0;
+        int more = 0;
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            if (st->query.limit == 0) {
+                more = 1;
+                break;
+            }
+            const char *item = (const char *)sqlite3_column_text(stmt, 1);
+            size_t item_len = item ? (size_t)sqlite3_column_bytes(stmt, 1) : 0;
+            if (stream_element(conn, st, item ? item : "null", item ? item_len : 4) != 0) {
+                rc = SQLITE_NOMEM;
+                break;
+            }
+            st->query.cursor = sqlite3_column_int64(stmt, 0);
+            rows++;
+        }
+        sqlite3_reset(stmt);
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE) return -1;
+        if (more || rows < want) {
+            int finish_rc = stream_finish(conn, st, more ? st->query.cursor : 0);
+            conn_stream_free(conn);
+            return finish_rc == 0 ? 0 : -1;
+        }
+        if (stream_emit(conn, st) != 0) return -1;
+    }
+    return 1;
 }
 
-static int handle_put_data(
-    int fd,
+/*
+ * GET with since/limit/cursor on a list key: {"items":[...],"next_cursor":...}
+ * sent with chunked transfer encoding (or close-delimited for HTTP/1.0).
+ * next_cursor is an opaque position to pass back as cursor, or null.
+ */
+static int handle_get_list_page(
+    conn_t *conn,
     worker_db_t *db,
+    const data_key_t *desc,
     const char *key,
-    const char *payload,
-    size_t payload_len,
+    const char *query,
     const request_log_context_t *ctx) {
-    if (!json_is_valid(db, payload)) {
-        send_response_with_log_context(fd, 400, "Bad Request", "{\"error\":\"invalid json payload\"}", ctx);
-        log_warn("DATA WRITE rejected key=%s reason=invalid_json bytes=%zu logid=%s", key, payload_len, ctx->log_id);
+    list_page_query_t page;
+    if (desc->kind != DATA_KEY_KIND_LIST || parse_list_page_query(query, &page) != 0) {
+        send_response_with_log_context(conn, 400, "Bad Request", "{\"error\":\"invalid list query\"}", ctx);
         return 400;
     }
-
-    char storage_key[256] = {0};
-    if (build_storage_key(ctx->account_id, key, storage_key, sizeof(storage_key)) != 0) {
-        send_response_with_log_context(fd, 500, "Internal Server Error", "{\"error\":\"invalid account key\"}", ctx);
+    list_stream_t *st = (list_stream_t *)calloc(1, sizeof(list_stream_t));
+    if (!st || build_storage_key(ctx->account_id, key, st->storage_key, sizeof(st->storage_key)) != 0 || db->shard_count <= 0) {
+        free(st);
+        send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"invalid account key\"}", ctx);
         return 500;
     }
+    st->shard = storage_key_shard(st->storage_key, db->shard_count);
+    st->chunked = ctx->http11;
+    st->query = page;
 
-    char pending_path[512] = {0};
-    if (create_pending_write(storage_key, payload, payload_len, ctx, pending_path, sizeof(pending_path)) != 0) {
-        send_response_with_log_context(fd, 500, "Internal Server Error", "{\"error\":\"durable journal error\"}", ctx);
-        log_error("DATA WRITE failed key=%s reason=pending_write_create_failed bytes=%zu account=%s logid=%s", key, payload_len, ctx->account_id, ctx->log_id);
+    sqlite3_stmt *stmt = db->get_stmts[st->shard];
+    sqlite3_reset(stmt);
+    sqlite3_bind_text(stmt, 1, st->storage_key, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        sqlite3_reset(stmt);
+        free(st);
+        send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"database error\"}", ctx);
         return 500;
     }
 
-    write_dispatch_result_t result;
-    int dispatch_rc = write_dispatch_submit(
-        key,
-        storage_key,
-        payload,
-        payload_len,
-        pending_path,
-        ctx->account_id,
+    int keep_alive = ctx->keep_alive && st->chunked;
+    char head[HEADER_BUF_SIZE];
+    int head_len = snprintf(
+        head,
+        sizeof(head),
+        "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n%s%s%s%sConnection: %s\r\n\r\n",
+        st->chunked ? "Transfer-Encoding: chunked\r\n" : "",
+        ctx->log_id[0] != '\0' ? "X-Log-Id: " : "",
         ctx->log_id,
-        150,
-        &result);
-    if (dispatch_rc < 0) {
-        send_response_with_log_context(fd, 500, "Internal Server Error", "{\"error\":\"write queue unavailable\"}", ctx);
-        log_error("DATA WRITE failed key=%s reason=dispatch_enqueue_failed bytes=%zu account=%s logid=%s", key, payload_len, ctx->account_id, ctx->log_id);
-        return 500;
-    }
-
-    if (dispatch_rc > 0) {
-        char response_body[512] = {0};
-        snprintf(
-            response_body,
-            sizeof(response_body),
-            "{\"status\":\"queued\",\"logid\":\"%s\",\"pending\":\"%s\"}",
-            ctx->log_id,
-            pending_path);
-        send_response_with_log_context(fd, 202, "Accepted", response_body, ctx);
-        log_warn(
-            "DATA WRITE queued key=%s reason=writer_backlog bytes=%zu pending=%s account=%s logid=%s",
-            key,
-            payload_len,
-            pending_path,
-            ctx->account_id,
-            ctx->log_id);
-        return 202;
-    }
-
-    if (result.status_code != 204) {
-        char response_body[512] = {0};
-        if (result.backup_path[0] != '\0') {
-            snprintf(
-                response_body,
-                sizeof(response_body),
-                "{\"error\":\"database error\",\"rc\":%d,\"ext\":%d,\"backup\":\"%s\"}",
-                result.sqlite_rc,
-                result.sqlite_ext,
-                result.backup_path);
+        ctx->log_id[0] != '\0' ? "\r\n" : "",
+        keep_alive ? "keep-alive" : "close");
+    if (!keep_alive) conn->close_after_flush = 1;
+    int stream_rc = -1;
+    if (head_len > 0 && (size_t)head_len < sizeof(head) &&
+        conn_output_append(conn, shared_buf_copy(head, (size_t)head_len), 0, (size_t)head_len) == 0 &&
+        stream_put(st, "{\"items\":[", 10) == 0) {
+        if (rc == SQLITE_ROW && sqlite3_column_int64(stmt, 2) > 0) {
+            conn->stream = st;
+            st = NULL;
+            stream_rc = conn_stream_resume(db, conn) < 0 ? -1 : 0;
         } else {
-            snprintf(response_body, sizeof(response_body), "{\"error\":\"database error\",\"rc\":%d,\"ext\":%d}", result.sqlite_rc, result.sqlite_ext);
+            const char *value = rc == SQLITE_ROW ? (const char *)sqlite3_column_text(stmt, 1) : NULL;
+            size_t value_len = value ? (size_t)sqlite3_column_bytes(stmt, 1) : 0;
+            stream_rc = stream_stored_array(conn, st, value ? value : "[]", value ? value_len : 2);
         }
-        send_response_with_log_context(fd, 500, "Internal Server Error", response_body, ctx);
+    }
+    sqlite3_reset(stmt);
+    if (st) {
+        free(st->scratch);
+        free(st);
+    }
+    if (stream_rc != 0) {
+        /* The status line may already be queued; a truncated body is all that is left. */
+        conn_stream_free(conn);
+        conn->close_after_flush = 1;
+        log_error("DATA READ key=%s source=list_page status=aborted account=%s logid=%s", key, ctx->account_id, ctx->log_id);
         return 500;
     }
-
-    send_response_with_log_context(fd, 204, "No Content", "", ctx);
-    return 204;
+    log_info("DATA READ key=%s source=list_page account=%s logid=%s", key, ctx->account_id, ctx->log_id);
+    return 200;
 }
 
-int try_process_client(int fd, worker_db_t *db, conn_t *conn) {
-    conn->buf[conn->len] = '\0';
-    char *header_end = strstr(conn->buf, "\r\n\r\n");
-    if (!header_end) return 0;
-    request_log_context_t log_ctx = build_request_log_context(conn->buf, header_end);
-
-    size_t header_len = (size_t)(header_end - conn->buf) + 4;
-    char method[8] = {0};
-    char path[512] = {0};
-    if (sscanf(conn->buf, "%7s %511s", method, path) != 2) {
-        send_response_with_log_context(fd, 400, "Bad Request", "{\"error\":\"malformed request line\"}", &log_ctx);
-        log_http_request("UNKNOWN", "/", 400, 0, &log_ctx);
-        return 1;
+static int handle_get_data(conn_t *conn, worker_db_t *db, const data_key_t *desc, const char *key, const request_log_context_t *ctx) {
+    char storage_key[256] = {0};
+    if (build_storage_key(ctx->account_id, key, storage_key, sizeof(storage_key)) != 0) {
+        send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"invalid account key\"}", ctx);
+        return 500;
+    }
+
+    const http_span_t if_none_match = conn->parse.if_none_match;
+    size_t body_off = 0;
+    uint64_t version = 0;
+    uint64_t ticket = 0;
+    int want_gzip = conn->parse.accept_encoding.len > 0 && accepts_gzip(conn->buf, conn->parse.accept_encoding);
+    shared_buf_t *response = desc->cacheable ? value_cache_lookup(storage_key, want_gzip, &body_off, &version, &ticket) : NULL;
+    if (response) {
+        int gzip_tag = 0;
+        if (if_none_match.len > 0 && if_none_match_hits(conn->buf, if_none_match, version, &gzip_tag)) {
+            shared_buf_release(response);
+            send_not_modified(conn, version, gzip_tag, ctx);
+            log_info("DATA READ key=%s source=cache status=not_modified account=%s logid=%s", key, ctx->account_id, ctx->log_id);
+            return 304;
+        }
+        if (queue_cached_response(conn, response, body_off, ctx) != 0) {
+            conn->close_after_flush = 1;
+        }
+        log_info("DATA READ key=%s source=cache account=%s logid=%s", key, ctx->account_id, ctx->log_id);
+        return 200;
+    }
+
+    int shard = db->shard_count > 0 ? storage_key_shard(storage_key, db->shard_count) : -1;
+    sqlite3_stmt *stmt = shard >= 0 ? db->get_stmts[shard] : NULL;
+    if (!stmt) {
+        send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"database error\"}", ctx);
+        return 500;
+    }
+
+    /* A revalidation that misses the cache still only needs the version column. */
+    sqlite3_stmt *version_stmt = db->version_stmts[shard];
+    if (if_none_match.len > 0 && version_stmt) {
+        sqlite3_reset(version_stmt);
+        sqlite3_bind_text(version_stmt, 1, storage_key, -1, SQLITE_TRANSIENT);
+        int version_rc = sqlite3_step(version_stmt);
+        uint64_t current = version_rc == SQLITE_ROW ? (uint64_t)sqlite3_column_int64(version_stmt, 0) : 0;
+        sqlite3_reset(version_stmt);
+        int gzip_tag = 0;
+        if ((version_rc == SQLITE_ROW || version_rc == SQLITE_DONE) && if_none_match_hits(conn->buf, if_none_match, current, &gzip_tag)) {
+            send_not_modified(conn, current, gzip_tag, ctx);
+            log_info("DATA READ key=%s source=version status=not_modified account=%s logid=%s", key, ctx->account_id, ctx->log_id);
+            return 304;
+        }
+    }
+
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    sqlite3_bind_text(stmt, 1, storage_key, -1, SQLITE_TRANSIENT);
+    uint64_t step_start = metrics_now_ns();
+    int rc = sqlite3_step(stmt);
+    metrics_observe_stage(METRICS_STAGE_SQLITE_STEP, step_start);
+    const char *source = "db";
+    const char *value = NULL;
+    size_t value_len = 0;
+    char *list_body = NULL;
+    if (rc == SQLITE_ROW && sqlite3_column_int64(stmt, 2) > 0) {
+        version = (uint64_t)sqlite3_column_int64(stmt, 0);
+        list_body = render_list_body(db->item_stmts[shard], storage_key, &value_len);
+        value = list_body;
+        source = "items";
+    } else if (rc == SQLITE_ROW) {
+        version = (uint64_t)sqlite3_column_int64(stmt, 0);
+        value = (const char *)sqlite3_column_text(stmt, 1);
+        value_len = value ? (size_t)sqlite3_column_bytes(stmt, 1) : 0;
+        if (!value) value = "";
+    } else {
+        version = 0;
+        value = desc->default_body;
+        value_len = strlen(desc->default_body);
+        source = "default";
+    }
+    /* A cached value is compressed once here and then served to every gzip reader. */
+    shared_buf_t *gzip_response = NULL;
+    size_t gzip_body_off = 0;
+    if (value) {
+        response = render_value_responses(
+            value, value_len, version, desc->cacheable || want_gzip, &body_off, &gzip_response, &gzip_body_off);
+    }
+    sqlite3_reset(stmt);
+    free(list_body);
+    if (!response) {
+        shared_buf_release(gzip_response);
+        send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"oom\"}", ctx);
+        return 500;
+    }
+
+    if (desc->cacheable) value_cache_fill(storage_key, ticket, response, body_off, gzip_response, gzip_body_off, version);
+    if (want_gzip && gzip_response) {
+        shared_buf_release(response);
+        response = gzip_response;
+        body_off = gzip_body_off;
+    } else {
+        shared_buf_release(gzip_response);
+    }
+    if (queue_cached_response(conn, response, body_off, ctx) != 0) {
+        conn->close_after_flush = 1;
+    }
+    log_info("DATA READ key=%s source=%s account=%s logid=%s", key, source, ctx->account_id, ctx->log_id);
+    return 200;
+}
+
+static int handle_get_cache_diagnostics(conn_t *conn, const request_log_context_t *ctx) {
+    value_cache_stats_t stats;
+    value_cache_stats_snapshot(&stats);
+
+    char body[512] = {0};
+    snprintf(
+        body,
+        sizeof(body),
+        "{\"max_bytes\":%zu,\"entries\":%zu,\"gzip_entries\":%zu,\"bytes\":%zu,\"hits\":%lld,\"misses\":%lld,"
+        "\"evictions\":%lld,\"invalidations\":%lld,\"stale_fills\":%lld}",
+        stats.max_bytes,
+        stats.entries,
+        stats.gzip_entries,
+        stats.bytes,
+        stats.hits,
+        stats.misses,
+        stats.evictions,
+        stats.invalidations,
+        stats.stale_fills);
+    send_response_with_log_context(conn, 200, "OK", body, ctx);
+    return 200;
+}
+
+static int handle_get_write_queue_diagnostics(conn_t *conn, const request_log_context_t *ctx) {
+    write_dispatch_diagnostics_t diag;
+    write_dispatch_diagnostics_snapshot(&diag);
+    journal_stats_t journal;
+    journal_stats_snapshot(&journal);
+
+    char body[4096] = {0};
+    int off = snprintf(
+        body,
+        sizeof(body),
+        "{\"running\":%s,\"queue_depth\":%d,\"last_batch_size\":%d,\"max_batch_size\":%d,\"batch_count\":%lld,\"superseded_count\":%lld,"
+        "\"last_success_logid\":\"%s\",\"last_error_logid\":\"%s\","
+        "\"journal_segments\":%d,\"journal_live_records\":%lld,\"journal_syncs\":%lld,\"journal_checkpoint\":%" PRIu64 ",\"shards\":[",
+        diag.running ? "true" : "false",
+        diag.queue_depth,
+        diag.last_batch_size,
+        diag.max_batch_size,
+        diag.batch_count,
+        diag.superseded_count,
+        diag.last_success_logid,
+        diag.last_error_logid,
+        journal.segments,
+        journal.live_records,
+        journal.sync_count,
+        journal.checkpoint_seq);
+    for (int i = 0; i < diag.shard_count && off > 0 && (size_t)off < sizeof(body); i++) {
+        off += snprintf(
+            body + off,
+            sizeof(body) - (size_t)off,
+            "%s{\"shard\":%d,\"queue_depth\":%d,\"last_batch_size\":%d,\"batch_count\":%lld,\"superseded_count\":%lld}",
+            i > 0 ? "," : "",
+            i,
+            diag.shards[i].queue_depth,
+            diag.shards[i].last_batch_size,
+            diag.shards[i].batch_count,
+            diag.shards[i].superseded_count);
+    }
+    if (off > 0 && (size_t)off < sizeof(body)) snprintf(body + off, sizeof(body) - (size_t)off, "]}");
+    send_response_with_log_context(conn, 200, "OK", body, ctx);
+    return 200;
+}
+
+static int handle_get_metrics(conn_t *conn, const request_log_context_t *ctx) {
+    size_t body_len = 0;
+    char *body = metrics_render(&body_len);
+    char head[160];
+    int head_len = body ? snprintf(
+                              head,
+                              sizeof(head),
+                              "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\n",
+                              body_len)
+                        : -1;
+    shared_buf_t *response = head_len > 0 ? shared_buf_new((size_t)head_len + body_len) : NULL;
+    if (!response) {
+        free(body);
+        send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"oom\"}", ctx);
+        return 500;
+    }
+    memcpy(response->data, head, (size_t)head_len);
+    memcpy(response->data + head_len, body, body_len);
+    free(body);
+    if (queue_cached_response(conn, response, (size_t)head_len, ctx) != 0) conn->close_after_flush = 1;
+    return 200;
+}
+
+/* PATCH elements are matched by their top-level "id", which must be a string or number. */
+static int patch_elements_have_ids(const char *payload, size_t payload_len) {
+    size_t pos = 0;
+    size_t elem_off = 0;
+    size_t elem_len = 0;
+    int next;
+    while ((next = json_array_next(payload, payload_len, &pos, &elem_off, &elem_len)) == 1) {
+        size_t id_off = 0;
+        size_t id_len = 0;
+        if (!json_object_member(payload + elem_off, elem_len, "id", &id_off, &id_len)) return 0;
+        char first = payload[elem_off + id_off];
+        if (first != '"' && first != '-' && (first < '0' || first > '9')) return 0;
+    }
+    return next == 0;
+}
+
+/* Returns NULL if the payload suits op, otherwise the 400 body, with the log reason in *out_reason. */
+static const char *write_payload_error(const data_key_t *desc, int op, const char *payload, size_t payload_len, const char **out_reason) {
+    json_shape_t shape;
+    const char *reason = NULL;
+    const char *error = NULL;
+    uint64_t validate_start = metrics_now_ns();
+    int valid = json_validate(payload, payload_len, &shape) == 0;
+    metrics_observe_stage(METRICS_STAGE_JSON_VALIDATE, validate_start);
+    if (!valid) {
+        reason = "invalid_json";
+        error = "{\"error\":\"invalid json payload\"}";
+    } else if (op != WRITE_OP_PUT && desc->kind != DATA_KEY_KIND_LIST) {
+        reason = "not_a_list_key";
+        error = "{\"error\":\"key is not a list\"}";
+    } else if (op != WRITE_OP_PUT && shape.type != JSON_TYPE_ARRAY) {
+        reason = "payload_not_array";
+        error = "{\"error\":\"payload must be a json array\"}";
+    } else if (op == WRITE_OP_PATCH && !patch_elements_have_ids(payload, payload_len)) {
+        reason = "missing_element_id";
+        error = "{\"error\":\"every element needs an id\"}";
+    }
+    *out_reason = reason;
+    return error;
+}
+
+/* Returns 0 if the payload suits op, otherwise sends 400 and returns -1. */
+static int validate_write_payload(
+    conn_t *conn,
+    const data_key_t *desc,
+    const char *key,
+    int op,
+    const char *payload,
+    size_t payload_len,
+    const request_log_context_t *ctx) {
+    const char *reason = NULL;
+    const char *error = write_payload_error(desc, op, payload, payload_len, &reason);
+    if (!error) return 0;
+    send_response_with_log_context(conn, 400, "Bad Request", error, ctx);
+    log_warn("DATA WRITE rejected key=%s reason=%s bytes=%zu logid=%s", key, reason, payload_len, ctx->log_id);
+    return -1;
+}
+
+static int reject_submit(conn_t *conn, const char *key, size_t payload_len, int submit_rc, const request_log_context_t *ctx) {
+    if (submit_rc == WRITE_DISPATCH_JOURNAL_FAILED) {
+        send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"durable journal error\"}", ctx);
+        log_error("DATA WRITE failed key=%s reason=journal_append_failed bytes=%zu account=%s logid=%s", key, payload_len, ctx->account_id, ctx->log_id);
+        return 500;
+    }
+    if (submit_rc == WRITE_DISPATCH_OVERLOADED) {
+        send_retry_after(conn, 503, "Service Unavailable", "{\"error\":\"write queue full\"}", 1, ctx);
+        return 503;
+    }
+    send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"write queue unavailable\"}", ctx);
+    log_error("DATA WRITE failed key=%s reason=dispatch_enqueue_failed bytes=%zu account=%s logid=%s", key, payload_len, ctx->account_id, ctx->log_id);
+    return 500;
+}
+
+/* For callers without an event loop: blocks until the one submitted write completes. */
+static void wait_write_completion(write_completion_queue_t *queue, write_dispatch_result_t *out_result) {
+    write_completion_t *completion = NULL;
+    while ((completion = write_completion_queue_take(queue)) == NULL) {
+        write_completion_queue_wait(queue, -1);
+    }
+    *out_result = completion->result;
+    write_completion_release(completion);
+}
+
+/* Answers a write from its dispatcher result; returns the status sent. */
+static int finish_write(
+    conn_t *conn,
+    const char *key,
+    size_t payload_len,
+    const char *ack,
+    const write_dispatch_result_t *result,
+    const request_log_context_t *ctx) {
+    if (result->status_code == 202) {
+        char response_body[512] = {0};
+        snprintf(
+            response_body,
+            sizeof(response_body),
+            "{\"status\":\"queued\",\"logid\":\"%s\",\"pending\":\"journal:%" PRIu64 "\"}",
+            ctx->log_id,
+            result->version);
+        send_response_with_log_context(conn, 202, "Accepted", response_body, ctx);
+        metrics_count_queued();
+        log_warn(
+            "DATA WRITE queued key=%s reason=writer_backlog bytes=%zu pending=journal:%" PRIu64 " account=%s logid=%s",
+            key,
+            payload_len,
+            result->version,
+            ctx->account_id,
+            ctx->log_id);
+        return 202;
+    }
+
+    if (result->status_code == 412) {
+        send_response_with_etag(conn, 412, "Precondition Failed", "{\"error\":\"precondition failed\"}", result->version, ctx);
+        return 412;
+    }
+
+    if (result->status_code == 409) {
+        send_response_with_log_context(conn, 409, "Conflict", "{\"error\":\"stored value is not an array\"}", ctx);
+        return 409;
+    }
+
+    if (result->status_code != 204) {
+        char response_body[640] = {0};
+        if (result->journal_error) {
+            snprintf(response_body, sizeof(response_body), "{\"error\":\"durable journal error\"}");
+        } else if (result->backup_path[0] != '\0') {
+            snprintf(
+                response_body,
+                sizeof(response_body),
+                "{\"error\":\"database error\",\"rc\":%d,\"ext\":%d,\"backup\":\"%s\"}",
+                result->sqlite_rc,
+                result->sqlite_ext,
+                result->backup_path);
+        } else {
+            snprintf(response_body, sizeof(response_body), "{\"error\":\"database error\",\"rc\":%d,\"ext\":%d}", result->sqlite_rc, result->sqlite_ext);
+        }
+        send_response_with_log_context(conn, 500, "Internal Server Error", response_body, ctx);
+        return 500;
+    }
+
+    if (ack && ack[0] != '\0') {
+        send_response_with_etag(conn, 200, "OK", ack, result->version, ctx);
+        return 200;
+    }
+    send_response_with_etag(conn, 204, "No Content", "", result->version, ctx);
+    return 204;
+}
+
+/*
+ * Hands a validated write to the dispatcher. Without a completion queue
+ * (tests, tools) it waits for the outcome; otherwise the response is sent
+ * by try_complete_write. A stored write is answered 204, or 200 with ack
+ * when one is given. Returns the status sent, or 0 while pending.
+ */
+static int submit_write(
+    conn_t *conn,
+    worker_db_t *db,
+    const char *method,
+    const char *path,
+    const char *key,
+    const char *storage_key,
+    int op,
+    int64_t if_match,
+    const char *payload,
+    size_t payload_len,
+    const char *ack,
+    const request_log_context_t *ctx) {
+    if (!db->completions) {
+        write_completion_queue_t queue;
+        if (write_completion_queue_init(&queue) != 0) {
+            send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"write queue unavailable\"}", ctx);
+            return 500;
+        }
+        int submit_rc = write_dispatch_submit(
+            key, storage_key, payload, payload_len, op, if_match, ctx->account_id, ctx->log_id, &queue, conn, conn->handle);
+        write_dispatch_result_t result;
+        if (submit_rc == 0) wait_write_completion(&queue, &result);
+        write_completion_queue_destroy(&queue);
+        if (submit_rc != 0) return reject_submit(conn, key, payload_len, submit_rc, ctx);
+        return finish_write(conn, key, payload_len, ack, &result, ctx);
+    }
+
+    pending_write_t *pending = (pending_write_t *)malloc(sizeof(pending_write_t));
+    if (!pending) {
+        send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"oom\"}", ctx);
+        return 500;
     }
+    pending->ctx = *ctx;
+    snprintf(pending->method, sizeof(pending->method), "%s", method);
+    snprintf(pending->path, sizeof(pending->path), "%s", path);
+    snprintf(pending->key, sizeof(pending->key), "%s", key);
+    snprintf(pending->ack, sizeof(pending->ack), "%s", ack ? ack : "");
+    pending->payload_len = payload_len;
+    int submit_rc = write_dispatch_submit(
+        key, storage_key, payload, payload_len, op, if_match, ctx->account_id, ctx->log_id, db->completions, conn, conn->handle);
+    if (submit_rc != 0) {
+        free(pending);
+        return reject_submit(conn, key, payload_len, submit_rc, ctx);
+    }
+    conn->pending_write = pending;
+    return 0;
+}
+
+/*
+ * Returns the status sent, or 0 when the write went to the dispatcher and
+ * the response waits in conn->pending_write for its completion.
+ */
+static int handle_write_data(
+    conn_t *conn,
+    worker_db_t *db,
+    const char *method,
+    const char *path,
+    const data_key_t *desc,
+    const char *key,
+    int op,
+    const char *payload,
+    size_t payload_len,
+    const request_log_context_t *ctx) {
+    if (payload_len > desc->max_bytes) {
+        send_response_with_log_context(conn, 413, "Payload Too Large", "{\"error\":\"payload too large for key\"}", ctx);
+        log_warn("DATA WRITE rejected key=%s reason=payload_too_large bytes=%zu limit=%zu logid=%s", key, payload_len, desc->max_bytes, ctx->log_id);
+        return 413;
+    }
+    if (validate_write_payload(conn, desc, key, op, payload, payload_len, ctx) != 0) return 400;
+
+    char storage_key[256] = {0};
+    if (build_storage_key(ctx->account_id, key, storage_key, sizeof(storage_key)) != 0) {
+        send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"invalid account key\"}", ctx);
+        return 500;
+    }
+
+    int64_t if_match = WRITE_IF_MATCH_NONE;
+    if (parse_if_match(conn->buf, conn->parse.if_match, &if_match) != 0) {
+        send_response_with_log_context(conn, 412, "Precondition Failed", "{\"error\":\"precondition failed\"}", ctx);
+        log_warn("DATA WRITE rejected key=%s reason=unmatchable_if_match bytes=%zu logid=%s", key, payload_len, ctx->log_id);
+        return 412;
+    }
+    return submit_write(conn, db, method, path, key, storage_key, op, if_match, payload, payload_len, NULL, ctx);
+}
+
+
+/* Batch key names end up in storage keys and JSON member names as is. */
+static int is_batch_key_name(const char *name, size_t len) {
+    if (len == 0 || len >= 128) return 0;
+    for (size_t i = 0; i < len; i++) {
+        char c = name[i];
+        if (!isalnum((unsigned char)c) && c != '_' && c != '-' && c != '.') return 0;
+    }
+    return 1;
+}
 
+static int batch_put(char **buf, size_t *len, size_t *cap, const char *data, size_t n) {
+    if (*len + n > *cap) {
+        size_t grown_cap = *cap ? *cap : 4096;
+        while (grown_cap < *len + n) grown_cap *= 2;
+        char *grown = (char *)realloc(*buf, grown_cap);
+        if (!grown) return -1;
+        *buf = grown;
+        *cap = grown_cap;
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+    return 0;
+}
+
+/* The contents of a JSON string member without escapes, e.g. a key name. */
+static int batch_string_member(const char *obj, size_t obj_len, const char *name, const char **out, size_t *out_len) {
+    size_t off = 0;
+    size_t len = 0;
+    if (!json_object_member(obj, obj_len, name, &off, &len)) return 0;
+    if (len < 2 || obj[off] != '"' || memchr(obj + off, '\\', len) != NULL) return -1;
+    *out = obj + off + 1;
+    *out_len = len - 2;
+    return 1;
+}
+
+/*
+ * Decodes one {"key":..., "op":..., "value":..., "if_match":...} element of
+ * a POST /v1/batch body. op is "put" (the default), "append" or "patch";
+ * if_match is a row version or "*". Returns NULL, or the 400 body.
+ */
+static const char *parse_batch_write(const char *elem, size_t elem_len, kv_batch_entry_t *out, const data_key_t **out_desc) {
+    if (elem_len == 0 || elem[0] != '{') return "{\"error\":\"batch entries must be objects\"}";
+    const char *key = NULL;
+    size_t key_len = 0;
+    if (batch_string_member(elem, elem_len, "key", &key, &key_len) != 1 || !is_batch_key_name(key, key_len)) {
+        return "{\"error\":\"batch entry needs a key\"}";
+    }
+    const data_key_t *desc = data_key_lookup(key, key_len);
+    if (!desc) return "{\"error\":\"unknown key\"}";
+
+    const char *op_name = "put";
+    size_t op_len = 3;
+    if (batch_string_member(elem, elem_len, "op", &op_name, &op_len) < 0) return "{\"error\":\"invalid batch op\"}";
+    int op = -1;
+    if (op_len == 3 && memcmp(op_name, "put", 3) == 0) {
+        op = WRITE_OP_PUT;
+    } else if (op_len == 6 && memcmp(op_name, "append", 6) == 0) {
+        op = WRITE_OP_APPEND;
+    } else if (op_len == 5 && memcmp(op_name, "patch", 5) == 0) {
+        op = WRITE_OP_PATCH;
+    }
+    if (op < 0) return "{\"error\":\"invalid batch op\"}";
+
+    size_t value_off = 0;
+    size_t value_len = 0;
+    if (!json_object_member(elem, elem_len, "value", &value_off, &value_len)) return "{\"error\":\"batch entry needs a value\"}";
+
+    int64_t if_match = WRITE_IF_MATCH_NONE;
+    size_t cond_off = 0;
+    size_t cond_len = 0;
+    if (json_object_member(elem, elem_len, "if_match", &cond_off, &cond_len)) {
+        const char *cond = elem + cond_off;
+        if (cond_len == 3 && memcmp(cond, "\"*\"", 3) == 0) {
+            if_match = WRITE_IF_MATCH_ANY;
+        } else {
+            uint64_t version = 0;
+            for (size_t i = 0; i < cond_len; i++) {
+                if (cond[i] < '0' || cond[i] > '9' || version > (uint64_t)(INT64_MAX - 9) / 10) return "{\"error\":\"invalid if_match\"}";
+                version = version * 10 + (uint64_t)(cond[i] - '0');
+            }
+            if_match = (int64_t)version;
+        }
+    }
+
+    out->op = op;
+    out->if_match = if_match;
+    out->key = key;
+    out->key_len = key_len;
+    out->value = elem + value_off;
+    out->value_len = value_len;
+    *out_desc = desc;
+    return NULL;
+}
+
+/*
+ * POST /v1/batch: a JSON array of writes that become one journal record and
+ * one dispatcher job, committed together or not at all. Answers like a
+ * single write: 204 with the ETag every written key now has, or 412 / 409
+ * when any entry's precondition or list check fails, leaving all keys as
+ * they were.
+ */
+static int handle_batch_write(
+    conn_t *conn,
+    worker_db_t *db,
+    const char *method,
+    const char *path,
+    const char *body,
+    size_t body_len,
+    const request_log_context_t *ctx) {
+    json_shape_t shape;
+    const char *error = NULL;
+    const char *reason = NULL;
+    if (json_validate(body, body_len, &shape) != 0 || shape.type != JSON_TYPE_ARRAY) {
+        error = "{\"error\":\"batch must be a json array\"}";
+        reason = "invalid_batch";
+    }
+
+    char *payload = NULL;
+    size_t payload_len = 0;
+    size_t payload_cap = 0;
+    int count = 0;
+    size_t pos = 0;
+    size_t elem_off = 0;
+    size_t elem_len = 0;
+    while (!error && json_array_next(body, body_len, &pos, &elem_off, &elem_len) == 1) {
+        kv_batch_entry_t entry;
+        const data_key_t *desc = NULL;
+        reason = "invalid_batch_entry";
+        if (++count > BATCH_MAX_KEYS) {
+            error = "{\"error\":\"too many batch entries\"}";
+        } else if ((error = parse_batch_write(body + elem_off, elem_len, &entry, &desc)) == NULL) {
+            if (entry.value_len > desc->max_bytes) {
+                free(payload);
+                send_response_with_log_context(conn, 413, "Payload Too Large", "{\"error\":\"payload too large for key\"}", ctx);
+                log_warn("DATA WRITE rejected key=batch reason=payload_too_large bytes=%zu limit=%zu logid=%s", entry.value_len, desc->max_bytes, ctx->log_id);
+                return 413;
+            }
+            error = write_payload_error(desc, entry.op, entry.value, entry.value_len, &reason);
+            if (!error && kv_batch_append(&payload, &payload_len, &payload_cap, &entry) != 0) {
+                free(payload);
+                send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"oom\"}", ctx);
+                return 500;
+            }
+        }
+    }
+    if (!error && count == 0) {
+        error = "{\"error\":\"empty batch\"}";
+        reason = "empty_batch";
+    }
+    char prefix[256];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "%s::", ctx->account_id);
+    if (!error && (prefix_len <= 2 || (size_t)prefix_len >= sizeof(prefix))) {
+        free(payload);
+        send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"invalid account key\"}", ctx);
+        return 500;
+    }
+    if (error) {
+        free(payload);
+        send_response_with_log_context(conn, 400, "Bad Request", error, ctx);
+        log_warn("DATA WRITE rejected key=batch reason=%s bytes=%zu logid=%s", reason, body_len, ctx->log_id);
+        return 400;
+    }
+
+    int status = submit_write(conn, db, method, path, "batch", prefix, WRITE_OP_BATCH, WRITE_IF_MATCH_NONE, payload, payload_len, NULL, ctx);
+    free(payload);
+    return status;
+}
+
+/*
+ * GET /v1/batch?keys=a,b,c: {"a":{"version":N,"value":...},...} with every
+ * value read inside one read transaction on the account's shard, so the
+ * keys form one consistent snapshot. Bypasses the value cache, whose
+ * entries are filled and invalidated one key at a time.
+ */
+static int handle_batch_get(conn_t *conn, worker_db_t *db, const char *query, const request_log_context_t *ctx) {
+    char names[BATCH_MAX_KEYS][128];
+    size_t name_lens[BATCH_MAX_KEYS];
+    const data_key_t *descs[BATCH_MAX_KEYS];
+    int count = 0;
+    const char *error = NULL;
+    const char *list = NULL;
+    for (const char *p = query; p && *p; p = strchr(p, '&') ? strchr(p, '&') + 1 : NULL) {
+        if (strncmp(p, "keys=", 5) == 0) list = p + 5;
+    }
+    if (!list) error = "{\"error\":\"missing keys\"}";
+    while (!error && *list != '\0' && *list != '&') {
+        const char *end = list;
+        while (*end != '\0' && *end != '&' && *end != ',') end++;
+        char name[sizeof(names[0])];
+        int decoded_len = percent_decode(list, (size_t)(end - list), name, sizeof(name));
+        size_t len = decoded_len > 0 ? (size_t)decoded_len : 0;
+        const data_key_t *desc = is_batch_key_name(name, len) ? data_key_lookup(name, len) : NULL;
+        if (!desc) {
+            error = "{\"error\":\"unknown key\"}";
+        } else if (count == BATCH_MAX_KEYS) {
+            error = "{\"error\":\"too many keys\"}";
+        } else {
+            for (int i = 0; i < count; i++) {
+                if (name_lens[i] == len && memcmp(names[i], name, len) == 0) error = "{\"error\":\"duplicate key\"}";
+            }
+            memcpy(names[count], name, len + 1);
+            name_lens[count] = len;
+            descs[count] = desc;
+            count++;
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+    if (!error && count == 0) error = "{\"error\":\"missing keys\"}";
+    if (error) {
+        send_response_with_log_context(conn, 400, "Bad Request", error, ctx);
+        return 400;
+    }
+
+    char prefix[256];
+    int prefix_len = snprintf(prefix, sizeof(prefix), "%s::", ctx->account_id);
+    if (prefix_len <= 2 || (size_t)prefix_len >= sizeof(prefix) || db->shard_count <= 0) {
+        send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"invalid account key\"}", ctx);
+        return 500;
+    }
+    int shard = storage_key_shard(prefix, db->shard_count);
+    sqlite3_stmt *stmt = db->get_stmts[shard];
+    if (!stmt || sqlite3_exec(db->shards[shard], "BEGIN", NULL, NULL, NULL) != SQLITE_OK) {
+        send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"database error\"}", ctx);
+        return 500;
+    }
+
+    char *out = NULL;
+    size_t out_len = 0;
+    size_t out_cap = 0;
+    int rc = batch_put(&out, &out_len, &out_cap, "{", 1) == 0 ? SQLITE_DONE : SQLITE_NOMEM;
+    for (int i = 0; i < count && rc == SQLITE_DONE; i++) {
+        kv_batch_entry_t entry = {.key = names[i], .key_len = name_lens[i]};
+        char storage_key[256];
+        if (kv_batch_storage_key(prefix, &entry, storage_key, sizeof(storage_key)) != 0) {
+            rc = SQLITE_MISUSE;
+            break;
+        }
+        sqlite3_reset(stmt);
+        sqlite3_bind_text(stmt, 1, storage_key, -1, SQLITE_TRANSIENT);
+        uint64_t step_start = metrics_now_ns();
+        int step_rc = sqlite3_step(stmt);
+        metrics_observe_stage(METRICS_STAGE_SQLITE_STEP, step_start);
+        uint64_t version = 0;
+        const char *value = descs[i]->default_body;
+        size_t value_len = strlen(value);
+        char *list_body = NULL;
+        if (step_rc == SQLITE_ROW) {
+            version = (uint64_t)sqlite3_column_int64(stmt, 0);
+            if (sqlite3_column_int64(stmt, 2) > 0) {
+                value = list_body = render_list_body(db->item_stmts[shard], storage_key, &value_len);
+            } else {
+                value = (const char *)sqlite3_column_text(stmt, 1);
+                value_len = value ? (size_t)sqlite3_column_bytes(stmt, 1) : 0;
+            }
+        } else if (step_rc != SQLITE_DONE) {
+            rc = step_rc;
+        }
+        char head[192];
+        int head_len = snprintf(head, sizeof(head), "%s\"%.*s\":{\"version\":%" PRIu64 ",\"value\":", i > 0 ? "," : "", (int)name_lens[i], names[i], version);
+        if (rc == SQLITE_DONE && (!value || head_len <= 0 || (size_t)head_len >= sizeof(head) ||
+                                  batch_put(&out, &out_len, &out_cap, head, (size_t)head_len) != 0 ||
+                                  batch_put(&out, &out_len, &out_cap, value, value_len) != 0 ||
+                                  batch_put(&out, &out_len, &out_cap, "}", 1) != 0)) {
+            rc = SQLITE_NOMEM;
+        }
+        free(list_body);
+    }
+    sqlite3_reset(stmt);
+    sqlite3_exec(db->shards[shard], "COMMIT", NULL, NULL, NULL);
+
+    shared_buf_t *response = rc == SQLITE_DONE && batch_put(&out, &out_len, &out_cap, "}", 1) == 0 ? shared_buf_copy(out, out_len) : NULL;
+    free(out);
+    if (!response) {
+        send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"database error\"}", ctx);
+        return 500;
+    }
+    if (queue_response_ref(conn, 200, "OK", response, ctx) != 0) conn->close_after_flush = 1;
+    log_info("DATA READ key=batch keys=%d source=db account=%s logid=%s", count, ctx->account_id, ctx->log_id);
+    return 200;
+}
+
+static int64_t now_ms(void) {
+    return (int64_t)(metrics_now_ns() / 1000000);
+}
+
+/* Parses ?since=&wait= of a change read; *out_has_since is 0 when since is absent. */
+static int parse_changes_query(const char *query, int *out_has_since, uint64_t *out_since, int *out_wait_s) {
+    *out_has_since = 0;
+    *out_since = 0;
+    *out_wait_s = 0;
+    const char *p = query;
+    while (*p != '\0') {
+        const char *end = strchr(p, '&');
+        if (!end) end = p + strlen(p);
+        const char *eq = memchr(p, '=', (size_t)(end - p));
+        char value[32];
+        int64_t parsed = 0;
+        if (eq) {
+            size_t name_len = (size_t)(eq - p);
+            int known = (name_len == 5 && strncmp(p, "since", 5) == 0) || (name_len == 4 && strncmp(p, "wait", 4) == 0);
+            if (known && (percent_decode(eq + 1, (size_t)(end - eq - 1), value, sizeof(value)) < 0 || parse_nonnegative(value, &parsed) != 0)) {
+                return -1;
+            }
+            if (known && name_len == 5) {
+                *out_has_since = 1;
+                *out_since = (uint64_t)parsed;
+            } else if (known) {
+                *out_wait_s = parsed > CHANGES_WAIT_MAX_S ? CHANGES_WAIT_MAX_S : (int)parsed;
+            }
+        }
+        p = *end == '&' ? end + 1 : end;
+    }
+    return 0;
+}
+
+/* {"next":N,"reset":bool,"changes":[{"seq":S,"key":"k","version":V},...]} in a shared buffer. */
+static shared_buf_t *render_changes_body(const change_feed_entry_t *entries, int count, uint64_t next, int reset) {
+    char *out = NULL;
+    size_t out_len = 0;
+    size_t out_cap = 0;
+    char item[CHANGE_FEED_KEY_MAX + 96];
+    int n = snprintf(item, sizeof(item), "{\"next\":%" PRIu64 ",\"reset\":%s,\"changes\":[", next, reset ? "true" : "false");
+    int ok = n > 0 && batch_put(&out, &out_len, &out_cap, item, (size_t)n) == 0;
+    for (int i = 0; ok && i < count; i++) {
+        n = snprintf(item, sizeof(item), "%s{\"seq\":%" PRIu64 ",\"key\":\"%s\",\"version\":%" PRIu64 "}",
+                     i > 0 ? "," : "", entries[i].seq, entries[i].key, entries[i].version);
+        ok = n > 0 && (size_t)n < sizeof(item) && batch_put(&out, &out_len, &out_cap, item, (size_t)n) == 0;
+    }
+    shared_buf_t *body = ok && batch_put(&out, &out_len, &out_cap, "]}", 2) == 0 ? shared_buf_copy(out, out_len) : NULL;
+    free(out);
+    return body;
+}
+
+/* count is what change_feed_read returned, or -2 when reading failed. */
+static int respond_changes(conn_t *conn, const change_feed_entry_t *entries, int count, uint64_t next, const request_log_context_t *ctx) {
+    int reset = count == CHANGE_FEED_RESET;
+    shared_buf_t *body = count >= CHANGE_FEED_RESET ? render_changes_body(entries, reset ? 0 : count, next, reset) : NULL;
+    if (!body) {
+        send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"oom\"}", ctx);
+        return 500;
+    }
+    if (queue_response_ref(conn, 200, "OK", body, ctx) != 0) conn->close_after_flush = 1;
+    return 200;
+}
+
+/* Queues one "id:/data:" event per change, or a reset event telling the client to resync. */
+static int queue_change_events(conn_t *conn, const change_feed_entry_t *entries, int count, uint64_t next, int reset) {
+    char *out = NULL;
+    size_t out_len = 0;
+    size_t out_cap = 0;
+    char item[CHANGE_FEED_KEY_MAX + 96];
+    int ok = 1;
+    if (reset) {
+        int n = snprintf(item, sizeof(item), "event: reset\nid: %" PRIu64 "\ndata: {\"next\":%" PRIu64 "}\n\n", next, next);
+        ok = n > 0 && batch_put(&out, &out_len, &out_cap, item, (size_t)n) == 0;
+    }
+    for (int i = 0; ok && i < count; i++) {
+        int n = snprintf(item, sizeof(item), "id: %" PRIu64 "\ndata: {\"key\":\"%s\",\"version\":%" PRIu64 "}\n\n",
+                         entries[i].seq, entries[i].key, entries[i].version);
+        ok = n > 0 && (size_t)n < sizeof(item) && batch_put(&out, &out_len, &out_cap, item, (size_t)n) == 0;
+    }
+    int rc = ok ? 0 : -1;
+    if (ok && out_len > 0) rc = conn_output_append(conn, shared_buf_copy(out, out_len), 0, out_len);
+    free(out);
+    return rc;
+}
+
+/* Moves an event stream up to the end of the feed, a page at a time. */
+static int advance_change_stream(conn_t *conn, change_watch_t *watch) {
+    change_feed_entry_t *entries = (change_feed_entry_t *)malloc(sizeof(change_feed_entry_t) * CHANGES_PAGE_MAX);
+    if (!entries) return -1;
+    int count;
+    do {
+        uint64_t next = 0;
+        count = change_feed_read(watch->prefix, watch->cursor, entries, CHANGES_PAGE_MAX, &next);
+        int reset = count == CHANGE_FEED_RESET;
+        if ((reset || count > 0) && queue_change_events(conn, entries, reset ? 0 : count, next, reset) != 0) {
+            free(entries);
+            return -1;
+        }
+        watch->cursor = next;
+    } while (count == CHANGES_PAGE_MAX);
+    free(entries);
+    return 0;
+}
+
+/*
+ * GET /v1/changes?since=<seq>[&wait=<s>]: the account's changes after seq,
+ * answered at once when there are some, when since is missing or outside
+ * the retained window (reset), or when wait is 0; otherwise parked until
+ * one arrives or wait runs out. With Accept: text/event-stream the response
+ * is a stream of events that stays open. Returns 0 when parked or streaming.
+ */
+static int handle_get_changes(conn_t *conn, worker_db_t *db, const char *path, const request_log_context_t *ctx) {
+    if (!change_feed_enabled()) {
+        send_response_with_log_context(conn, 404, "Not Found", "{\"error\":\"change feed disabled\"}", ctx);
+        return 404;
+    }
+    const char *query = strchr(path, '?');
+    int has_since = 0;
+    uint64_t since = 0;
+    int wait_s = 0;
+    if (parse_changes_query(query ? query + 1 : "", &has_since, &since, &wait_s) != 0) {
+        send_response_with_log_context(conn, 400, "Bad Request", "{\"error\":\"invalid changes query\"}", ctx);
+        return 400;
+    }
+
+    int sse = 0;
+    if (conn->parse.accept.len > 0) {
+        char accept[256];
+        copy_span(conn->buf, conn->parse.accept, accept, sizeof(accept));
+        sse = header_value_has_token(accept, "text/event-stream");
+    }
+    /* A reconnecting EventSource resumes after the last event it saw. */
+    if (sse && conn->parse.last_event_id.len > 0) {
+        char raw[32];
+        int64_t parsed = 0;
+        copy_span(conn->buf, conn->parse.last_event_id, raw, sizeof(raw));
+        if (parse_nonnegative(raw, &parsed) == 0) {
+            has_since = 1;
+            since = (uint64_t)parsed;
+        }
+    }
+
+    change_watch_t *watch = (change_watch_t *)calloc(1, sizeof(change_watch_t));
+    if (!watch) {
+        send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"oom\"}", ctx);
+        return 500;
+    }
+    watch->ctx = *ctx;
+    snprintf(watch->path, sizeof(watch->path), "%s", path);
+    snprintf(watch->prefix, sizeof(watch->prefix), "%s::", ctx->account_id);
+    watch->cursor = has_since ? since : change_feed_last_seq();
+
+    if (sse) {
+        /* The stream ends only with the connection. */
+        watch->sse = 1;
+        watch->ctx.keep_alive = 0;
+        const char *log_id = ctx->log_id[0] != '\0' ? ctx->log_id : "-";
+        char header[HEADER_BUF_SIZE];
+        int header_len = snprintf(header, sizeof(header),
+                                  "HTTP/1.1 200 OK\r\n"
+                                  "Content-Type: text/event-stream\r\n"
+                                  "Cache-Control: no-cache\r\n"
+                                  "X-Log-Id: %s\r\n"
+                                  "Connection: close\r\n\r\n",
+                                  log_id);
+        if (header_len <= 0 || (size_t)header_len >= sizeof(header) ||
+            conn_output_append(conn, shared_buf_copy(header, (size_t)header_len), 0, (size_t)header_len) != 0 ||
+            advance_change_stream(conn, watch) != 0) {
+            free(watch);
+            conn->close_after_flush = 1;
+            return 500;
+        }
+        log_http_request("GET", path, 200, 0, ctx);
+        /* Without an event loop nothing would ever resume it: the stream ends after the backlog. */
+        if (!db->completions) {
+            free(watch);
+            conn->close_after_flush = 1;
+            return 0;
+        }
+        watch->deadline_ms = now_ms() + CHANGES_HEARTBEAT_MS;
+        conn->watch = watch;
+        return 0;
+    }
+
+    change_feed_entry_t *entries = (change_feed_entry_t *)malloc(sizeof(change_feed_entry_t) * CHANGES_PAGE_MAX);
+    uint64_t next = watch->cursor;
+    int count = entries ? 0 : -2;
+    if (entries && has_since) count = change_feed_read(watch->prefix, since, entries, CHANGES_PAGE_MAX, &next);
+    if (count == 0 && wait_s > 0 && db->completions) {
+        free(entries);
+        watch->cursor = next;
+        watch->deadline_ms = now_ms() + (int64_t)wait_s * 1000;
+        conn->watch = watch;
+        return 0;
+    }
+    free(watch);
+    int status = respond_changes(conn, entries, count, next, ctx);
+    free(entries);
+    return status;
+}
+
+/*
+ * Undoes a write body's Content-Encoding. A gzip body is inflated into
+ * *out_decoded (NULL otherwise), refusing to grow past max_bytes.
+ * Returns 0 when the write can go ahead, else the status already sent.
+ */
+static int decode_write_body(
+    conn_t *conn,
+    size_t max_bytes,
+    const char *key,
+    const char *body,
+    size_t body_len,
+    char **out_decoded,
+    size_t *out_decoded_len,
+    const request_log_context_t *ctx) {
+    *out_decoded = NULL;
+    http_span_t span = conn->parse.content_encoding;
+    const char *coding = conn->buf + span.off;
+    if (span.len == 0 || (span.len == 8 && strncasecmp(coding, "identity", 8) == 0)) return 0;
+    if (!((span.len == 4 && strncasecmp(coding, "gzip", 4) == 0) || (span.len == 6 && strncasecmp(coding, "x-gzip", 6) == 0))) {
+        send_response_with_log_context(conn, 415, "Unsupported Media Type", "{\"error\":\"unsupported content encoding\"}", ctx);
+        log_warn("DATA WRITE rejected key=%s reason=content_encoding logid=%s", key, ctx->log_id);
+        return 415;
+    }
+    int rc = gzip_decompress(body, body_len, max_bytes, out_decoded, out_decoded_len);
+    if (rc == -2) {
+        send_response_with_log_context(conn, 413, "Payload Too Large", "{\"error\":\"payload too large for key\"}", ctx);
+        log_warn("DATA WRITE rejected key=%s reason=payload_too_large bytes=%zu encoding=gzip limit=%zu logid=%s", key, body_len, max_bytes, ctx->log_id);
+        return 413;
+    }
+    if (rc != 0) {
+        send_response_with_log_context(conn, 400, "Bad Request", "{\"error\":\"invalid gzip body\"}", ctx);
+        log_warn("DATA WRITE rejected key=%s reason=invalid_gzip bytes=%zu logid=%s", key, body_len, ctx->log_id);
+        return 400;
+    }
+    return 0;
+}
+
+/* The ride id of a /v1/streams/<ride-id> path, without its query. */
+static int parse_ride_path(const char *path, char *out_id, size_t out_len) {
+    const char *id = path + 12;
+    const char *query = strchr(id, '?');
+    size_t len = query ? (size_t)(query - id) : strlen(id);
+    if (!ride_id_is_valid(id, len) || len >= out_len) return -1;
+    memcpy(out_id, id, len);
+    out_id[len] = '\0';
+    return 0;
+}
+
+/* from and to are sample times in ms; to is exclusive and open-ended when absent. */
+static int parse_ride_range_query(const char *query, int64_t *out_from, int64_t *out_to) {
+    *out_from = 0;
+    *out_to = INT64_MAX;
+    const char *p = query;
+    while (*p != '\0') {
+        const char *end = strchr(p, '&');
+        if (!end) end = p + strlen(p);
+        const char *eq = memchr(p, '=', (size_t)(end - p));
+        char value[32];
+        if (eq && percent_decode(eq + 1, (size_t)(end - eq - 1), value, sizeof(value)) >= 0) {
+            size_t name_len = (size_t)(eq - p);
+            if (name_len == 4 && strncmp(p, "from", 4) == 0) {
+                if (parse_nonnegative(value, out_from) != 0) return -1;
+            } else if (name_len == 2 && strncmp(p, "to", 2) == 0) {
+                if (parse_nonnegative(value, out_to) != 0) return -1;
+            }
+        } else if (eq) {
+            return -1;
+        }
+        p = *end == '&' ? end + 1 : end;
+    }
+    return *out_to < *out_from ? -1 : 0;
+}
+
+static int media_type_is(const char *buf, http_span_t span, const char *type) {
+    size_t type_len = strlen(type);
+    const char *value = buf + span.off;
+    size_t len = 0;
+    while (len < span.len && value[len] != ';' && value[len] != ' ' && value[len] != '\t') len++;
+    return len == type_len && strncasecmp(value, type, type_len) == 0;
+}
+
+/*
+ * One POST is one chunk of a ride: the samples are parsed and checked here,
+ * and the dispatcher appends whatever lies past the ride's last sample.
+ */
+static int handle_ride_write(
+    conn_t *conn,
+    worker_db_t *db,
+    const char *method,
+    const char *path,
+    const char *ride_id,
+    const char *body,
+    size_t body_len,
+    const request_log_context_t *ctx) {
+    char key[RIDE_ID_MAX + 16];
+    snprintf(key, sizeof(key), "%s%s", RIDE_STREAM_KEY_PREFIX, ride_id);
+    if (body_len > RIDE_CHUNK_MAX_BYTES) {
+        send_response_with_log_context(conn, 413, "Payload Too Large", "{\"error\":\"chunk too large\"}", ctx);
+        log_warn("RIDE WRITE rejected key=%s reason=payload_too_large bytes=%zu limit=%d logid=%s", key, body_len, RIDE_CHUNK_MAX_BYTES, ctx->log_id);
+        return 413;
+    }
+
+    uint32_t crc = ride_chunk_crc32(body, body_len);
+    if (conn->parse.chunk_crc32.len > 0) {
+        char raw[16];
+        char *end = NULL;
+        copy_span(conn->buf, conn->parse.chunk_crc32, raw, sizeof(raw));
+        unsigned long expected = strtoul(raw, &end, 16);
+        if (conn->parse.chunk_crc32.len > 8 || end == raw || *end != '\0' || (uint32_t)expected != crc) {
+            send_response_with_log_context(conn, 400, "Bad Request", "{\"error\":\"chunk checksum mismatch\"}", ctx);
+            log_warn("RIDE WRITE rejected key=%s reason=crc_mismatch bytes=%zu crc32=%08x logid=%s", key, body_len, (unsigned)crc, ctx->log_id);
+            return 400;
+        }
+    }
+
+    int binary = conn->parse.content_type.len > 0 && media_type_is(conn->buf, conn->parse.content_type, "application/octet-stream");
+    char *chunk = NULL;
+    size_t chunk_len = 0;
+    const char *error = NULL;
+    if (ride_chunk_build(body, body_len, binary, &chunk, &chunk_len, &error) != 0) {
+        if (!error) {
+            send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"out of memory\"}", ctx);
+            return 500;
+        }
+        send_response_with_log_context(conn, 400, "Bad Request", error, ctx);
+        log_warn("RIDE WRITE rejected key=%s reason=invalid_chunk bytes=%zu binary=%d logid=%s", key, body_len, binary, ctx->log_id);
+        return 400;
+    }
+
+    int64_t samples = ride_chunk_samples(chunk, chunk_len);
+    char ack[160];
+    snprintf(
+        ack,
+        sizeof(ack),
+        "{\"samples\":%lld,\"from\":%lld,\"to\":%lld,\"crc32\":\"%08x\"}",
+        (long long)samples,
+        (long long)ride_chunk_time(chunk, chunk_len, 0),
+        (long long)ride_chunk_time(chunk, chunk_len, samples - 1),
+        (unsigned)crc);
+    char storage_key[256] = {0};
+    int status;
+    if (build_storage_key(ctx->account_id, key, storage_key, sizeof(storage_key)) != 0) {
+        send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"invalid account key\"}", ctx);
+        status = 500;
+    } else {
+        status = submit_write(conn, db, method, path, key, storage_key, WRITE_OP_RIDE_CHUNK, WRITE_IF_MATCH_NONE, chunk, chunk_len, ack, ctx);
+    }
+    free(chunk);
+    return status;
+}
+
+/*
+ * Streams the samples in [from, to) as NDJSON, or as binary samples when
+ * asked for with Accept. The read is pinned to the head version it sends as
+ * ETag, so chunks appended meanwhile do not show up half way.
+ */
+static int handle_ride_read(conn_t *conn, worker_db_t *db, const char *ride_id, const char *query, const request_log_context_t *ctx) {
+    int64_t from = 0;
+    int64_t to = 0;
+    if (parse_ride_range_query(query, &from, &to) != 0) {
+        send_response_with_log_context(conn, 400, "Bad Request", "{\"error\":\"invalid range\"}", ctx);
+        return 400;
+    }
+    char key[RIDE_ID_MAX + 16];
+    snprintf(key, sizeof(key), "%s%s", RIDE_STREAM_KEY_PREFIX, ride_id);
+    list_stream_t *st = (list_stream_t *)calloc(1, sizeof(list_stream_t));
+    if (!st || build_storage_key(ctx->account_id, key, st->storage_key, sizeof(st->storage_key)) != 0 || db->shard_count <= 0) {
+        free(st);
+        send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"invalid account key\"}", ctx);
+        return 500;
+    }
+    st->shard = storage_key_shard(st->storage_key, db->shard_count);
+    st->chunked = ctx->http11;
+    st->ride = 1;
+    st->ride_from = from;
+    st->ride_to = to;
+
+    sqlite3_stmt *version_stmt = db->version_stmts[st->shard];
+    sqlite3_reset(version_stmt);
+    sqlite3_bind_text(version_stmt, 1, st->storage_key, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(version_stmt);
+    st->ride_version = rc == SQLITE_ROW ? (uint64_t)sqlite3_column_int64(version_stmt, 0) : 0;
+    sqlite3_reset(version_stmt);
+    if (rc != SQLITE_ROW) {
+        free(st);
+        if (rc != SQLITE_DONE) {
+            send_response_with_log_context(conn, 500, "Internal Server Error", "{\"error\":\"database error\"}", ctx);
+            return 500;
+        }
+        send_response_with_log_context(conn, 404, "Not Found", "{\"error\":\"unknown stream\"}", ctx);
+        return 404;
+    }
+    if (conn->parse.if_none_match.len > 0 && if_none_match_hits(conn->buf, conn->parse.if_none_match, st->ride_version, NULL)) {
+        send_not_modified(conn, st->ride_version, 0, ctx);
+        free(st);
+        log_info("RIDE READ key=%s status=not_modified account=%s logid=%s", key, ctx->account_id, ctx->log_id);
+        return 304;
+    }
+    if (conn->parse.accept.len > 0) {
+        char accept[256];
+        copy_span(conn->buf, conn->parse.accept, accept, sizeof(accept));
+        st->ride_binary = header_value_has_token(accept, "application/octet-stream");
+    }
+
+    char etag[32];
+    int keep_alive = ctx->keep_alive && st->chunked;
+    char head[HEADER_BUF_SIZE];
+    int head_len = format_etag(etag, sizeof(etag), st->ride_version, 0) < 0 ? -1 : snprintf(
+        head,
+        sizeof(head),
+        "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nETag: %s\r\n%s%s%s%sConnection: %s\r\n\r\n",
+        st->ride_binary ? "application/octet-stream" : "application/x-ndjson",
+        etag,
+        st->chunked ? "Transfer-Encoding: chunked\r\n" : "",
+        ctx->log_id[0] != '\0' ? "X-Log-Id: " : "",
+        ctx->log_id,
+        ctx->log_id[0] != '\0' ? "\r\n" : "",
+        keep_alive ? "keep-alive" : "close");
+    if (!keep_alive) conn->close_after_flush = 1;
+    int stream_rc = -1;
+    if (head_len > 0 && (size_t)head_len < sizeof(head) &&
+        conn_output_append(conn, shared_buf_copy(head, (size_t)head_len), 0, (size_t)head_len) == 0) {
+        conn->stream = st;
+        st = NULL;
+        stream_rc = conn_stream_resume(db, conn) < 0 ? -1 : 0;
+    }
+    free(st);
+    if (stream_rc != 0) {
+        /* The status line may already be queued; a truncated body is all that is left. */
+        conn_stream_free(conn);
+        conn->close_after_flush = 1;
+        log_error("RIDE READ key=%s status=aborted account=%s logid=%s", key, ctx->account_id, ctx->log_id);
+        return 500;
+    }
+    log_info("RIDE READ key=%s from=%lld account=%s logid=%s", key, (long long)from, ctx->account_id, ctx->log_id);
+    return 200;
+}
+
+static void handle_request(
+    conn_t *conn,
+    worker_db_t *db,
+    const char *method,
+    const char *path,
+    const char *body,
+    size_t body_len,
+    const request_log_context_t *log_ctx) {
     if (strcmp(path, "/health") == 0 && strcmp(method, "GET") == 0) {
-        send_response_with_log_context(fd, 200, "OK", "{\"status\":\"ok\"}", &log_ctx);
-        log_http_request(method, path, 200, 0, &log_ctx);
-        return 1;
+        send_response_with_log_context(conn, 200, "OK", "{\"status\":\"ok\"}", log_ctx);
+        log_http_request(method, path, 200, 0, log_ctx);
+        return;
     }
 
     if ((strcmp(path, "/debug/write-queue") == 0 || strcmp(path, "/v1/debug/write-queue") == 0) &&
         strcmp(method, "GET") == 0) {
-        int status = handle_get_write_queue_diagnostics(fd, &log_ctx);
-        log_http_request(method, path, status, 0, &log_ctx);
-        return 1;
+        int status = handle_get_write_queue_diagnostics(conn, log_ctx);
+        log_http_request(method, path, status, 0, log_ctx);
+        return;
+    }
+
+    if (strcmp(path, "/metrics") == 0 && strcmp(method, "GET") == 0) {
+        int status = handle_get_metrics(conn, log_ctx);
+        log_http_request(method, path, status, 0, log_ctx);
+        return;
+    }
+
+    if ((strcmp(path, "/debug/cache") == 0 || strcmp(path, "/v1/debug/cache") == 0) && strcmp(method, "GET") == 0) {
+        int status = handle_get_cache_diagnostics(conn, log_ctx);
+        log_http_request(method, path, status, 0, log_ctx);
+        return;
+    }
+
+    if (is_batch_path(path) && (strcmp(method, "GET") == 0 || strcmp(method, "POST") == 0)) {
+        int status = 401;
+        if (log_ctx->account_id[0] == '\0') {
+            send_response_with_log_context(conn, 401, "Unauthorized", "{\"error\":\"missing X-Account-Id\"}", log_ctx);
+        } else if (strcmp(method, "GET") == 0) {
+            const char *query = strchr(path, '?');
+            status = handle_batch_get(conn, db, query ? query + 1 : "", log_ctx);
+        } else {
+            char *decoded = NULL;
+            size_t decoded_len = 0;
+            status = decode_write_body(conn, REQ_BUF_SIZE, "batch", body, body_len, &decoded, &decoded_len, log_ctx);
+            if (status == 0) {
+                status = decoded ? handle_batch_write(conn, db, method, path, decoded, decoded_len, log_ctx)
+                                 : handle_batch_write(conn, db, method, path, body, body_len, log_ctx);
+            }
+            free(decoded);
+        }
+        if (status != 0) log_http_request(method, path, status, body_len, log_ctx);
+        return;
+    }
+
+    if (is_changes_path(path) && strcmp(method, "GET") == 0) {
+        int status = 401;
+        if (log_ctx->account_id[0] == '\0') {
+            send_response_with_log_context(conn, 401, "Unauthorized", "{\"error\":\"missing X-Account-Id\"}", log_ctx);
+        } else {
+            status = handle_get_changes(conn, db, path, log_ctx);
+        }
+        if (status != 0) log_http_request(method, path, status, 0, log_ctx);
+        return;
+    }
+
+    if (is_streams_path(path)) {
+        char ride_id[RIDE_ID_MAX + 1];
+        const char *query = strchr(path, '?');
+        int status = 401;
+        if (strcmp(method, "GET") != 0 && strcmp(method, "POST") != 0) {
+            send_response_with_log_context(conn, 405, "Method Not Allowed", "{\"error\":\"method not allowed\"}", log_ctx);
+            status = 405;
+        } else if (parse_ride_path(path, ride_id, sizeof(ride_id)) != 0) {
+            send_response_with_log_context(conn, 404, "Not Found", "{\"error\":\"unknown stream\"}", log_ctx);
+            status = 404;
+        } else if (log_ctx->account_id[0] == '\0') {
+            send_response_with_log_context(conn, 401, "Unauthorized", "{\"error\":\"missing X-Account-Id\"}", log_ctx);
+        } else if (strcmp(method, "GET") == 0) {
+            status = handle_ride_read(conn, db, ride_id, query ? query + 1 : "", log_ctx);
+        } else {
+            char *decoded = NULL;
+            size_t decoded_len = 0;
+            status = decode_write_body(conn, RIDE_CHUNK_MAX_BYTES, ride_id, body, body_len, &decoded, &decoded_len, log_ctx);
+            if (status == 0) {
+                status = decoded ? handle_ride_write(conn, db, method, path, ride_id, decoded, decoded_len, log_ctx)
+                                 : handle_ride_write(conn, db, method, path, ride_id, body, body_len, log_ctx);
+            }
+            free(decoded);
+        }
+        if (status != 0) log_http_request(method, path, status, body_len, log_ctx);
+        return;
     }
 
     const char *prefix = "/v1/data/";
     if (strncmp(path, prefix, strlen(prefix)) != 0) {
-        send_response_with_log_context(fd, 404, "Not Found", "{\"error\":\"not found\"}", &log_ctx);
-        log_http_request(method, path, 404, 0, &log_ctx);
-        return 1;
+        send_response_with_log_context(conn, 404, "Not Found", "{\"error\":\"not found\"}", log_ctx);
+        log_http_request(method, path, 404, 0, log_ctx);
+        return;
     }
 
-    const char *key = path + strlen(prefix);
-    if (!is_valid_key(key)) {
-        send_response_with_log_context(fd, 404, "Not Found", "{\"error\":\"unknown key\"}", &log_ctx);
-        log_http_request(method, path, 404, 0, &log_ctx);
-        return 1;
+    /* "<key>:append" addresses the append operation of a list key. */
+    char key[256];
+    const char *key_path = path + strlen(prefix);
+    const char *query = strchr(key_path, '?');
+    const char *append_suffix = ":append";
+    size_t key_len = query ? (size_t)(query - key_path) : strlen(key_path);
+    size_t suffix_len = strlen(append_suffix);
+    int append = key_len > suffix_len && strncmp(key_path + key_len - suffix_len, append_suffix, suffix_len) == 0;
+    if (append) key_len -= suffix_len;
+    if (key_len >= sizeof(key)) key_len = 0;
+    memcpy(key, key_path, key_len);
+    key[key_len] = '\0';
+    const data_key_t *desc = data_key_lookup(key, key_len);
+    if (!desc) {
+        send_response_with_log_context(conn, 404, "Not Found", "{\"error\":\"unknown key\"}", log_ctx);
+        log_http_request(method, path, 404, 0, log_ctx);
+        return;
     }
+    metrics_count_key(desc->id);
 
-    if (log_ctx.account_id[0] == '\0') {
-        send_response_with_log_context(fd, 401, "Unauthorized", "{\"error\":\"missing X-Account-Id\"}", &log_ctx);
-        log_http_request(method, path, 401, 0, &log_ctx);
-        return 1;
+    if (log_ctx->account_id[0] == '\0') {
+        send_response_with_log_context(conn, 401, "Unauthorized", "{\"error\":\"missing X-Account-Id\"}", log_ctx);
+        log_http_request(method, path, 401, 0, log_ctx);
+        return;
     }
 
-    if (strcmp(method, "GET") == 0) {
-        int status = handle_get_data(fd, db, key, &log_ctx);
-        log_http_request(method, path, status, 0, &log_ctx);
-        return 1;
+    if (!append && strcmp(method, "GET") == 0) {
+        int status = query && query[1] != '\0' ? handle_get_list_page(conn, db, desc, key, query + 1, log_ctx)
+                                                : handle_get_data(conn, db, desc, key, log_ctx);
+        log_http_request(method, path, status, 0, log_ctx);
+        return;
     }
 
-    if (strcmp(method, "PUT") == 0) {
-        int content_length = read_content_length(conn->buf, header_end);
-        if (content_length < 0 || (size_t)content_length > REQ_BUF_SIZE - header_len) {
-            send_response_with_log_context(fd, 400, "Bad Request", "{\"error\":\"invalid content length\"}", &log_ctx);
-            log_http_request(method, path, 400, 0, &log_ctx);
-            return 1;
-        }
-        if ((size_t)content_length > conn->len - header_len) {
-            return 0;
+    int op = -1;
+    if (append) {
+        op = strcmp(method, "POST") == 0 ? WRITE_OP_APPEND : -1;
+    } else if (strcmp(method, "PUT") == 0) {
+        op = WRITE_OP_PUT;
+    } else if (strcmp(method, "PATCH") == 0) {
+        op = WRITE_OP_PATCH;
+    }
+    if (op >= 0) {
+        char *decoded = NULL;
+        size_t decoded_len = 0;
+        int status = decode_write_body(conn, desc->max_bytes, key, body, body_len, &decoded, &decoded_len, log_ctx);
+        if (status == 0) {
+            status = decoded ? handle_write_data(conn, db, method, path, desc, key, op, decoded, decoded_len, log_ctx)
+                             : handle_write_data(conn, db, method, path, desc, key, op, body, body_len, log_ctx);
         }
+        free(decoded);
+        if (status != 0) log_http_request(method, path, status, body_len, log_ctx);
+        return;
+    }
+
+    send_response_with_log_context(conn, 405, "Method Not Allowed", "{\"error\":\"method not allowed\"}", log_ctx);
+    log_http_request(method, path, 405, 0, log_ctx);
+}
+
+/*
+ * Decides, from the headers alone, whether a write may send its body. A
+ * write is turned away before its body is read when the worker already
+ * receives as many large bodies as it allows, its buffer budget cannot hold
+ * this one, the shard's queue has no room for Content-Length more bytes, or
+ * the account is over its rate. Returns 0 on admission, else the status to
+ * answer with, along with its body and Retry-After.
+ */
+static int is_write_request(const char *method, const char *path) {
+    int route = request_route(method, path);
+    return route == METRICS_ROUTE_DATA_PUT || route == METRICS_ROUTE_DATA_PATCH || route == METRICS_ROUTE_BATCH_WRITE ||
+           route == METRICS_ROUTE_STREAM_WRITE || (route == METRICS_ROUTE_DATA_APPEND && strcmp(method, "POST") == 0);
+}
 
-        char *body = conn->buf + header_len;
-        body[content_length] = '\0';
-        int status = handle_put_data(fd, db, key, body, (size_t)content_length, &log_ctx);
-        log_http_request(method, path, status, (size_t)content_length, &log_ctx);
-        return 1;
+static int admit_request(conn_t *conn, worker_db_t *db, const char *method, const char *path, const char *account_id,
+                         const char **out_body, int *out_retry_after_s) {
+    int write = is_write_request(method, path);
+    conn->admission = CONN_ADMISSION_ADMITTED;
+    if (!write || account_id[0] == '\0') return 0;
+
+    size_t content_length = conn->parse.content_length;
+    int large = content_length >= ADMISSION_LARGE_BODY_BYTES && db->pool && db->max_large_uploads > 0;
+    *out_retry_after_s = 1;
+    if (large && db->large_uploads >= db->max_large_uploads) {
+        *out_body = "{\"error\":\"too many uploads\"}";
+        return 503;
+    }
+    if (db->pool && !conn_pool_can_grow(db->pool, conn, conn->parse.header_len + content_length)) {
+        *out_body = "{\"error\":\"server busy\"}";
+        return 503;
+    }
+    if (!write_dispatch_has_room(account_id, content_length)) {
+        *out_body = "{\"error\":\"write queue full\"}";
+        return 503;
+    }
+    if (admission_take_write(account_id, out_retry_after_s) != 0) {
+        *out_body = "{\"error\":\"rate limited\"}";
+        return 429;
     }
+    if (large) {
+        db->large_uploads++;
+        conn->admission = CONN_ADMISSION_LARGE;
+    }
+    return 0;
+}
 
-    send_response_with_log_context(fd, 405, "Method Not Allowed", "{\"error\":\"method not allowed\"}", &log_ctx);
-    log_http_request(method, path, 405, 0, &log_ctx);
+void conn_admission_release(worker_db_t *db, conn_t *conn) {
+    if (conn->admission == CONN_ADMISSION_LARGE && db && db->large_uploads > 0) db->large_uploads--;
+    conn->admission = CONN_ADMISSION_PENDING;
+}
+
+static int flush_response(int fd, conn_t *conn) {
+    if (conn_output_flush(fd, conn) < 0) {
+        conn_output_reset(conn);
+        conn->close_after_flush = 1;
+    }
+    if (conn->close_after_flush) conn->keep_alive = 0;
     return 1;
 }
+
+/*
+ * Returns 0 while the request is incomplete and 1 once a response was
+ * queued. On 1, the request's bytes were consumed from conn->buf (any
+ * pipelined remainder is moved to the front), as much of the response as
+ * the socket accepts has been written, and conn->keep_alive says whether the
+ * connection may be reused. Anything left in the output queue is flushed by
+ * the event loop when the socket becomes writable. Returns 2 when the
+ * request was consumed but is a write whose response waits for its
+ * completion; try_complete_write then finishes it as if it had returned 1.
+ * It also returns 2 for a change read parked in conn->watch, which
+ * conn_watch_poll finishes (an event stream, whose headers are already
+ * out, never does).
+ */
+int try_process_client(int fd, worker_db_t *db, conn_t *conn) {
+    http_parse_state_t *parse = &conn->parse;
+    uint64_t parse_start = metrics_now_ns();
+    int parse_rc = http_parse_request(parse, conn->buf, conn->len);
+    metrics_observe_stage(METRICS_STAGE_PARSE, parse_start);
+    /* Once the headers are in, a write's body is only read if it is admitted. */
+    if (parse_rc == HTTP_PARSE_INCOMPLETE && (parse->header_len == 0 || conn->admission != CONN_ADMISSION_PENDING)) return 0;
+    conn->keep_alive = 0;
+
+    request_log_context_t log_ctx = build_request_log_context(conn->buf, parse);
+    if (parse_rc == HTTP_PARSE_HEADER_TOO_LARGE) {
+        send_response_with_log_context(conn, 431, "Request Header Fields Too Large", "{\"error\":\"headers too large\"}", &log_ctx);
+        log_http_request("UNKNOWN", "/", 431, 0, &log_ctx);
+        return flush_response(fd, conn);
+    }
+
+    char method[8] = {0};
+    char path[512] = {0};
+    char version[16] = {0};
+    if (parse_rc == HTTP_PARSE_BAD_REQUEST_LINE || parse->method.len >= sizeof(method) || parse->path.len >= sizeof(path)) {
+        send_response_with_log_context(conn, 400, "Bad Request", "{\"error\":\"malformed request line\"}", &log_ctx);
+        log_http_request("UNKNOWN", "/", 400, 0, &log_ctx);
+        return flush_response(fd, conn);
+    }
+    copy_span(conn->buf, parse->method, method, sizeof(method));
+    copy_span(conn->buf, parse->path, path, sizeof(path));
+    copy_span(conn->buf, parse->version, version, sizeof(version));
+
+    /* Where the body ends is unknown, so nothing after it can be read as a request. */
+    if (parse_rc == HTTP_PARSE_BAD_CONTENT_LENGTH) {
+        conn->close_after_flush = 1;
+        send_response_with_log_context(conn, 400, "Bad Request", "{\"error\":\"invalid content length\"}", &log_ctx);
+        log_http_request(method, path, 400, 0, &log_ctx);
+        return flush_response(fd, conn);
+    }
+    if (parse_rc == HTTP_PARSE_TRANSFER_ENCODING) {
+        conn->close_after_flush = 1;
+        send_response_with_log_context(conn, 501, "Not Implemented", "{\"error\":\"transfer encoding not supported\"}", &log_ctx);
+        log_http_request(method, path, 501, 0, &log_ctx);
+        return flush_response(fd, conn);
+    }
+
+    log_ctx.keep_alive = request_wants_keep_alive(conn->buf, parse, version);
+    log_ctx.http11 = strcmp(version, "HTTP/1.1") == 0;
+    if (conn->max_requests > 0 && conn->requests_served + 1 >= conn->max_requests) {
+        log_ctx.keep_alive = 0;
+    }
+
+    size_t content_length = parse->content_length;
+    if (conn->admission == CONN_ADMISSION_PENDING && replication_is_follower() && is_write_request(method, path)) {
+        /* A follower only applies what the primary sends; 307 keeps the method and body for the retry there. */
+        log_ctx.keep_alive = 0;
+        conn->close_after_flush = 1;
+        const char *primary_url = replication_primary_url();
+        int status = 503;
+        char extra[sizeof(path) + 288];
+        if (primary_url[0] != '\0' && snprintf(extra, sizeof(extra), "Location: %s%s\r\n", primary_url, path) < (int)sizeof(extra)) {
+            status = 307;
+            send_response_with_headers(conn, 307, "Temporary Redirect", "{\"error\":\"read-only replica\"}", extra, &log_ctx);
+        } else {
+            send_response_with_log_context(conn, 503, "Service Unavailable", "{\"error\":\"read-only replica\"}", &log_ctx);
+        }
+        log_http_request(method, path, status, content_length, &log_ctx);
+        return flush_response(fd, conn);
+    }
+    if (conn->admission == CONN_ADMISSION_PENDING) {
+        const char *reject_body = NULL;
+        int retry_after_s = 1;
+        int status = admit_request(conn, db, method, path, log_ctx.account_id, &reject_body, &retry_after_s);
+        if (status != 0) {
+            /* The unread body stays in the way of any later request. */
+            log_ctx.keep_alive = 0;
+            conn->close_after_flush = 1;
+            send_retry_after(conn, status, status == 429 ? "Too Many Requests" : "Service Unavailable", reject_body, retry_after_s, &log_ctx);
+            log_http_request(method, path, status, content_length, &log_ctx);
+            return flush_response(fd, conn);
+        }
+    }
+    if (parse_rc == HTTP_PARSE_INCOMPLETE) return 0;
+
+    char *body = conn->buf + parse->header_len;
+    char saved = body[content_length];
+    body[content_length] = '\0';
+    handle_request(conn, db, method, path, body, content_length, &log_ctx);
+    body[content_length] = saved;
+    conn_admission_release(db, conn);
+
+    size_t consumed = parse->header_len + content_length;
+    if (consumed < conn->len) {
+        memmove(conn->buf, conn->buf + consumed, conn->len - consumed);
+    }
+    conn->len -= consumed;
+    http_parse_reset(parse);
+    conn->requests_served++;
+    conn->keep_alive = log_ctx.keep_alive;
+    if (conn->pending_write) return 2;
+    if (conn->watch) {
+        flush_response(fd, conn);
+        return 2;
+    }
+    return flush_response(fd, conn);
+}
+
+int try_complete_write(int fd, conn_t *conn, const write_dispatch_result_t *result) {
+    pending_write_t *pending = conn->pending_write;
+    if (!pending) return 0;
+    conn->pending_write = NULL;
+    int status = finish_write(conn, pending->key, pending->payload_len, pending->ack, result, &pending->ctx);
+    log_http_request(pending->method, pending->path, status, pending->payload_len, &pending->ctx);
+    conn->keep_alive = pending->ctx.keep_alive;
+    free(pending);
+    return flush_response(fd, conn);
+}
+
+void conn_pending_write_free(conn_t *conn) {
+    free(conn->pending_write);
+    conn->pending_write = NULL;
+}
+
+int conn_watch_poll(int fd, conn_t *conn, int64_t now_ms, int64_t *out_due_ms) {
+    change_watch_t *watch = conn->watch;
+    if (!watch) return 0;
+    *out_due_ms = watch->deadline_ms;
+    int due = now_ms >= watch->deadline_ms;
+    if (!due && change_feed_last_seq() == watch->cursor) return 0;
+
+    if (watch->sse) {
+        /* A client that does not keep up is left behind; past the window it gets a reset. */
+        if (conn->out_bytes > LIST_STREAM_HIGH_WATER) return 0;
+        uint64_t cursor = watch->cursor;
+        if (advance_change_stream(conn, watch) != 0) return -1;
+        if (watch->cursor == cursor && due) {
+            if (conn_output_append(conn, shared_buf_copy(": keepalive\n\n", 13), 0, 13) != 0) return -1;
+        }
+        if (due || watch->cursor != cursor) watch->deadline_ms = now_ms + CHANGES_HEARTBEAT_MS;
+        *out_due_ms = watch->deadline_ms;
+        return conn_output_flush(fd, conn) < 0 ? -1 : 0;
+    }
+
+    change_feed_entry_t *entries = (change_feed_entry_t *)malloc(sizeof(change_feed_entry_t) * CHANGES_PAGE_MAX);
+    uint64_t next = watch->cursor;
+    int count = entries ? change_feed_read(watch->prefix, watch->cursor, entries, CHANGES_PAGE_MAX, &next) : -2;
+    if (count == 0 && !due) {
+        free(entries);
+        watch->cursor = next;
+        return 0;
+    }
+    conn->watch = NULL;
+    int status = respond_changes(conn, entries, count, next, &watch->ctx);
+    free(entries);
+    log_http_request("GET", watch->path, status, 0, &watch->ctx);
+    conn->keep_alive = watch->ctx.keep_alive;
+    free(watch);
+    flush_response(fd, conn);
+    return 0;
+}
+
+void conn_watch_free(conn_t *conn) {
+    free(conn->watch);
+    conn->watch = NULL;
+}
@@ -0,0 +1,195 @@
+#include "server_internal.h"
+
+#include <string.h>
+#include <strings.h>
+
+void http_parse_reset(http_parse_state_t *st) {
+    memset(st, 0, sizeof(*st));
+}
+
+static int span_is(const char *start, const char *end, const char *name) {
+    size_t name_len = strlen(name);
+    return (size_t)(end - start) == name_len && strncasecmp(start, name, name_len) == 0;
+}
+
+static http_span_t make_span(const char *buf, const char *start, const char *end) {
+    http_span_t span;
+    span.off = (size_t)(start - buf);
+    span.len = (size_t)(end - start);
+    return span;
+}
+
+static int parse_request_line(http_parse_state_t *st, const char *buf, const char *line, const char *line_end) {
+    const char *p = line;
+    const char *method = p;
+    while (p < line_end && *p != ' ') p++;
+    if (p == method || p == line_end) return -1;
+    st->method = make_span(buf, method, p);
+
+    while (p < line_end && *p == ' ') p++;
+    const char *path = p;
+    while (p < line_end && *p != ' ') p++;
+    if (p == path) return -1;
+    st->path = make_span(buf, path, p);
+
+    while (p < line_end && *p == ' ') p++;
+    const char *version = p;
+    while (p < line_end && *p != ' ') p++;
+    st->version = make_span(buf, version, p);
+    return 0;
+}
+
+static int parse_length_span(const char *buf, http_span_t span, size_t *out_value) {
+    const char *p = buf + span.off;
+    const char *end = p + span.len;
+    size_t value = 0;
+    for (; p < end; p++) {
+        if (*p < '0' || *p > '9') return -1;
+        value = value * 10 + (size_t)(*p - '0');
+        if (value > REQ_BUF_SIZE) return -1;
+    }
+    *out_value = value;
+    return 0;
+}
+
+static int parse_content_length(http_parse_state_t *st, const char *buf) {
+    if (st->content_length_value.len == 0) return 0;
+    size_t value = 0;
+    if (parse_length_span(buf, st->content_length_value, &value) != 0) return -1;
+    if (value > REQ_BUF_SIZE - st->header_len) return -1;
+    st->content_length = value;
+    return 0;
+}
+
+/*
+ * Walks the complete header block once and records the spans the server
+ * cares about. Unknown headers are skipped without copying. A repeated
+ * header keeps its first value, except that Content-Length values must
+ * agree: either disagreement or any Transfer-Encoding would leave the
+ * body's end ambiguous, and a connection that guesses can be fed a
+ * smuggled request.
+ */
+static int parse_header_block(http_parse_state_t *st, const char *buf, const char *block_end) {
+    const char *line = buf;
+    const char *line_end = memchr(line, '\r', (size_t)(block_end - line));
+    if (!line_end) line_end = block_end;
+    if (parse_request_line(st, buf, line, line_end) != 0) return HTTP_PARSE_BAD_REQUEST_LINE;
+
+    int conflicting_length = 0;
+    int transfer_encoding = 0;
+    line = line_end + 2;
+    while (line < block_end) {
+        line_end = memchr(line, '\r', (size_t)(block_end - line));
+        if (!line_end) line_end = block_end;
+
+        const char *colon = memchr(line, ':', (size_t)(line_end - line));
+        if (colon) {
+            const char *value = colon + 1;
+            while (value < line_end && (*value == ' ' || *value == '\t')) value++;
+            const char *value_end = line_end;
+            while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+
+            http_span_t *slot = NULL;
+            switch (colon - line) {
+                case 6:
+                    if (span_is(line, colon, "Accept")) slot = &st->accept;
+                    break;
+                case 8:
+                    if (span_is(line, colon, "X-Log-Id")) {
+                        slot = &st->log_id;
+                    } else if (span_is(line, colon, "If-Match")) {
+                        slot = &st->if_match;
+                    }
+                    break;
+                case 10:
+                    if (span_is(line, colon, "Connection")) slot = &st->connection;
+                    break;
+                case 12:
+                    if (span_is(line, colon, "X-Account-Id")) {
+                        slot = &st->account_id;
+                    } else if (span_is(line, colon, "Content-Type")) {
+                        slot = &st->content_type;
+                    }
+                    break;
+                case 13:
+                    if (span_is(line, colon, "If-None-Match")) {
+                        slot = &st->if_none_match;
+                    } else if (span_is(line, colon, "Last-Event-ID")) {
+                        slot = &st->last_event_id;
+                    } else if (span_is(line, colon, "X-Chunk-CRC32")) {
+                        slot = &st->chunk_crc32;
+                    }
+                    break;
+                case 14:
+                    if (span_is(line, colon, "Content-Length")) {
+                        size_t first = 0;
+                        size_t repeat = 0;
+                        if (st->content_length_value.len > 0 &&
+                            (parse_length_span(buf, st->content_length_value, &first) != 0 ||
+                             parse_length_span(buf, make_span(buf, value, value_end), &repeat) != 0 || first != repeat)) {
+                            conflicting_length = 1;
+                        }
+                        slot = &st->content_length_value;
+                    }
+                    break;
+                case 15:
+                    if (span_is(line, colon, "X-Retry-Attempt")) {
+                        slot = &st->retry_attempt;
+                    } else if (span_is(line, colon, "Accept-Encoding")) {
+                        slot = &st->accept_encoding;
+                    }
+                    break;
+                case 16:
+                    if (span_is(line, colon, "Content-Encoding")) slot = &st->content_encoding;
+                    break;
+                case 17:
+                    if (span_is(line, colon, "Transfer-Encoding")) transfer_encoding = 1;
+                    break;
+                default:
+                    break;
+            }
+            if (slot && slot->len == 0) *slot = make_span(buf, value, value_end);
+        }
+        line = line_end + 2;
+    }
+
+    if (transfer_encoding) return HTTP_PARSE_TRANSFER_ENCODING;
+    if (conflicting_length || parse_content_length(st, buf) != 0) return HTTP_PARSE_BAD_CONTENT_LENGTH;
+    return HTTP_PARSE_INCOMPLETE;
+}
+
+/*
+ * Advances the parser over buf[0..len). Bytes already scanned on a previous
+ * call are not looked at again: the header terminator search resumes at
+ * scan_off, and once the header block is parsed only the body length is
+ * compared. Returns HTTP_PARSE_DONE when header and body are both buffered.
+ */
+int http_parse_request(http_parse_state_t *st, const char *buf, size_t len) {
+    if (st->header_len == 0) {
+        size_t pos = st->scan_off;
+        const char *found = NULL;
+        while (pos < len) {
+            const char *nl = memchr(buf + pos, '\n', len - pos);
+            if (!nl) break;
+            size_t at = (size_t)(nl - buf);
+            if (at >= 3 && buf[at - 1] == '\r' && buf[at - 2] == '\n' && buf[at - 3] == '\r') {
+                found = nl + 1;
+                break;
+            }
+            pos = at + 1;
+        }
+        if (!found) {
+            st->scan_off = len;
+            if (len > HTTP_HEADER_MAX) return HTTP_PARSE_HEADER_TOO_LARGE;
+            return HTTP_PARSE_INCOMPLETE;
+        }
+
+        st->header_len = (size_t)(found - buf);
+        st->scan_off = st->header_len;
+        int rc = parse_header_block(st, buf, found - 4);
+        if (rc != HTTP_PARSE_INCOMPLETE) return rc;
+    }
+
+    if (len - st->header_len < st->content_length) return HTTP_PARSE_INCOMPLETE;
+    return HTTP_PARSE_DONE;
+}
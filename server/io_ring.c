@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+
+#include "server_internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define FRICU_HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef FRICU_HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * A minimal io_uring wrapper over the raw syscalls: one submission and one
+ * completion ring mapped from the kernel, plus a ring of provided receive
+ * buffers (buffer group 0) that recv picks from. SQEs are only queued by
+ * the io_ring_prep_* calls and reach the kernel on the next io_ring_wait,
+ * so one io_uring_enter carries everything a loop iteration produced.
+ */
+struct io_ring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    struct io_uring_sqe *sqes;
+    /* SQEs handed out so far; the kernel has consumed up to *sq_head. */
+    unsigned sqe_tail;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_len;
+    char *bufs;
+    unsigned buf_count;
+    size_t buf_size;
+    unsigned short buf_tail;
+};
+
+static int ring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void buf_ring_add(io_ring_t *ring, unsigned id) {
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (ring->buf_count - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)id * ring->buf_size);
+    buf->len = (uint32_t)ring->buf_size;
+    buf->bid = (uint16_t)id;
+    ring->buf_tail++;
+}
+
+static void buf_ring_publish(io_ring_t *ring) {
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+void io_ring_destroy(io_ring_t *ring) {
+    if (!ring) return;
+    if (ring->buf_ring) munmap(ring->buf_ring, ring->buf_ring_len);
+    if (ring->bufs) munmap(ring->bufs, (size_t)ring->buf_count * ring->buf_size);
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_map && ring->cq_map != ring->sq_map) munmap(ring->cq_map, ring->cq_map_len);
+    if (ring->sq_map) munmap(ring->sq_map, ring->sq_map_len);
+    if (ring->fd >= 0) close(ring->fd);
+    free(ring);
+}
+
+io_ring_t *io_ring_create(unsigned entries, unsigned buf_count, size_t buf_size) {
+    if (entries == 0 || buf_count == 0 || (buf_count & (buf_count - 1)) != 0 || buf_count > 32768 || buf_size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    io_ring_t *ring = (io_ring_t *)calloc(1, sizeof(io_ring_t));
+    if (!ring) return NULL;
+    ring->fd = -1;
+
+    /*
+     * Only the owning worker submits, so the kernel may defer completion
+     * work to our io_uring_enter; older kernels reject those flags.
+     */
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 8;
+#if defined(IORING_SETUP_SINGLE_ISSUER) && defined(IORING_SETUP_DEFER_TASKRUN)
+    p.flags |= IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+#endif
+    ring->fd = ring_setup(entries, &p);
+    if (ring->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = entries * 8;
+        ring->fd = ring_setup(entries, &p);
+    }
+    if (ring->fd < 0) goto fail;
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)) {
+        errno = ENOTSUP;
+        goto fail;
+    }
+
+    ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_map_len > ring->sq_map_len) ring->sq_map_len = ring->cq_map_len;
+        ring->cq_map_len = ring->sq_map_len;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED) {
+        ring->sq_map = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_map = ring->sq_map;
+    } else {
+        ring->cq_map = mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_map == MAP_FAILED) {
+            ring->cq_map = NULL;
+            goto fail;
+        }
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    char *sq = (char *)ring->sq_map;
+    char *cq = (char *)ring->cq_map;
+    ring->sq_entries = p.sq_entries;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sqe_tail = *ring->sq_tail;
+    /* An identity index array: SQE i always sits in slot i. */
+    unsigned *array = (unsigned *)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) array[i] = i;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    ring->buf_count = buf_count;
+    ring->buf_size = buf_size;
+    ring->buf_ring_len = buf_count * sizeof(struct io_uring_buf);
+    ring->buf_ring = (struct io_uring_buf_ring *)mmap(NULL, ring->buf_ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED) {
+        ring->buf_ring = NULL;
+        goto fail;
+    }
+    ring->bufs = (char *)mmap(NULL, (size_t)buf_count * buf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->bufs == MAP_FAILED) {
+        ring->bufs = NULL;
+        goto fail;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = buf_count;
+    reg.bgid = 0;
+    if (ring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) goto fail;
+    for (unsigned i = 0; i < buf_count; i++) buf_ring_add(ring, i);
+    buf_ring_publish(ring);
+    return ring;
+
+fail: {
+    int saved = errno;
+    io_ring_destroy(ring);
+    errno = saved;
+    return NULL;
+}
+}
+
+/* Submits what is queued; with wait, also blocks for one completion or timeout_ms. */
+static int ring_enter(io_ring_t *ring, int wait, int timeout_ms) {
+    unsigned to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (wait && timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000LL;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    /* GETEVENTS even when not waiting, so deferred completion work runs. */
+    unsigned flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    int rc = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, wait ? 1 : 0, flags, &arg, sizeof(arg));
+    if (rc < 0 && (errno == ETIME || errno == EINTR)) return 0;
+    return rc < 0 ? -1 : 0;
+}
+
+static struct io_uring_sqe *ring_sqe(io_ring_t *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sqe_tail - head >= ring->sq_entries) {
+        if (ring_enter(ring, 0, 0) != 0) return NULL;
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (ring->sqe_tail - head >= ring->sq_entries) return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqe_tail++;
+    return sqe;
+}
+
+int io_ring_prep_accept_multishot(io_ring_t *ring, int listen_fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = ring_sqe(ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int io_ring_prep_recv(io_ring_t *ring, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = ring_sqe(ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int io_ring_prep_poll(io_ring_t *ring, int fd, unsigned events, int multishot, uint64_t user_data) {
+    struct io_uring_sqe *sqe = ring_sqe(ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int io_ring_prep_cancel(io_ring_t *ring, uint64_t target, uint64_t user_data) {
+    struct io_uring_sqe *sqe = ring_sqe(ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int io_ring_prep_close(io_ring_t *ring, int fd, uint64_t user_data) {
+    struct io_uring_sqe *sqe = ring_sqe(ring);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    return 0;
+}
+
+int io_ring_wait(io_ring_t *ring, int timeout_ms) {
+    int ready = *ring->cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    return ring_enter(ring, !ready, timeout_ms);
+}
+
+int io_ring_next(io_ring_t *ring, io_ring_cqe_t *out) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+    const struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    out->user_data = cqe->user_data;
+    out->res = cqe->res;
+    out->more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+    out->buf = NULL;
+    out->buf_id = -1;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        out->buf_id = (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        out->buf = ring->bufs + (size_t)out->buf_id * ring->buf_size;
+    }
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+void io_ring_recycle(io_ring_t *ring, int buf_id) {
+    if (buf_id < 0) return;
+    buf_ring_add(ring, (unsigned)buf_id);
+    buf_ring_publish(ring);
+}
+
+#else
+
+io_ring_t *io_ring_create(unsigned entries, unsigned buf_count, size_t buf_size) {
+    (void)entries;
+    (void)buf_count;
+    (void)buf_size;
+    errno = ENOSYS;
+    return NULL;
+}
+
+void io_ring_destroy(io_ring_t *ring) {
+    (void)ring;
+}
+
+int io_ring_prep_accept_multishot(io_ring_t *ring, int listen_fd, uint64_t user_data) {
+    (void)ring;
+    (void)listen_fd;
+    (void)user_data;
+    return -1;
+}
+
+int io_ring_prep_recv(io_ring_t *ring, int fd, uint64_t user_data) {
+    (void)ring;
+    (void)fd;
+    (void)user_data;
+    return -1;
+}
+
+int io_ring_prep_poll(io_ring_t *ring, int fd, unsigned events, int multishot, uint64_t user_data) {
+    (void)ring;
+    (void)fd;
+    (void)events;
+    (void)multishot;
+    (void)user_data;
+    return -1;
+}
+
+int io_ring_prep_cancel(io_ring_t *ring, uint64_t target, uint64_t user_data) {
+    (void)ring;
+    (void)target;
+    (void)user_data;
+    return -1;
+}
+
+int io_ring_prep_close(io_ring_t *ring, int fd, uint64_t user_data) {
+    (void)ring;
+    (void)fd;
+    (void)user_data;
+    return -1;
+}
+
+int io_ring_wait(io_ring_t *ring, int timeout_ms) {
+    (void)ring;
+    (void)timeout_ms;
+    return -1;
+}
+
+int io_ring_next(io_ring_t *ring, io_ring_cqe_t *out) {
+    (void)ring;
+    (void)out;
+    return 0;
+}
+
+void io_ring_recycle(io_ring_t *ring, int buf_id) {
+    (void)ring;
+    (void)buf_id;
+}
+
+#endif
@@ -0,0 +1,940 @@
+#define _GNU_SOURCE
+
+#include "server_internal.h"
+#include "logger.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+/*
+ * On-disk record layout (little-endian host order, 8-byte aligned):
+ *   u32 magic | u32 crc32c | u64 seq | u64 segment_id | u32 payload_len |
+ *   u16 key_len | u16 log_id_len | u8 kind | u8 op | 6 bytes zero |
+ *   key | log_id | payload | zero padding
+ * A conditional write (kind 3) starts its payload with the i64 If-Match
+ * version it was accepted under; payload_len includes those 8 bytes.
+ * op is the WRITE_OP_* of a write record (0, a plain PUT, in records
+ * written before list operations existed). A WRITE_OP_BATCH record is keyed
+ * by the account prefix "<account>::" and carries its entries as payload;
+ * a WRITE_OP_RIDE_CHUNK record carries a ride chunk (see ride_stream.c).
+ * The CRC covers everything after the crc field. A record whose magic, CRC
+ * or segment id does not match ends the segment scan, so preallocated
+ * (zero-filled) tails and torn writes are both treated as end of log.
+ */
+#define JOURNAL_MAGIC 0x314A5246u
+#define JOURNAL_HEADER_SIZE 40
+#define JOURNAL_KIND_WRITE 1
+#define JOURNAL_KIND_CHECKPOINT 2
+#define JOURNAL_KIND_WRITE_IF 3
+#define JOURNAL_IF_MATCH_SIZE 8
+#define JOURNAL_SEGMENT_SUFFIX ".seg"
+
+typedef struct journal_segment {
+    uint64_t id;
+    int fd;
+    size_t size;
+    size_t write_off;
+    uint64_t last_seq;
+    int live;
+    char path[256];
+    struct journal_segment *next;
+} journal_segment_t;
+
+struct journal_entry {
+    uint64_t seq;
+    journal_segment_t *segment;
+    struct journal_entry *prev;
+    struct journal_entry *next;
+};
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t sync_cond;
+    int open;
+    size_t segment_bytes;
+    uint64_t next_seq;
+    uint64_t synced_seq;
+    uint64_t written_checkpoint;
+    int sync_in_progress;
+    int sync_failed;
+    journal_segment_t *segments_head;
+    journal_segment_t *segments_tail;
+    journal_entry_t *live_head;
+    journal_entry_t *live_tail;
+    long long live_records;
+    long long appended_records;
+    long long sync_count;
+} journal_t;
+
+static journal_t g_journal = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .sync_cond = PTHREAD_COND_INITIALIZER,
+    .next_seq = 1,
+    .segment_bytes = DEFAULT_JOURNAL_SEGMENT_BYTES,
+};
+
+#if !defined(__SSE4_2__) && !defined(__ARM_FEATURE_CRC32)
+static uint32_t g_crc32c_table[256];
+static pthread_once_t g_crc32c_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+        g_crc32c_table[i] = c;
+    }
+}
+#endif
+
+static uint32_t crc32c_update(uint32_t crc, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    crc = ~crc;
+#if defined(__SSE4_2__)
+    uint64_t c = crc;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c;
+    while (len--) crc = _mm_crc32_u8(crc, *p++);
+#elif defined(__ARM_FEATURE_CRC32)
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--) crc = __crc32cb(crc, *p++);
+#else
+    pthread_once(&g_crc32c_once, crc32c_init_table);
+    while (len--) crc = g_crc32c_table[(crc ^ *p++) & 0xFFu] ^ (crc >> 8);
+#endif
+    return ~crc;
+}
+
+static size_t record_size(size_t key_len, size_t log_id_len, size_t payload_len) {
+    size_t raw = JOURNAL_HEADER_SIZE + key_len + log_id_len + payload_len;
+    return (raw + 7) & ~(size_t)7;
+}
+
+static void encode_header(
+    unsigned char *out,
+    uint64_t seq,
+    uint64_t segment_id,
+    uint32_t payload_len,
+    uint16_t key_len,
+    uint16_t log_id_len,
+    uint8_t kind,
+    uint8_t op) {
+    uint32_t magic = JOURNAL_MAGIC;
+    memset(out, 0, JOURNAL_HEADER_SIZE);
+    memcpy(out + 0, &magic, 4);
+    memcpy(out + 8, &seq, 8);
+    memcpy(out + 16, &segment_id, 8);
+    memcpy(out + 24, &payload_len, 4);
+    memcpy(out + 28, &key_len, 2);
+    memcpy(out + 30, &log_id_len, 2);
+    out[32] = kind;
+    out[33] = op;
+}
+
+static int sync_fd(int fd) {
+#if defined(__APPLE__)
+    if (fcntl(fd, F_FULLFSYNC) == 0) return 0;
+    return fsync(fd);
+#else
+    return fdatasync(fd);
+#endif
+}
+
+static int sync_dir(const char *dir_path) {
+    int fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+static int ensure_journal_dir(void) {
+    struct stat st;
+    if (stat(JOURNAL_DIR, &st) == 0) return S_ISDIR(st.st_mode) ? 0 : -1;
+    if (errno != ENOENT) return -1;
+    if (mkdir(JOURNAL_DIR, 0700) != 0 && errno != EEXIST) return -1;
+    return sync_dir(".");
+}
+
+static int write_full_at(int fd, struct iovec *iov, int iovcnt, off_t off) {
+    while (iovcnt > 0) {
+        ssize_t n = pwritev(fd, iov, iovcnt, off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        off += n;
+        size_t left = (size_t)n;
+        while (iovcnt > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return 0;
+}
+
+static int preallocate(int fd, size_t size) {
+#if defined(__linux__)
+    int rc = posix_fallocate(fd, 0, (off_t)size);
+    if (rc == 0) return 0;
+    if (rc != EOPNOTSUPP && rc != EINVAL) return -1;
+#endif
+    return ftruncate(fd, (off_t)size);
+}
+
+/* Called with the journal mutex held. */
+static int roll_segment(journal_t *j, size_t need) {
+    journal_segment_t *active = j->segments_tail;
+    if (active && j->synced_seq + 1 < j->next_seq) {
+        if (sync_fd(active->fd) != 0) return -1;
+        j->synced_seq = j->next_seq - 1;
+        j->sync_count++;
+    }
+
+    journal_segment_t *seg = (journal_segment_t *)calloc(1, sizeof(journal_segment_t));
+    if (!seg) return -1;
+    seg->id = j->next_seq;
+    seg->size = need > j->segment_bytes ? need : j->segment_bytes;
+    int path_len = snprintf(seg->path, sizeof(seg->path), "%s/%020" PRIu64 "%s", JOURNAL_DIR, seg->id, JOURNAL_SEGMENT_SUFFIX);
+    if (path_len <= 0 || (size_t)path_len >= sizeof(seg->path)) {
+        free(seg);
+        return -1;
+    }
+    seg->fd = open(seg->path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (seg->fd < 0) {
+        free(seg);
+        return -1;
+    }
+    if (preallocate(seg->fd, seg->size) != 0 || sync_fd(seg->fd) != 0 || sync_dir(JOURNAL_DIR) != 0) {
+        close(seg->fd);
+        unlink(seg->path);
+        free(seg);
+        return -1;
+    }
+
+    if (j->segments_tail) {
+        j->segments_tail->next = seg;
+    } else {
+        j->segments_head = seg;
+    }
+    j->segments_tail = seg;
+    return 0;
+}
+
+static int append_locked(
+    journal_t *j,
+    uint8_t kind,
+    uint8_t op,
+    uint64_t seq,
+    const char *key,
+    size_t key_len,
+    const char *log_id,
+    size_t log_id_len,
+    const int64_t *if_match,
+    const char *payload,
+    size_t payload_len) {
+    size_t cond_len = if_match ? JOURNAL_IF_MATCH_SIZE : 0;
+    size_t size = record_size(key_len, log_id_len, cond_len + payload_len);
+    journal_segment_t *seg = j->segments_tail;
+    if (!seg || seg->write_off + size > seg->size) {
+        if (roll_segment(j, size) != 0) return -1;
+        seg = j->segments_tail;
+    }
+
+    unsigned char header[JOURNAL_HEADER_SIZE];
+    encode_header(header, seq, seg->id, (uint32_t)(cond_len + payload_len), (uint16_t)key_len, (uint16_t)log_id_len, kind, op);
+    uint32_t crc = crc32c_update(0, header + 8, JOURNAL_HEADER_SIZE - 8);
+    crc = crc32c_update(crc, key, key_len);
+    crc = crc32c_update(crc, log_id, log_id_len);
+    crc = crc32c_update(crc, if_match, cond_len);
+    crc = crc32c_update(crc, payload, payload_len);
+    memcpy(header + 4, &crc, 4);
+
+    static const char zeros[8] = {0};
+    size_t pad = size - (JOURNAL_HEADER_SIZE + key_len + log_id_len + cond_len + payload_len);
+    struct iovec iov[6];
+    int iovcnt = 0;
+    iov[iovcnt].iov_base = header;
+    iov[iovcnt++].iov_len = JOURNAL_HEADER_SIZE;
+    if (key_len > 0) {
+        iov[iovcnt].iov_base = (void *)key;
+        iov[iovcnt++].iov_len = key_len;
+    }
+    if (log_id_len > 0) {
+        iov[iovcnt].iov_base = (void *)log_id;
+        iov[iovcnt++].iov_len = log_id_len;
+    }
+    if (cond_len > 0) {
+        iov[iovcnt].iov_base = (void *)if_match;
+        iov[iovcnt++].iov_len = cond_len;
+    }
+    if (payload_len > 0) {
+        iov[iovcnt].iov_base = (void *)payload;
+        iov[iovcnt++].iov_len = payload_len;
+    }
+    if (pad > 0) {
+        iov[iovcnt].iov_base = (void *)zeros;
+        iov[iovcnt++].iov_len = pad;
+    }
+    if (write_full_at(seg->fd, iov, iovcnt, (off_t)seg->write_off) != 0) return -1;
+    seg->write_off += size;
+    return 0;
+}
+
+/*
+ * Group fsync: the first appender to find its record unsynced syncs the
+ * active segment on behalf of everyone who appended before it started;
+ * later appenders wait for that sync or start the next one.
+ */
+static int wait_durable(journal_t *j, uint64_t seq) {
+    while (j->synced_seq < seq) {
+        if (j->sync_failed) return -1;
+        if (j->sync_in_progress) {
+            pthread_cond_wait(&j->sync_cond, &j->mutex);
+            continue;
+        }
+        j->sync_in_progress = 1;
+        uint64_t target = j->next_seq - 1;
+        int fd = j->segments_tail->fd;
+        pthread_mutex_unlock(&j->mutex);
+        uint64_t sync_start = metrics_now_ns();
+        int rc = sync_fd(fd);
+        metrics_observe_stage(METRICS_STAGE_JOURNAL_FSYNC, sync_start);
+        pthread_mutex_lock(&j->mutex);
+        j->sync_in_progress = 0;
+        if (rc != 0) {
+            j->sync_failed = 1;
+            log_error("journal sync failed: errno=%d", errno);
+        } else if (target > j->synced_seq) {
+            j->synced_seq = target;
+        }
+        j->sync_count++;
+        pthread_cond_broadcast(&j->sync_cond);
+    }
+    return 0;
+}
+
+void journal_configure(const journal_config_t *config) {
+    if (!config) return;
+    pthread_mutex_lock(&g_journal.mutex);
+    g_journal.segment_bytes = config->segment_bytes >= 4096 ? config->segment_bytes : DEFAULT_JOURNAL_SEGMENT_BYTES;
+    pthread_mutex_unlock(&g_journal.mutex);
+}
+
+static int has_segment_suffix(const char *name) {
+    size_t len = strlen(name);
+    size_t suffix_len = strlen(JOURNAL_SEGMENT_SUFFIX);
+    return len > suffix_len && strcmp(name + len - suffix_len, JOURNAL_SEGMENT_SUFFIX) == 0;
+}
+
+int journal_open(void) {
+    pthread_mutex_lock(&g_journal.mutex);
+    if (g_journal.open) {
+        pthread_mutex_unlock(&g_journal.mutex);
+        return 0;
+    }
+    if (ensure_journal_dir() != 0) {
+        pthread_mutex_unlock(&g_journal.mutex);
+        log_error("failed to create journal dir %s", JOURNAL_DIR);
+        return -1;
+    }
+
+    DIR *dir = opendir(JOURNAL_DIR);
+    if (!dir) {
+        pthread_mutex_unlock(&g_journal.mutex);
+        return -1;
+    }
+    int leftover = 0;
+    struct dirent *ent = NULL;
+    while ((ent = readdir(dir)) != NULL) {
+        if (has_segment_suffix(ent->d_name)) leftover++;
+    }
+    closedir(dir);
+    if (leftover > 0) {
+        pthread_mutex_unlock(&g_journal.mutex);
+        log_error("journal has %d unreplayed segment(s); run replay before accepting writes", leftover);
+        return -1;
+    }
+
+    g_journal.synced_seq = g_journal.next_seq - 1;
+    g_journal.written_checkpoint = 0;
+    g_journal.sync_failed = 0;
+    g_journal.live_records = 0;
+    g_journal.appended_records = 0;
+    g_journal.sync_count = 0;
+    g_journal.open = 1;
+    pthread_mutex_unlock(&g_journal.mutex);
+    return 0;
+}
+
+void journal_close(void) {
+    pthread_mutex_lock(&g_journal.mutex);
+    while (g_journal.sync_in_progress) {
+        pthread_cond_wait(&g_journal.sync_cond, &g_journal.mutex);
+    }
+    journal_segment_t *seg = g_journal.segments_head;
+    while (seg) {
+        journal_segment_t *next = seg->next;
+        sync_fd(seg->fd);
+        close(seg->fd);
+        free(seg);
+        seg = next;
+    }
+    journal_entry_t *entry = g_journal.live_head;
+    while (entry) {
+        journal_entry_t *next = entry->next;
+        free(entry);
+        entry = next;
+    }
+    g_journal.segments_head = NULL;
+    g_journal.segments_tail = NULL;
+    g_journal.live_head = NULL;
+    g_journal.live_tail = NULL;
+    g_journal.open = 0;
+    pthread_mutex_unlock(&g_journal.mutex);
+}
+
+void journal_reserve_seq(uint64_t next_seq) {
+    pthread_mutex_lock(&g_journal.mutex);
+    if (!g_journal.open && next_seq > 0) g_journal.next_seq = next_seq;
+    pthread_mutex_unlock(&g_journal.mutex);
+}
+
+int journal_write(
+    const char *storage_key,
+    const char *log_id,
+    int op,
+    int64_t if_match,
+    const char *payload,
+    size_t payload_len,
+    journal_entry_t **out_entry) {
+    if (!storage_key || !log_id || !payload || !out_entry || op < WRITE_OP_PUT || op > WRITE_OP_RIDE_CHUNK) return -1;
+    size_t key_len = strlen(storage_key);
+    size_t log_id_len = strlen(log_id);
+    if (key_len > UINT16_MAX || log_id_len > UINT16_MAX || payload_len > UINT32_MAX - JOURNAL_IF_MATCH_SIZE) return -1;
+
+    journal_entry_t *entry = (journal_entry_t *)calloc(1, sizeof(journal_entry_t));
+    if (!entry) return -1;
+
+    pthread_mutex_lock(&g_journal.mutex);
+    if (!g_journal.open || g_journal.sync_failed) {
+        pthread_mutex_unlock(&g_journal.mutex);
+        free(entry);
+        return -1;
+    }
+    uint64_t seq = g_journal.next_seq;
+    uint8_t kind = if_match == WRITE_IF_MATCH_NONE ? JOURNAL_KIND_WRITE : JOURNAL_KIND_WRITE_IF;
+    const int64_t *cond = kind == JOURNAL_KIND_WRITE_IF ? &if_match : NULL;
+    if (append_locked(&g_journal, kind, (uint8_t)op, seq, storage_key, key_len, log_id, log_id_len, cond, payload, payload_len) != 0) {
+        pthread_mutex_unlock(&g_journal.mutex);
+        free(entry);
+        return -1;
+    }
+    g_journal.next_seq++;
+    g_journal.appended_records++;
+
+    journal_segment_t *seg = g_journal.segments_tail;
+    seg->last_seq = seq;
+    seg->live++;
+    entry->seq = seq;
+    entry->segment = seg;
+    entry->prev = g_journal.live_tail;
+    if (g_journal.live_tail) {
+        g_journal.live_tail->next = entry;
+    } else {
+        g_journal.live_head = entry;
+    }
+    g_journal.live_tail = entry;
+    g_journal.live_records++;
+    pthread_mutex_unlock(&g_journal.mutex);
+    *out_entry = entry;
+    return 0;
+}
+
+int journal_sync(uint64_t seq) {
+    pthread_mutex_lock(&g_journal.mutex);
+    int rc = g_journal.open ? wait_durable(&g_journal, seq) : -1;
+    pthread_mutex_unlock(&g_journal.mutex);
+    return rc;
+}
+
+int journal_append(
+    const char *storage_key,
+    const char *log_id,
+    int op,
+    int64_t if_match,
+    const char *payload,
+    size_t payload_len,
+    journal_entry_t **out_entry) {
+    journal_entry_t *entry = NULL;
+    if (journal_write(storage_key, log_id, op, if_match, payload, payload_len, &entry) != 0) return -1;
+    if (journal_sync(entry->seq) != 0) return -1;
+    *out_entry = entry;
+    return 0;
+}
+
+uint64_t journal_entry_seq(const journal_entry_t *entry) {
+    return entry ? entry->seq : 0;
+}
+
+void journal_retire(journal_entry_t *entry) {
+    if (!entry) return;
+    pthread_mutex_lock(&g_journal.mutex);
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        g_journal.live_head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        g_journal.live_tail = entry->prev;
+    }
+    entry->segment->live--;
+    g_journal.live_records--;
+    pthread_mutex_unlock(&g_journal.mutex);
+    free(entry);
+}
+
+/*
+ * Records the highest seq below which every record has been retired and
+ * deletes the oldest segments that hold nothing newer. The marker is not
+ * synced on its own; losing it only means replaying already-applied
+ * records, which converges to the same state.
+ */
+void journal_checkpoint(void) {
+    pthread_mutex_lock(&g_journal.mutex);
+    if (!g_journal.open) {
+        pthread_mutex_unlock(&g_journal.mutex);
+        return;
+    }
+    uint64_t low = g_journal.live_head ? g_journal.live_head->seq - 1 : g_journal.next_seq - 1;
+    if (low > g_journal.written_checkpoint) {
+        if (append_locked(&g_journal, JOURNAL_KIND_CHECKPOINT, 0, low, NULL, 0, NULL, 0, NULL, NULL, 0) == 0) {
+            g_journal.written_checkpoint = low;
+        }
+    }
+
+    int removed = 0;
+    while (g_journal.segments_head && g_journal.segments_head != g_journal.segments_tail &&
+           g_journal.segments_head->live == 0 && g_journal.segments_head->last_seq <= low) {
+        journal_segment_t *seg = g_journal.segments_head;
+        g_journal.segments_head = seg->next;
+        close(seg->fd);
+        unlink(seg->path);
+        free(seg);
+        removed++;
+    }
+    if (removed > 0) sync_dir(JOURNAL_DIR);
+    pthread_mutex_unlock(&g_journal.mutex);
+}
+
+void journal_stats_snapshot(journal_stats_t *out_stats) {
+    if (!out_stats) return;
+    memset(out_stats, 0, sizeof(*out_stats));
+    pthread_mutex_lock(&g_journal.mutex);
+    for (journal_segment_t *seg = g_journal.segments_head; seg; seg = seg->next) out_stats->segments++;
+    out_stats->live_records = g_journal.live_records;
+    out_stats->appended_records = g_journal.appended_records;
+    out_stats->sync_count = g_journal.sync_count;
+    out_stats->checkpoint_seq = g_journal.written_checkpoint;
+    pthread_mutex_unlock(&g_journal.mutex);
+}
+
+typedef struct {
+    char name[64];
+    uint64_t id;
+} segment_name_t;
+
+static int compare_segment_names(const void *a, const void *b) {
+    const segment_name_t *x = (const segment_name_t *)a;
+    const segment_name_t *y = (const segment_name_t *)b;
+    return x->id < y->id ? -1 : (x->id > y->id ? 1 : 0);
+}
+
+static int list_segments(segment_name_t **out, size_t *out_count) {
+    *out = NULL;
+    *out_count = 0;
+    DIR *dir = opendir(JOURNAL_DIR);
+    if (!dir) return errno == ENOENT ? 0 : -1;
+
+    size_t cap = 0;
+    segment_name_t *names = NULL;
+    struct dirent *ent = NULL;
+    while ((ent = readdir(dir)) != NULL) {
+        size_t name_len = strlen(ent->d_name);
+        if (!has_segment_suffix(ent->d_name) || name_len >= sizeof(names[0].name)) continue;
+        char *end = NULL;
+        unsigned long long id = strtoull(ent->d_name, &end, 10);
+        if (!end || strcmp(end, JOURNAL_SEGMENT_SUFFIX) != 0) continue;
+        if (*out_count == cap) {
+            cap = cap ? cap * 2 : 16;
+            segment_name_t *grown = (segment_name_t *)realloc(names, cap * sizeof(segment_name_t));
+            if (!grown) {
+                free(names);
+                closedir(dir);
+                return -1;
+            }
+            names = grown;
+        }
+        memcpy(names[*out_count].name, ent->d_name, name_len);
+        names[*out_count].name[name_len] = '\0';
+        names[*out_count].id = (uint64_t)id;
+        (*out_count)++;
+    }
+    closedir(dir);
+    if (*out_count > 1) qsort(names, *out_count, sizeof(segment_name_t), compare_segment_names);
+    *out = names;
+    return 0;
+}
+
+typedef int (*segment_record_fn)(
+    void *ctx,
+    uint8_t kind,
+    uint8_t op,
+    uint64_t seq,
+    const char *key,
+    size_t key_len,
+    const char *log_id,
+    size_t log_id_len,
+    const char *payload,
+    size_t payload_len);
+
+/* Walks the valid prefix of one segment, verifying every record's CRC. */
+static int scan_segment(const char *path, uint64_t segment_id, segment_record_fn fn, void *ctx) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    size_t cap = 64 * 1024;
+    unsigned char *buf = (unsigned char *)malloc(cap);
+    if (!buf) {
+        close(fd);
+        return -1;
+    }
+
+    int rc = 0;
+    off_t off = 0;
+    uint64_t last_seq = 0;
+    while (1) {
+        unsigned char header[JOURNAL_HEADER_SIZE];
+        ssize_t n = pread(fd, header, sizeof(header), off);
+        if (n != (ssize_t)sizeof(header)) break;
+
+        uint32_t magic, crc, payload_len;
+        uint64_t seq, seg_id;
+        uint16_t key_len, log_id_len;
+        memcpy(&magic, header + 0, 4);
+        memcpy(&crc, header + 4, 4);
+        memcpy(&seq, header + 8, 8);
+        memcpy(&seg_id, header + 16, 8);
+        memcpy(&payload_len, header + 24, 4);
+        memcpy(&key_len, header + 28, 2);
+        memcpy(&log_id_len, header + 30, 2);
+        uint8_t kind = header[32];
+        uint8_t op = header[33];
+        int is_write = kind == JOURNAL_KIND_WRITE || kind == JOURNAL_KIND_WRITE_IF;
+        if (magic != JOURNAL_MAGIC || seg_id != segment_id || (!is_write && kind != JOURNAL_KIND_CHECKPOINT)) break;
+        if (op > WRITE_OP_RIDE_CHUNK) break;
+        if (is_write && seq <= last_seq) break;
+        if (kind == JOURNAL_KIND_WRITE_IF && payload_len < JOURNAL_IF_MATCH_SIZE) break;
+
+        size_t body_len = (size_t)key_len + log_id_len + payload_len;
+        if (body_len > REQ_BUF_SIZE + 1024) break;
+        if (body_len + 1 > cap) {
+            unsigned char *grown = (unsigned char *)realloc(buf, body_len + 1);
+            if (!grown) {
+                rc = -1;
+                break;
+            }
+            buf = grown;
+            cap = body_len + 1;
+        }
+        if (body_len > 0 && pread(fd, buf, body_len, off + JOURNAL_HEADER_SIZE) != (ssize_t)body_len) break;
+
+        uint32_t expected = crc32c_update(0, header + 8, JOURNAL_HEADER_SIZE - 8);
+        expected = crc32c_update(expected, buf, body_len);
+        if (expected != crc) break;
+
+        buf[body_len] = '\0';
+        if (is_write) last_seq = seq;
+        if (fn(ctx, kind, op, seq, (const char *)buf, key_len, (const char *)buf + key_len, log_id_len,
+               (const char *)buf + key_len + log_id_len, payload_len) != 0) {
+            rc = -1;
+            break;
+        }
+        off += (off_t)record_size(key_len, log_id_len, payload_len);
+    }
+
+    free(buf);
+    close(fd);
+    return rc;
+}
+
+/*
+ * The first pass also remembers, per storage key, the seq of its last
+ * unconditional PUT. Anything earlier for that key is overwritten by it
+ * (a PUT replaces the value and any list items), so the apply pass skips
+ * those records instead of writing rows that are about to be replaced.
+ * A batch is a write of each of its keys that may depend on what came
+ * before it, as in the dispatcher: nothing ahead of the last batch before
+ * that PUT (barrier_seq) is skipped.
+ */
+typedef struct replay_key {
+    uint32_t hash;
+    uint64_t last_put_seq;
+    uint64_t last_batch_seq;
+    uint64_t barrier_seq;
+    struct replay_key *next;
+    size_t key_len;
+    char key[];
+} replay_key_t;
+
+typedef struct {
+    uint64_t checkpoint;
+    size_t records;
+    replay_key_t **buckets;
+    size_t bucket_count;
+    size_t key_count;
+    int oom;
+} replay_scan_t;
+
+static uint32_t hash_key_bytes(const char *key, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static replay_key_t *replay_key_find(const replay_scan_t *scan, const char *key, size_t key_len, uint32_t hash) {
+    if (scan->bucket_count == 0) return NULL;
+    replay_key_t *entry = scan->buckets[hash & (scan->bucket_count - 1)];
+    while (entry && (entry->hash != hash || entry->key_len != key_len || memcmp(entry->key, key, key_len) != 0)) entry = entry->next;
+    return entry;
+}
+
+static replay_key_t *replay_key_get(replay_scan_t *scan, const char *key, size_t key_len) {
+    uint32_t hash = hash_key_bytes(key, key_len);
+    replay_key_t *entry = replay_key_find(scan, key, key_len, hash);
+    if (entry) return entry;
+    if (scan->key_count >= scan->bucket_count) {
+        size_t count = scan->bucket_count ? scan->bucket_count * 2 : 1024;
+        replay_key_t **buckets = (replay_key_t **)calloc(count, sizeof(*buckets));
+        if (!buckets) return NULL;
+        for (size_t i = 0; i < scan->bucket_count; i++) {
+            replay_key_t *e = scan->buckets[i];
+            while (e) {
+                replay_key_t *next = e->next;
+                e->next = buckets[e->hash & (count - 1)];
+                buckets[e->hash & (count - 1)] = e;
+                e = next;
+            }
+        }
+        free(scan->buckets);
+        scan->buckets = buckets;
+        scan->bucket_count = count;
+    }
+    entry = (replay_key_t *)calloc(1, sizeof(*entry) + key_len);
+    if (!entry) return NULL;
+    entry->hash = hash;
+    entry->key_len = key_len;
+    memcpy(entry->key, key, key_len);
+    entry->next = scan->buckets[hash & (scan->bucket_count - 1)];
+    scan->buckets[hash & (scan->bucket_count - 1)] = entry;
+    scan->key_count++;
+    return entry;
+}
+
+static int replay_key_note_put(replay_scan_t *scan, const char *key, size_t key_len, uint64_t seq) {
+    replay_key_t *entry = replay_key_get(scan, key, key_len);
+    if (!entry) return -1;
+    entry->last_put_seq = seq;
+    entry->barrier_seq = entry->last_batch_seq;
+    return 0;
+}
+
+static int replay_key_note_batch(replay_scan_t *scan, const char *prefix, size_t prefix_len, const char *payload, size_t payload_len, uint64_t seq) {
+    char prefix_buf[256];
+    if (prefix_len >= sizeof(prefix_buf)) return 0;
+    memcpy(prefix_buf, prefix, prefix_len);
+    prefix_buf[prefix_len] = '\0';
+    size_t pos = 0;
+    kv_batch_entry_t batch_entry;
+    while (kv_batch_next(payload, payload_len, &pos, &batch_entry) == 1) {
+        char storage_key[256];
+        if (kv_batch_storage_key(prefix_buf, &batch_entry, storage_key, sizeof(storage_key)) != 0) continue;
+        replay_key_t *entry = replay_key_get(scan, storage_key, strlen(storage_key));
+        if (!entry) return -1;
+        entry->last_batch_seq = seq;
+    }
+    return 0;
+}
+
+static void replay_scan_free(replay_scan_t *scan) {
+    for (size_t i = 0; i < scan->bucket_count; i++) {
+        replay_key_t *e = scan->buckets[i];
+        while (e) {
+            replay_key_t *next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    free(scan->buckets);
+    scan->buckets = NULL;
+    scan->bucket_count = 0;
+}
+
+static int find_checkpoint(
+    void *ctx,
+    uint8_t kind,
+    uint8_t op,
+    uint64_t seq,
+    const char *key,
+    size_t key_len,
+    const char *log_id,
+    size_t log_id_len,
+    const char *payload,
+    size_t payload_len) {
+    (void)log_id;
+    (void)log_id_len;
+    replay_scan_t *scan = (replay_scan_t *)ctx;
+    if (kind == JOURNAL_KIND_CHECKPOINT && seq > scan->checkpoint) scan->checkpoint = seq;
+    if (kind != JOURNAL_KIND_CHECKPOINT) scan->records++;
+    if (kind == JOURNAL_KIND_WRITE && op == WRITE_OP_PUT) return replay_key_note_put(scan, key, key_len, seq);
+    if (kind != JOURNAL_KIND_CHECKPOINT && op == WRITE_OP_BATCH) {
+        if (kind == JOURNAL_KIND_WRITE_IF) {
+            payload += JOURNAL_IF_MATCH_SIZE;
+            payload_len -= JOURNAL_IF_MATCH_SIZE;
+        }
+        return replay_key_note_batch(scan, key, key_len, payload, payload_len, seq);
+    }
+    return 0;
+}
+
+typedef struct {
+    const replay_scan_t *scan;
+    journal_apply_fn apply;
+    void *apply_ctx;
+    journal_replay_stats_t *stats;
+    size_t seen;
+    uint64_t reported_ns;
+} replay_apply_t;
+
+static int apply_record(
+    void *ctx,
+    uint8_t kind,
+    uint8_t op,
+    uint64_t seq,
+    const char *key,
+    size_t key_len,
+    const char *log_id,
+    size_t log_id_len,
+    const char *payload,
+    size_t payload_len) {
+    replay_apply_t *replay = (replay_apply_t *)ctx;
+    if (kind == JOURNAL_KIND_CHECKPOINT) return 0;
+    replay->seen++;
+    uint64_t now_ns = metrics_now_ns();
+    if (now_ns - replay->reported_ns >= 1000000000ull) {
+        log_info("journal replay progress records=%zu/%zu applied=%zu", replay->seen, replay->scan->records, replay->stats->applied);
+        replay->reported_ns = now_ns;
+    }
+    if (seq <= replay->scan->checkpoint) {
+        replay->stats->skipped++;
+        return 0;
+    }
+    const replay_key_t *latest = replay_key_find(replay->scan, key, key_len, hash_key_bytes(key, key_len));
+    if (latest && seq < latest->last_put_seq && seq > latest->barrier_seq) {
+        replay->stats->superseded++;
+        return 0;
+    }
+    char key_buf[256];
+    char log_id_buf[128];
+    if (key_len >= sizeof(key_buf) || log_id_len >= sizeof(log_id_buf)) return -1;
+    memcpy(key_buf, key, key_len);
+    key_buf[key_len] = '\0';
+    memcpy(log_id_buf, log_id, log_id_len);
+    log_id_buf[log_id_len] = '\0';
+    int64_t if_match = WRITE_IF_MATCH_NONE;
+    if (kind == JOURNAL_KIND_WRITE_IF) {
+        memcpy(&if_match, payload, JOURNAL_IF_MATCH_SIZE);
+        payload += JOURNAL_IF_MATCH_SIZE;
+        payload_len -= JOURNAL_IF_MATCH_SIZE;
+    }
+    if (replay->apply(replay->apply_ctx, seq, key_buf, log_id_buf, op, if_match, payload, payload_len) != 0) return -1;
+    replay->stats->applied++;
+    return 0;
+}
+
+int journal_replay(journal_apply_fn apply, journal_flush_fn flush, void *ctx, journal_replay_stats_t *out_stats) {
+    journal_replay_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+
+    segment_name_t *names = NULL;
+    size_t count = 0;
+    if (list_segments(&names, &count) != 0) return -1;
+
+    int rc = 0;
+    replay_scan_t scan = {0};
+    for (size_t i = 0; i < count && rc == 0; i++) {
+        char path[128];
+        snprintf(path, sizeof(path), "%s/%s", JOURNAL_DIR, names[i].name);
+        rc = scan_segment(path, names[i].id, find_checkpoint, &scan);
+    }
+
+    replay_apply_t replay = {.scan = &scan, .apply = apply, .apply_ctx = ctx, .stats = &stats, .reported_ns = metrics_now_ns()};
+    for (size_t i = 0; i < count && rc == 0; i++) {
+        char path[128];
+        snprintf(path, sizeof(path), "%s/%s", JOURNAL_DIR, names[i].name);
+        rc = scan_segment(path, names[i].id, apply_record, &replay);
+    }
+    if (rc == 0 && flush) rc = flush(ctx);
+
+    if (rc == 0) {
+        for (size_t i = 0; i < count; i++) {
+            char path[128];
+            snprintf(path, sizeof(path), "%s/%s", JOURNAL_DIR, names[i].name);
+            if (unlink(path) != 0) rc = -1;
+        }
+        if (count > 0 && sync_dir(JOURNAL_DIR) != 0) rc = -1;
+    }
+
+    stats.segments = count;
+    stats.checkpoint_seq = scan.checkpoint;
+    if (out_stats) *out_stats = stats;
+    replay_scan_free(&scan);
+    free(names);
+    return rc;
+}
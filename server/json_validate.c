@@ -0,0 +1,314 @@
+#include "server_internal.h"
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+ * Strict RFC 8259 validator that walks the buffer once without copying or
+ * recursing: containers are tracked on a fixed byte stack, so depth is
+ * bounded by JSON_MAX_DEPTH. String bodies, which dominate real payloads,
+ * are scanned a vector at a time for the only bytes that need attention
+ * (quote, backslash, control characters).
+ */
+
+enum {
+    EXPECT_VALUE,
+    EXPECT_KEY,
+    AFTER_VALUE,
+};
+
+static int is_ws(unsigned char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static const unsigned char *skip_ws(const unsigned char *p, const unsigned char *end) {
+    while (p < end && is_ws(*p)) p++;
+    return p;
+}
+
+static int is_hex(unsigned char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+/* Returns the first quote, backslash or control byte at or after p, or end. */
+static const unsigned char *skip_plain_string_bytes(const unsigned char *p, const unsigned char *end) {
+#if defined(__AVX2__)
+    const __m256i quote = _mm256_set1_epi8('"');
+    const __m256i backslash = _mm256_set1_epi8('\\');
+    const __m256i control = _mm256_set1_epi8(0x1F);
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i special = _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash));
+        special = _mm256_or_si256(special, _mm256_cmpeq_epi8(_mm256_min_epu8(v, control), v));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(special);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 32;
+    }
+#elif defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control = _mm_set1_epi8(0x1F);
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i special = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash));
+        special = _mm_or_si128(special, _mm_cmpeq_epi8(_mm_min_epu8(v, control), v));
+        unsigned mask = (unsigned)_mm_movemask_epi8(special);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t control = vdupq_n_u8(0x1F);
+    while (end - p >= 16) {
+        uint8x16_t v = vld1q_u8(p);
+        uint8x16_t special = vorrq_u8(vceqq_u8(v, quote), vceqq_u8(v, backslash));
+        special = vorrq_u8(special, vcleq_u8(v, control));
+        if (vmaxvq_u8(special)) break;
+        p += 16;
+    }
+#endif
+    while (p < end && *p != '"' && *p != '\\' && *p >= 0x20) p++;
+    return p;
+}
+
+/* p points just past the opening quote; returns just past the closing one, or NULL. */
+static const unsigned char *scan_string(const unsigned char *p, const unsigned char *end) {
+    while (1) {
+        p = skip_plain_string_bytes(p, end);
+        if (p >= end || *p < 0x20) return NULL;
+        if (*p == '"') return p + 1;
+        if (end - p < 2) return NULL;
+        switch (p[1]) {
+            case '"':
+            case '\\':
+            case '/':
+            case 'b':
+            case 'f':
+            case 'n':
+            case 'r':
+            case 't':
+                p += 2;
+                break;
+            case 'u':
+                if (end - p < 6 || !is_hex(p[2]) || !is_hex(p[3]) || !is_hex(p[4]) || !is_hex(p[5])) return NULL;
+                p += 6;
+                break;
+            default:
+                return NULL;
+        }
+    }
+}
+
+static const unsigned char *scan_digits(const unsigned char *p, const unsigned char *end) {
+    const unsigned char *start = p;
+    while (p < end && *p >= '0' && *p <= '9') p++;
+    return p == start ? NULL : p;
+}
+
+static const unsigned char *scan_number(const unsigned char *p, const unsigned char *end) {
+    if (*p == '-') p++;
+    if (p >= end) return NULL;
+    if (*p == '0') {
+        p++;
+    } else if (!(p = scan_digits(p, end))) {
+        return NULL;
+    }
+    if (p < end && *p == '.' && !(p = scan_digits(p + 1, end))) return NULL;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        if (p < end && (*p == '+' || *p == '-')) p++;
+        if (!(p = scan_digits(p, end))) return NULL;
+    }
+    return p;
+}
+
+static const unsigned char *scan_literal(const unsigned char *p, const unsigned char *end, const char *word) {
+    size_t len = strlen(word);
+    if ((size_t)(end - p) < len || memcmp(p, word, len) != 0) return NULL;
+    return p + len;
+}
+
+static int value_type(unsigned char c) {
+    switch (c) {
+        case '{':
+            return JSON_TYPE_OBJECT;
+        case '[':
+            return JSON_TYPE_ARRAY;
+        case '"':
+            return JSON_TYPE_STRING;
+        case 't':
+        case 'f':
+            return JSON_TYPE_BOOL;
+        case 'n':
+            return JSON_TYPE_NULL;
+        default:
+            return JSON_TYPE_NUMBER;
+    }
+}
+
+int json_validate(const char *buf, size_t len, json_shape_t *out_shape) {
+    const unsigned char *p = (const unsigned char *)buf;
+    const unsigned char *end = p + len;
+    unsigned char stack[JSON_MAX_DEPTH];
+    int depth = 0;
+    int max_depth = 0;
+    size_t count = 0;
+    int state = EXPECT_VALUE;
+
+    p = skip_ws(p, end);
+    if (p >= end) return -1;
+    int type = value_type(*p);
+
+    while (1) {
+        if (state == EXPECT_KEY) {
+            if (p >= end || *p != '"' || !(p = scan_string(p + 1, end))) return -1;
+            p = skip_ws(p, end);
+            if (p >= end || *p != ':') return -1;
+            p = skip_ws(p + 1, end);
+            state = EXPECT_VALUE;
+        }
+
+        if (state == EXPECT_VALUE) {
+            if (p >= end) return -1;
+            unsigned char c = *p;
+            if (c == '{' || c == '[') {
+                if (depth == JSON_MAX_DEPTH) return -1;
+                stack[depth++] = c;
+                if (depth > max_depth) max_depth = depth;
+                p = skip_ws(p + 1, end);
+                if (p >= end || *p != (c == '{' ? '}' : ']')) {
+                    state = c == '{' ? EXPECT_KEY : EXPECT_VALUE;
+                    continue;
+                }
+                p++;
+                depth--;
+            } else if (c == '"') {
+                p = scan_string(p + 1, end);
+            } else if (c == 't') {
+                p = scan_literal(p, end, "true");
+            } else if (c == 'f') {
+                p = scan_literal(p, end, "false");
+            } else if (c == 'n') {
+                p = scan_literal(p, end, "null");
+            } else if (c == '-' || (c >= '0' && c <= '9')) {
+                p = scan_number(p, end);
+            } else {
+                return -1;
+            }
+            if (!p) return -1;
+            if (depth == 1) count++;
+            state = AFTER_VALUE;
+        }
+
+        /* AFTER_VALUE: a value just ended inside stack[depth - 1]. */
+        if (depth == 0) break;
+        p = skip_ws(p, end);
+        if (p >= end) return -1;
+        unsigned char open = stack[depth - 1];
+        if (*p == ',') {
+            p = skip_ws(p + 1, end);
+            state = open == '{' ? EXPECT_KEY : EXPECT_VALUE;
+        } else if (*p == (open == '{' ? '}' : ']')) {
+            p++;
+            depth--;
+            if (depth == 1) count++;
+        } else {
+            return -1;
+        }
+    }
+    if (skip_ws(p, end) != end) return -1;
+
+    if (out_shape) {
+        out_shape->type = type;
+        out_shape->count = type == JSON_TYPE_OBJECT || type == JSON_TYPE_ARRAY ? count : 0;
+        out_shape->max_depth = max_depth;
+    }
+    return 0;
+}
+
+static int is_value_end(unsigned char c) {
+    return c == ',' || c == ']' || c == '}' || is_ws(c);
+}
+
+/* Returns just past the value starting at p; buf must already have passed json_validate. */
+static const unsigned char *skip_value(const unsigned char *p, const unsigned char *end) {
+    if (*p == '"') return scan_string(p + 1, end);
+    if (*p != '{' && *p != '[') {
+        while (p < end && !is_value_end(*p)) p++;
+        return p;
+    }
+    int depth = 0;
+    while (p < end) {
+        unsigned char c = *p;
+        if (c == '"') {
+            if (!(p = scan_string(p + 1, end))) return NULL;
+            continue;
+        }
+        p++;
+        if (c == '{' || c == '[') {
+            depth++;
+        } else if ((c == '}' || c == ']') && --depth == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+int json_array_next(const char *buf, size_t len, size_t *pos, size_t *out_off, size_t *out_len) {
+    const unsigned char *base = (const unsigned char *)buf;
+    const unsigned char *end = base + len;
+    const unsigned char *p = base + *pos;
+    if (*pos == 0) {
+        p = skip_ws(p, end);
+        if (p >= end || *p != '[') return -1;
+        p = skip_ws(p + 1, end);
+    } else {
+        p = skip_ws(p, end);
+        if (p < end && *p == ',') p = skip_ws(p + 1, end);
+    }
+    if (p >= end) return -1;
+    if (*p == ']') return 0;
+
+    const unsigned char *value_end = skip_value(p, end);
+    if (!value_end) return -1;
+    *out_off = (size_t)(p - base);
+    *out_len = (size_t)(value_end - p);
+    *pos = (size_t)(value_end - base);
+    return 1;
+}
+
+int json_object_member(const char *buf, size_t len, const char *name, size_t *out_off, size_t *out_len) {
+    const unsigned char *base = (const unsigned char *)buf;
+    const unsigned char *end = base + len;
+    const unsigned char *p = skip_ws(base, end);
+    if (p >= end || *p != '{') return 0;
+    size_t name_len = strlen(name);
+    p = skip_ws(p + 1, end);
+    while (p < end && *p == '"') {
+        const unsigned char *key = p + 1;
+        if (!(p = scan_string(key, end))) return 0;
+        int hit = (size_t)(p - 1 - key) == name_len && memcmp(key, name, name_len) == 0;
+        p = skip_ws(p, end);
+        if (p >= end || *p != ':') return 0;
+        p = skip_ws(p + 1, end);
+        if (p >= end) return 0;
+        const unsigned char *value_end = skip_value(p, end);
+        if (!value_end) return 0;
+        if (hit) {
+            *out_off = (size_t)(p - base);
+            *out_len = (size_t)(value_end - p);
+            return 1;
+        }
+        p = skip_ws(value_end, end);
+        if (p < end && *p == ',') p = skip_ws(p + 1, end);
+    }
+    return 0;
+}
@@ -0,0 +1,419 @@
+#include "server_internal.h"
+
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A list key is stored either as one JSON array in kv_store.data_value, or,
+ * once it has seen an APPEND or PATCH, as one kv_items row per element with
+ * data_value left at "[]" and kv_store.items holding the element count. The
+ * first list operation on a key moves its stored array into kv_items; after
+ * that every change touches only the rows it changes. A PUT goes back to
+ * the single-value form.
+ */
+
+int kv_element_timestamp(const char *elem, size_t elem_len, int64_t *out_ts) {
+    static const char *const names[] = {"date", "createdAt"};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        size_t off = 0;
+        size_t len = 0;
+        if (!json_object_member(elem, elem_len, names[i], &off, &len)) continue;
+        const char *value = elem + off;
+        if (len >= 2 && value[0] == '"') {
+            value++;
+            len -= 2;
+        }
+        return parse_timestamp(value, len, out_ts);
+    }
+    return -1;
+}
+
+int kv_writer_prepare(kv_writer_t *w, sqlite3 *db) {
+    memset(w, 0, sizeof(*w));
+    w->db = db;
+    const char *upsert_sql =
+        "INSERT INTO kv_store (data_key, data_value, updated_at, version, items) VALUES (?1, ?2, strftime('%s', 'now'), ?3, 0)"
+        " ON CONFLICT(data_key) DO UPDATE SET data_value=excluded.data_value, updated_at=excluded.updated_at, version=excluded.version, items=0";
+    const char *set_list_sql =
+        "INSERT INTO kv_store (data_key, data_value, updated_at, version, items) VALUES (?1, '[]', strftime('%s', 'now'), ?2, ?3)"
+        " ON CONFLICT(data_key) DO UPDATE SET data_value='[]', updated_at=excluded.updated_at, version=excluded.version, items=excluded.items";
+    const char *update_item_sql =
+        "UPDATE kv_items SET item_value=?3, item_ts=?4 WHERE rowid=("
+        "SELECT rowid FROM kv_items WHERE data_key=?1 AND item_id=?2 ORDER BY position LIMIT 1)";
+    if (sqlite3_prepare_v2(db, upsert_sql, -1, &w->upsert, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "SELECT version FROM kv_store WHERE data_key=?1", -1, &w->version, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "SELECT data_value, items FROM kv_store WHERE data_key=?1", -1, &w->read_list, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, set_list_sql, -1, &w->set_list, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "DELETE FROM kv_items WHERE data_key=?1", -1, &w->delete_items, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "SELECT COALESCE(MAX(position), 0) FROM kv_items WHERE data_key=?1", -1, &w->last_position, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(
+            db,
+            "INSERT INTO kv_items (data_key, position, item_id, item_ts, item_value) VALUES (?1, ?2, ?3, ?4, ?5)",
+            -1,
+            &w->insert_item,
+            NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, update_item_sql, -1, &w->update_item, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(
+            db,
+            "INSERT INTO ride_chunks (stream_key, version, t_first, t_last, samples, crc32, columns) VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7)",
+            -1,
+            &w->insert_chunk,
+            NULL) != SQLITE_OK) {
+        kv_writer_finalize(w);
+        return -1;
+    }
+    return 0;
+}
+
+void kv_writer_finalize(kv_writer_t *w) {
+    sqlite3_finalize(w->upsert);
+    sqlite3_finalize(w->version);
+    sqlite3_finalize(w->read_list);
+    sqlite3_finalize(w->set_list);
+    sqlite3_finalize(w->delete_items);
+    sqlite3_finalize(w->last_position);
+    sqlite3_finalize(w->insert_item);
+    sqlite3_finalize(w->update_item);
+    sqlite3_finalize(w->insert_chunk);
+    memset(w, 0, sizeof(*w));
+}
+
+int kv_read_version(kv_writer_t *w, const char *storage_key, uint64_t *out_version) {
+    sqlite3_stmt *stmt = w->version;
+    sqlite3_reset(stmt);
+    sqlite3_bind_text(stmt, 1, storage_key, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    *out_version = rc == SQLITE_ROW ? (uint64_t)sqlite3_column_int64(stmt, 0) : 0;
+    sqlite3_reset(stmt);
+    return rc == SQLITE_ROW ? SQLITE_DONE : rc;
+}
+
+static int step_once(sqlite3_stmt *stmt) {
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    return rc;
+}
+
+static int apply_put(kv_writer_t *w, const char *storage_key, const char *payload, size_t payload_len, uint64_t version) {
+    sqlite3_reset(w->upsert);
+    sqlite3_clear_bindings(w->upsert);
+    sqlite3_bind_text(w->upsert, 1, storage_key, -1, SQLITE_STATIC);
+    sqlite3_bind_text(w->upsert, 2, payload, (int)payload_len, SQLITE_STATIC);
+    sqlite3_bind_int64(w->upsert, 3, (sqlite3_int64)version);
+    int rc = step_once(w->upsert);
+    if (rc != SQLITE_DONE) return rc;
+
+    sqlite3_bind_text(w->delete_items, 1, storage_key, -1, SQLITE_STATIC);
+    return step_once(w->delete_items);
+}
+
+static int insert_item(kv_writer_t *w, const char *storage_key, int64_t position, const char *elem, size_t elem_len) {
+    size_t id_off = 0;
+    size_t id_len = 0;
+    int has_id = json_object_member(elem, elem_len, "id", &id_off, &id_len);
+    sqlite3_reset(w->insert_item);
+    sqlite3_clear_bindings(w->insert_item);
+    sqlite3_bind_text(w->insert_item, 1, storage_key, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(w->insert_item, 2, (sqlite3_int64)position);
+    if (has_id) sqlite3_bind_text(w->insert_item, 3, elem + id_off, (int)id_len, SQLITE_STATIC);
+    int64_t ts = 0;
+    if (kv_element_timestamp(elem, elem_len, &ts) == 0) sqlite3_bind_int64(w->insert_item, 4, (sqlite3_int64)ts);
+    sqlite3_bind_text(w->insert_item, 5, elem, (int)elem_len, SQLITE_STATIC);
+    return step_once(w->insert_item);
+}
+
+/*
+ * Makes sure the key is in the per-element form, moving a stored array into
+ * kv_items if needed, and returns its element count and last position.
+ */
+static int open_list(kv_writer_t *w, const char *storage_key, int64_t *out_items, int64_t *out_position) {
+    sqlite3_stmt *stmt = w->read_list;
+    sqlite3_reset(stmt);
+    sqlite3_bind_text(stmt, 1, storage_key, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_DONE) {
+        sqlite3_reset(stmt);
+        *out_items = 0;
+        *out_position = 0;
+        return SQLITE_DONE;
+    }
+    if (rc != SQLITE_ROW) {
+        sqlite3_reset(stmt);
+        return rc;
+    }
+
+    int64_t items = sqlite3_column_int64(stmt, 1);
+    if (items > 0) {
+        sqlite3_reset(stmt);
+        sqlite3_bind_text(w->last_position, 1, storage_key, -1, SQLITE_STATIC);
+        rc = sqlite3_step(w->last_position);
+        *out_position = rc == SQLITE_ROW ? sqlite3_column_int64(w->last_position, 0) : 0;
+        sqlite3_reset(w->last_position);
+        *out_items = items;
+        return rc == SQLITE_ROW ? SQLITE_DONE : rc;
+    }
+
+    /* The value stays valid until stmt is reset; only kv_items is written meanwhile. */
+    const char *value = (const char *)sqlite3_column_text(stmt, 0);
+    size_t value_len = value ? (size_t)sqlite3_column_bytes(stmt, 0) : 0;
+    int64_t position = 0;
+    size_t pos = 0;
+    size_t elem_off = 0;
+    size_t elem_len = 0;
+    rc = SQLITE_DONE;
+    int next = 0;
+    while (rc == SQLITE_DONE && (next = json_array_next(value, value_len, &pos, &elem_off, &elem_len)) == 1) {
+        rc = insert_item(w, storage_key, ++position, value + elem_off, elem_len);
+    }
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_DONE) return rc;
+    if (next < 0) return KV_WRITE_NOT_LIST;
+    *out_items = position;
+    *out_position = position;
+    return SQLITE_DONE;
+}
+
+static int apply_list_op(
+    kv_writer_t *w,
+    int op,
+    const char *storage_key,
+    const char *payload,
+    size_t payload_len,
+    uint64_t version) {
+    int64_t items = 0;
+    int64_t position = 0;
+    int rc = open_list(w, storage_key, &items, &position);
+
+    size_t pos = 0;
+    size_t elem_off = 0;
+    size_t elem_len = 0;
+    int next = 0;
+    while (rc == SQLITE_DONE && (next = json_array_next(payload, payload_len, &pos, &elem_off, &elem_len)) == 1) {
+        const char *elem = payload + elem_off;
+        size_t id_off = 0;
+        size_t id_len = 0;
+        if (op == WRITE_OP_PATCH && json_object_member(elem, elem_len, "id", &id_off, &id_len)) {
+            sqlite3_bind_text(w->update_item, 1, storage_key, -1, SQLITE_STATIC);
+            sqlite3_bind_text(w->update_item, 2, elem + id_off, (int)id_len, SQLITE_STATIC);
+            sqlite3_bind_text(w->update_item, 3, elem, (int)elem_len, SQLITE_STATIC);
+            int64_t ts = 0;
+            if (kv_element_timestamp(elem, elem_len, &ts) == 0) sqlite3_bind_int64(w->update_item, 4, (sqlite3_int64)ts);
+            rc = step_once(w->update_item);
+            sqlite3_clear_bindings(w->update_item);
+            if (rc != SQLITE_DONE || sqlite3_changes(w->db) > 0) continue;
+        }
+        rc = insert_item(w, storage_key, ++position, elem, elem_len);
+        items++;
+    }
+    if (rc != SQLITE_DONE) return rc;
+    if (next < 0) return KV_WRITE_NOT_LIST;
+
+    sqlite3_bind_text(w->set_list, 1, storage_key, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(w->set_list, 2, (sqlite3_int64)version);
+    sqlite3_bind_int64(w->set_list, 3, (sqlite3_int64)items);
+    return step_once(w->set_list);
+}
+
+/*
+ * Samples at or before the head's "to" are dropped, so a chunk sent again
+ * after its acknowledgement was lost (or replayed over itself) adds
+ * nothing. The head takes the version either way.
+ */
+static int apply_ride_chunk(kv_writer_t *w, const char *storage_key, const char *payload, size_t payload_len, uint64_t version) {
+    int64_t samples = ride_chunk_samples(payload, payload_len);
+    if (samples < 0) return SQLITE_MISUSE;
+
+    ride_head_t head = {0};
+    sqlite3_stmt *stmt = w->read_list;
+    sqlite3_reset(stmt);
+    sqlite3_bind_text(stmt, 1, storage_key, -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_ROW) {
+        const char *value = (const char *)sqlite3_column_text(stmt, 0);
+        if (!value || ride_head_parse(value, (size_t)sqlite3_column_bytes(stmt, 0), &head) != 0) memset(&head, 0, sizeof(head));
+    }
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) return rc;
+
+    int64_t skip = head.chunks > 0 ? ride_chunk_first_after(payload, payload_len, head.to) : 0;
+    if (skip < samples) {
+        char *trimmed = NULL;
+        const char *chunk = payload;
+        size_t chunk_len = payload_len;
+        if (skip > 0) {
+            if (ride_chunk_trim(payload, payload_len, skip, &trimmed, &chunk_len) != 0) return SQLITE_NOMEM;
+            chunk = trimmed;
+        }
+        int64_t kept = samples - skip;
+        int64_t t_first = ride_chunk_time(chunk, chunk_len, 0);
+        int64_t t_last = ride_chunk_time(chunk, chunk_len, kept - 1);
+        sqlite3_bind_text(w->insert_chunk, 1, storage_key, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(w->insert_chunk, 2, (sqlite3_int64)version);
+        sqlite3_bind_int64(w->insert_chunk, 3, (sqlite3_int64)t_first);
+        sqlite3_bind_int64(w->insert_chunk, 4, (sqlite3_int64)t_last);
+        sqlite3_bind_int64(w->insert_chunk, 5, (sqlite3_int64)kept);
+        sqlite3_bind_int64(w->insert_chunk, 6, (sqlite3_int64)ride_chunk_crc32(chunk, chunk_len));
+        sqlite3_bind_blob(w->insert_chunk, 7, chunk, (int)chunk_len, SQLITE_STATIC);
+        rc = step_once(w->insert_chunk);
+        sqlite3_clear_bindings(w->insert_chunk);
+        free(trimmed);
+        if (rc != SQLITE_DONE) return rc;
+        if (head.chunks == 0) head.from = t_first;
+        head.chunks++;
+        head.samples += kept;
+        head.to = t_last;
+    }
+
+    char summary[160];
+    int summary_len = ride_head_format(&head, summary, sizeof(summary));
+    if (summary_len < 0) return SQLITE_MISUSE;
+    sqlite3_reset(w->upsert);
+    sqlite3_clear_bindings(w->upsert);
+    sqlite3_bind_text(w->upsert, 1, storage_key, -1, SQLITE_STATIC);
+    sqlite3_bind_text(w->upsert, 2, summary, summary_len, SQLITE_STATIC);
+    sqlite3_bind_int64(w->upsert, 3, (sqlite3_int64)version);
+    return step_once(w->upsert);
+}
+
+/*
+ * Each write runs under its own savepoint, so a failing one leaves nothing
+ * behind whether or not the caller holds a transaction.
+ */
+int kv_write_apply(kv_writer_t *w, int op, const char *storage_key, const char *payload, size_t payload_len, uint64_t version) {
+    w->last_ext = SQLITE_OK;
+    int rc = sqlite3_exec(w->db, "SAVEPOINT kv_write", NULL, NULL, NULL);
+    if (rc == SQLITE_OK) {
+        if (op == WRITE_OP_PUT) {
+            rc = apply_put(w, storage_key, payload, payload_len, version);
+        } else if (op == WRITE_OP_RIDE_CHUNK) {
+            rc = apply_ride_chunk(w, storage_key, payload, payload_len, version);
+        } else {
+            rc = apply_list_op(w, op, storage_key, payload, payload_len, version);
+        }
+        if (rc == SQLITE_DONE) {
+            rc = sqlite3_exec(w->db, "RELEASE kv_write", NULL, NULL, NULL);
+            if (rc == SQLITE_OK) return SQLITE_DONE;
+        }
+    }
+    w->last_ext = rc == KV_WRITE_NOT_LIST ? SQLITE_OK : sqlite3_extended_errcode(w->db);
+    /* SQLite may already have rolled the whole transaction back. */
+    if (!sqlite3_get_autocommit(w->db)) {
+        sqlite3_exec(w->db, "ROLLBACK TO kv_write", NULL, NULL, NULL);
+        sqlite3_exec(w->db, "RELEASE kv_write", NULL, NULL, NULL);
+    }
+    return rc;
+}
+
+/*
+ * Batch entries are laid out back to back in host order:
+ *   u8 op | u8 zero | u16 key_len | u32 value_len | i64 if_match | key | value
+ */
+#define KV_BATCH_ENTRY_HEADER 16
+
+int kv_batch_append(char **buf, size_t *len, size_t *cap, const kv_batch_entry_t *entry) {
+    if (entry->key_len > UINT16_MAX || entry->value_len > UINT32_MAX) return -1;
+    size_t need = *len + KV_BATCH_ENTRY_HEADER + entry->key_len + entry->value_len;
+    if (need > *cap) {
+        size_t grown_cap = *cap ? *cap : 4096;
+        while (grown_cap < need) grown_cap *= 2;
+        char *grown = (char *)realloc(*buf, grown_cap);
+        if (!grown) return -1;
+        *buf = grown;
+        *cap = grown_cap;
+    }
+    unsigned char *p = (unsigned char *)*buf + *len;
+    uint16_t key_len = (uint16_t)entry->key_len;
+    uint32_t value_len = (uint32_t)entry->value_len;
+    p[0] = (unsigned char)entry->op;
+    p[1] = 0;
+    memcpy(p + 2, &key_len, 2);
+    memcpy(p + 4, &value_len, 4);
+    memcpy(p + 8, &entry->if_match, 8);
+    memcpy(p + KV_BATCH_ENTRY_HEADER, entry->key, entry->key_len);
+    if (entry->value_len > 0) memcpy(p + KV_BATCH_ENTRY_HEADER + entry->key_len, entry->value, entry->value_len);
+    *len = need;
+    return 0;
+}
+
+int kv_batch_next(const char *payload, size_t payload_len, size_t *pos, kv_batch_entry_t *out_entry) {
+    if (*pos == payload_len) return 0;
+    if (payload_len - *pos < KV_BATCH_ENTRY_HEADER) return -1;
+    const unsigned char *p = (const unsigned char *)payload + *pos;
+    uint16_t key_len = 0;
+    uint32_t value_len = 0;
+    memcpy(&key_len, p + 2, 2);
+    memcpy(&value_len, p + 4, 4);
+    if (p[0] > WRITE_OP_PATCH || key_len == 0 || payload_len - *pos - KV_BATCH_ENTRY_HEADER < (size_t)key_len + value_len) return -1;
+    out_entry->op = p[0];
+    memcpy(&out_entry->if_match, p + 8, 8);
+    out_entry->key = (const char *)p + KV_BATCH_ENTRY_HEADER;
+    out_entry->key_len = key_len;
+    out_entry->value = out_entry->key + key_len;
+    out_entry->value_len = value_len;
+    *pos += KV_BATCH_ENTRY_HEADER + (size_t)key_len + value_len;
+    return 1;
+}
+
+int kv_batch_storage_key(const char *prefix, const kv_batch_entry_t *entry, char *out, size_t out_len) {
+    int written = snprintf(out, out_len, "%s%.*s", prefix, (int)entry->key_len, entry->key);
+    if (written <= 0 || (size_t)written >= out_len) return -1;
+    return 0;
+}
+
+/* Checks every If-Match before anything is written, so a rejected batch costs no rollback. */
+static int check_batch_preconditions(kv_writer_t *w, const char *prefix, const char *payload, size_t payload_len, uint64_t *out_current) {
+    size_t pos = 0;
+    kv_batch_entry_t entry;
+    int next = 0;
+    while ((next = kv_batch_next(payload, payload_len, &pos, &entry)) == 1) {
+        if (entry.if_match == WRITE_IF_MATCH_NONE) continue;
+        char storage_key[256];
+        uint64_t current = 0;
+        if (kv_batch_storage_key(prefix, &entry, storage_key, sizeof(storage_key)) != 0) return SQLITE_MISUSE;
+        int rc = kv_read_version(w, storage_key, &current);
+        if (rc != SQLITE_DONE) return rc;
+        if (!write_precondition_holds(entry.if_match, current)) {
+            *out_current = current;
+            return KV_WRITE_PRECONDITION_FAILED;
+        }
+    }
+    return next < 0 ? SQLITE_CORRUPT : SQLITE_DONE;
+}
+
+int kv_write_apply_batch(kv_writer_t *w, const char *prefix, const char *payload, size_t payload_len, uint64_t version, uint64_t *out_current) {
+    w->last_ext = SQLITE_OK;
+    int rc = check_batch_preconditions(w, prefix, payload, payload_len, out_current);
+    if (rc != SQLITE_DONE) {
+        if (rc != KV_WRITE_PRECONDITION_FAILED) w->last_ext = sqlite3_extended_errcode(w->db);
+        return rc;
+    }
+
+    rc = sqlite3_exec(w->db, "SAVEPOINT kv_batch", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        w->last_ext = sqlite3_extended_errcode(w->db);
+        return rc;
+    }
+    size_t pos = 0;
+    kv_batch_entry_t entry;
+    rc = SQLITE_DONE;
+    while (rc == SQLITE_DONE && kv_batch_next(payload, payload_len, &pos, &entry) == 1) {
+        char storage_key[256];
+        if (kv_batch_storage_key(prefix, &entry, storage_key, sizeof(storage_key)) != 0) {
+            rc = SQLITE_MISUSE;
+            break;
+        }
+        rc = kv_write_apply(w, entry.op, storage_key, entry.value, entry.value_len, version);
+    }
+    if (rc == SQLITE_DONE) {
+        rc = sqlite3_exec(w->db, "RELEASE kv_batch", NULL, NULL, NULL);
+        if (rc == SQLITE_OK) return SQLITE_DONE;
+        w->last_ext = sqlite3_extended_errcode(w->db);
+    }
+    if (!sqlite3_get_autocommit(w->db)) {
+        sqlite3_exec(w->db, "ROLLBACK TO kv_batch", NULL, NULL, NULL);
+        sqlite3_exec(w->db, "RELEASE kv_batch", NULL, NULL, NULL);
+    }
+    return rc;
+}
@@ -1,47 +1,256 @@
+#define _GNU_SOURCE
 #include "logger.h"
 
+#include <errno.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
-static void log_v(const char *level, const char *fmt, va_list ap) {
+/*
+ * Every thread that logs owns a single-producer ring; the flusher thread is
+ * the only consumer and gathers whatever the rings hold into one write(2) at
+ * a time. Producers never block or take a lock: a line that does not fit in
+ * its ring is counted as dropped. Rings are never freed while the process
+ * runs; a thread's ring is handed to the next new thread once it exits.
+ * Until logger_start (and after logger_stop) each line is one direct write.
+ */
+
+#define LOG_LINE_MAX 2048
+#define LOG_RING_BYTES (256 * 1024)
+#define LOG_BATCH_BYTES (64 * 1024)
+#define LOG_FLUSH_IDLE_NS (5 * 1000 * 1000)
+
+typedef struct log_ring {
+    struct log_ring *next;
+    atomic_int in_use;
+    /* Monotonic byte counters; records are a 2-byte length then the line. */
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    char data[LOG_RING_BYTES];
+} log_ring_t;
+
+static _Atomic(log_ring_t *) g_rings;
+static atomic_int g_running;
+static atomic_llong g_dropped;
+static int g_level = LOG_LEVEL_INFO;
+static int g_info_sample_every = 1;
+static pthread_t g_flusher;
+static pthread_once_t g_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_ring_key;
+
+static _Thread_local log_ring_t *tls_ring;
+static _Thread_local time_t tls_ts_sec = (time_t)-1;
+static _Thread_local char tls_ts[32];
+static _Thread_local unsigned tls_info_seen;
+
+void logger_configure(const logger_config_t *config) {
+    g_level = config->level;
+    g_info_sample_every = config->info_sample_every > 0 ? config->info_sample_every : 1;
+}
+
+int logger_parse_level(const char *name) {
+    if (strcmp(name, "info") == 0) return LOG_LEVEL_INFO;
+    if (strcmp(name, "warn") == 0) return LOG_LEVEL_WARN;
+    if (strcmp(name, "error") == 0) return LOG_LEVEL_ERROR;
+    return -1;
+}
+
+long long logger_dropped_lines(void) {
+    return atomic_load_explicit(&g_dropped, memory_order_relaxed);
+}
+
+static void write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDERR_FILENO, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+static void release_ring(void *ring) {
+    atomic_store_explicit(&((log_ring_t *)ring)->in_use, 0, memory_order_release);
+}
+
+static void make_ring_key(void) {
+    pthread_key_create(&g_ring_key, release_ring);
+}
+
+static log_ring_t *thread_ring(void) {
+    if (tls_ring) return tls_ring;
+    pthread_once(&g_key_once, make_ring_key);
+    log_ring_t *ring = atomic_load_explicit(&g_rings, memory_order_acquire);
+    for (; ring; ring = ring->next) {
+        int idle = 0;
+        if (atomic_compare_exchange_strong_explicit(&ring->in_use, &idle, 1, memory_order_acq_rel, memory_order_relaxed)) break;
+    }
+    if (!ring) {
+        ring = (log_ring_t *)calloc(1, sizeof(log_ring_t));
+        if (!ring) return NULL;
+        atomic_init(&ring->in_use, 1);
+        log_ring_t *top = atomic_load_explicit(&g_rings, memory_order_relaxed);
+        do {
+            ring->next = top;
+        } while (!atomic_compare_exchange_weak_explicit(&g_rings, &top, ring, memory_order_release, memory_order_relaxed));
+    }
+    pthread_setspecific(g_ring_key, ring);
+    tls_ring = ring;
+    return ring;
+}
+
+static void ring_copy_in(log_ring_t *ring, size_t at, const char *src, size_t len) {
+    size_t off = at % LOG_RING_BYTES;
+    size_t first = len < LOG_RING_BYTES - off ? len : LOG_RING_BYTES - off;
+    memcpy(ring->data + off, src, first);
+    memcpy(ring->data, src + first, len - first);
+}
+
+static void ring_copy_out(const log_ring_t *ring, size_t at, char *dst, size_t len) {
+    size_t off = at % LOG_RING_BYTES;
+    size_t first = len < LOG_RING_BYTES - off ? len : LOG_RING_BYTES - off;
+    memcpy(dst, ring->data + off, first);
+    memcpy(dst + first, ring->data, len - first);
+}
+
+static int ring_push(log_ring_t *ring, const char *line, size_t len) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (LOG_RING_BYTES - (head - tail) < len + 2) return -1;
+    unsigned char prefix[2] = {(unsigned char)(len >> 8), (unsigned char)len};
+    ring_copy_in(ring, head, (const char *)prefix, 2);
+    ring_copy_in(ring, head + 2, line, len);
+    atomic_store_explicit(&ring->head, head + 2 + len, memory_order_release);
+    return 0;
+}
+
+/* Moves complete records from ring into batch, writing batch out whenever it fills. */
+static int ring_drain(log_ring_t *ring, char *batch, size_t *batch_len) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    int moved = tail != head;
+    while (tail != head) {
+        unsigned char prefix[2];
+        ring_copy_out(ring, tail, (char *)prefix, 2);
+        size_t len = (size_t)prefix[0] << 8 | prefix[1];
+        if (*batch_len + len > LOG_BATCH_BYTES) {
+            write_all(batch, *batch_len);
+            *batch_len = 0;
+        }
+        ring_copy_out(ring, tail + 2, batch + *batch_len, len);
+        *batch_len += len;
+        tail += 2 + len;
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    return moved;
+}
+
+static size_t format_prefix(char *out, size_t cap, const char *level) {
     time_t now = time(NULL);
-    struct tm tm_now;
-#if defined(__APPLE__) || defined(__linux__)
-    localtime_r(&now, &tm_now);
-#else
-    struct tm *tmp = localtime(&now);
-    if (!tmp) return;
-    tm_now = *tmp;
-#endif
+    if (now != tls_ts_sec) {
+        struct tm tm_now;
+        localtime_r(&now, &tm_now);
+        if (strftime(tls_ts, sizeof(tls_ts), "%Y-%m-%d %H:%M:%S", &tm_now) == 0) tls_ts[0] = '\0';
+        tls_ts_sec = now;
+    }
+    int n = snprintf(out, cap, "[%s] [%s] ", tls_ts, level);
+    return n > 0 ? (size_t)n : 0;
+}
 
-    char ts[32];
-    if (strftime(ts, sizeof(ts), "%Y-%m-%d %H:%M:%S", &tm_now) == 0) {
-        ts[0] = '\0';
+static void *flusher_main(void *arg) {
+    (void)arg;
+    char *batch = (char *)malloc(LOG_BATCH_BYTES);
+    if (!batch) return NULL;
+    long long reported = 0;
+    time_t reported_at = 0;
+    while (1) {
+        int running = atomic_load_explicit(&g_running, memory_order_acquire);
+        size_t batch_len = 0;
+        int moved = 0;
+        for (log_ring_t *ring = atomic_load_explicit(&g_rings, memory_order_acquire); ring; ring = ring->next) {
+            moved |= ring_drain(ring, batch, &batch_len);
+        }
+        long long dropped = logger_dropped_lines();
+        time_t now = time(NULL);
+        if (dropped != reported && (now != reported_at || !running)) {
+            size_t n = format_prefix(batch + batch_len, LOG_BATCH_BYTES - batch_len, "WARN");
+            int m = snprintf(batch + batch_len + n, LOG_BATCH_BYTES - batch_len - n, "logger dropped %lld lines\n", dropped - reported);
+            if (n > 0 && m > 0 && batch_len + n + (size_t)m < LOG_BATCH_BYTES) batch_len += n + (size_t)m;
+            reported = dropped;
+            reported_at = now;
+        }
+        if (batch_len > 0) write_all(batch, batch_len);
+        if (!running) break;
+        if (!moved) {
+            struct timespec idle = {0, LOG_FLUSH_IDLE_NS};
+            nanosleep(&idle, NULL);
+        }
     }
+    free(batch);
+    return NULL;
+}
+
+int logger_start(void) {
+    if (atomic_load_explicit(&g_running, memory_order_relaxed)) return 0;
+    atomic_store_explicit(&g_running, 1, memory_order_release);
+    if (pthread_create(&g_flusher, NULL, flusher_main, NULL) != 0) {
+        atomic_store_explicit(&g_running, 0, memory_order_release);
+        return -1;
+    }
+    return 0;
+}
 
-    fprintf(stderr, "[%s] [%s] ", ts, level);
-    vfprintf(stderr, fmt, ap);
-    fputc('\n', stderr);
+void logger_stop(void) {
+    if (!atomic_load_explicit(&g_running, memory_order_relaxed)) return;
+    atomic_store_explicit(&g_running, 0, memory_order_release);
+    pthread_join(g_flusher, NULL);
+}
+
+static void log_v(int level, const char *name, const char *fmt, va_list ap) {
+    if (level < g_level) return;
+    if (level == LOG_LEVEL_INFO && g_info_sample_every > 1 && tls_info_seen++ % (unsigned)g_info_sample_every != 0) return;
+
+    char line[LOG_LINE_MAX];
+    size_t len = format_prefix(line, sizeof(line), name);
+    int n = vsnprintf(line + len, sizeof(line) - len - 1, fmt, ap);
+    if (n < 0) n = 0;
+    len += (size_t)n < sizeof(line) - len - 1 ? (size_t)n : sizeof(line) - len - 2;
+    line[len++] = '\n';
+
+    if (atomic_load_explicit(&g_running, memory_order_acquire)) {
+        log_ring_t *ring = thread_ring();
+        if (ring && ring_push(ring, line, len) == 0) return;
+        atomic_fetch_add_explicit(&g_dropped, 1, memory_order_relaxed);
+        return;
+    }
+    write_all(line, len);
 }
 
 void log_info(const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    log_v("INFO", fmt, ap);
+    log_v(LOG_LEVEL_INFO, "INFO", fmt, ap);
     va_end(ap);
 }
 
 void log_warn(const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    log_v("WARN", fmt, ap);
+    log_v(LOG_LEVEL_WARN, "WARN", fmt, ap);
     va_end(ap);
 }
 
 void log_error(const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    log_v("ERROR", fmt, ap);
+    log_v(LOG_LEVEL_ERROR, "ERROR", fmt, ap);
     va_end(ap);
 }
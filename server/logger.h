@@ -1,6 +1,27 @@
 #ifndef FRICU_LOGGER_H
 #define FRICU_LOGGER_H
 
+enum {
+    LOG_LEVEL_INFO = 0,
+    LOG_LEVEL_WARN = 1,
+    LOG_LEVEL_ERROR = 2,
+};
+
+/* Lines below level are discarded; only every info_sample_every-th INFO line per thread is kept. */
+typedef struct {
+    int level;
+    int info_sample_every;
+} logger_config_t;
+
+void logger_configure(const logger_config_t *config);
+/* Returns the LOG_LEVEL_* for "info", "warn" or "error", or -1. */
+int logger_parse_level(const char *name);
+/* Hands lines to a background flusher; logger_stop drains what is buffered. */
+int logger_start(void);
+void logger_stop(void);
+/* Lines discarded because their thread's buffer was full. */
+long long logger_dropped_lines(void);
+
 void log_info(const char *fmt, ...);
 void log_warn(const char *fmt, ...);
 void log_error(const char *fmt, ...);
@@ -1,14 +1,10 @@
 #define _GNU_SOURCE
-#include <arpa/inet.h>
-#include <errno.h>
-#include <netinet/in.h>
-#include <netinet/tcp.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/resource.h>
 #include <sys/socket.h>
-#include <time.h>
 #include <unistd.h>
 
 #include "logger.h"
@@ -16,14 +12,28 @@
 #include "server_internal.h"
 
 typedef struct {
+    int index;
     int listen_fd;
     char db_path[512];
-    size_t max_fds;
+    worker_config_t config;
 } worker_ctx_t;
 
+static int env_int(const char *name, int fallback, int min_value, int max_value) {
+    const char *raw = getenv(name);
+    if (!raw || raw[0] == '\0') return fallback;
+    char *end = NULL;
+    long parsed = strtol(raw, &end, 10);
+    if (end == raw || *end != '\0' || parsed < min_value || parsed > max_value) {
+        log_warn("ignoring invalid %s=%s", name, raw);
+        return fallback;
+    }
+    return (int)parsed;
+}
+
 static void *worker_entry(void *arg) {
     worker_ctx_t *ctx = (worker_ctx_t *)arg;
-    if (run_worker_loop(ctx->listen_fd, ctx->db_path, ctx->max_fds) != 0) {
+    affinity_pin_worker(ctx->index);
+    if (run_worker_loop(ctx->listen_fd, ctx->db_path, &ctx->config) != 0) {
         log_error("worker loop exited with error");
     }
     return NULL;
@@ -33,18 +43,118 @@ static void *worker_entry(void *arg) {
 int main(void) {
     const char *bind_env = getenv("FRICU_SERVER_BIND");
     const char *db_env = getenv("FRICU_DB_PATH");
-    const char *workers_env = getenv("FRICU_SERVER_WORKERS");
     const char *bind_addr_str = bind_env ? bind_env : "0.0.0.0:8080";
     const char *db_path = db_env ? db_env : "fricu_server.db";
 
-    size_t worker_count = workers_env ? (size_t)strtoul(workers_env, NULL, 10) : DEFAULT_WORKERS;
-    if (worker_count == 0 || worker_count > 1024) worker_count = DEFAULT_WORKERS;
+    logger_config_t log_config;
+    log_config.level = LOG_LEVEL_INFO;
+    const char *level_env = getenv("FRICU_LOG_LEVEL");
+    if (level_env && level_env[0] != '\0') {
+        int level = logger_parse_level(level_env);
+        if (level < 0) {
+            log_warn("ignoring invalid FRICU_LOG_LEVEL=%s", level_env);
+        } else {
+            log_config.level = level;
+        }
+    }
+    log_config.info_sample_every = env_int("FRICU_LOG_INFO_SAMPLE", 1, 1, 1000000);
+    logger_configure(&log_config);
+    if (logger_start() != 0) {
+        log_warn("failed to start log flusher, logging synchronously");
+    } else {
+        /* Early returns below still get their last lines out. */
+        atexit(logger_stop);
+    }
+
+    worker_config_t config;
+    memset(&config, 0, sizeof(config));
+    config.keepalive_idle_ms = env_int("FRICU_KEEPALIVE_IDLE_MS", DEFAULT_KEEPALIVE_IDLE_MS, 0, 3600 * 1000);
+    config.keepalive_max_requests = env_int("FRICU_KEEPALIVE_MAX_REQUESTS", DEFAULT_KEEPALIVE_MAX_REQUESTS, 0, 1000000);
+    config.send_timeout_ms = env_int("FRICU_SEND_TIMEOUT_MS", DEFAULT_SEND_TIMEOUT_MS, 0, 3600 * 1000);
+    config.zerocopy_min_bytes = (size_t)env_int("FRICU_ZEROCOPY_MIN_BYTES", DEFAULT_ZEROCOPY_MIN_BYTES, 0, INT_MAX);
+    config.max_buffered_bytes = (size_t)env_int("FRICU_WORKER_BUFFER_BYTES", DEFAULT_WORKER_BUFFER_BYTES, 0, INT_MAX);
+    config.max_large_uploads = env_int("FRICU_MAX_LARGE_UPLOADS", DEFAULT_MAX_LARGE_UPLOADS, 0, 1000000);
+    config.backend = WORKER_BACKEND_EPOLL;
+    const char *backend_env = getenv("FRICU_EVENT_BACKEND");
+    if (backend_env && strcmp(backend_env, "io_uring") == 0) {
+        config.backend = WORKER_BACKEND_IO_URING;
+    } else if (backend_env && backend_env[0] != '\0' && strcmp(backend_env, "epoll") != 0) {
+        log_warn("ignoring invalid FRICU_EVENT_BACKEND=%s", backend_env);
+    }
+
+    write_dispatch_config_t write_config;
+    memset(&write_config, 0, sizeof(write_config));
+    write_config.batch_max_jobs = env_int("FRICU_WRITE_BATCH_MAX_JOBS", DEFAULT_WRITE_BATCH_MAX_JOBS, 1, 65536);
+    write_config.batch_max_bytes = (size_t)env_int("FRICU_WRITE_BATCH_MAX_BYTES", DEFAULT_WRITE_BATCH_MAX_BYTES, 1, 1024 * 1024 * 1024);
+    write_config.batch_linger_us = env_int("FRICU_WRITE_BATCH_LINGER_US", DEFAULT_WRITE_BATCH_LINGER_US, 0, 1000000);
+    write_config.shard_count = env_int("FRICU_WRITE_SHARDS", DEFAULT_WRITE_SHARDS, 1, MAX_WRITE_SHARDS);
+    write_config.queued_ack_ms = env_int("FRICU_WRITE_QUEUED_ACK_MS", DEFAULT_WRITE_QUEUED_ACK_MS, 0, 3600000);
+    write_config.queue_max_jobs = env_int("FRICU_WRITE_QUEUE_MAX_JOBS", DEFAULT_WRITE_QUEUE_MAX_JOBS, 0, INT_MAX);
+    write_config.queue_max_bytes = (size_t)env_int("FRICU_WRITE_QUEUE_MAX_BYTES", DEFAULT_WRITE_QUEUE_MAX_BYTES, 0, INT_MAX);
+    write_dispatcher_configure(&write_config);
+
+    affinity_config_t affinity_config;
+    affinity_config.pin_threads = env_int("FRICU_CPU_AFFINITY", 0, 0, 1);
+    affinity_config.numa_interleave = env_int("FRICU_NUMA_INTERLEAVE", 0, 0, 1);
+    affinity_config.dispatcher_cpus = write_config.shard_count;
+    affinity_configure(&affinity_config);
+    /* One worker per CPU left to the workers. */
+    size_t worker_count = (size_t)env_int("FRICU_SERVER_WORKERS", affinity_cpu_count(), 1, 1024);
+
+    admission_config_t admission_config;
+    admission_config.account_write_rate = env_int("FRICU_ACCOUNT_WRITE_RATE", 0, 0, 1000000);
+    admission_config.account_write_burst = env_int("FRICU_ACCOUNT_WRITE_BURST", 0, 0, 1000000);
+    admission_configure(&admission_config);
+
+    journal_config_t journal_config;
+    journal_config.segment_bytes = (size_t)env_int("FRICU_JOURNAL_SEGMENT_BYTES", DEFAULT_JOURNAL_SEGMENT_BYTES, 1024 * 1024, 1024 * 1024 * 1024);
+    journal_configure(&journal_config);
+
+    value_cache_config_t cache_config;
+    cache_config.max_bytes = (size_t)env_int("FRICU_VALUE_CACHE_BYTES", DEFAULT_VALUE_CACHE_BYTES, 0, INT_MAX);
+    value_cache_configure(&cache_config);
+
+    compress_config_t compress_config;
+    compress_config.min_bytes = (size_t)env_int("FRICU_GZIP_MIN_BYTES", DEFAULT_GZIP_MIN_BYTES, 0, INT_MAX);
+    compress_config.level = env_int("FRICU_GZIP_LEVEL", DEFAULT_GZIP_LEVEL, 1, 9);
+    compress_configure(&compress_config);
+
+    change_feed_config_t change_config;
+    change_config.entries = (size_t)env_int("FRICU_CHANGE_FEED_ENTRIES", DEFAULT_CHANGE_FEED_ENTRIES, 0, 16 * 1024 * 1024);
+    change_feed_configure(&change_config);
+
+    replication_config_t replication_config;
+    memset(&replication_config, 0, sizeof(replication_config));
+    replication_config.log_bytes = (size_t)env_int("FRICU_REPLICATION_LOG_BYTES", DEFAULT_REPLICATION_LOG_BYTES, 1024 * 1024, INT_MAX);
+    const char *replication_bind = getenv("FRICU_REPLICATION_BIND");
+    const char *replica_of = getenv("FRICU_REPLICA_OF");
+    const char *primary_url = getenv("FRICU_REPLICA_PRIMARY_URL");
+    const char *replication_token = getenv("FRICU_REPLICATION_TOKEN");
+    if (replica_of && replica_of[0] != '\0') {
+        if (parse_bind_addr(replica_of, replication_config.primary_host, sizeof(replication_config.primary_host), &replication_config.primary_port) != 0) {
+            log_error("invalid FRICU_REPLICA_OF: %s", replica_of);
+            return 1;
+        }
+        if (replication_bind && replication_bind[0] != '\0') log_warn("ignoring FRICU_REPLICATION_BIND on a follower");
+    } else if (replication_bind && replication_bind[0] != '\0' &&
+               parse_bind_addr(replication_bind, replication_config.listen_host, sizeof(replication_config.listen_host), &replication_config.listen_port) != 0) {
+        log_error("invalid FRICU_REPLICATION_BIND: %s", replication_bind);
+        return 1;
+    }
+    if (primary_url) snprintf(replication_config.primary_url, sizeof(replication_config.primary_url), "%s", primary_url);
+    if (replication_token && strlen(replication_token) >= sizeof(replication_config.token)) {
+        log_error("FRICU_REPLICATION_TOKEN is longer than %d bytes", REPLICATION_TOKEN_MAX - 1);
+        return 1;
+    }
+    if (replication_token) snprintf(replication_config.token, sizeof(replication_config.token), "%s", replication_token);
+    replication_configure(&replication_config);
 
     if (tune_fd_limit() != 0) {
         log_warn("failed to tune fd limit, continuing");
     }
 
     if (init_db(db_path) != 0) return 1;
+    if (replication_is_follower() ? replication_follower_start(db_path) != 0 : replication_primary_start(db_path) != 0) return 1;
 
     char host[128] = {0};
     int port = 8080;
@@ -53,88 +163,67 @@ int main(void) {
         return 1;
     }
 
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
-        log_error("socket creation failed: errno=%d", errno);
-        return 1;
+    int backlog = env_int("FRICU_LISTEN_BACKLOG", DEFAULT_LISTEN_BACKLOG, 1, 65535);
+    int reuse_port = env_int("FRICU_REUSEPORT", 0, 0, 1);
+#if !defined(__linux__) || !defined(SO_REUSEPORT)
+    if (reuse_port) {
+        /* Elsewhere SO_REUSEPORT does not spread connections across the sockets. */
+        log_warn("FRICU_REUSEPORT needs Linux, sharing one listening socket");
+        reuse_port = 0;
     }
-
-    int opt = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-#ifdef SO_REUSEPORT
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
 #endif
 
-    int backlog = 65535;
-    setsockopt(server_fd, SOL_SOCKET, SO_RCVBUF, &backlog, sizeof(backlog));
-    setsockopt(server_fd, SOL_SOCKET, SO_SNDBUF, &backlog, sizeof(backlog));
-
-    if (set_nonblocking(server_fd) != 0) {
-        log_error("set_nonblocking failed: errno=%d", errno);
-        close(server_fd);
-        return 1;
-    }
-
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons((uint16_t)port);
-    if (inet_pton(AF_INET, host, &addr.sin_addr) <= 0) {
-        log_error("invalid bind host: %s", host);
-        close(server_fd);
-        return 1;
-    }
-
-    if (bind(server_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        log_error("bind failed: errno=%d", errno);
-        close(server_fd);
-        return 1;
-    }
-
-    if (listen(server_fd, 65535) < 0) {
-        log_error("listen failed: errno=%d", errno);
-        close(server_fd);
-        return 1;
+    /*
+     * Shared mode: every worker watches one socket (EPOLLEXCLUSIVE wakes a
+     * single one per connection). Reuseport mode: each worker binds its own
+     * socket and the kernel spreads incoming connections across them.
+     */
+    int server_fd = -1;
+    if (!reuse_port) {
+        server_fd = open_listen_socket(host, port, backlog, 1);
+        if (server_fd < 0) return 1;
     }
 
-    struct rlimit lim;
-    if (getrlimit(RLIMIT_NOFILE, &lim) != 0) {
-        log_warn("getrlimit failed, using fallback max_fds");
-        lim.rlim_cur = 65535;
-    }
-    size_t max_fds = (size_t)lim.rlim_cur;
-
     worker_ctx_t *workers = (worker_ctx_t *)calloc(worker_count, sizeof(worker_ctx_t));
     pthread_t *threads = (pthread_t *)calloc(worker_count, sizeof(pthread_t));
     if (!workers || !threads) {
         log_error("failed to allocate worker structures");
-        close(server_fd);
+        if (server_fd >= 0) close(server_fd);
         free(workers);
         free(threads);
         return 1;
     }
 
     for (size_t i = 0; i < worker_count; i++) {
-        workers[i].listen_fd = server_fd;
-        workers[i].max_fds = max_fds;
+        workers[i].index = (int)i;
+        workers[i].listen_fd = reuse_port ? open_listen_socket(host, port, backlog, 1) : server_fd;
+        workers[i].config = config;
         strncpy(workers[i].db_path, db_path, sizeof(workers[i].db_path) - 1);
         workers[i].db_path[sizeof(workers[i].db_path) - 1] = '\0';
-        if (pthread_create(&threads[i], NULL, worker_entry, &workers[i]) != 0) {
+        if (workers[i].listen_fd < 0 || pthread_create(&threads[i], NULL, worker_entry, &workers[i]) != 0) {
             log_error("failed to start worker %zu", i);
-            close(server_fd);
-            free(workers);
-            free(threads);
             return 1;
         }
     }
 
-    log_info("fricu-server listening on %s (workers=%zu, async_io=auto)", bind_addr_str, worker_count);
+    log_info(
+        "fricu-server listening on %s (workers=%zu, reuseport=%d, cpu_affinity=%d, async_io=auto, keepalive_idle_ms=%d, keepalive_max_requests=%d, write_shards=%d)",
+        bind_addr_str,
+        worker_count,
+        reuse_port,
+        affinity_config.pin_threads,
+        config.keepalive_idle_ms,
+        config.keepalive_max_requests,
+        write_config.shard_count);
 
     for (size_t i = 0; i < worker_count; i++) {
         pthread_join(threads[i], NULL);
     }
 
-    close(server_fd);
+    for (size_t i = 0; i < worker_count; i++) {
+        if (reuse_port) close(workers[i].listen_fd);
+    }
+    if (server_fd >= 0) close(server_fd);
     free(workers);
     free(threads);
     return 0;
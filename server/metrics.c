@@ -0,0 +1,343 @@
+#define _GNU_SOURCE
+#include "server_internal.h"
+#include "logger.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Every thread that records a metric owns a shard and is its only writer,
+ * so updates are a plain load and store of relaxed atomics: no lock and no
+ * locked instruction on the request path. A scrape walks the lock-free list
+ * of shards and sums them. Shards are never freed; the one of an exited
+ * thread passes to the next new thread, keeping the totals it holds.
+ *
+ * Histograms are log-linear in the HDR style: values below 4 have a bucket
+ * each, and every power of two above that is split into 4 sub-buckets, so a
+ * bucket's width is at most a quarter of its lower bound.
+ */
+
+#define HIST_SUB_BUCKETS 4
+#define HIST_MAX_EXP 26
+#define HIST_BUCKETS (HIST_SUB_BUCKETS + (HIST_MAX_EXP - 1) * HIST_SUB_BUCKETS)
+
+typedef struct {
+    _Atomic uint64_t buckets[HIST_BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+} histogram_t;
+
+typedef struct metrics_shard {
+    struct metrics_shard *next;
+    atomic_int in_use;
+    _Atomic uint64_t requests[METRICS_ROUTE_COUNT][METRICS_STATUS_COUNT];
+    _Atomic uint64_t key_requests[DATA_KEY_ID_COUNT];
+    histogram_t stages[METRICS_STAGE_COUNT];
+    histogram_t batch_jobs;
+    _Atomic uint64_t retries;
+    _Atomic uint64_t queued;
+    /* Set by event loop workers; -1 on every other thread. */
+    _Atomic int64_t open_conns;
+} metrics_shard_t;
+
+static const char *const route_names[METRICS_ROUTE_COUNT] = {
+    "health", "data_get", "data_page", "data_put", "data_append", "data_patch", "batch_get", "batch_write", "changes",
+    "stream_write", "stream_read", "debug", "metrics", "other",
+};
+
+static const int status_codes[METRICS_STATUS_COUNT - 1] = {200, 202, 204, 304, 307, 400, 401, 404, 405, 409, 412, 413, 415, 429, 431, 500, 503};
+
+static const char *const stage_names[METRICS_STAGE_COUNT] = {
+    "parse", "json_validate", "journal_fsync", "dispatch_wait", "sqlite_step", "send",
+};
+
+static _Atomic(metrics_shard_t *) g_shards;
+static pthread_once_t g_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t g_shard_key;
+static _Thread_local metrics_shard_t *tls_shard;
+
+static void release_shard(void *shard) {
+    metrics_shard_t *s = (metrics_shard_t *)shard;
+    atomic_store_explicit(&s->open_conns, -1, memory_order_relaxed);
+    atomic_store_explicit(&s->in_use, 0, memory_order_release);
+}
+
+static void make_shard_key(void) {
+    pthread_key_create(&g_shard_key, release_shard);
+}
+
+static metrics_shard_t *thread_shard(void) {
+    if (tls_shard) return tls_shard;
+    pthread_once(&g_key_once, make_shard_key);
+    metrics_shard_t *shard = atomic_load_explicit(&g_shards, memory_order_acquire);
+    for (; shard; shard = shard->next) {
+        int idle = 0;
+        if (atomic_compare_exchange_strong_explicit(&shard->in_use, &idle, 1, memory_order_acq_rel, memory_order_relaxed)) break;
+    }
+    if (!shard) {
+        shard = (metrics_shard_t *)calloc(1, sizeof(metrics_shard_t));
+        if (!shard) return NULL;
+        atomic_init(&shard->in_use, 1);
+        atomic_init(&shard->open_conns, -1);
+        metrics_shard_t *top = atomic_load_explicit(&g_shards, memory_order_relaxed);
+        do {
+            shard->next = top;
+        } while (!atomic_compare_exchange_weak_explicit(&g_shards, &top, shard, memory_order_release, memory_order_relaxed));
+    }
+    pthread_setspecific(g_shard_key, shard);
+    tls_shard = shard;
+    return shard;
+}
+
+static void bump(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static int hist_index(uint64_t v) {
+    if (v < HIST_SUB_BUCKETS) return (int)v;
+    int exp = 63 - __builtin_clzll(v);
+    if (exp > HIST_MAX_EXP) return HIST_BUCKETS - 1;
+    int sub = (int)((v >> (exp - 2)) & (HIST_SUB_BUCKETS - 1));
+    int index = HIST_SUB_BUCKETS + (exp - 2) * HIST_SUB_BUCKETS + sub;
+    return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+/* Largest value that lands in bucket index. */
+static uint64_t hist_upper(int index) {
+    if (index < HIST_SUB_BUCKETS) return (uint64_t)index;
+    int exp = (index - HIST_SUB_BUCKETS) / HIST_SUB_BUCKETS + 2;
+    int sub = (index - HIST_SUB_BUCKETS) % HIST_SUB_BUCKETS;
+    return ((uint64_t)(HIST_SUB_BUCKETS + sub + 1) << (exp - 2)) - 1;
+}
+
+static void hist_record(histogram_t *h, uint64_t v) {
+    bump(&h->buckets[hist_index(v)], 1);
+    bump(&h->count, 1);
+    bump(&h->sum, v);
+}
+
+uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void metrics_observe_stage(int stage, uint64_t start_ns) {
+    metrics_shard_t *shard = thread_shard();
+    if (!shard) return;
+    uint64_t now = metrics_now_ns();
+    hist_record(&shard->stages[stage], now > start_ns ? (now - start_ns) / 1000 : 0);
+}
+
+int metrics_status_index(int status) {
+    for (int i = 0; i < METRICS_STATUS_COUNT - 1; i++) {
+        if (status_codes[i] == status) return i;
+    }
+    return METRICS_STATUS_COUNT - 1;
+}
+
+void metrics_count_request(int route, int status) {
+    metrics_shard_t *shard = thread_shard();
+    if (shard) bump(&shard->requests[route][metrics_status_index(status)], 1);
+}
+
+void metrics_count_key(int key_id) {
+    metrics_shard_t *shard = thread_shard();
+    if (shard) bump(&shard->key_requests[key_id], 1);
+}
+
+void metrics_observe_batch(int jobs) {
+    metrics_shard_t *shard = thread_shard();
+    if (shard) hist_record(&shard->batch_jobs, (uint64_t)jobs);
+}
+
+void metrics_count_retry(void) {
+    metrics_shard_t *shard = thread_shard();
+    if (shard) bump(&shard->retries, 1);
+}
+
+void metrics_count_queued(void) {
+    metrics_shard_t *shard = thread_shard();
+    if (shard) bump(&shard->queued, 1);
+}
+
+void metrics_set_open_conns(size_t open_conns) {
+    metrics_shard_t *shard = thread_shard();
+    if (shard) atomic_store_explicit(&shard->open_conns, (int64_t)open_conns, memory_order_relaxed);
+}
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int failed;
+} text_buf_t;
+
+static void text_printf(text_buf_t *t, const char *fmt, ...) {
+    if (t->failed) return;
+    while (1) {
+        va_list ap;
+        va_start(ap, fmt);
+        int n = vsnprintf(t->buf + t->len, t->cap - t->len, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            t->failed = 1;
+            return;
+        }
+        if ((size_t)n < t->cap - t->len) {
+            t->len += (size_t)n;
+            return;
+        }
+        size_t cap = t->cap * 2;
+        while (cap - t->len <= (size_t)n) cap *= 2;
+        char *grown = (char *)realloc(t->buf, cap);
+        if (!grown) {
+            t->failed = 1;
+            return;
+        }
+        t->buf = grown;
+        t->cap = cap;
+    }
+}
+
+static uint64_t load(const _Atomic uint64_t *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static void merge_hist(histogram_t *into, const histogram_t *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) bump(&into->buckets[i], load(&from->buckets[i]));
+    bump(&into->count, load(&from->count));
+    bump(&into->sum, load(&from->sum));
+}
+
+/* scale converts recorded units to the exposed ones (microseconds to seconds for latencies). */
+static void render_hist(text_buf_t *t, const char *name, const char *labels, const histogram_t *h, double scale) {
+    uint64_t cumulative = 0;
+    const char *sep = labels[0] ? "," : "";
+    for (int i = 0; i < HIST_BUCKETS - 1; i++) {
+        cumulative += load(&h->buckets[i]);
+        text_printf(t, "%s_bucket{%s%sle=\"%.9g\"} %llu\n", name, labels, sep, (double)hist_upper(i) * scale, (unsigned long long)cumulative);
+    }
+    text_printf(t, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep, (unsigned long long)load(&h->count));
+    const char *open = labels[0] ? "{" : "";
+    const char *close = labels[0] ? "}" : "";
+    text_printf(t, "%s_sum%s%s%s %.9g\n", name, open, labels, close, (double)load(&h->sum) * scale);
+    text_printf(t, "%s_count%s%s%s %llu\n", name, open, labels, close, (unsigned long long)load(&h->count));
+}
+
+char *metrics_render(size_t *out_len) {
+    metrics_shard_t *total = (metrics_shard_t *)calloc(1, sizeof(metrics_shard_t));
+    text_buf_t t = {(char *)malloc(64 * 1024), 0, 64 * 1024, 0};
+    if (!total || !t.buf) {
+        free(total);
+        free(t.buf);
+        return NULL;
+    }
+
+    int workers = 0;
+    for (metrics_shard_t *s = atomic_load_explicit(&g_shards, memory_order_acquire); s; s = s->next) {
+        for (int r = 0; r < METRICS_ROUTE_COUNT; r++) {
+            for (int c = 0; c < METRICS_STATUS_COUNT; c++) bump(&total->requests[r][c], load(&s->requests[r][c]));
+        }
+        for (int k = 0; k < DATA_KEY_ID_COUNT; k++) bump(&total->key_requests[k], load(&s->key_requests[k]));
+        for (int i = 0; i < METRICS_STAGE_COUNT; i++) merge_hist(&total->stages[i], &s->stages[i]);
+        merge_hist(&total->batch_jobs, &s->batch_jobs);
+        bump(&total->retries, load(&s->retries));
+        bump(&total->queued, load(&s->queued));
+    }
+
+    text_printf(&t, "# HELP fricu_http_requests_total Requests answered, by route and status.\n# TYPE fricu_http_requests_total counter\n");
+    for (int r = 0; r < METRICS_ROUTE_COUNT; r++) {
+        for (int c = 0; c < METRICS_STATUS_COUNT; c++) {
+            uint64_t n = load(&total->requests[r][c]);
+            if (n == 0) continue;
+            if (c < METRICS_STATUS_COUNT - 1) {
+                text_printf(&t, "fricu_http_requests_total{route=\"%s\",status=\"%d\"} %llu\n", route_names[r], status_codes[c], (unsigned long long)n);
+            } else {
+                text_printf(&t, "fricu_http_requests_total{route=\"%s\",status=\"other\"} %llu\n", route_names[r], (unsigned long long)n);
+            }
+        }
+    }
+
+    text_printf(&t, "# HELP fricu_data_key_requests_total Requests under /v1/data, by logical key.\n# TYPE fricu_data_key_requests_total counter\n");
+    for (int k = 0; k < DATA_KEY_ID_COUNT; k++) {
+        uint64_t n = load(&total->key_requests[k]);
+        if (n == 0) continue;
+        const char *name = k == DATA_KEY_EXPORTED_FILE ? "exported_file" : DATA_KEY_TABLE[k].name;
+        text_printf(&t, "fricu_data_key_requests_total{key=\"%s\"} %llu\n", name, (unsigned long long)n);
+    }
+
+    text_printf(&t, "# HELP fricu_stage_seconds Time spent per request stage.\n# TYPE fricu_stage_seconds histogram\n");
+    for (int i = 0; i < METRICS_STAGE_COUNT; i++) {
+        char labels[48];
+        snprintf(labels, sizeof(labels), "stage=\"%s\"", stage_names[i]);
+        render_hist(&t, "fricu_stage_seconds", labels, &total->stages[i], 1e-6);
+    }
+
+    text_printf(&t, "# HELP fricu_write_batch_jobs Jobs committed per dispatcher batch.\n# TYPE fricu_write_batch_jobs histogram\n");
+    render_hist(&t, "fricu_write_batch_jobs", "", &total->batch_jobs, 1.0);
+    text_printf(
+        &t,
+        "# HELP fricu_write_retries_total Busy retries of queued writes.\n# TYPE fricu_write_retries_total counter\nfricu_write_retries_total %llu\n",
+        (unsigned long long)load(&total->retries));
+    text_printf(
+        &t,
+        "# HELP fricu_write_queued_total Writes answered 202 while still queued.\n# TYPE fricu_write_queued_total counter\nfricu_write_queued_total %llu\n",
+        (unsigned long long)load(&total->queued));
+    text_printf(
+        &t,
+        "# HELP fricu_log_dropped_lines_total Log lines dropped because a buffer was full.\n# TYPE fricu_log_dropped_lines_total counter\n"
+        "fricu_log_dropped_lines_total %lld\n",
+        logger_dropped_lines());
+
+    text_printf(&t, "# HELP fricu_open_connections Open client connections per worker.\n# TYPE fricu_open_connections gauge\n");
+    for (metrics_shard_t *s = atomic_load_explicit(&g_shards, memory_order_acquire); s; s = s->next) {
+        int64_t open = atomic_load_explicit(&s->open_conns, memory_order_relaxed);
+        if (open < 0) continue;
+        text_printf(&t, "fricu_open_connections{worker=\"%d\"} %lld\n", workers++, (long long)open);
+    }
+
+    replication_stats_t repl;
+    replication_stats_snapshot(&repl);
+    if (repl.role == REPLICATION_ROLE_PRIMARY) {
+        text_printf(
+            &t,
+            "# HELP fricu_replication_followers Followers streaming from this primary.\n# TYPE fricu_replication_followers gauge\n"
+            "fricu_replication_followers %d\n"
+            "# HELP fricu_replication_position Last replication log position published.\n# TYPE fricu_replication_position gauge\n"
+            "fricu_replication_position %llu\n",
+            repl.connected,
+            (unsigned long long)repl.position);
+    } else if (repl.role == REPLICATION_ROLE_FOLLOWER) {
+        uint64_t behind = repl.primary_position > repl.position ? repl.primary_position - repl.position : 0;
+        text_printf(
+            &t,
+            "# HELP fricu_replica_connected Whether this follower is streaming from its primary.\n# TYPE fricu_replica_connected gauge\n"
+            "fricu_replica_connected %d\n"
+            "# HELP fricu_replica_lag_seconds How long ago the last applied write committed on the primary; 0 once caught up.\n"
+            "# TYPE fricu_replica_lag_seconds gauge\nfricu_replica_lag_seconds %.6f\n"
+            "# HELP fricu_replica_lag_records Writes the primary is known to have that are not applied here.\n"
+            "# TYPE fricu_replica_lag_records gauge\nfricu_replica_lag_records %llu\n"
+            "# HELP fricu_replica_applied_total Writes applied from the replication stream.\n# TYPE fricu_replica_applied_total counter\n"
+            "fricu_replica_applied_total %lld\n"
+            "# HELP fricu_replica_snapshots_total Full snapshots loaded from the primary.\n# TYPE fricu_replica_snapshots_total counter\n"
+            "fricu_replica_snapshots_total %lld\n",
+            repl.connected,
+            repl.lag_seconds,
+            (unsigned long long)behind,
+            repl.applied_records,
+            repl.snapshots);
+    }
+
+    free(total);
+    if (t.failed) {
+        free(t.buf);
+        return NULL;
+    }
+    *out_len = t.len;
+    return t.buf;
+}
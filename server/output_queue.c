@@ -0,0 +1,239 @@
+#define _GNU_SOURCE
+
+#include "server.h"
+#include "server_internal.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#if defined(__linux__)
+#include <time.h>
+#include <linux/errqueue.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define FRICU_HAVE_ZEROCOPY 1
+#endif
+#endif
+
+typedef struct zc_hold {
+    shared_buf_t *buf;
+    uint32_t id;
+    struct zc_hold *next;
+} zc_hold_t;
+
+/* Takes ownership of the caller's reference to buf, even on failure. */
+int conn_output_append(conn_t *conn, shared_buf_t *buf, size_t off, size_t len) {
+    if (!buf) return -1;
+    if (len == 0) {
+        shared_buf_release(buf);
+        return 0;
+    }
+    out_seg_t *seg = (out_seg_t *)malloc(sizeof(out_seg_t));
+    if (!seg) {
+        shared_buf_release(buf);
+        return -1;
+    }
+    seg->buf = buf;
+    seg->off = off;
+    seg->len = len;
+    seg->next = NULL;
+    if (conn->out_tail) {
+        conn->out_tail->next = seg;
+    } else {
+        conn->out_head = seg;
+    }
+    conn->out_tail = seg;
+    conn->out_bytes += len;
+    return 0;
+}
+
+static void pop_head(conn_t *conn) {
+    out_seg_t *seg = conn->out_head;
+    conn->out_head = seg->next;
+    if (!conn->out_head) conn->out_tail = NULL;
+    shared_buf_release(seg->buf);
+    free(seg);
+}
+
+int conn_output_enable_zerocopy(int fd, conn_t *conn, size_t min_bytes) {
+#if defined(FRICU_HAVE_ZEROCOPY)
+    int one = 1;
+    if (min_bytes == 0 || setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) return -1;
+    conn->zerocopy = 1;
+    conn->zerocopy_min = min_bytes;
+    return 0;
+#else
+    (void)fd;
+    (void)conn;
+    (void)min_bytes;
+    return -1;
+#endif
+}
+
+int conn_output_zerocopy_pending(const conn_t *conn) {
+    return conn->zc_head != NULL;
+}
+
+static void release_holds(conn_t *conn, uint32_t lo, uint32_t hi) {
+    zc_hold_t **slot = &conn->zc_head;
+    conn->zc_tail = NULL;
+    while (*slot) {
+        zc_hold_t *hold = *slot;
+        if ((uint32_t)(hold->id - lo) <= (uint32_t)(hi - lo)) {
+            *slot = hold->next;
+            shared_buf_release(hold->buf);
+            free(hold);
+            continue;
+        }
+        conn->zc_tail = hold;
+        slot = &hold->next;
+    }
+}
+
+int conn_output_reap_zerocopy(int fd, conn_t *conn) {
+#if defined(FRICU_HAVE_ZEROCOPY)
+    while (1) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) {
+                continue;
+            }
+            struct sock_extended_err serr;
+            memcpy(&serr, CMSG_DATA(cm), sizeof(serr));
+            if (serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                if (serr.ee_errno != 0) return -1;
+                continue;
+            }
+            release_holds(conn, serr.ee_info, serr.ee_data);
+        }
+    }
+#else
+    (void)fd;
+    (void)conn;
+    return 0;
+#endif
+}
+
+#if defined(FRICU_HAVE_ZEROCOPY)
+/*
+ * A peer advertising less than this (a reader with a tiny SO_RCVBUF) drops
+ * the page-backed skbs of a zerocopy send and only takes them on
+ * retransmit backoff, so neither writability nor completions come back.
+ */
+#define ZEROCOPY_MIN_PEER_WINDOW (32 * 1024)
+
+static int peer_window_fits_zerocopy(int fd) {
+    struct tcp_info info;
+    memset(&info, 0, sizeof(info));
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) return 1;
+    if (len < offsetof(struct tcp_info, tcpi_snd_wnd) + sizeof(info.tcpi_snd_wnd)) return 1;
+    return info.tcpi_snd_wnd >= ZEROCOPY_MIN_PEER_WINDOW;
+}
+#endif
+
+/* Pins every buffer the last zerocopy send touched under that send's id. */
+static int hold_sent_buffers(conn_t *conn, size_t written) {
+    uint32_t id = conn->zc_next_id++;
+    for (out_seg_t *seg = conn->out_head; seg && written > 0; seg = seg->next) {
+        zc_hold_t *hold = (zc_hold_t *)malloc(sizeof(zc_hold_t));
+        if (!hold) return -1;
+        hold->buf = shared_buf_retain(seg->buf);
+        hold->id = id;
+        hold->next = NULL;
+        if (conn->zc_tail) {
+            conn->zc_tail->next = hold;
+        } else {
+            conn->zc_head = hold;
+        }
+        conn->zc_tail = hold;
+        written -= written < seg->len ? written : seg->len;
+    }
+    return 0;
+}
+
+/*
+ * Writes as much queued output as the socket accepts without blocking.
+ * Returns 0 when the queue is empty, 1 when bytes remain (wait for
+ * writability), -1 on a socket error.
+ */
+int conn_output_flush(int fd, conn_t *conn) {
+    while (conn->out_head) {
+        struct iovec iov[OUT_FLUSH_MAX_IOV];
+        int iovcnt = 0;
+        int zerocopy = 0;
+        for (out_seg_t *seg = conn->out_head; seg && iovcnt < OUT_FLUSH_MAX_IOV; seg = seg->next) {
+            iov[iovcnt].iov_base = seg->buf->data + seg->off;
+            iov[iovcnt].iov_len = seg->len;
+            iovcnt++;
+            if (conn->zerocopy && seg->len >= conn->zerocopy_min) zerocopy = 1;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (size_t)iovcnt;
+        int flags = socket_send_flags();
+#if defined(FRICU_HAVE_ZEROCOPY)
+        if (zerocopy && !peer_window_fits_zerocopy(fd)) zerocopy = 0;
+        if (zerocopy) flags |= MSG_ZEROCOPY;
+#endif
+        uint64_t send_start = metrics_now_ns();
+        ssize_t n = sendmsg(fd, &msg, flags);
+        metrics_observe_stage(METRICS_STAGE_SEND, send_start);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            /* Out of optmem for pinned pages: fall back to a copying send. */
+            if (zerocopy && errno == ENOBUFS) n = sendmsg(fd, &msg, socket_send_flags());
+            zerocopy = 0;
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+                return -1;
+            }
+        }
+
+        size_t written = (size_t)n;
+        if (zerocopy && hold_sent_buffers(conn, written) != 0) return -1;
+        conn->out_bytes -= written;
+        while (written > 0 && conn->out_head) {
+            out_seg_t *seg = conn->out_head;
+            if (written < seg->len) {
+                seg->off += written;
+                seg->len -= written;
+                written = 0;
+                break;
+            }
+            written -= seg->len;
+            pop_head(conn);
+        }
+    }
+    return 0;
+}
+
+void conn_output_reset(conn_t *conn) {
+    while (conn->out_head) pop_head(conn);
+    conn->out_bytes = 0;
+    while (conn->zc_head) {
+        zc_hold_t *hold = conn->zc_head;
+        conn->zc_head = hold->next;
+        shared_buf_release(hold->buf);
+        free(hold);
+    }
+    conn->zc_tail = NULL;
+}
@@ -0,0 +1,1080 @@
+#define _GNU_SOURCE
+#include "server_internal.h"
+#include "logger.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Primary side: dispatchers hand every write they committed to
+ * replication_publish, which encodes it once as a frame and keeps it in a
+ * ring of positions, bounded by log_bytes. Each connected follower has a
+ * sender thread that streams the frames after the position it asked for.
+ * A follower that asks for a position the ring no longer holds (a new
+ * follower, one that fell too far behind, or one that last streamed from an
+ * earlier primary process) is sent a snapshot of every row first.
+ *
+ * Follower side: one thread streams from the primary and applies what it
+ * gets with its own connection per shard, committing everything that
+ * arrived together in one transaction per shard. A frame carries the
+ * version the primary wrote, and one is skipped when its row already holds
+ * that version or a later one, so overlap between a snapshot and the frames
+ * that follow it, or a resent stretch after a reconnect, is harmless.
+ *
+ * Positions start at the process start time in microseconds, as the change
+ * feed's seqs do, so a follower's position from an earlier primary process
+ * reads as outside the window instead of silently skipping writes.
+ */
+
+#define REPLICATION_LOG_MAX_FRAMES 65536
+#define REPLICATION_MAX_FOLLOWERS 16
+#define REPLICATION_FRAME_HEADER 32
+#define REPLICATION_FRAME_MAX (256 * 1024 * 1024)
+#define REPLICATION_HEARTBEAT_MS 1000
+/* A follower that hears nothing, not even a heartbeat, for this long reconnects. */
+#define REPLICATION_IDLE_TIMEOUT_MS 5000
+#define REPLICATION_SEND_TIMEOUT_MS 30000
+#define REPLICATION_RECONNECT_MS 1000
+#define REPLICATION_SEND_CHUNK (256 * 1024)
+/* Frames a sender takes from the ring per wakeup. */
+#define REPLICATION_SEND_FRAMES 256
+
+enum {
+    FRAME_RECORD = 1,
+    /* position is the primary's last position; stamp its clock. */
+    FRAME_HEARTBEAT = 2,
+    /* The rows that follow replace the follower's; the stream resumes after position. */
+    FRAME_SNAPSHOT_BEGIN = 3,
+    FRAME_SNAPSHOT_ROW = 4,
+    FRAME_SNAPSHOT_END = 5,
+};
+
+/*
+ * Frame: type, op, key length (16 bits), payload length (32 bits),
+ * position, version, stamp (64 bits each, realtime microseconds), then the
+ * storage key and the payload. Fields are in host byte order, as in the
+ * journal and batch payloads.
+ */
+typedef struct {
+    int type;
+    int op;
+    uint64_t position;
+    uint64_t version;
+    uint64_t stamp_us;
+    const char *key;
+    size_t key_len;
+    const char *payload;
+    size_t payload_len;
+} frame_t;
+
+typedef struct {
+    pthread_t thread;
+    int fd;
+    int active;
+    uint64_t start;
+} follower_slot_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    atomic_int enabled;
+    int stopping;
+    /* Ring of encoded FRAME_RECORDs; position base + 1 is the first one. */
+    shared_buf_t **frames;
+    uint64_t base;
+    uint64_t last;
+    size_t count;
+    size_t bytes;
+    char db_path[512];
+    int listen_fd;
+    pthread_t listener;
+    int listener_running;
+    follower_slot_t followers[REPLICATION_MAX_FOLLOWERS];
+} primary_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    int running;
+    int stopping;
+    int fd;
+    pthread_t thread;
+    char db_path[512];
+    int connected;
+    uint64_t applied;
+    uint64_t primary_position;
+    uint64_t lag_stamp_us;
+    long long applied_records;
+    long long snapshots;
+} follower_t;
+
+static replication_config_t g_config = {
+    .log_bytes = DEFAULT_REPLICATION_LOG_BYTES,
+};
+static primary_t g_primary = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .listen_fd = -1,
+};
+static follower_t g_follower = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .fd = -1,
+};
+
+static uint64_t realtime_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+void replication_configure(const replication_config_t *config) {
+    if (!config) return;
+    g_config = *config;
+    if (g_config.log_bytes == 0) g_config.log_bytes = DEFAULT_REPLICATION_LOG_BYTES;
+}
+
+int replication_is_follower(void) {
+    return g_config.primary_host[0] != '\0';
+}
+
+const char *replication_primary_url(void) {
+    return g_config.primary_url;
+}
+
+static void encode_header(unsigned char *p, int type, int op, size_t key_len, size_t payload_len, uint64_t position, uint64_t version, uint64_t stamp_us) {
+    uint16_t key_len16 = (uint16_t)key_len;
+    uint32_t payload_len32 = (uint32_t)payload_len;
+    p[0] = (unsigned char)type;
+    p[1] = (unsigned char)op;
+    memcpy(p + 2, &key_len16, 2);
+    memcpy(p + 4, &payload_len32, 4);
+    memcpy(p + 8, &position, 8);
+    memcpy(p + 16, &version, 8);
+    memcpy(p + 24, &stamp_us, 8);
+}
+
+/* 1 with *out filled and *pos advanced, 0 when the frame at *pos is not complete yet, -1 when malformed. */
+static int decode_frame(const char *buf, size_t len, size_t *pos, frame_t *out) {
+    if (len - *pos < REPLICATION_FRAME_HEADER) return 0;
+    const unsigned char *p = (const unsigned char *)buf + *pos;
+    uint16_t key_len = 0;
+    uint32_t payload_len = 0;
+    memcpy(&key_len, p + 2, 2);
+    memcpy(&payload_len, p + 4, 4);
+    if (p[0] < FRAME_RECORD || p[0] > FRAME_SNAPSHOT_END || (size_t)key_len + payload_len > REPLICATION_FRAME_MAX) return -1;
+    size_t total = REPLICATION_FRAME_HEADER + (size_t)key_len + payload_len;
+    if (len - *pos < total) return 0;
+    out->type = p[0];
+    out->op = p[1];
+    memcpy(&out->position, p + 8, 8);
+    memcpy(&out->version, p + 16, 8);
+    memcpy(&out->stamp_us, p + 24, 8);
+    out->key = (const char *)p + REPLICATION_FRAME_HEADER;
+    out->key_len = key_len;
+    out->payload = out->key + key_len;
+    out->payload_len = payload_len;
+    *pos += total;
+    return 1;
+}
+
+static int send_all(int fd, const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, socket_send_flags());
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void set_socket_timeout(int fd, int option, int timeout_ms) {
+    struct timeval tv;
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, option, &tv, sizeof(tv));
+}
+
+/* ---- Primary ---- */
+
+/* Called with the primary mutex held. */
+static uint64_t oldest_position(void) {
+    return g_primary.last - g_primary.count + 1;
+}
+
+/* Called with the primary mutex held. */
+static void drop_oldest_frame(void) {
+    size_t slot = (size_t)((oldest_position() - g_primary.base - 1) % REPLICATION_LOG_MAX_FRAMES);
+    g_primary.bytes -= g_primary.frames[slot]->len;
+    shared_buf_release(g_primary.frames[slot]);
+    g_primary.frames[slot] = NULL;
+    g_primary.count--;
+}
+
+/*
+ * A write that cannot be logged still takes a position, with the whole ring
+ * dropped before it, so every follower finds itself outside the window and
+ * resyncs rather than missing it.
+ */
+static void skip_unlogged_write(const char *storage_key) {
+    log_error("replication log could not hold key=%s, followers will resync", storage_key);
+    pthread_mutex_lock(&g_primary.mutex);
+    if (atomic_load_explicit(&g_primary.enabled, memory_order_relaxed)) {
+        while (g_primary.count > 0) drop_oldest_frame();
+        g_primary.last++;
+        pthread_cond_broadcast(&g_primary.cond);
+    }
+    pthread_mutex_unlock(&g_primary.mutex);
+}
+
+void replication_publish(int op, const char *storage_key, const char *payload, size_t payload_len, uint64_t version) {
+    if (!atomic_load_explicit(&g_primary.enabled, memory_order_acquire)) return;
+    size_t key_len = strlen(storage_key);
+    shared_buf_t *frame = key_len <= UINT16_MAX && payload_len <= UINT32_MAX
+        ? shared_buf_new(REPLICATION_FRAME_HEADER + key_len + payload_len)
+        : NULL;
+    if (!frame) {
+        skip_unlogged_write(storage_key);
+        return;
+    }
+    memcpy(frame->data + REPLICATION_FRAME_HEADER, storage_key, key_len);
+    if (payload_len > 0) memcpy(frame->data + REPLICATION_FRAME_HEADER + key_len, payload, payload_len);
+
+    pthread_mutex_lock(&g_primary.mutex);
+    if (!atomic_load_explicit(&g_primary.enabled, memory_order_relaxed)) {
+        pthread_mutex_unlock(&g_primary.mutex);
+        shared_buf_release(frame);
+        return;
+    }
+    /* The newest frame always stays, however large. */
+    while (g_primary.count > 0 &&
+           (g_primary.count == REPLICATION_LOG_MAX_FRAMES || g_primary.bytes + frame->len > g_config.log_bytes)) {
+        drop_oldest_frame();
+    }
+    uint64_t position = ++g_primary.last;
+    encode_header((unsigned char *)frame->data, FRAME_RECORD, op, key_len, payload_len, position, version, realtime_us());
+    g_primary.frames[(position - g_primary.base - 1) % REPLICATION_LOG_MAX_FRAMES] = frame;
+    g_primary.count++;
+    g_primary.bytes += frame->len;
+    pthread_cond_broadcast(&g_primary.cond);
+    pthread_mutex_unlock(&g_primary.mutex);
+}
+
+typedef struct {
+    int fd;
+    char *buf;
+    size_t len;
+    size_t cap;
+} out_buf_t;
+
+static int out_flush(out_buf_t *out) {
+    int rc = send_all(out->fd, out->buf, out->len);
+    out->len = 0;
+    return rc;
+}
+
+static int out_frame(out_buf_t *out, int type, int op, const char *key, size_t key_len, const char *payload, size_t payload_len, uint64_t position, uint64_t version, uint64_t stamp_us) {
+    size_t need = REPLICATION_FRAME_HEADER + key_len + payload_len;
+    if (out->len + need > out->cap) {
+        if (out->len > 0 && out_flush(out) != 0) return -1;
+        if (need > out->cap) {
+            char *grown = (char *)realloc(out->buf, need);
+            if (!grown) return -1;
+            out->buf = grown;
+            out->cap = need;
+        }
+    }
+    encode_header((unsigned char *)out->buf + out->len, type, op, key_len, payload_len, position, version, stamp_us);
+    memcpy(out->buf + out->len + REPLICATION_FRAME_HEADER, key, key_len);
+    if (payload_len > 0) memcpy(out->buf + out->len + REPLICATION_FRAME_HEADER + key_len, payload, payload_len);
+    out->len += need;
+    return out->len >= REPLICATION_SEND_CHUNK ? out_flush(out) : 0;
+}
+
+/* A list key kept as kv_items rows is sent as the array those rows add up to. */
+static int snapshot_list_value(sqlite3_stmt *items, const char *key, char **buf, size_t *cap, size_t *out_len) {
+    size_t len = 0;
+    sqlite3_reset(items);
+    sqlite3_bind_text(items, 1, key, -1, SQLITE_TRANSIENT);
+    int rc;
+    while ((rc = sqlite3_step(items)) == SQLITE_ROW) {
+        const char *elem = (const char *)sqlite3_column_text(items, 0);
+        size_t elem_len = (size_t)sqlite3_column_bytes(items, 0);
+        if (len + elem_len + 2 > *cap) {
+            size_t grown_cap = *cap ? *cap : 4096;
+            while (grown_cap < len + elem_len + 2) grown_cap *= 2;
+            char *grown = (char *)realloc(*buf, grown_cap);
+            if (!grown) {
+                sqlite3_reset(items);
+                return -1;
+            }
+            *buf = grown;
+            *cap = grown_cap;
+        }
+        char sep = len == 0 ? '[' : ',';
+        (*buf)[len++] = sep;
+        memcpy(*buf + len, elem, elem_len);
+        len += elem_len;
+    }
+    sqlite3_reset(items);
+    if (rc != SQLITE_DONE) return -1;
+    if (len == 0) {
+        if (*cap < 2) {
+            char *grown = (char *)realloc(*buf, 4096);
+            if (!grown) return -1;
+            *buf = grown;
+            *cap = 4096;
+        }
+        (*buf)[len++] = '[';
+    }
+    (*buf)[len++] = ']';
+    *out_len = len;
+    return 0;
+}
+
+static int snapshot_shard(out_buf_t *out, const char *path, long long *out_rows) {
+    sqlite3 *db = NULL;
+    sqlite3_stmt *rows = NULL;
+    sqlite3_stmt *items = NULL;
+    sqlite3_stmt *chunks = NULL;
+    char *list = NULL;
+    size_t list_cap = 0;
+    int rc = -1;
+    if (sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+        log_error("replication snapshot failed to open %s: %s", path, sqlite3_errmsg(db));
+        goto done;
+    }
+    sqlite3_exec(db, "PRAGMA busy_timeout=5000;", NULL, NULL, NULL);
+    /* One read transaction, so the shard is sent as of a single commit. */
+    if (sqlite3_exec(db, "BEGIN", NULL, NULL, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "SELECT data_key, version, items, data_value FROM kv_store", -1, &rows, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "SELECT item_value FROM kv_items WHERE data_key=?1 ORDER BY position", -1, &items, NULL) != SQLITE_OK ||
+        sqlite3_prepare_v2(db, "SELECT version, columns FROM ride_chunks WHERE stream_key=?1 ORDER BY t_last", -1, &chunks, NULL) != SQLITE_OK) {
+        log_error("replication snapshot failed to read %s: %s", path, sqlite3_errmsg(db));
+        goto done;
+    }
+    int step;
+    while ((step = sqlite3_step(rows)) == SQLITE_ROW) {
+        const char *key = (const char *)sqlite3_column_text(rows, 0);
+        size_t key_len = (size_t)sqlite3_column_bytes(rows, 0);
+        uint64_t version = (uint64_t)sqlite3_column_int64(rows, 1);
+        const char *value = (const char *)sqlite3_column_text(rows, 3);
+        size_t value_len = (size_t)sqlite3_column_bytes(rows, 3);
+        if (sqlite3_column_int64(rows, 2) > 0) {
+            if (snapshot_list_value(items, key, &list, &list_cap, &value_len) != 0) goto done;
+            value = list;
+        }
+        /* A ride's chunks go ahead of its head row, which then overwrites the head they rebuilt. */
+        if (ride_storage_key_is_valid(key)) {
+            if (key_len > UINT16_MAX) goto done;
+            sqlite3_reset(chunks);
+            sqlite3_bind_text(chunks, 1, key, (int)key_len, SQLITE_STATIC);
+            int chunk_step;
+            while ((chunk_step = sqlite3_step(chunks)) == SQLITE_ROW) {
+                const char *chunk = (const char *)sqlite3_column_blob(chunks, 1);
+                size_t chunk_len = (size_t)sqlite3_column_bytes(chunks, 1);
+                if (out_frame(out, FRAME_SNAPSHOT_ROW, WRITE_OP_RIDE_CHUNK, key, key_len, chunk, chunk_len, 0, (uint64_t)sqlite3_column_int64(chunks, 0), 0) != 0) goto done;
+                (*out_rows)++;
+            }
+            sqlite3_reset(chunks);
+            if (chunk_step != SQLITE_DONE) goto done;
+        }
+        if (key_len > UINT16_MAX || out_frame(out, FRAME_SNAPSHOT_ROW, WRITE_OP_PUT, key, key_len, value, value_len, 0, version, 0) != 0) goto done;
+        (*out_rows)++;
+    }
+    rc = step == SQLITE_DONE ? 0 : -1;
+
+done:
+    free(list);
+    sqlite3_finalize(rows);
+    sqlite3_finalize(items);
+    sqlite3_finalize(chunks);
+    if (db) {
+        if (!sqlite3_get_autocommit(db)) sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+        sqlite3_close(db);
+    }
+    return rc;
+}
+
+/*
+ * The position is taken before any shard is read: every write after it is
+ * streamed next, and those the snapshot already holds are skipped by
+ * version on the follower.
+ */
+static int send_snapshot(out_buf_t *out, uint64_t *position) {
+    pthread_mutex_lock(&g_primary.mutex);
+    uint64_t start = g_primary.last;
+    pthread_mutex_unlock(&g_primary.mutex);
+
+    uint64_t started_ns = metrics_now_ns();
+    long long rows = 0;
+    if (out_frame(out, FRAME_SNAPSHOT_BEGIN, 0, "", 0, NULL, 0, start, 0, realtime_us()) != 0) return -1;
+    int shard_count = write_dispatch_shard_count();
+    for (int i = 0; i < shard_count; i++) {
+        char path[512];
+        if (shard_db_path(g_primary.db_path, i, path, sizeof(path)) != 0 || snapshot_shard(out, path, &rows) != 0) return -1;
+    }
+    if (out_frame(out, FRAME_SNAPSHOT_END, 0, "", 0, NULL, 0, start, 0, realtime_us()) != 0 || out_flush(out) != 0) return -1;
+    log_info(
+        "replication snapshot sent rows=%lld position=%llu elapsed_ms=%llu",
+        rows,
+        (unsigned long long)start,
+        (unsigned long long)((metrics_now_ns() - started_ns) / 1000000ull));
+    *position = start;
+    return 0;
+}
+
+static void *sender_main(void *arg) {
+    follower_slot_t *slot = (follower_slot_t *)arg;
+    out_buf_t out = {slot->fd, (char *)malloc(REPLICATION_SEND_CHUNK), 0, REPLICATION_SEND_CHUNK};
+    uint64_t position = slot->start;
+    shared_buf_t *frames[REPLICATION_SEND_FRAMES];
+    int ok = out.buf != NULL;
+
+    while (ok) {
+        int count = 0;
+        int resync = 0;
+        uint64_t last = 0;
+        pthread_mutex_lock(&g_primary.mutex);
+        if (!g_primary.stopping && position == g_primary.last) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += REPLICATION_HEARTBEAT_MS / 1000;
+            pthread_cond_timedwait(&g_primary.cond, &g_primary.mutex, &deadline);
+        }
+        if (g_primary.stopping) {
+            pthread_mutex_unlock(&g_primary.mutex);
+            break;
+        }
+        last = g_primary.last;
+        if (position < g_primary.base || position > last || position + 1 < oldest_position()) {
+            resync = 1;
+        } else {
+            for (uint64_t p = position + 1; p <= last && count < REPLICATION_SEND_FRAMES; p++) {
+                frames[count++] = shared_buf_retain(g_primary.frames[(p - g_primary.base - 1) % REPLICATION_LOG_MAX_FRAMES]);
+            }
+        }
+        pthread_mutex_unlock(&g_primary.mutex);
+
+        if (resync) {
+            ok = send_snapshot(&out, &position) == 0;
+            continue;
+        }
+        if (count == 0) {
+            ok = out_frame(&out, FRAME_HEARTBEAT, 0, "", 0, NULL, 0, last, 0, realtime_us()) == 0 && out_flush(&out) == 0;
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            const shared_buf_t *frame = frames[i];
+            /* Large frames go out as they are; small ones are coalesced. */
+            if (frame->len >= REPLICATION_SEND_CHUNK) {
+                if (ok && out.len > 0) ok = out_flush(&out) == 0;
+                if (ok) ok = send_all(out.fd, frame->data, frame->len) == 0;
+            } else if (ok) {
+                if (out.len + frame->len > out.cap) ok = out_flush(&out) == 0;
+                if (ok) {
+                    memcpy(out.buf + out.len, frame->data, frame->len);
+                    out.len += frame->len;
+                }
+            }
+            shared_buf_release(frames[i]);
+        }
+        if (ok) ok = out_flush(&out) == 0;
+        position += (uint64_t)count;
+    }
+
+    free(out.buf);
+    pthread_mutex_lock(&g_primary.mutex);
+    if (g_primary.stopping) {
+        /* replication_stop joins this thread and closes the socket. */
+        pthread_mutex_unlock(&g_primary.mutex);
+        return NULL;
+    }
+    close(slot->fd);
+    slot->fd = -1;
+    slot->active = 0;
+    pthread_detach(slot->thread);
+    pthread_mutex_unlock(&g_primary.mutex);
+    log_info("replication follower disconnected position=%llu", (unsigned long long)position);
+    return NULL;
+}
+
+/* "FRICU-REPLICATE <position> <token>\n", where token is "-" when none is configured. */
+static int read_handshake(int fd, uint64_t *out_position) {
+    char line[64 + REPLICATION_TOKEN_MAX];
+    size_t len = 0;
+    while (len < sizeof(line) - 1) {
+        ssize_t n = recv(fd, line + len, 1, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        if (line[len] == '\n') break;
+        len++;
+    }
+    line[len] = '\0';
+    unsigned long long position = 0;
+    char token[REPLICATION_TOKEN_MAX];
+    if (sscanf(line, "FRICU-REPLICATE %llu %127s", &position, token) != 2) return -1;
+    const char *want = g_config.token[0] != '\0' ? g_config.token : "-";
+    if (strcmp(token, want) != 0) return -1;
+    *out_position = (uint64_t)position;
+    return 0;
+}
+
+static void accept_follower(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags >= 0) fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    configure_socket_after_accept(fd);
+    set_socket_timeout(fd, SO_RCVTIMEO, REPLICATION_IDLE_TIMEOUT_MS);
+    set_socket_timeout(fd, SO_SNDTIMEO, REPLICATION_SEND_TIMEOUT_MS);
+    uint64_t position = 0;
+    if (read_handshake(fd, &position) != 0) {
+        log_warn("replication follower rejected reason=bad_handshake");
+        close(fd);
+        return;
+    }
+
+    pthread_mutex_lock(&g_primary.mutex);
+    follower_slot_t *slot = NULL;
+    for (int i = 0; i < REPLICATION_MAX_FOLLOWERS && !slot; i++) {
+        if (!g_primary.followers[i].active) slot = &g_primary.followers[i];
+    }
+    if (!slot) {
+        pthread_mutex_unlock(&g_primary.mutex);
+        log_warn("replication follower rejected reason=too_many_followers");
+        close(fd);
+        return;
+    }
+    slot->fd = fd;
+    slot->start = position;
+    slot->active = 1;
+    log_info("replication follower connected position=%llu", (unsigned long long)position);
+    if (pthread_create(&slot->thread, NULL, sender_main, slot) != 0) {
+        slot->active = 0;
+        slot->fd = -1;
+        pthread_mutex_unlock(&g_primary.mutex);
+        log_error("replication follower rejected reason=thread_create_failed");
+        close(fd);
+        return;
+    }
+    pthread_mutex_unlock(&g_primary.mutex);
+}
+
+static void *listener_main(void *arg) {
+    (void)arg;
+    while (1) {
+        pthread_mutex_lock(&g_primary.mutex);
+        int stopping = g_primary.stopping;
+        pthread_mutex_unlock(&g_primary.mutex);
+        if (stopping) break;
+
+        struct pollfd pfd = {.fd = g_primary.listen_fd, .events = POLLIN};
+        if (poll(&pfd, 1, 200) <= 0) continue;
+        int fd = accept(g_primary.listen_fd, NULL, NULL);
+        if (fd >= 0) accept_follower(fd);
+    }
+    return NULL;
+}
+
+int replication_primary_start(const char *db_path) {
+    if (g_config.listen_port <= 0) return 0;
+    pthread_mutex_lock(&g_primary.mutex);
+    if (atomic_load(&g_primary.enabled)) {
+        pthread_mutex_unlock(&g_primary.mutex);
+        return -1;
+    }
+    g_primary.frames = (shared_buf_t **)calloc(REPLICATION_LOG_MAX_FRAMES, sizeof(shared_buf_t *));
+    if (!g_primary.frames || snprintf(g_primary.db_path, sizeof(g_primary.db_path), "%s", db_path) >= (int)sizeof(g_primary.db_path)) {
+        free(g_primary.frames);
+        g_primary.frames = NULL;
+        pthread_mutex_unlock(&g_primary.mutex);
+        return -1;
+    }
+    uint64_t base = realtime_us();
+    if (base <= g_primary.last) base = g_primary.last + 1;
+    g_primary.base = base;
+    g_primary.last = base;
+    g_primary.count = 0;
+    g_primary.bytes = 0;
+    g_primary.stopping = 0;
+    g_primary.listen_fd = open_listen_socket(g_config.listen_host[0] ? g_config.listen_host : "0.0.0.0", g_config.listen_port, 64, 0);
+    if (g_primary.listen_fd < 0 || pthread_create(&g_primary.listener, NULL, listener_main, NULL) != 0) {
+        if (g_primary.listen_fd >= 0) close(g_primary.listen_fd);
+        g_primary.listen_fd = -1;
+        free(g_primary.frames);
+        g_primary.frames = NULL;
+        pthread_mutex_unlock(&g_primary.mutex);
+        log_error("failed to start replication listener on %s:%d", g_config.listen_host, g_config.listen_port);
+        return -1;
+    }
+    g_primary.listener_running = 1;
+    atomic_store_explicit(&g_primary.enabled, 1, memory_order_release);
+    pthread_mutex_unlock(&g_primary.mutex);
+    if (g_config.token[0] == '\0') log_warn("replication listener has no FRICU_REPLICATION_TOKEN; any client may read every row");
+    log_info("replication listening on %s:%d (log_bytes=%zu)", g_config.listen_host, g_config.listen_port, g_config.log_bytes);
+    return 0;
+}
+
+static void primary_stop(void) {
+    pthread_mutex_lock(&g_primary.mutex);
+    if (!atomic_load(&g_primary.enabled)) {
+        pthread_mutex_unlock(&g_primary.mutex);
+        return;
+    }
+    atomic_store_explicit(&g_primary.enabled, 0, memory_order_release);
+    g_primary.stopping = 1;
+    pthread_cond_broadcast(&g_primary.cond);
+    for (int i = 0; i < REPLICATION_MAX_FOLLOWERS; i++) {
+        if (g_primary.followers[i].active) shutdown(g_primary.followers[i].fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&g_primary.mutex);
+
+    if (g_primary.listener_running) pthread_join(g_primary.listener, NULL);
+    g_primary.listener_running = 0;
+    close(g_primary.listen_fd);
+    g_primary.listen_fd = -1;
+    for (int i = 0; i < REPLICATION_MAX_FOLLOWERS; i++) {
+        follower_slot_t *slot = &g_primary.followers[i];
+        if (!slot->active) continue;
+        pthread_join(slot->thread, NULL);
+        close(slot->fd);
+        slot->fd = -1;
+        slot->active = 0;
+    }
+
+    pthread_mutex_lock(&g_primary.mutex);
+    for (size_t i = 0; i < REPLICATION_LOG_MAX_FRAMES; i++) shared_buf_release(g_primary.frames[i]);
+    free(g_primary.frames);
+    g_primary.frames = NULL;
+    g_primary.count = 0;
+    g_primary.bytes = 0;
+    g_primary.stopping = 0;
+    pthread_mutex_unlock(&g_primary.mutex);
+}
+
+/* ---- Follower ---- */
+
+typedef struct {
+    int count;
+    sqlite3 *dbs[MAX_WRITE_SHARDS];
+    kv_writer_t writers[MAX_WRITE_SHARDS];
+} apply_set_t;
+
+static void apply_set_close(apply_set_t *set) {
+    for (int i = 0; i < set->count; i++) {
+        kv_writer_finalize(&set->writers[i]);
+        if (set->dbs[i]) sqlite3_close(set->dbs[i]);
+    }
+    memset(set, 0, sizeof(*set));
+}
+
+static int apply_set_open(apply_set_t *set, const char *db_path) {
+    memset(set, 0, sizeof(*set));
+    set->count = write_dispatch_shard_count();
+    for (int i = 0; i < set->count; i++) {
+        char path[512];
+        if (shard_db_path(db_path, i, path, sizeof(path)) != 0 ||
+            sqlite3_open_v2(path, &set->dbs[i], SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+            log_error("replication failed to open db %s: %s", path, set->dbs[i] ? sqlite3_errmsg(set->dbs[i]) : "oom");
+            apply_set_close(set);
+            return -1;
+        }
+        sqlite3_exec(set->dbs[i], "PRAGMA busy_timeout=5000;", NULL, NULL, NULL);
+        sqlite3_exec(set->dbs[i], "PRAGMA synchronous=FULL;", NULL, NULL, NULL);
+        if (kv_writer_prepare(&set->writers[i], set->dbs[i]) != 0) {
+            log_error("replication failed to prepare statements: %s", sqlite3_errmsg(set->dbs[i]));
+            apply_set_close(set);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int apply_begin(apply_set_t *set, int shard) {
+    if (!sqlite3_get_autocommit(set->dbs[shard])) return 0;
+    return sqlite3_exec(set->dbs[shard], "BEGIN IMMEDIATE", NULL, NULL, NULL) == SQLITE_OK ? 0 : -1;
+}
+
+static int apply_commit(apply_set_t *set) {
+    int rc = 0;
+    for (int i = 0; i < set->count; i++) {
+        if (sqlite3_get_autocommit(set->dbs[i])) continue;
+        if (sqlite3_exec(set->dbs[i], "COMMIT", NULL, NULL, NULL) != SQLITE_OK) {
+            log_error("replication commit failed on shard %d: %s", i, sqlite3_errmsg(set->dbs[i]));
+            rc = -1;
+        }
+    }
+    return rc;
+}
+
+static void apply_rollback(apply_set_t *set) {
+    for (int i = 0; i < set->count; i++) {
+        if (!sqlite3_get_autocommit(set->dbs[i])) sqlite3_exec(set->dbs[i], "ROLLBACK", NULL, NULL, NULL);
+    }
+}
+
+/* 1 when the write is already in the db at its version or a later one. */
+static int already_applied(kv_writer_t *writer, const char *storage_key, int op, const char *payload, size_t payload_len, uint64_t version, int *out_err) {
+    *out_err = 0;
+    if (op != WRITE_OP_BATCH) {
+        uint64_t current = 0;
+        if (kv_read_version(writer, storage_key, &current) != SQLITE_DONE) *out_err = 1;
+        return current >= version;
+    }
+    size_t pos = 0;
+    kv_batch_entry_t entry;
+    while (kv_batch_next(payload, payload_len, &pos, &entry) == 1) {
+        char entry_key[256];
+        uint64_t current = 0;
+        if (kv_batch_storage_key(storage_key, &entry, entry_key, sizeof(entry_key)) != 0) continue;
+        if (kv_read_version(writer, entry_key, &current) != SQLITE_DONE) {
+            *out_err = 1;
+            return 0;
+        }
+        if (current >= version) return 1;
+    }
+    return 0;
+}
+
+/* Returns 1 when applied, 0 when skipped, -1 on a database error. */
+static int apply_record(apply_set_t *set, const frame_t *frame, const char *storage_key) {
+    int shard = storage_key_shard(storage_key, set->count);
+    kv_writer_t *writer = &set->writers[shard];
+    if (apply_begin(set, shard) != 0) return -1;
+    int err = 0;
+    if (already_applied(writer, storage_key, frame->op, frame->payload, frame->payload_len, frame->version, &err)) return 0;
+    if (err) return -1;
+    int rc;
+    if (frame->op == WRITE_OP_BATCH) {
+        uint64_t current = 0;
+        rc = kv_write_apply_batch(writer, storage_key, frame->payload, frame->payload_len, frame->version, &current);
+    } else {
+        rc = kv_write_apply(writer, frame->op, storage_key, frame->payload, frame->payload_len, frame->version);
+    }
+    if (rc == SQLITE_DONE) return 1;
+    if (rc == KV_WRITE_NOT_LIST || rc == KV_WRITE_PRECONDITION_FAILED) {
+        /* The primary applied it, so the rows here have diverged; the next snapshot repairs them. */
+        log_warn("replication skipped key=%s version=%llu reason=%s", storage_key, (unsigned long long)frame->version,
+                 rc == KV_WRITE_NOT_LIST ? "not_a_list" : "precondition_failed");
+        return 0;
+    }
+    log_error("replication apply failed key=%s errmsg=%s", storage_key, sqlite3_errmsg(set->dbs[shard]));
+    return -1;
+}
+
+static int start_snapshot(apply_set_t *set) {
+    for (int i = 0; i < set->count; i++) {
+        if (apply_begin(set, i) != 0 ||
+            sqlite3_exec(set->dbs[i], "DELETE FROM kv_items; DELETE FROM kv_store; DELETE FROM ride_chunks;", NULL, NULL, NULL) != SQLITE_OK) {
+            log_error("replication snapshot failed to clear shard %d: %s", i, sqlite3_errmsg(set->dbs[i]));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    apply_set_t set;
+    char *buf;
+    size_t len;
+    size_t cap;
+    int in_snapshot;
+    uint64_t snapshot_position;
+    long long snapshot_rows;
+} stream_t;
+
+/*
+ * Applies every complete frame in the buffer. Records are committed together
+ * at the end and only then published, like a dispatcher batch. A snapshot
+ * stays in its own transactions until its end frame, however many reads it
+ * spans.
+ */
+static int apply_buffered(stream_t *st) {
+    size_t pos = 0;
+    size_t consumed = 0;
+    size_t group_start = 0;
+    int group = 0;
+    uint64_t group_position = 0;
+    uint64_t group_stamp = 0;
+    uint64_t heartbeat = 0;
+    long long applied = 0;
+    frame_t frame;
+    int rc;
+    while ((rc = decode_frame(st->buf, st->len, &pos, &frame)) == 1) {
+        char storage_key[256];
+        if (frame.key_len >= sizeof(storage_key)) return -1;
+        memcpy(storage_key, frame.key, frame.key_len);
+        storage_key[frame.key_len] = '\0';
+
+        if (frame.type == FRAME_HEARTBEAT) {
+            heartbeat = frame.position;
+        } else if (frame.type == FRAME_SNAPSHOT_BEGIN) {
+            if (st->in_snapshot) return -1;
+            /* Records still uncommitted are cleared with the rest; the snapshot holds them. */
+            group = 0;
+            applied = 0;
+            if (start_snapshot(&st->set) != 0) return -1;
+            st->in_snapshot = 1;
+            st->snapshot_position = frame.position;
+            st->snapshot_rows = 0;
+            log_info("replication snapshot started position=%llu", (unsigned long long)frame.position);
+        } else if (frame.type == FRAME_SNAPSHOT_ROW) {
+            if (!st->in_snapshot || (frame.op != WRITE_OP_PUT && frame.op != WRITE_OP_RIDE_CHUNK)) return -1;
+            int shard = storage_key_shard(storage_key, st->set.count);
+            if (kv_write_apply(&st->set.writers[shard], frame.op, storage_key, frame.payload, frame.payload_len, frame.version) != SQLITE_DONE) {
+                log_error("replication snapshot failed key=%s errmsg=%s", storage_key, sqlite3_errmsg(st->set.dbs[shard]));
+                return -1;
+            }
+            st->snapshot_rows++;
+        } else if (frame.type == FRAME_SNAPSHOT_END) {
+            if (!st->in_snapshot || apply_commit(&st->set) != 0) return -1;
+            st->in_snapshot = 0;
+            /* Every row may have changed: nothing cached or handed out as a cursor still holds. */
+            value_cache_clear();
+            change_feed_reset();
+            pthread_mutex_lock(&g_follower.mutex);
+            g_follower.applied = st->snapshot_position;
+            if (st->snapshot_position > g_follower.primary_position) g_follower.primary_position = st->snapshot_position;
+            g_follower.snapshots++;
+            pthread_mutex_unlock(&g_follower.mutex);
+            log_info("replication snapshot applied rows=%lld position=%llu", st->snapshot_rows, (unsigned long long)st->snapshot_position);
+        } else {
+            if (st->in_snapshot) return -1;
+            if (!group) group_start = consumed;
+            int applied_rc = apply_record(&st->set, &frame, storage_key);
+            if (applied_rc < 0) return -1;
+            applied += applied_rc;
+            group = 1;
+            group_position = frame.position;
+            group_stamp = frame.stamp_us;
+        }
+        consumed = pos;
+    }
+    if (rc < 0) {
+        log_error("replication stream malformed frame");
+        return -1;
+    }
+
+    if (group) {
+        if (apply_commit(&st->set) != 0) return -1;
+        /* After COMMIT, in stream order, as a dispatcher publishes its batch. */
+        size_t publish_pos = group_start;
+        while (publish_pos < consumed && decode_frame(st->buf, consumed, &publish_pos, &frame) == 1) {
+            if (frame.type != FRAME_RECORD) continue;
+            char storage_key[256];
+            memcpy(storage_key, frame.key, frame.key_len);
+            storage_key[frame.key_len] = '\0';
+            write_publish_committed(frame.op, storage_key, frame.payload, frame.payload_len, frame.version);
+        }
+        change_feed_notify();
+    }
+
+    pthread_mutex_lock(&g_follower.mutex);
+    if (group) {
+        g_follower.applied = group_position;
+        g_follower.applied_records += applied;
+        if (group_position > g_follower.primary_position) g_follower.primary_position = group_position;
+        g_follower.lag_stamp_us = group_stamp;
+    }
+    if (heartbeat > g_follower.primary_position) g_follower.primary_position = heartbeat;
+    if (!st->in_snapshot && g_follower.applied >= g_follower.primary_position) g_follower.lag_stamp_us = 0;
+    pthread_mutex_unlock(&g_follower.mutex);
+
+    if (consumed > 0) {
+        memmove(st->buf, st->buf + consumed, st->len - consumed);
+        st->len -= consumed;
+    }
+    return 0;
+}
+
+static int connect_primary(void) {
+    char port[16];
+    snprintf(port, sizeof(port), "%d", g_config.primary_port);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *res = NULL;
+    if (getaddrinfo(g_config.primary_host, port, &hints, &res) != 0) return -1;
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int follower_is_stopping(void) {
+    pthread_mutex_lock(&g_follower.mutex);
+    int stopping = g_follower.stopping;
+    pthread_mutex_unlock(&g_follower.mutex);
+    return stopping;
+}
+
+/* Streams until the connection fails; the caller reconnects from the applied position. */
+static void follow_once(stream_t *st) {
+    int fd = connect_primary();
+    if (fd < 0) return;
+    configure_socket_after_accept(fd);
+    set_socket_timeout(fd, SO_RCVTIMEO, REPLICATION_IDLE_TIMEOUT_MS);
+    set_socket_timeout(fd, SO_SNDTIMEO, REPLICATION_SEND_TIMEOUT_MS);
+
+    pthread_mutex_lock(&g_follower.mutex);
+    if (g_follower.stopping) {
+        pthread_mutex_unlock(&g_follower.mutex);
+        close(fd);
+        return;
+    }
+    g_follower.fd = fd;
+    uint64_t position = g_follower.applied;
+    pthread_mutex_unlock(&g_follower.mutex);
+
+    char hello[64 + REPLICATION_TOKEN_MAX];
+    int hello_len = snprintf(hello, sizeof(hello), "FRICU-REPLICATE %llu %s\n", (unsigned long long)position,
+                             g_config.token[0] != '\0' ? g_config.token : "-");
+    if (hello_len > 0 && (size_t)hello_len < sizeof(hello) && send_all(fd, hello, (size_t)hello_len) == 0) {
+        pthread_mutex_lock(&g_follower.mutex);
+        g_follower.connected = 1;
+        pthread_mutex_unlock(&g_follower.mutex);
+        log_info("replication connected to %s:%d position=%llu", g_config.primary_host, g_config.primary_port, (unsigned long long)position);
+
+        st->len = 0;
+        st->in_snapshot = 0;
+        while (1) {
+            if (st->cap - st->len < REPLICATION_SEND_CHUNK) {
+                /* Room for the frame being received, whose header says how big it is. */
+                size_t want = st->len + REPLICATION_SEND_CHUNK;
+                if (st->len >= REPLICATION_FRAME_HEADER) {
+                    uint16_t key_len = 0;
+                    uint32_t payload_len = 0;
+                    memcpy(&key_len, st->buf + 2, 2);
+                    memcpy(&payload_len, st->buf + 4, 4);
+                    size_t frame_len = REPLICATION_FRAME_HEADER + (size_t)key_len + payload_len;
+                    if (frame_len > REPLICATION_FRAME_HEADER + REPLICATION_FRAME_MAX) break;
+                    if (frame_len > want) want = frame_len;
+                }
+                char *grown = (char *)realloc(st->buf, want);
+                if (!grown) break;
+                st->buf = grown;
+                st->cap = want;
+            }
+            ssize_t n = recv(fd, st->buf + st->len, st->cap - st->len, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            st->len += (size_t)n;
+            if (apply_buffered(st) != 0) break;
+        }
+        apply_rollback(&st->set);
+        st->in_snapshot = 0;
+    }
+
+    pthread_mutex_lock(&g_follower.mutex);
+    g_follower.fd = -1;
+    g_follower.connected = 0;
+    pthread_mutex_unlock(&g_follower.mutex);
+    close(fd);
+}
+
+static void *follower_main(void *arg) {
+    (void)arg;
+    stream_t st;
+    memset(&st, 0, sizeof(st));
+    if (apply_set_open(&st.set, g_follower.db_path) != 0) return NULL;
+    while (!follower_is_stopping()) {
+        follow_once(&st);
+        if (follower_is_stopping()) break;
+        log_warn("replication disconnected from %s:%d, retrying", g_config.primary_host, g_config.primary_port);
+        for (int waited = 0; waited < REPLICATION_RECONNECT_MS && !follower_is_stopping(); waited += 100) usleep(100 * 1000);
+    }
+    free(st.buf);
+    apply_set_close(&st.set);
+    return NULL;
+}
+
+int replication_follower_start(const char *db_path) {
+    if (!replication_is_follower()) return 0;
+    pthread_mutex_lock(&g_follower.mutex);
+    if (g_follower.running ||
+        snprintf(g_follower.db_path, sizeof(g_follower.db_path), "%s", db_path) >= (int)sizeof(g_follower.db_path)) {
+        pthread_mutex_unlock(&g_follower.mutex);
+        return -1;
+    }
+    /* The rows on disk may be from anywhere; the first stream always starts with a snapshot. */
+    g_follower.applied = 0;
+    g_follower.primary_position = 0;
+    g_follower.lag_stamp_us = 0;
+    g_follower.applied_records = 0;
+    g_follower.snapshots = 0;
+    g_follower.stopping = 0;
+    if (pthread_create(&g_follower.thread, NULL, follower_main, NULL) != 0) {
+        pthread_mutex_unlock(&g_follower.mutex);
+        log_error("failed to start replication follower");
+        return -1;
+    }
+    g_follower.running = 1;
+    pthread_mutex_unlock(&g_follower.mutex);
+    log_info("replication following %s:%d", g_config.primary_host, g_config.primary_port);
+    return 0;
+}
+
+static void follower_stop(void) {
+    pthread_mutex_lock(&g_follower.mutex);
+    if (!g_follower.running) {
+        pthread_mutex_unlock(&g_follower.mutex);
+        return;
+    }
+    g_follower.stopping = 1;
+    if (g_follower.fd >= 0) shutdown(g_follower.fd, SHUT_RDWR);
+    pthread_mutex_unlock(&g_follower.mutex);
+    pthread_join(g_follower.thread, NULL);
+    pthread_mutex_lock(&g_follower.mutex);
+    g_follower.running = 0;
+    g_follower.stopping = 0;
+    pthread_mutex_unlock(&g_follower.mutex);
+}
+
+void replication_stop(void) {
+    follower_stop();
+    primary_stop();
+}
+
+void replication_stats_snapshot(replication_stats_t *out_stats) {
+    memset(out_stats, 0, sizeof(*out_stats));
+    pthread_mutex_lock(&g_follower.mutex);
+    if (g_follower.running) {
+        out_stats->role = REPLICATION_ROLE_FOLLOWER;
+        out_stats->connected = g_follower.connected;
+        out_stats->position = g_follower.applied;
+        out_stats->primary_position = g_follower.primary_position;
+        out_stats->applied_records = g_follower.applied_records;
+        out_stats->snapshots = g_follower.snapshots;
+        if (g_follower.lag_stamp_us > 0) {
+            uint64_t now = realtime_us();
+            out_stats->lag_seconds = now > g_follower.lag_stamp_us ? (double)(now - g_follower.lag_stamp_us) / 1e6 : 0.0;
+        }
+    }
+    pthread_mutex_unlock(&g_follower.mutex);
+    if (out_stats->role != REPLICATION_ROLE_NONE) return;
+
+    pthread_mutex_lock(&g_primary.mutex);
+    if (atomic_load(&g_primary.enabled)) {
+        out_stats->role = REPLICATION_ROLE_PRIMARY;
+        out_stats->position = g_primary.last;
+        for (int i = 0; i < REPLICATION_MAX_FOLLOWERS; i++) out_stats->connected += g_primary.followers[i].active;
+    }
+    pthread_mutex_unlock(&g_primary.mutex);
+}
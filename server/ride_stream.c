@@ -0,0 +1,324 @@
+#include "server_internal.h"
+
+#include <ctype.h>
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+/*
+ * A ride chunk is what an upload becomes and what the journal, the
+ * replication stream and ride_chunks.columns all carry. It is laid out
+ * column by column in host order:
+ *   u32 samples | u32 zero | i64 t[samples] | f32 values[RIDE_FIELD_COUNT][samples]
+ * so finding a time window only touches the t column, and a missing
+ * reading costs a NaN instead of a member name.
+ */
+#define RIDE_CHUNK_HEADER 8
+
+static const char *const RIDE_FIELD_NAMES[RIDE_FIELD_COUNT] = {
+    "power", "heart_rate", "cadence", "speed", "distance", "left_balance", "right_balance",
+};
+
+static size_t chunk_bytes(int64_t samples) {
+    return RIDE_CHUNK_HEADER + (size_t)samples * RIDE_SAMPLE_WIRE_BYTES;
+}
+
+static size_t time_offset(int64_t index) {
+    return RIDE_CHUNK_HEADER + (size_t)index * 8;
+}
+
+static size_t value_offset(int64_t samples, int field, int64_t index) {
+    return RIDE_CHUNK_HEADER + (size_t)samples * 8 + ((size_t)field * (size_t)samples + (size_t)index) * 4;
+}
+
+static int ride_id_char(char c) {
+    return isalnum((unsigned char)c) || c == '-' || c == '_' || c == '.';
+}
+
+int ride_id_is_valid(const char *id, size_t len) {
+    if (len == 0 || len > RIDE_ID_MAX) return 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!ride_id_char(id[i])) return 0;
+    }
+    return 1;
+}
+
+int ride_storage_key_is_valid(const char *storage_key) {
+    const char *sep = strstr(storage_key, "::");
+    if (!sep || sep == storage_key) return 0;
+    for (const char *p = storage_key; p < sep; p++) {
+        if (!ride_id_char(*p)) return 0;
+    }
+    const char *logical = sep + 2;
+    size_t prefix_len = strlen(RIDE_STREAM_KEY_PREFIX);
+    if (strncmp(logical, RIDE_STREAM_KEY_PREFIX, prefix_len) != 0) return 0;
+    return ride_id_is_valid(logical + prefix_len, strlen(logical + prefix_len));
+}
+
+static uint64_t load_le(const unsigned char *p, int bytes) {
+    uint64_t v = 0;
+    for (int i = bytes - 1; i >= 0; i--) v = v << 8 | p[i];
+    return v;
+}
+
+static void store_le(unsigned char *p, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+/* Sample times are milliseconds and never negative; JSON ones must be plain integers. */
+static int parse_count(const char *s, size_t len, int64_t *out) {
+    if (len == 0 || len > 18) return -1;
+    int64_t v = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] < '0' || s[i] > '9') return -1;
+        v = v * 10 + (s[i] - '0');
+    }
+    *out = v;
+    return 0;
+}
+
+static int parse_reading(const char *s, size_t len, float *out) {
+    if (len == 4 && memcmp(s, "null", 4) == 0) {
+        *out = NAN;
+        return 0;
+    }
+    char buf[64];
+    if (len == 0 || len >= sizeof(buf)) return -1;
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    char *end = NULL;
+    double v = strtod(buf, &end);
+    if (end != buf + len || !isfinite(v) || v > FLT_MAX || v < -FLT_MAX) return -1;
+    *out = (float)v;
+    return 0;
+}
+
+static int parse_ndjson_sample(const char *line, size_t len, int64_t *out_t, float values[RIDE_FIELD_COUNT]) {
+    json_shape_t shape;
+    size_t off = 0;
+    size_t value_len = 0;
+    if (json_validate(line, len, &shape) != 0 || shape.type != JSON_TYPE_OBJECT) return -1;
+    if (!json_object_member(line, len, "t", &off, &value_len) || parse_count(line + off, value_len, out_t) != 0) return -1;
+    for (int f = 0; f < RIDE_FIELD_COUNT; f++) {
+        values[f] = NAN;
+        if (json_object_member(line, len, RIDE_FIELD_NAMES[f], &off, &value_len) && parse_reading(line + off, value_len, &values[f]) != 0) return -1;
+    }
+    return 0;
+}
+
+static int parse_binary_sample(const unsigned char *record, int64_t *out_t, float values[RIDE_FIELD_COUNT]) {
+    uint64_t t = load_le(record, 8);
+    if (t > INT64_MAX) return -1;
+    *out_t = (int64_t)t;
+    for (int f = 0; f < RIDE_FIELD_COUNT; f++) {
+        uint32_t bits = (uint32_t)load_le(record + 8 + 4 * f, 4);
+        memcpy(&values[f], &bits, 4);
+        if (isinf(values[f])) return -1;
+    }
+    return 0;
+}
+
+static void put_sample(char *chunk, int64_t samples, int64_t index, int64_t t, const float values[RIDE_FIELD_COUNT]) {
+    memcpy(chunk + time_offset(index), &t, 8);
+    for (int f = 0; f < RIDE_FIELD_COUNT; f++) memcpy(chunk + value_offset(samples, f, index), &values[f], 4);
+}
+
+/*
+ * NDJSON posts carry one object per line, {"t":<ms>,"power":...}, with
+ * every reading optional; blank lines are skipped. The chunk is sized for
+ * one sample per line and compacted once the real count is known.
+ */
+int ride_chunk_build(const char *body, size_t body_len, int binary, char **out_chunk, size_t *out_len, const char **out_error) {
+    *out_chunk = NULL;
+    *out_error = NULL;
+    int64_t cap = 0;
+    if (binary) {
+        if (body_len % RIDE_SAMPLE_WIRE_BYTES != 0) {
+            *out_error = "{\"error\":\"binary body must hold whole samples\"}";
+            return -1;
+        }
+        cap = (int64_t)(body_len / RIDE_SAMPLE_WIRE_BYTES);
+    } else {
+        cap = 1;
+        for (const char *p = body; (p = memchr(p, '\n', body_len - (size_t)(p - body))) != NULL; p++) cap++;
+    }
+    if (body_len == 0 || cap > UINT32_MAX) {
+        *out_error = body_len == 0 ? "{\"error\":\"empty chunk\"}" : "{\"error\":\"too many samples\"}";
+        return -1;
+    }
+
+    char *chunk = (char *)calloc(1, chunk_bytes(cap));
+    if (!chunk) return -1;
+    int64_t count = 0;
+    int64_t last_t = -1;
+    const char *p = body;
+    const char *end = body + body_len;
+    while (p < end) {
+        int64_t t = 0;
+        float values[RIDE_FIELD_COUNT];
+        int rc;
+        if (binary) {
+            rc = parse_binary_sample((const unsigned char *)p, &t, values);
+            p += RIDE_SAMPLE_WIRE_BYTES;
+        } else {
+            const char *line_end = memchr(p, '\n', (size_t)(end - p));
+            if (!line_end) line_end = end;
+            const char *line = p;
+            p = line_end + 1;
+            while (line < line_end && isspace((unsigned char)*line)) line++;
+            if (line == line_end) continue;
+            rc = parse_ndjson_sample(line, (size_t)(line_end - line), &t, values);
+        }
+        if (rc != 0 || t <= last_t) {
+            free(chunk);
+            *out_error = rc != 0 ? "{\"error\":\"invalid sample\"}" : "{\"error\":\"samples must be in time order\"}";
+            return -1;
+        }
+        put_sample(chunk, cap, count++, t, values);
+        last_t = t;
+    }
+    if (count == 0) {
+        free(chunk);
+        *out_error = "{\"error\":\"empty chunk\"}";
+        return -1;
+    }
+
+    /* Columns move towards the front, so each lands at or before where it was read. */
+    if (count < cap) {
+        for (int f = 0; f < RIDE_FIELD_COUNT; f++) {
+            memmove(chunk + value_offset(count, f, 0), chunk + value_offset(cap, f, 0), (size_t)count * 4);
+        }
+    }
+    uint32_t samples = (uint32_t)count;
+    memcpy(chunk, &samples, 4);
+    *out_chunk = chunk;
+    *out_len = chunk_bytes(count);
+    return 0;
+}
+
+int64_t ride_chunk_samples(const char *chunk, size_t len) {
+    if (len < RIDE_CHUNK_HEADER) return -1;
+    uint32_t samples = 0;
+    memcpy(&samples, chunk, 4);
+    if (samples == 0 || len != chunk_bytes(samples)) return -1;
+    return samples;
+}
+
+int64_t ride_chunk_time(const char *chunk, size_t len, int64_t index) {
+    (void)len;
+    int64_t t = 0;
+    memcpy(&t, chunk + time_offset(index), 8);
+    return t;
+}
+
+int64_t ride_chunk_first_after(const char *chunk, size_t len, int64_t t) {
+    int64_t lo = 0;
+    int64_t hi = ride_chunk_samples(chunk, len);
+    if (hi < 0) return 0;
+    while (lo < hi) {
+        int64_t mid = lo + (hi - lo) / 2;
+        if (ride_chunk_time(chunk, len, mid) <= t) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+int ride_chunk_trim(const char *chunk, size_t len, int64_t skip, char **out_chunk, size_t *out_len) {
+    int64_t samples = ride_chunk_samples(chunk, len);
+    if (samples < 0 || skip < 0 || skip >= samples) return -1;
+    int64_t kept = samples - skip;
+    char *trimmed = (char *)malloc(chunk_bytes(kept));
+    if (!trimmed) return -1;
+    uint32_t header[2] = {(uint32_t)kept, 0};
+    memcpy(trimmed, header, RIDE_CHUNK_HEADER);
+    memcpy(trimmed + time_offset(0), chunk + time_offset(skip), (size_t)kept * 8);
+    for (int f = 0; f < RIDE_FIELD_COUNT; f++) {
+        memcpy(trimmed + value_offset(kept, f, 0), chunk + value_offset(samples, f, skip), (size_t)kept * 4);
+    }
+    *out_chunk = trimmed;
+    *out_len = chunk_bytes(kept);
+    return 0;
+}
+
+uint32_t ride_chunk_crc32(const char *chunk, size_t len) {
+    return (uint32_t)crc32(crc32(0L, Z_NULL, 0), (const Bytef *)chunk, (uInt)len);
+}
+
+static int buf_put(char **buf, size_t *buf_len, size_t *buf_cap, const void *data, size_t n) {
+    if (*buf_len + n > *buf_cap) {
+        size_t cap = *buf_cap ? *buf_cap : 4096;
+        while (*buf_len + n > cap) cap *= 2;
+        char *grown = (char *)realloc(*buf, cap);
+        if (!grown) return -1;
+        *buf = grown;
+        *buf_cap = cap;
+    }
+    memcpy(*buf + *buf_len, data, n);
+    *buf_len += n;
+    return 0;
+}
+
+int64_t ride_chunk_render(const char *chunk, size_t len, int64_t from, int64_t to, int binary, char **buf, size_t *buf_len, size_t *buf_cap) {
+    int64_t samples = ride_chunk_samples(chunk, len);
+    if (samples < 0) return -1;
+    int64_t count = 0;
+    for (int64_t i = from > 0 ? ride_chunk_first_after(chunk, len, from - 1) : 0; i < samples; i++) {
+        int64_t t = ride_chunk_time(chunk, len, i);
+        if (t >= to) break;
+        float values[RIDE_FIELD_COUNT];
+        for (int f = 0; f < RIDE_FIELD_COUNT; f++) memcpy(&values[f], chunk + value_offset(samples, f, i), 4);
+
+        int rc;
+        if (binary) {
+            unsigned char record[RIDE_SAMPLE_WIRE_BYTES];
+            store_le(record, (uint64_t)t, 8);
+            for (int f = 0; f < RIDE_FIELD_COUNT; f++) {
+                uint32_t bits = 0;
+                memcpy(&bits, &values[f], 4);
+                store_le(record + 8 + 4 * f, bits, 4);
+            }
+            rc = buf_put(buf, buf_len, buf_cap, record, sizeof(record));
+        } else {
+            char line[512];
+            int off = snprintf(line, sizeof(line), "{\"t\":%lld", (long long)t);
+            for (int f = 0; f < RIDE_FIELD_COUNT; f++) {
+                if (!isnan(values[f])) off += snprintf(line + off, sizeof(line) - (size_t)off, ",\"%s\":%.7g", RIDE_FIELD_NAMES[f], (double)values[f]);
+            }
+            line[off++] = '}';
+            line[off++] = '\n';
+            rc = buf_put(buf, buf_len, buf_cap, line, (size_t)off);
+        }
+        if (rc != 0) return -1;
+        count++;
+    }
+    return count;
+}
+
+int ride_head_parse(const char *json, size_t len, ride_head_t *out_head) {
+    static const char *const names[] = {"chunks", "samples", "from", "to"};
+    int64_t *fields[] = {&out_head->chunks, &out_head->samples, &out_head->from, &out_head->to};
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        size_t off = 0;
+        size_t value_len = 0;
+        if (!json_object_member(json, len, names[i], &off, &value_len) || parse_count(json + off, value_len, fields[i]) != 0) return -1;
+    }
+    return 0;
+}
+
+int ride_head_format(const ride_head_t *head, char *out, size_t out_len) {
+    int written = snprintf(
+        out,
+        out_len,
+        "{\"chunks\":%lld,\"samples\":%lld,\"from\":%lld,\"to\":%lld}",
+        (long long)head->chunks,
+        (long long)head->samples,
+        (long long)head->from,
+        (long long)head->to);
+    return written > 0 && (size_t)written < out_len ? written : -1;
+}
@@ -2,72 +2,991 @@
 #define FRICU_SERVER_INTERNAL_H
 
 #include <sqlite3.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #define REQ_BUF_SIZE (8 * 1024 * 1024)
 #define HEADER_BUF_SIZE 2048
-#define DEFAULT_WORKERS 64
 #define EVENT_MAX_EVENTS 1024
 #define CONN_INIT_BUF 8192
+#define HTTP_HEADER_MAX (64 * 1024)
+#define OUT_INLINE_BODY_MAX 4096
+#define OUT_FLUSH_MAX_IOV 64
+#define DEFAULT_KEEPALIVE_IDLE_MS 5000
+#define DEFAULT_SEND_TIMEOUT_MS 30000
+#define DEFAULT_KEEPALIVE_MAX_REQUESTS 1000
+#define DEFAULT_ZEROCOPY_MIN_BYTES (256 * 1024)
+#define DEFAULT_WORKER_BUFFER_BYTES (256 * 1024 * 1024)
+#define DEFAULT_MAX_LARGE_UPLOADS 16
+#define DEFAULT_LISTEN_BACKLOG 4096
+/* Request bodies at least this large count against max_large_uploads. */
+#define ADMISSION_LARGE_BODY_BYTES (1024 * 1024)
+#define MAX_WRITE_SHARDS 16
+#define DEFAULT_WRITE_SHARDS 1
 
+/*
+ * Every kv_store row carries a version: the journal seq of the write that
+ * produced it (1 for rows that predate versioning, 0 when the row is
+ * absent). It is served as the ETag.
+ */
+#define WRITE_IF_MATCH_NONE (-1)
+#define WRITE_IF_MATCH_ANY (-2)
+
+/*
+ * PUT replaces the whole value. APPEND and PATCH carry a JSON array of
+ * elements for a list key: APPEND adds them at the end, PATCH replaces the
+ * element with the same top-level "id" member (appending it when no element
+ * has that id).
+ */
+enum {
+    WRITE_OP_PUT = 0,
+    WRITE_OP_APPEND = 1,
+    WRITE_OP_PATCH = 2,
+    /* Several writes of one account applied together; see kv_write_apply_batch. */
+    WRITE_OP_BATCH = 3,
+    /* One chunk of a ride's telemetry samples; see ride_stream.c. */
+    WRITE_OP_RIDE_CHUNK = 4,
+};
+
+/* Most keys one GET or POST /v1/batch may name. */
+#define BATCH_MAX_KEYS 32
+
+typedef struct write_completion_queue write_completion_queue_t;
+typedef struct conn_pool conn_pool_t;
+
+/* shards[0] is the configured db file; shard i > 0 lives at "<db_path>.shard<i>". */
 typedef struct {
-    sqlite3 *db;
-    sqlite3_stmt *get_stmt;
-    sqlite3_stmt *json_valid_stmt;
+    int shard_count;
+    sqlite3 *shards[MAX_WRITE_SHARDS];
+    sqlite3_stmt *get_stmts[MAX_WRITE_SHARDS];
+    sqlite3_stmt *version_stmts[MAX_WRITE_SHARDS];
+    sqlite3_stmt *item_stmts[MAX_WRITE_SHARDS];
+    sqlite3_stmt *page_stmts[MAX_WRITE_SHARDS];
+    sqlite3_stmt *since_stmts[MAX_WRITE_SHARDS];
+    sqlite3_stmt *chunk_stmts[MAX_WRITE_SHARDS];
     char db_path[512];
+    /*
+     * The event loop's write completion queue. When NULL (no event loop, as
+     * in the tests) a write waits for its own completion before responding.
+     */
+    write_completion_queue_t *completions;
+    /*
+     * The event loop's buffer pool and its count of request bodies of at
+     * least ADMISSION_LARGE_BODY_BYTES being received. pool is NULL outside
+     * an event loop, which turns the per-worker admission checks off.
+     */
+    conn_pool_t *pool;
+    int max_large_uploads;
+    int large_uploads;
 } worker_db_t;
 
+enum {
+    WORKER_BACKEND_EPOLL = 0,
+    /* Linux only; a worker whose ring cannot be set up falls back to epoll. */
+    WORKER_BACKEND_IO_URING = 1,
+};
+
+typedef struct {
+    int keepalive_idle_ms;
+    int keepalive_max_requests;
+    /* Drops a connection whose response made no progress for this long; 0 means never. */
+    int send_timeout_ms;
+    size_t zerocopy_min_bytes;
+    /* Cap on request buffer bytes held by one worker; 0 means unlimited. */
+    size_t max_buffered_bytes;
+    /* WORKER_BACKEND_*; epoll also stands for kqueue on macOS. */
+    int backend;
+    /* Large request bodies received at once per worker; 0 means unlimited. */
+    int max_large_uploads;
+} worker_config_t;
+
+/* Immutable, refcounted byte buffer shared between producers and output queues. */
+typedef struct shared_buf {
+    atomic_int refcount;
+    size_t len;
+    char data[];
+} shared_buf_t;
+
+shared_buf_t *shared_buf_new(size_t len);
+shared_buf_t *shared_buf_copy(const char *data, size_t len);
+shared_buf_t *shared_buf_retain(shared_buf_t *buf);
+void shared_buf_release(shared_buf_t *buf);
+
+#define DEFAULT_VALUE_CACHE_BYTES (256 * 1024 * 1024)
+
+typedef struct {
+    size_t max_bytes;
+} value_cache_config_t;
+
+typedef struct {
+    size_t max_bytes;
+    size_t entries;
+    size_t bytes;
+    long long hits;
+    long long misses;
+    long long evictions;
+    long long invalidations;
+    long long stale_fills;
+    size_t gzip_entries;
+} value_cache_stats_t;
+
+/*
+ * Process-wide LRU of storage key -> pre-rendered 200 response (connection-
+ * independent head at [0, body_off), value after it) and the row version it
+ * was rendered from. max_bytes 0 disables caching. Writers must call
+ * value_cache_invalidate after their commit.
+ */
+void value_cache_configure(const value_cache_config_t *config);
+/*
+ * Returns a retained response on hit, the gzip variant when want_gzip is
+ * set and the entry has one; on miss sets *out_ticket for value_cache_fill.
+ */
+shared_buf_t *value_cache_lookup(
+    const char *storage_key, int want_gzip, size_t *out_body_off, uint64_t *out_version, uint64_t *out_ticket);
+/*
+ * Inserts response, and its gzip variant if not NULL, unless the key's shard
+ * was invalidated since the ticket was issued.
+ */
+void value_cache_fill(
+    const char *storage_key,
+    uint64_t ticket,
+    shared_buf_t *response,
+    size_t body_off,
+    shared_buf_t *gzip_response,
+    size_t gzip_body_off,
+    uint64_t version);
+void value_cache_invalidate(const char *storage_key);
+void value_cache_clear(void);
+void value_cache_stats_snapshot(value_cache_stats_t *out_stats);
+
+#define DEFAULT_GZIP_MIN_BYTES 1024
+#define DEFAULT_GZIP_LEVEL 6
+
+typedef struct {
+    /* Bodies shorter than this are always sent as is; 0 disables gzip responses. */
+    size_t min_bytes;
+    /* zlib level 1-9. */
+    int level;
+} compress_config_t;
+
+void compress_configure(const compress_config_t *config);
+size_t compress_min_bytes(void);
+/* Both return a malloc'd buffer in *out; -1 on malformed input or OOM. */
+int gzip_compress(const char *in, size_t in_len, char **out, size_t *out_len);
+/* NUL-terminates the output; -2 when it would exceed max_len bytes. */
+int gzip_decompress(const char *in, size_t in_len, size_t max_len, char **out, size_t *out_len);
+
+typedef struct out_seg {
+    shared_buf_t *buf;
+    size_t off;
+    size_t len;
+    struct out_seg *next;
+} out_seg_t;
+
 typedef struct {
+    size_t off;
+    size_t len;
+} http_span_t;
+
+/*
+ * Resumable request parser state. All spans are offsets into conn->buf and
+ * stay valid until the request is consumed. A zeroed struct is a fresh parser.
+ */
+typedef struct {
+    size_t scan_off;
+    size_t header_len;
+    size_t content_length;
+    http_span_t method;
+    http_span_t path;
+    http_span_t version;
+    http_span_t content_length_value;
+    http_span_t log_id;
+    http_span_t account_id;
+    http_span_t retry_attempt;
+    http_span_t connection;
+    http_span_t if_match;
+    http_span_t if_none_match;
+    http_span_t accept_encoding;
+    http_span_t content_encoding;
+    http_span_t accept;
+    http_span_t last_event_id;
+    http_span_t content_type;
+    http_span_t chunk_crc32;
+} http_parse_state_t;
+
+enum {
+    HTTP_PARSE_INCOMPLETE = 0,
+    HTTP_PARSE_DONE = 1,
+    HTTP_PARSE_BAD_REQUEST_LINE = -1,
+    HTTP_PARSE_BAD_CONTENT_LENGTH = -2,
+    HTTP_PARSE_HEADER_TOO_LARGE = -3,
+    /* Bodies are only framed by Content-Length; see parse_header_block. */
+    HTTP_PARSE_TRANSFER_ENCODING = -4,
+};
+
+int http_parse_request(http_parse_state_t *st, const char *buf, size_t len);
+void http_parse_reset(http_parse_state_t *st);
+
+typedef struct list_stream list_stream_t;
+typedef struct pending_write pending_write_t;
+typedef struct change_watch change_watch_t;
+
+enum {
+    CONN_INTEREST_READ = 0,
+    CONN_INTEREST_WRITE = 1,
+    CONN_INTEREST_NONE = 2,
+};
+
+enum {
+    CONN_ADMISSION_PENDING = 0,
+    CONN_ADMISSION_ADMITTED = 1,
+    /* Admitted, and holding one of the worker's large-upload slots. */
+    CONN_ADMISSION_LARGE = 2,
+};
+
+typedef struct conn {
     int fd;
+    /* Event queue handle; see event_loop.c. */
+    uint64_t handle;
     size_t len;
     size_t cap;
+    /* cap + 1 bytes; buf_class says which conn_pool class it came from. */
     char *buf;
+    int buf_class;
+    http_parse_state_t parse;
+    /* CONN_ADMISSION_*: of the request whose headers are in parse. */
+    int admission;
+    /* Set by try_process_client for the request it just consumed. */
+    int keep_alive;
+    int requests_served;
+    /* 0 means unlimited; 1 disables keep-alive. */
+    int max_requests;
+    int64_t last_active_ms;
+    struct conn *idle_prev;
+    struct conn *idle_next;
+    /* Response bytes not yet accepted by the socket, oldest first. */
+    out_seg_t *out_head;
+    out_seg_t *out_tail;
+    size_t out_bytes;
+    /* CONN_INTEREST_*: what the event queue is watching the socket for. */
+    int interest;
+    /* io_uring backend: 1 + the CONN_INTEREST_* of the recv or poll in flight, or 0. */
+    int ring_armed;
+    int close_after_flush;
+    /* A response still being produced; resumed once queued output drains. */
+    list_stream_t *stream;
+    /* A write handed to the dispatcher; the response waits for its completion. */
+    pending_write_t *pending_write;
+    /* A GET /v1/changes parked until the feed has something for it; see conn_watch_poll. */
+    change_watch_t *watch;
+    struct conn *watch_prev;
+    struct conn *watch_next;
+    int watch_linked;
+
+    /*
+     * MSG_ZEROCOPY (Linux): sends carrying a segment of at least
+     * zerocopy_min bytes leave the pages to the kernel, so their buffers are
+     * held in zc_head until the completion shows up on the error queue.
+     * zc_draining marks a closed connection waiting for those completions.
+     */
+    int zerocopy;
+    size_t zerocopy_min;
+    uint32_t zc_next_id;
+    struct zc_hold *zc_head;
+    struct zc_hold *zc_tail;
+    int zc_draining;
 } conn_t;
 
-extern const char *DATA_KEYS[];
-extern const size_t DATA_KEYS_COUNT;
+/*
+ * Per-worker allocator for connections and their request buffers (see
+ * conn_pool.c). conn_t objects are carved from slabs and recycled; buffers
+ * come from size classes. buffered_bytes counts every request buffer handed
+ * out and is held under max_buffered_bytes when that is non-zero.
+ */
+#define CONN_POOL_SLAB_CONNS 256
+#define CONN_BUF_CLASSES 3
+#define CONN_POOL_OVER_BUDGET (-2)
+
+struct conn_pool {
+    conn_t *free_conns;
+    void *slabs;
+    void *free_bufs[CONN_BUF_CLASSES];
+    size_t free_buf_count[CONN_BUF_CLASSES];
+    size_t max_buffered_bytes;
+    size_t buffered_bytes;
+    size_t live_conns;
+    long long over_budget;
+};
+
+void conn_pool_init(conn_pool_t *pool, size_t max_buffered_bytes);
+void conn_pool_destroy(conn_pool_t *pool);
+/* Returns a zeroed connection holding the smallest buffer, or NULL on OOM or over budget. */
+conn_t *conn_pool_get(conn_pool_t *pool);
+void conn_pool_put(conn_pool_t *pool, conn_t *conn);
+/* Grows conn->buf to hold at least want bytes; returns 0, -1 on OOM, or CONN_POOL_OVER_BUDGET. */
+int conn_pool_grow(conn_pool_t *pool, conn_t *conn, size_t want);
+/* Moves a conn whose buffered bytes fit back into the smallest class. */
+void conn_pool_shrink(conn_pool_t *pool, conn_t *conn);
+/* Whether growing conn->buf to want bytes would stay within the pool's budget. */
+int conn_pool_can_grow(const conn_pool_t *pool, const conn_t *conn, size_t want);
+
+/*
+ * A worker's live connections, each named by a handle of
+ * (generation << 32 | slot). Removing a connection bumps its slot's
+ * generation, so handles issued before then no longer resolve.
+ */
+#define CONN_SLOT_NONE UINT32_MAX
+
+typedef struct {
+    conn_t *conn;
+    uint32_t generation;
+    uint32_t next_free;
+} conn_slot_t;
+
+typedef struct {
+    conn_slot_t *slots;
+    uint32_t slot_count;
+    uint32_t free_slot;
+} conn_table_t;
+
+void conn_table_init(conn_table_t *table);
+void conn_table_destroy(conn_table_t *table);
+/* Gives conn a slot and sets conn->handle; returns -1 on OOM. */
+int conn_table_insert(conn_table_t *table, conn_t *conn);
+void conn_table_remove(conn_table_t *table, conn_t *conn);
+/* Returns NULL for a handle whose connection has since been removed. */
+conn_t *conn_table_lookup(const conn_table_t *table, uint64_t handle);
+
+int conn_output_append(conn_t *conn, shared_buf_t *buf, size_t off, size_t len);
+int conn_output_flush(int fd, conn_t *conn);
+void conn_output_reset(conn_t *conn);
+/* Returns 0 when MSG_ZEROCOPY was enabled on fd, -1 when unsupported. */
+int conn_output_enable_zerocopy(int fd, conn_t *conn, size_t min_bytes);
+/* Drains zerocopy completions; returns -1 if the error queue reports a socket error. */
+int conn_output_reap_zerocopy(int fd, conn_t *conn);
+int conn_output_zerocopy_pending(const conn_t *conn);
+
+#define JSON_MAX_DEPTH 1000
+
+enum {
+    JSON_TYPE_NULL,
+    JSON_TYPE_BOOL,
+    JSON_TYPE_NUMBER,
+    JSON_TYPE_STRING,
+    JSON_TYPE_ARRAY,
+    JSON_TYPE_OBJECT,
+};
+
+/* count is the number of top-level elements or members; 0 for scalars. */
+typedef struct {
+    int type;
+    size_t count;
+    int max_depth;
+} json_shape_t;
+
+/* Validates buf[0..len) as one RFC 8259 JSON text in place. Returns 0 if valid. */
+int json_validate(const char *buf, size_t len, json_shape_t *out_shape);
+/*
+ * Helpers for text that already passed json_validate. json_array_next walks
+ * a top-level array: start with *pos = 0; returns 1 with the next element's
+ * span, 0 after the last one, -1 on malformed input. json_object_member
+ * finds a top-level member by its raw (unescaped) name and returns 1 with
+ * the value's span.
+ */
+int json_array_next(const char *buf, size_t len, size_t *pos, size_t *out_off, size_t *out_len);
+int json_object_member(const char *buf, size_t len, const char *name, size_t *out_off, size_t *out_len);
+
+/* Logical keys under /v1/data; see util.c. */
+enum {
+    DATA_KEY_ACTIVITIES,
+    DATA_KEY_ACTIVITY_METRIC_INSIGHTS,
+    DATA_KEY_MEAL_PLANS,
+    DATA_KEY_CUSTOM_FOODS,
+    DATA_KEY_WORKOUTS,
+    DATA_KEY_EVENTS,
+    DATA_KEY_WELLNESS_SAMPLES,
+    DATA_KEY_PROFILE,
+    DATA_KEY_APP_SETTINGS,
+    DATA_KEY_LACTATE_HISTORY_RECORDS,
+    /* Every exported_file_<name> key; name is the prefix. */
+    DATA_KEY_EXPORTED_FILE,
+    DATA_KEY_ID_COUNT,
+};
+
+enum {
+    DATA_KEY_KIND_LIST,
+    DATA_KEY_KIND_OBJECT,
+};
+
+typedef struct {
+    uint16_t id;
+    uint8_t kind;
+    /* Whether GET responses go through the value cache. */
+    uint8_t cacheable;
+    const char *name;
+    size_t name_len;
+    /* Served, and seeded, while the key was never written. */
+    const char *default_body;
+    /* Largest write body accepted. */
+    size_t max_bytes;
+} data_key_t;
+
+extern const data_key_t DATA_KEY_TABLE[DATA_KEY_ID_COUNT];
+/* Returns the descriptor of key[0..len), or NULL if it is not a data key. */
+const data_key_t *data_key_lookup(const char *key, size_t len);
+/* The same for "<account>::<key>" or an unprefixed key. */
+const data_key_t *storage_key_lookup(const char *key);
 
 int tune_fd_limit(void);
 int set_nonblocking(int fd);
+/* A non-blocking listening socket; reuse_port lets several of them bind one address. */
+int open_listen_socket(const char *host, int port, int backlog, int reuse_port);
 int socket_send_flags(void);
 int configure_socket_after_accept(int fd);
+int storage_key_shard(const char *storage_key, int shard_count);
+int write_precondition_holds(int64_t if_match, uint64_t version);
+int shard_db_path(const char *db_path, int shard, char *out, size_t out_len);
+int parse_timestamp(const char *s, size_t len, int64_t *out_ts);
+/* Row writes shared by the write dispatcher and journal replay; see kv_write.c. */
+typedef struct {
+    sqlite3 *db;
+    sqlite3_stmt *upsert;
+    sqlite3_stmt *version;
+    sqlite3_stmt *read_list;
+    sqlite3_stmt *set_list;
+    sqlite3_stmt *delete_items;
+    sqlite3_stmt *last_position;
+    sqlite3_stmt *insert_item;
+    sqlite3_stmt *update_item;
+    sqlite3_stmt *insert_chunk;
+    /* Extended result code of the last failed kv_write_apply. */
+    int last_ext;
+} kv_writer_t;
+
+/*
+ * Seconds since the epoch from an element's "date" or "createdAt" member;
+ * kv_items keeps it as item_ts for since= reads.
+ */
+int kv_element_timestamp(const char *elem, size_t elem_len, int64_t *out_ts);
+/* Returned by kv_write_apply when APPEND/PATCH meets a stored value that is not an array. */
+#define KV_WRITE_NOT_LIST (-1)
+
+int kv_writer_prepare(kv_writer_t *w, sqlite3 *db);
+void kv_writer_finalize(kv_writer_t *w);
+/* Returns SQLITE_DONE with the row version (0 when absent), or the failing result code. */
+int kv_read_version(kv_writer_t *w, const char *storage_key, uint64_t *out_version);
+/* Returns SQLITE_DONE, an SQLite result code, or KV_WRITE_NOT_LIST. */
+int kv_write_apply(kv_writer_t *w, int op, const char *storage_key, const char *payload, size_t payload_len, uint64_t version);
+
+/*
+ * One write of a WRITE_OP_BATCH payload. The job's storage key is the
+ * account prefix "<account>::" and each entry names a logical key under it.
+ */
+typedef struct {
+    int op;
+    int64_t if_match;
+    const char *key;
+    size_t key_len;
+    const char *value;
+    size_t value_len;
+} kv_batch_entry_t;
+
+/* Returned by kv_write_apply_batch when an entry's If-Match does not hold. */
+#define KV_WRITE_PRECONDITION_FAILED (-2)
+
+/* Appends entry to the malloc'd batch payload *buf. */
+int kv_batch_append(char **buf, size_t *len, size_t *cap, const kv_batch_entry_t *entry);
+/* Decodes the entry at *pos: 1 and advances, 0 at the end, -1 on a malformed payload. */
+int kv_batch_next(const char *payload, size_t payload_len, size_t *pos, kv_batch_entry_t *out_entry);
+/* "<prefix><key>" for an entry of the batch stored under prefix. */
+int kv_batch_storage_key(const char *prefix, const kv_batch_entry_t *entry, char *out, size_t out_len);
+/*
+ * Applies every entry at version, or none of them: the first entry whose
+ * If-Match fails yields KV_WRITE_PRECONDITION_FAILED with its row version in
+ * *out_current, and an APPEND/PATCH on a non-list yields KV_WRITE_NOT_LIST.
+ */
+int kv_write_apply_batch(kv_writer_t *w, const char *prefix, const char *payload, size_t payload_len, uint64_t version, uint64_t *out_current);
+/*
+ * Ride telemetry under /v1/streams/<ride-id> (see ride_stream.c). A ride is
+ * stored as "<account>::stream:<ride-id>": its kv_store row is the head, a
+ * JSON summary carrying the version of the last chunk written, and every
+ * chunk is an append-only ride_chunks row holding its samples column by
+ * column. t is an integer time in milliseconds, strictly increasing within
+ * a ride; each RIDE_FIELD_* reading is a float, NaN when missing.
+ */
+#define RIDE_STREAM_KEY_PREFIX "stream:"
+#define RIDE_ID_MAX 128
+/* Largest chunk upload, after any Content-Encoding is undone. */
+#define RIDE_CHUNK_MAX_BYTES (1024 * 1024)
+
+enum {
+    RIDE_FIELD_POWER,
+    RIDE_FIELD_HEART_RATE,
+    RIDE_FIELD_CADENCE,
+    RIDE_FIELD_SPEED,
+    RIDE_FIELD_DISTANCE,
+    RIDE_FIELD_LEFT_BALANCE,
+    RIDE_FIELD_RIGHT_BALANCE,
+    RIDE_FIELD_COUNT,
+};
+
+/* One sample of the binary wire format: i64 t, then RIDE_FIELD_COUNT f32, all little-endian. */
+#define RIDE_SAMPLE_WIRE_BYTES (8 + 4 * RIDE_FIELD_COUNT)
+
+typedef struct {
+    int64_t chunks;
+    int64_t samples;
+    int64_t from;
+    int64_t to;
+} ride_head_t;
+
+int ride_id_is_valid(const char *id, size_t len);
+/* Whether key is "<account>::stream:<ride-id>". */
+int ride_storage_key_is_valid(const char *storage_key);
+/* Builds a chunk from an NDJSON or binary upload; -1 with the 400 body in *out_error. */
+int ride_chunk_build(const char *body, size_t body_len, int binary, char **out_chunk, size_t *out_len, const char **out_error);
+/* Sample count of a well-formed chunk, or -1. */
+int64_t ride_chunk_samples(const char *chunk, size_t len);
+int64_t ride_chunk_time(const char *chunk, size_t len, int64_t index);
+/* Index of the first sample later than t (the sample count when there is none). */
+int64_t ride_chunk_first_after(const char *chunk, size_t len, int64_t t);
+/* A malloc'd copy of the chunk without its first skip samples. */
+int ride_chunk_trim(const char *chunk, size_t len, int64_t skip, char **out_chunk, size_t *out_len);
+uint32_t ride_chunk_crc32(const char *chunk, size_t len);
+/*
+ * Appends the samples with from <= t < to to the malloc'd *buf, as NDJSON
+ * lines or binary wire records. Returns the number appended, -1 on OOM.
+ */
+int64_t ride_chunk_render(const char *chunk, size_t len, int64_t from, int64_t to, int binary, char **buf, size_t *buf_len, size_t *buf_cap);
+int ride_head_parse(const char *json, size_t len, ride_head_t *out_head);
+int ride_head_format(const ride_head_t *head, char *out, size_t out_len);
+
 int init_db(const char *db_path);
 int worker_db_open(worker_db_t *db, const char *db_path);
 void worker_db_close(worker_db_t *db);
 
+#define JOURNAL_DIR "journal"
+#define DEFAULT_JOURNAL_SEGMENT_BYTES (64 * 1024 * 1024)
+
+typedef struct journal_entry journal_entry_t;
+
+typedef struct {
+    size_t segment_bytes;
+} journal_config_t;
+
+typedef struct {
+    int segments;
+    long long live_records;
+    long long appended_records;
+    long long sync_count;
+    uint64_t checkpoint_seq;
+} journal_stats_t;
+
+typedef struct {
+    size_t segments;
+    size_t applied;
+    /* At or below the checkpoint. */
+    size_t skipped;
+    /* Overwritten by a later unconditional PUT of the same key. */
+    size_t superseded;
+    uint64_t checkpoint_seq;
+} journal_replay_stats_t;
+
+/* if_match is the precondition the write was accepted under, or WRITE_IF_MATCH_NONE. */
+typedef int (*journal_apply_fn)(
+    void *ctx,
+    uint64_t seq,
+    const char *storage_key,
+    const char *log_id,
+    int op,
+    int64_t if_match,
+    const char *payload,
+    size_t payload_len);
+
+/* Must be called before journal_open to take effect. */
+void journal_configure(const journal_config_t *config);
+/* Sets the seq of the next append so row versions keep increasing across restarts; ignored while open. */
+void journal_reserve_seq(uint64_t next_seq);
+/* Fails if unreplayed segments are present; run journal_replay first. */
+int journal_open(void);
+void journal_close(void);
+/* Appends the record without waiting for it to be durable; see journal_sync. */
+int journal_write(
+    const char *storage_key,
+    const char *log_id,
+    int op,
+    int64_t if_match,
+    const char *payload,
+    size_t payload_len,
+    journal_entry_t **out_entry);
+/* Returns once every record up to seq is durable, syncing on behalf of all writers. */
+int journal_sync(uint64_t seq);
+/* journal_write then journal_sync; the entry stays live until retired. */
+int journal_append(
+    const char *storage_key,
+    const char *log_id,
+    int op,
+    int64_t if_match,
+    const char *payload,
+    size_t payload_len,
+    journal_entry_t **out_entry);
+uint64_t journal_entry_seq(const journal_entry_t *entry);
+void journal_retire(journal_entry_t *entry);
+void journal_checkpoint(void);
+void journal_stats_snapshot(journal_stats_t *out_stats);
+/* Called once every record was applied, before the segments are deleted; nonzero keeps them. */
+typedef int (*journal_flush_fn)(void *ctx);
+/* Applies records newer than the last checkpoint in seq order, then deletes the segments. flush may be NULL. */
+int journal_replay(journal_apply_fn apply, journal_flush_fn flush, void *ctx, journal_replay_stats_t *out_stats);
+
+/* status_code 202 means durable in the journal but not applied yet. */
 typedef struct {
-    int completed;
     int status_code;
     int sqlite_rc;
     int sqlite_ext;
     int retry_count;
+    /* Set on a 500 because the journal record could not be made durable. */
+    int journal_error;
+    /* On 202/204 the version written; on 412 the version found. */
+    uint64_t version;
     char backup_path[512];
 } write_dispatch_result_t;
 
+/* owner and owner_handle are the submitter's, passed back untouched. */
+typedef struct write_completion {
+    struct write_completion *next;
+    void *owner;
+    uint64_t owner_handle;
+    write_dispatch_result_t result;
+} write_completion_t;
+
+/*
+ * Multi-producer, single-consumer queue of finished writes. Dispatcher
+ * threads push; the owning thread waits for fd to become readable (it is
+ * an eventfd on Linux and a pipe on macOS) and takes everything at once.
+ */
+struct write_completion_queue {
+    _Atomic(write_completion_t *) head;
+    atomic_int signaled;
+    int fd;
+    int signal_fd;
+};
+
+int write_completion_queue_init(write_completion_queue_t *queue);
+/* Only once nothing submitted against the queue is still outstanding. */
+void write_completion_queue_destroy(write_completion_queue_t *queue);
+/* Returns the completions pushed so far, oldest first, or NULL. */
+write_completion_t *write_completion_queue_take(write_completion_queue_t *queue);
+/* Polls fd; returns >0 once a completion may be waiting, 0 on timeout. */
+int write_completion_queue_wait(write_completion_queue_t *queue, int timeout_ms);
+/* Every taken completion must be released. */
+void write_completion_release(write_completion_t *completion);
+/* Wakes the owner without a completion, for the other events its loop watches. */
+void write_completion_queue_signal(write_completion_queue_t *queue);
+
+#define DEFAULT_CHANGE_FEED_ENTRIES 16384
+#define CHANGE_FEED_KEY_MAX 256
+#define CHANGE_FEED_RESET (-1)
+
+typedef struct {
+    /* Changes retained for GET /v1/changes; 0 disables the feed. */
+    size_t entries;
+} change_feed_config_t;
+
+/* One change as seen by a reader: key is the logical key, without the account prefix. */
+typedef struct {
+    uint64_t seq;
+    uint64_t version;
+    char key[CHANGE_FEED_KEY_MAX];
+} change_feed_entry_t;
+
+/* Must be called before init_db and the workers start to take effect. */
+void change_feed_configure(const change_feed_config_t *config);
+int change_feed_enabled(void);
+uint64_t change_feed_last_seq(void);
+/* Records that storage_key now holds version; dispatchers call it after COMMIT. */
+void change_feed_append(const char *storage_key, uint64_t version);
+/* Wakes every worker whose completion queue is marked as waiting. */
+void change_feed_notify(void);
+void change_feed_set_waiting(write_completion_queue_t *queue, int waiting);
+/*
+ * Copies up to max changes after seq since whose storage key starts with
+ * prefix, oldest first, and sets *out_next to the seq to resume from.
+ * Returns the count, or CHANGE_FEED_RESET when since lies outside the
+ * retained window (or the feed is off) and the reader must resync from
+ * *out_next.
+ */
+int change_feed_read(const char *prefix, uint64_t since, change_feed_entry_t *out, int max, uint64_t *out_next);
+/* Starts a new window, so every cursor handed out so far reads as a reset. */
+void change_feed_reset(void);
+
+#define DEFAULT_REPLICATION_LOG_BYTES (64 * 1024 * 1024)
+#define REPLICATION_TOKEN_MAX 128
+
+enum {
+    REPLICATION_ROLE_NONE = 0,
+    REPLICATION_ROLE_PRIMARY = 1,
+    REPLICATION_ROLE_FOLLOWER = 2,
+};
+
+/*
+ * A primary listens on listen_port for followers and keeps the last
+ * log_bytes of committed writes for them. A follower connects to
+ * primary_host:primary_port, applies what it is sent and redirects writes
+ * to primary_url. Both ends must agree on token when one is set.
+ */
+typedef struct {
+    char listen_host[128];
+    int listen_port;
+    char primary_host[128];
+    int primary_port;
+    char primary_url[256];
+    char token[REPLICATION_TOKEN_MAX];
+    size_t log_bytes;
+} replication_config_t;
+
+typedef struct {
+    int role;
+    /* Primary: connected followers. Follower: 1 while streaming from the primary. */
+    int connected;
+    /* Primary: last position published. Follower: last position applied. */
+    uint64_t position;
+    /* Follower: last position the primary was known to have. */
+    uint64_t primary_position;
+    /* Follower: how long ago the last write applied here committed on the primary; 0 once caught up. */
+    double lag_seconds;
+    long long applied_records;
+    long long snapshots;
+} replication_stats_t;
+
+/* Must be called before init_db and the workers start to take effect. */
+void replication_configure(const replication_config_t *config);
+int replication_is_follower(void);
+const char *replication_primary_url(void);
+/* Starts the listener for followers; the log only records writes from here on. */
+int replication_primary_start(const char *db_path);
+/* Starts the thread that streams from the primary into db_path. */
+int replication_follower_start(const char *db_path);
+void replication_stop(void);
+/* Called by a dispatcher after COMMIT, in commit order, for every write it applied. */
+void replication_publish(int op, const char *storage_key, const char *payload, size_t payload_len, uint64_t version);
+void replication_stats_snapshot(replication_stats_t *out_stats);
+
+typedef struct {
+    int queue_depth;
+    int last_batch_size;
+    long long batch_count;
+    long long superseded_count;
+} write_shard_diagnostics_t;
+
 typedef struct {
     int running;
     int queue_depth;
+    int last_batch_size;
+    int max_batch_size;
+    long long batch_count;
+    /* Queued writes dropped because a later PUT of the same key replaced them. */
+    long long superseded_count;
     char last_success_logid[96];
     char last_error_logid[96];
+    int shard_count;
+    write_shard_diagnostics_t shards[MAX_WRITE_SHARDS];
 } write_dispatch_diagnostics_t;
 
+#define DEFAULT_WRITE_BATCH_MAX_JOBS 256
+#define DEFAULT_WRITE_BATCH_MAX_BYTES (32 * 1024 * 1024)
+#define DEFAULT_WRITE_BATCH_LINGER_US 0
+#define DEFAULT_WRITE_QUEUED_ACK_MS 150
+#define DEFAULT_WRITE_QUEUE_MAX_JOBS 65536
+#define DEFAULT_WRITE_QUEUE_MAX_BYTES (1024 * 1024 * 1024)
+
+typedef struct {
+    int batch_max_jobs;
+    size_t batch_max_bytes;
+    int batch_linger_us;
+    int shard_count;
+    /* A write not applied this long after submission is answered 202; 0 never does. */
+    int queued_ack_ms;
+    /* Per-shard bounds on queued writes; 0 means unbounded. */
+    int queue_max_jobs;
+    size_t queue_max_bytes;
+} write_dispatch_config_t;
+
+/* Must be called before init_db and the first write_dispatcher_acquire to take effect. */
+void write_dispatcher_configure(const write_dispatch_config_t *config);
+int write_dispatch_shard_count(void);
 int write_dispatcher_acquire(const char *db_path);
 void write_dispatcher_release(void);
+#define WRITE_DISPATCH_JOURNAL_FAILED (-2)
+#define WRITE_DISPATCH_OVERLOADED (-3)
+
+/*
+ * Journals the write and queues it on its shard without waiting. Exactly
+ * one completion for it is later pushed to completions. Returns 0, -1 when
+ * the dispatcher is not running, WRITE_DISPATCH_OVERLOADED when the shard's
+ * queue is full, or WRITE_DISPATCH_JOURNAL_FAILED.
+ */
 int write_dispatch_submit(
     const char *logical_key,
     const char *storage_key,
     const char *payload,
     size_t payload_len,
-    const char *pending_path,
+    int op,
+    int64_t if_match,
     const char *account_id,
     const char *log_id,
-    int wait_timeout_ms,
-    write_dispatch_result_t *out_result);
+    write_completion_queue_t *completions,
+    void *owner,
+    uint64_t owner_handle);
+/* Whether the shard of account_id has queue room for payload_len more bytes right now. */
+int write_dispatch_has_room(const char *account_id, size_t payload_len);
 void write_dispatch_diagnostics_snapshot(write_dispatch_diagnostics_t *out_diag);
+/* Invalidates the cache for, and records in the change feed, a write committed at version. */
+void write_publish_committed(int op, const char *storage_key, const char *payload, size_t payload_len, uint64_t version);
+
+/*
+ * Process-wide counters and latency histograms, served as GET /metrics. See
+ * metrics.c; recording never blocks and only touches the calling thread's
+ * shard.
+ */
+enum {
+    METRICS_ROUTE_HEALTH,
+    METRICS_ROUTE_DATA_GET,
+    METRICS_ROUTE_DATA_PAGE,
+    METRICS_ROUTE_DATA_PUT,
+    METRICS_ROUTE_DATA_APPEND,
+    METRICS_ROUTE_DATA_PATCH,
+    METRICS_ROUTE_BATCH_GET,
+    METRICS_ROUTE_BATCH_WRITE,
+    METRICS_ROUTE_CHANGES,
+    METRICS_ROUTE_STREAM_WRITE,
+    METRICS_ROUTE_STREAM_READ,
+    METRICS_ROUTE_DEBUG,
+    METRICS_ROUTE_METRICS,
+    METRICS_ROUTE_OTHER,
+    METRICS_ROUTE_COUNT,
+};
+
+/* The status codes the server sends, plus one slot for anything else. */
+#define METRICS_STATUS_COUNT 18
+
+enum {
+    METRICS_STAGE_PARSE,
+    METRICS_STAGE_JSON_VALIDATE,
+    METRICS_STAGE_JOURNAL_FSYNC,
+    METRICS_STAGE_DISPATCH_WAIT,
+    METRICS_STAGE_SQLITE_STEP,
+    METRICS_STAGE_SEND,
+    METRICS_STAGE_COUNT,
+};
+
+uint64_t metrics_now_ns(void);
+/* Records the time since start_ns (from metrics_now_ns) for stage. */
+void metrics_observe_stage(int stage, uint64_t start_ns);
+int metrics_status_index(int status);
+void metrics_count_request(int route, int status);
+/* key_id is a DATA_KEY_* id. */
+void metrics_count_key(int key_id);
+void metrics_observe_batch(int jobs);
+void metrics_count_retry(void);
+void metrics_count_queued(void);
+/* Called by each event loop worker whenever its connection count changes. */
+void metrics_set_open_conns(size_t open_conns);
+/* Returns the Prometheus text exposition in a malloc'd buffer, or NULL. */
+char *metrics_render(size_t *out_len);
 
 void send_response(int fd, int code, const char *status, const char *body);
+/* Returns 1 while the stream has more to produce, 0 once it finished, -1 on error. */
+int conn_stream_resume(worker_db_t *db, conn_t *conn);
+void conn_stream_free(conn_t *conn);
+void conn_pending_write_free(conn_t *conn);
+/* Gives back what the admission of conn's current request holds. */
+void conn_admission_release(worker_db_t *db, conn_t *conn);
 int try_process_client(int fd, worker_db_t *db, conn_t *conn);
+/* Sends the response of conn's pending write; returns 1 like try_process_client. */
+int try_complete_write(int fd, conn_t *conn, const write_dispatch_result_t *result);
+/*
+ * Looks at the feed for conn's parked watch. A long-poll is answered once
+ * the account has a change or its wait ran out, which clears conn->watch;
+ * an event stream queues the new events (or a heartbeat when due) and stays
+ * parked. *out_due_ms is when the watch next wants a look regardless of the
+ * feed. Returns -1 when the connection should be closed, else 0.
+ */
+int conn_watch_poll(int fd, conn_t *conn, int64_t now_ms, int64_t *out_due_ms);
+void conn_watch_free(conn_t *conn);
+
+#define IO_RING_ENTRIES 1024
+#define IO_RING_BUFS 256
+#define IO_RING_BUF_SIZE (16 * 1024)
+
+/* One io_uring instance and its provided receive buffers; see io_ring.c. */
+typedef struct io_ring io_ring_t;
+
+typedef struct {
+    uint64_t user_data;
+    int res;
+    /* A multishot request stays armed. */
+    int more;
+    /* The provided buffer holding res bytes, or NULL; return it with io_ring_recycle. */
+    const char *buf;
+    int buf_id;
+} io_ring_cqe_t;
+
+/* Returns NULL with errno set when io_uring or a feature it needs is unavailable. */
+io_ring_t *io_ring_create(unsigned entries, unsigned buf_count, size_t buf_size);
+void io_ring_destroy(io_ring_t *ring);
+/* Queue an SQE for the next io_ring_wait; -1 when the ring is full and could not be flushed. */
+int io_ring_prep_accept_multishot(io_ring_t *ring, int listen_fd, uint64_t user_data);
+int io_ring_prep_recv(io_ring_t *ring, int fd, uint64_t user_data);
+int io_ring_prep_poll(io_ring_t *ring, int fd, unsigned events, int multishot, uint64_t user_data);
+int io_ring_prep_cancel(io_ring_t *ring, uint64_t target, uint64_t user_data);
+int io_ring_prep_close(io_ring_t *ring, int fd, uint64_t user_data);
+/* Submits everything queued and, unless completions are ready, waits up to timeout_ms (-1 forever). */
+int io_ring_wait(io_ring_t *ring, int timeout_ms);
+/* Pops the next completion; returns 0 when none is left. */
+int io_ring_next(io_ring_t *ring, io_ring_cqe_t *out);
+void io_ring_recycle(io_ring_t *ring, int buf_id);
+
+/*
+ * Process-wide write rate limit per account (see admission.c); the
+ * per-worker and per-shard limits live with the worker and dispatcher.
+ */
+typedef struct {
+    /* Writes per second; 0 disables the limit. */
+    int account_write_rate;
+    /* Bucket size; 0 means one second's worth. */
+    int account_write_burst;
+} admission_config_t;
+
+/* Must be called before the workers start to take effect. */
+void admission_configure(const admission_config_t *config);
+/* Takes one write token for account_id; -1 with a Retry-After hint when it has none left. */
+int admission_take_write(const char *account_id, int *out_retry_after_s);
+
+/*
+ * CPU placement for the worker and dispatcher threads (see affinity.c).
+ * Nothing is pinned unless pin_threads is set.
+ */
+typedef struct {
+    int pin_threads;
+    /* Hands consecutive workers to different NUMA nodes instead of filling one node first. */
+    int numa_interleave;
+    /* CPUs set aside for the write dispatchers, normally one per shard. */
+    int dispatcher_cpus;
+} affinity_config_t;
+
+/* Must be called before init_db and the workers start to take effect. */
+void affinity_configure(const affinity_config_t *config);
+/* CPUs this process may run on, less those kept for dispatchers when pinning. */
+int affinity_cpu_count(void);
+/* The CPU a thread is pinned to, or -1 when pinning is off. */
+int affinity_worker_cpu(int worker);
+int affinity_dispatcher_cpu(int shard);
+/* Pin the calling thread; failures are logged and otherwise ignored. */
+void affinity_pin_worker(int worker);
+void affinity_pin_dispatcher(int shard);
 
-int run_worker_loop(int listen_fd, const char *db_path, size_t max_fds);
+int run_worker_loop(int listen_fd, const char *db_path, const worker_config_t *config);
 
 #endif
@@ -0,0 +1,32 @@
+#include "server_internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+shared_buf_t *shared_buf_new(size_t len) {
+    shared_buf_t *buf = (shared_buf_t *)malloc(sizeof(shared_buf_t) + len + 1);
+    if (!buf) return NULL;
+    atomic_init(&buf->refcount, 1);
+    buf->len = len;
+    buf->data[len] = '\0';
+    return buf;
+}
+
+shared_buf_t *shared_buf_copy(const char *data, size_t len) {
+    shared_buf_t *buf = shared_buf_new(len);
+    if (!buf) return NULL;
+    if (len > 0) memcpy(buf->data, data, len);
+    return buf;
+}
+
+shared_buf_t *shared_buf_retain(shared_buf_t *buf) {
+    if (buf) atomic_fetch_add_explicit(&buf->refcount, 1, memory_order_relaxed);
+    return buf;
+}
+
+void shared_buf_release(shared_buf_t *buf) {
+    if (!buf) return;
+    if (atomic_fetch_sub_explicit(&buf->refcount, 1, memory_order_acq_rel) == 1) {
+        free(buf);
+    }
+}
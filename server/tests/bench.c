@@ -0,0 +1,404 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+#include "../logger.h"
+#include "../server.h"
+#include "../server_internal.h"
+
+/*
+ * Micro-benchmarks for the request hot paths. Each benchmark is calibrated
+ * until one round takes at least FRICU_BENCH_MIN_MS, then run for
+ * BENCH_ROUNDS rounds; the median round is reported so a noisy neighbour
+ * moves the minimum rather than the headline number. Set FRICU_BENCH_FILTER
+ * to a substring to run a subset, and FRICU_BENCH_DISK_DIR to choose where
+ * the on-disk journal benchmark writes (tmpfs is /dev/shm).
+ *
+ * With glibc, malloc/calloc/realloc are counted from every thread, so
+ * allocs_op for the write paths includes what the flusher and dispatcher
+ * threads allocate on the request's behalf.
+ */
+
+#define BENCH_ROUNDS 5
+#define DEFAULT_BENCH_MIN_MS 50
+
+#if defined(__GLIBC__)
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static atomic_ullong g_allocs;
+
+void *malloc(size_t size) {
+    atomic_fetch_add_explicit(&g_allocs, 1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    atomic_fetch_add_explicit(&g_allocs, 1, memory_order_relaxed);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    atomic_fetch_add_explicit(&g_allocs, 1, memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+static unsigned long long alloc_count(void) {
+    return atomic_load_explicit(&g_allocs, memory_order_relaxed);
+}
+#define BENCH_COUNTS_ALLOCS 1
+#else
+static unsigned long long alloc_count(void) {
+    return 0;
+}
+#define BENCH_COUNTS_ALLOCS 0
+#endif
+
+typedef void (*bench_fn)(void *ctx);
+
+static const char *g_filter;
+static long g_min_ns;
+
+static uint64_t bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_run(const char *name, bench_fn fn, void *ctx) {
+    if (g_filter && !strstr(name, g_filter)) return;
+
+    long long iters = 1;
+    while (1) {
+        uint64_t start = bench_now_ns();
+        for (long long i = 0; i < iters; i++) fn(ctx);
+        uint64_t elapsed = bench_now_ns() - start;
+        if ((long)elapsed >= g_min_ns || iters >= (1ll << 30)) break;
+        long long scaled = elapsed > 0 ? (long long)((double)iters * (double)g_min_ns / (double)elapsed * 1.2) : iters * 10;
+        iters = scaled > iters * 10 ? iters * 10 : scaled > iters ? scaled : iters * 2;
+    }
+
+    double ns_op[BENCH_ROUNDS];
+    unsigned long long allocs = 0;
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        unsigned long long allocs_before = alloc_count();
+        uint64_t start = bench_now_ns();
+        for (long long i = 0; i < iters; i++) fn(ctx);
+        uint64_t elapsed = bench_now_ns() - start;
+        allocs += alloc_count() - allocs_before;
+        ns_op[r] = (double)elapsed / (double)iters;
+    }
+    qsort(ns_op, BENCH_ROUNDS, sizeof(ns_op[0]), compare_double);
+    double allocs_op = (double)allocs / (double)(iters * BENCH_ROUNDS);
+    if (BENCH_COUNTS_ALLOCS) {
+        printf("bench=%s iters=%lld ns_op=%.1f ns_op_min=%.1f allocs_op=%.2f\n", name, iters, ns_op[BENCH_ROUNDS / 2], ns_op[0], allocs_op);
+    } else {
+        printf("bench=%s iters=%lld ns_op=%.1f ns_op_min=%.1f allocs_op=n/a\n", name, iters, ns_op[BENCH_ROUNDS / 2], ns_op[0]);
+    }
+    fflush(stdout);
+}
+
+static char *make_tmpdir(const char *base, const char *tag) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/fricu-bench-%s-XXXXXX", base, tag);
+    char *dir = mkdtemp(path);
+    return dir ? strdup(dir) : NULL;
+}
+
+static void remove_tmpdir(const char *dir) {
+    char cmd[600];
+    snprintf(cmd, sizeof(cmd), "rm -rf '%s' >/dev/null 2>&1", dir);
+    if (system(cmd) != 0) fprintf(stderr, "failed to remove %s\n", dir);
+}
+
+/* ---- parsing and validation ---- */
+
+typedef struct {
+    const char *req;
+    size_t len;
+    http_parse_state_t st;
+} parse_ctx_t;
+
+static void bench_http_parse(void *arg) {
+    parse_ctx_t *ctx = (parse_ctx_t *)arg;
+    http_parse_reset(&ctx->st);
+    int rc = http_parse_request(&ctx->st, ctx->req, ctx->len);
+    assert(rc == HTTP_PARSE_DONE);
+}
+
+static volatile int g_sink;
+
+static void bench_is_valid_key(void *arg) {
+    g_sink += is_valid_key((const char *)arg);
+}
+
+static void bench_is_valid_storage_key(void *arg) {
+    g_sink += is_valid_storage_key((const char *)arg);
+}
+
+typedef struct {
+    const char *text;
+    size_t len;
+    sqlite3_stmt *stmt;
+} json_ctx_t;
+
+static void bench_json_validate(void *arg) {
+    json_ctx_t *ctx = (json_ctx_t *)arg;
+    json_shape_t shape;
+    int rc = json_validate(ctx->text, ctx->len, &shape);
+    assert(rc == 0);
+    g_sink += rc;
+}
+
+/* SQLite's json_valid(), which the server used before json_validate, as the baseline. */
+static void bench_sqlite_json_valid(void *arg) {
+    json_ctx_t *ctx = (json_ctx_t *)arg;
+    sqlite3_reset(ctx->stmt);
+    sqlite3_bind_text(ctx->stmt, 1, ctx->text, (int)ctx->len, SQLITE_STATIC);
+    int rc = sqlite3_step(ctx->stmt);
+    assert(rc == SQLITE_ROW && sqlite3_column_int(ctx->stmt, 0) == 1);
+}
+
+static char *make_activities_json(size_t target, size_t *out_len) {
+    char *buf = (char *)malloc(target + 256);
+    assert(buf != NULL);
+    size_t len = 0;
+    buf[len++] = '[';
+    for (int i = 0; len < target; i++) {
+        if (i > 0) buf[len++] = ',';
+        len += (size_t)snprintf(
+            buf + len,
+            256,
+            "{\"id\":%d,\"sport\":\"cycling\",\"start\":\"2024-05-02T08:%02d:00Z\",\"tss\":%d.5,\"tags\":[\"z2\",\"base\"],\"note\":null}",
+            i,
+            i % 60,
+            40 + i % 80);
+    }
+    buf[len++] = ']';
+    buf[len] = '\0';
+    *out_len = len;
+    return buf;
+}
+
+static void run_parse_benches(void) {
+    parse_ctx_t parse = {0};
+    parse.req =
+        "GET /v1/data/activities?limit=50 HTTP/1.1\r\n"
+        "Host: fricu.local:8080\r\n"
+        "User-Agent: FricuApp/1.0 (macOS 14.4)\r\n"
+        "Accept: application/json\r\n"
+        "Accept-Encoding: gzip, deflate\r\n"
+        "X-Account-Id: athlete-00042\r\n"
+        "X-Request-Id: 3f6c2a9e-1b7d-4e0f-9a55-8d2c41f07b13\r\n"
+        "If-None-Match: \"1842\"\r\n"
+        "Connection: keep-alive\r\n\r\n";
+    parse.len = strlen(parse.req);
+    bench_run("http_parse_request/get_9_headers", bench_http_parse, &parse);
+
+    bench_run("is_valid_key/activities", bench_is_valid_key, (void *)"activities");
+    bench_run("is_valid_storage_key/account_activities", bench_is_valid_storage_key, (void *)"athlete-00042::activities");
+
+    sqlite3 *mem = NULL;
+    assert(sqlite3_open(":memory:", &mem) == SQLITE_OK);
+    sqlite3_stmt *stmt = NULL;
+    assert(sqlite3_prepare_v2(mem, "SELECT json_valid(?1)", -1, &stmt, NULL) == SQLITE_OK);
+
+    json_ctx_t small = {"{\"name\":\"Ana\",\"ftp\":250,\"weight\":61.5,\"zones\":[120,150,175,200],\"indoor\":true}", 0, stmt};
+    small.len = strlen(small.text);
+    char *large_text = NULL;
+    json_ctx_t large = {NULL, 0, stmt};
+    large_text = make_activities_json(64 * 1024, &large.len);
+    large.text = large_text;
+
+    bench_run("json_validate/profile_80b", bench_json_validate, &small);
+    bench_run("sqlite_json_valid/profile_80b", bench_sqlite_json_valid, &small);
+    bench_run("json_validate/activities_64k", bench_json_validate, &large);
+    bench_run("sqlite_json_valid/activities_64k", bench_sqlite_json_valid, &large);
+
+    free(large_text);
+    sqlite3_finalize(stmt);
+    sqlite3_close(mem);
+}
+
+/* ---- full request handling ---- */
+
+typedef struct {
+    worker_db_t *db;
+    conn_t conn;
+    int fds[2];
+    const char *req;
+    size_t req_len;
+    char drain[65536];
+} request_ctx_t;
+
+static void bench_try_process_client(void *arg) {
+    request_ctx_t *ctx = (request_ctx_t *)arg;
+    memcpy(ctx->conn.buf, ctx->req, ctx->req_len);
+    ctx->conn.len = ctx->req_len;
+    http_parse_reset(&ctx->conn.parse);
+    int rc = try_process_client(ctx->fds[0], ctx->db, &ctx->conn);
+    assert(rc == 1);
+    while (read(ctx->fds[1], ctx->drain, sizeof(ctx->drain)) == (ssize_t)sizeof(ctx->drain)) {
+    }
+}
+
+static void run_request_bench(worker_db_t *db, const char *name, const char *req) {
+    request_ctx_t *ctx = (request_ctx_t *)calloc(1, sizeof(request_ctx_t));
+    assert(ctx != NULL);
+    ctx->db = db;
+    ctx->req = req;
+    ctx->req_len = strlen(req);
+    ctx->conn.cap = REQ_BUF_SIZE;
+    ctx->conn.buf = (char *)malloc(ctx->conn.cap);
+    assert(ctx->conn.buf != NULL && ctx->req_len <= ctx->conn.cap);
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, ctx->fds) == 0);
+    assert(set_nonblocking(ctx->fds[1]) == 0);
+    bench_run(name, bench_try_process_client, ctx);
+    free(ctx->conn.buf);
+    close(ctx->fds[0]);
+    close(ctx->fds[1]);
+    free(ctx);
+}
+
+static void run_request_benches(const char *base) {
+    char *dir = make_tmpdir(base, "requests");
+    assert(dir != NULL);
+    int old_cwd = open(".", O_RDONLY);
+    assert(old_cwd >= 0 && chdir(dir) == 0);
+
+    assert(init_db("state.db") == 0);
+    worker_db_t db;
+    assert(worker_db_open(&db, "state.db") == 0);
+
+    run_request_bench(&db, "try_process_client/get_health", "GET /health HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    run_request_bench(
+        &db,
+        "try_process_client/put_profile",
+        "PUT /v1/data/profile HTTP/1.1\r\nHost: localhost\r\nX-Account-Id: bench\r\nContent-Type: application/json\r\n"
+        "Content-Length: 24\r\n\r\n{\"name\":\"Ana\",\"ftp\":250}");
+    run_request_bench(
+        &db,
+        "try_process_client/get_profile_cached",
+        "GET /v1/data/profile HTTP/1.1\r\nHost: localhost\r\nX-Account-Id: bench\r\nUser-Agent: FricuApp/1.0\r\n\r\n");
+    run_request_bench(
+        &db,
+        "try_process_client/get_profile_not_modified",
+        "GET /v1/data/profile HTTP/1.1\r\nHost: localhost\r\nX-Account-Id: bench\r\nIf-None-Match: *\r\n\r\n");
+
+    worker_db_close(&db);
+    assert(fchdir(old_cwd) == 0);
+    close(old_cwd);
+    remove_tmpdir(dir);
+    free(dir);
+}
+
+/* ---- journal and dispatcher ---- */
+
+typedef struct {
+    long long n;
+} journal_ctx_t;
+
+static void bench_journal_append(void *arg) {
+    journal_ctx_t *ctx = (journal_ctx_t *)arg;
+    journal_entry_t *entry = NULL;
+    int rc = journal_append("bench::profile", "srv-bench", WRITE_OP_PUT, WRITE_IF_MATCH_NONE, "{\"name\":\"Ana\",\"ftp\":250}", 24, &entry);
+    assert(rc == 0);
+    journal_retire(entry);
+    if (++ctx->n % 1024 == 0) journal_checkpoint();
+}
+
+static void run_journal_bench(const char *base, const char *tag) {
+    char *dir = make_tmpdir(base, tag);
+    if (!dir) {
+        fprintf(stderr, "skipping journal_append/%s: cannot create a directory under %s\n", tag, base);
+        return;
+    }
+    int old_cwd = open(".", O_RDONLY);
+    assert(old_cwd >= 0 && chdir(dir) == 0);
+    assert(journal_open() == 0);
+    journal_ctx_t ctx = {0};
+    char name[64];
+    snprintf(name, sizeof(name), "journal_append/%s", tag);
+    bench_run(name, bench_journal_append, &ctx);
+    journal_close();
+    assert(fchdir(old_cwd) == 0);
+    close(old_cwd);
+    remove_tmpdir(dir);
+    free(dir);
+}
+
+typedef struct {
+    long long n;
+    write_completion_queue_t completions;
+} dispatch_ctx_t;
+
+static void bench_dispatch_round_trip(void *arg) {
+    dispatch_ctx_t *ctx = (dispatch_ctx_t *)arg;
+    const char *payload = "{\"name\":\"Ana\",\"ftp\":250}";
+    int rc = write_dispatch_submit(
+        "profile", "bench::profile", payload, strlen(payload), WRITE_OP_PUT, WRITE_IF_MATCH_NONE, "bench", "srv-bench", &ctx->completions, NULL, 0);
+    assert(rc == 0);
+    write_completion_t *completion = NULL;
+    while ((completion = write_completion_queue_take(&ctx->completions)) == NULL) {
+        write_completion_queue_wait(&ctx->completions, -1);
+    }
+    assert(completion->result.status_code == 204 && completion->next == NULL);
+    write_completion_release(completion);
+    ctx->n++;
+}
+
+static void run_dispatch_bench(const char *base) {
+    char *dir = make_tmpdir(base, "dispatch");
+    assert(dir != NULL);
+    int old_cwd = open(".", O_RDONLY);
+    assert(old_cwd >= 0 && chdir(dir) == 0);
+    assert(init_db("state.db") == 0);
+    worker_db_t db;
+    assert(worker_db_open(&db, "state.db") == 0);
+    dispatch_ctx_t ctx = {0};
+    assert(write_completion_queue_init(&ctx.completions) == 0);
+    bench_run("write_dispatch_submit/round_trip", bench_dispatch_round_trip, &ctx);
+    write_completion_queue_destroy(&ctx.completions);
+    worker_db_close(&db);
+    assert(fchdir(old_cwd) == 0);
+    close(old_cwd);
+    remove_tmpdir(dir);
+    free(dir);
+}
+
+int main(void) {
+    g_filter = getenv("FRICU_BENCH_FILTER");
+    const char *min_ms = getenv("FRICU_BENCH_MIN_MS");
+    g_min_ns = (min_ms && atol(min_ms) > 0 ? atol(min_ms) : DEFAULT_BENCH_MIN_MS) * 1000000L;
+    const char *disk_dir = getenv("FRICU_BENCH_DISK_DIR");
+    if (!disk_dir || !*disk_dir) disk_dir = "/var/tmp";
+
+    logger_config_t log_config = {LOG_LEVEL_ERROR, 1};
+    logger_configure(&log_config);
+
+    run_parse_benches();
+    run_request_benches(disk_dir);
+    if (access("/dev/shm", W_OK) == 0) run_journal_bench("/dev/shm", "tmpfs");
+    run_journal_bench(disk_dir, "disk");
+    run_dispatch_bench(disk_dir);
+    return 0;
+}
@@ -14,7 +14,7 @@ trap 'kill $SERVER_PID 2>/dev/null || true' EXIT
 
 sleep 1
 
-OUTPUT=$(./perf-client 50000 512)
+OUTPUT=$(./perf-client --requests=50000 --connections=512 ${PERF_CLIENT_ARGS:-})
 echo "$OUTPUT"
 
 echo "$OUTPUT" | rg -q '^failed=0$'
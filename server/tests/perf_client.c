@@ -1,141 +1,720 @@
+#define _GNU_SOURCE
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
-#include <stdatomic.h>
-#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
-#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#elif defined(__APPLE__)
+#include <sys/event.h>
+#else
+#error "Unsupported platform: only Linux and macOS are supported"
+#endif
+
+/*
+ * Event-driven load generator. Each thread drives its share of the
+ * connections from one epoll/kqueue loop. With --rate the load is open
+ * loop: request k of a thread is due at start + k / (rate / threads), and
+ * its latency is measured from that due time rather than from when a
+ * connection became free, so a stalled server shows up in the tail instead
+ * of silently lowering the send rate (coordinated omission). Without --rate
+ * every connection sends its next request as soon as the previous answer
+ * arrives.
+ */
+
+#define IN_BUF_SIZE 16384
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_EXP 36
+#define HIST_BUCKETS (HIST_SUB + (HIST_MAX_EXP - HIST_SUB_BITS + 1) * HIST_SUB)
+#define SPIN_BELOW_NS 1000000ull
+
+enum {
+    CLIENT_CLOSED,
+    CLIENT_CONNECTING,
+    CLIENT_IDLE,
+    CLIENT_SENDING,
+    CLIENT_READING,
+};
+
+enum {
+    STATUS_200,
+    STATUS_202,
+    STATUS_204,
+    STATUS_OTHER,
+    STATUS_SLOTS,
+};
+
 typedef struct {
     const char *host;
     int port;
-    int requests;
-    atomic_int *success;
-    atomic_int *failed;
-} worker_args_t;
-
-static int send_all(int fd, const char *buf, size_t len) {
-    size_t sent = 0;
-    while (sent < len) {
-        ssize_t n = send(fd, buf + sent, len - sent, 0);
-        if (n <= 0) return -1;
-        sent += (size_t)n;
+    int threads;
+    int connections;
+    long long requests;
+    double rate;
+    double put_ratio;
+    size_t payload_min;
+    size_t payload_max;
+    int payload_log;
+    int accounts;
+    int keep_alive;
+    int timeout_ms;
+    int json;
+} options_t;
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+    double sum;
+} latency_hist_t;
+
+typedef struct {
+    int fd;
+    int state;
+    int is_put;
+    int server_closes;
+    uint64_t due_ns;
+    uint64_t sent_ns;
+    char *out;
+    size_t out_len;
+    size_t out_off;
+    char in[IN_BUF_SIZE];
+    size_t in_len;
+    int status;
+    size_t header_len;
+    size_t body_left;
+} client_t;
+
+typedef struct {
+    int index;
+    const options_t *opt;
+    const struct sockaddr_in *addr;
+    long long share;
+    int conn_count;
+    client_t *clients;
+    int qfd;
+    int *idle;
+    int idle_len;
+    unsigned rng;
+    long long issued;
+    long long done;
+    long long status_counts[STATUS_SLOTS];
+    long long connect_errors;
+    long long io_errors;
+    long long timeouts;
+    latency_hist_t hist;
+} worker_t;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static unsigned next_rand(unsigned *state) {
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 8;
+}
+
+static double rand_unit(unsigned *state) {
+    return (double)(next_rand(state) & 0xFFFFFF) / (double)0x1000000;
+}
+
+static int hist_index(uint64_t v) {
+    if (v < HIST_SUB) return (int)v;
+    int exp = 63 - __builtin_clzll(v);
+    if (exp > HIST_MAX_EXP) return HIST_BUCKETS - 1;
+    int sub = (int)(v >> (exp - HIST_SUB_BITS)) - HIST_SUB;
+    return HIST_SUB + (exp - HIST_SUB_BITS) * HIST_SUB + sub;
+}
+
+static uint64_t hist_value(int index) {
+    if (index < HIST_SUB) return (uint64_t)index;
+    int exp = (index - HIST_SUB) / HIST_SUB + HIST_SUB_BITS;
+    int sub = (index - HIST_SUB) % HIST_SUB;
+    return ((uint64_t)(HIST_SUB + sub + 1) << (exp - HIST_SUB_BITS)) - 1;
+}
+
+static void hist_record(latency_hist_t *h, uint64_t us) {
+    h->counts[hist_index(us)]++;
+    h->total++;
+    h->sum += (double)us;
+    if (us > h->max) h->max = us;
+}
+
+static uint64_t hist_percentile(const latency_hist_t *h, double q) {
+    if (h->total == 0) return 0;
+    uint64_t rank = (uint64_t)ceil(q * (double)h->total);
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) return hist_value(i) < h->max ? hist_value(i) : h->max;
     }
-    return 0;
+    return h->max;
+}
+
+static int queue_add(int qfd, int fd, int slot) {
+#if defined(__linux__)
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLOUT;
+    ev.data.u32 = (uint32_t)slot;
+    return epoll_ctl(qfd, EPOLL_CTL_ADD, fd, &ev);
+#elif defined(__APPLE__)
+    struct kevent ev[2];
+    EV_SET(&ev[0], fd, EVFILT_READ, EV_ADD | EV_DISABLE, 0, 0, (void *)(intptr_t)slot);
+    EV_SET(&ev[1], fd, EVFILT_WRITE, EV_ADD | EV_ENABLE, 0, 0, (void *)(intptr_t)slot);
+    return kevent(qfd, ev, 2, NULL, 0, NULL);
+#endif
+}
+
+static int queue_want(int qfd, int fd, int slot, int want_write) {
+#if defined(__linux__)
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = want_write ? EPOLLOUT : EPOLLIN;
+    ev.data.u32 = (uint32_t)slot;
+    return epoll_ctl(qfd, EPOLL_CTL_MOD, fd, &ev);
+#elif defined(__APPLE__)
+    struct kevent ev[2];
+    EV_SET(&ev[0], fd, EVFILT_READ, want_write ? EV_DISABLE : EV_ENABLE, 0, 0, (void *)(intptr_t)slot);
+    EV_SET(&ev[1], fd, EVFILT_WRITE, want_write ? EV_ENABLE : EV_DISABLE, 0, 0, (void *)(intptr_t)slot);
+    return kevent(qfd, ev, 2, NULL, 0, NULL);
+#endif
+}
+
+/* Fills slots with ready connection indexes; returns how many. */
+static int queue_wait(int qfd, int *slots, int max_slots, int timeout_ms) {
+#if defined(__linux__)
+    struct epoll_event events[256];
+    int n = epoll_wait(qfd, events, max_slots < 256 ? max_slots : 256, timeout_ms);
+    for (int i = 0; i < n; i++) slots[i] = (int)events[i].data.u32;
+    return n;
+#elif defined(__APPLE__)
+    struct kevent events[256];
+    struct timespec timeout = {timeout_ms / 1000, (long)(timeout_ms % 1000) * 1000000L};
+    int n = kevent(qfd, NULL, 0, events, max_slots < 256 ? max_slots : 256, &timeout);
+    for (int i = 0; i < n; i++) slots[i] = (int)(intptr_t)events[i].udata;
+    return n;
+#endif
+}
+
+static void client_close(worker_t *w, int slot) {
+    client_t *c = &w->clients[slot];
+    if (c->fd >= 0) close(c->fd);
+    c->fd = -1;
+    c->state = CLIENT_CLOSED;
+    w->idle[w->idle_len++] = slot;
 }
 
-static int request_once(const char *host, int port, const char *req) {
+static int client_connect(worker_t *w, int slot) {
+    client_t *c = &w->clients[slot];
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0) return -1;
-
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons((uint16_t)port);
-    if (inet_pton(AF_INET, host, &addr.sin_addr) <= 0) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if (connect(fd, (const struct sockaddr *)w->addr, sizeof(*w->addr)) != 0 && errno != EINPROGRESS) {
         close(fd);
         return -1;
     }
-    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    if (queue_add(w->qfd, fd, slot) != 0) {
         close(fd);
         return -1;
     }
+    c->fd = fd;
+    c->state = CLIENT_CONNECTING;
+    return 0;
+}
+
+static size_t pick_payload_size(worker_t *w) {
+    const options_t *opt = w->opt;
+    if (opt->payload_max <= opt->payload_min) return opt->payload_min;
+    double u = rand_unit(&w->rng);
+    if (opt->payload_log) {
+        double lo = log((double)opt->payload_min);
+        double hi = log((double)opt->payload_max);
+        return (size_t)exp(lo + u * (hi - lo));
+    }
+    return opt->payload_min + (size_t)(u * (double)(opt->payload_max - opt->payload_min));
+}
 
-    if (send_all(fd, req, strlen(req)) != 0) {
-        close(fd);
-        return -1;
+/* Renders the next request into c->out: a GET, or a PUT of a JSON array sized to the payload distribution. */
+static void build_request(worker_t *w, client_t *c) {
+    const options_t *opt = w->opt;
+    char account[32];
+    snprintf(account, sizeof(account), "perf-%u", opt->accounts > 1 ? next_rand(&w->rng) % (unsigned)opt->accounts : 0u);
+    const char *connection = opt->keep_alive ? "keep-alive" : "close";
+    c->is_put = opt->put_ratio > 0 && rand_unit(&w->rng) < opt->put_ratio;
+    int head_len;
+    if (!c->is_put) {
+        head_len = snprintf(
+            c->out,
+            256,
+            "GET /v1/data/activities HTTP/1.1\r\nHost: %s\r\nX-Account-Id: %s\r\nConnection: %s\r\n\r\n",
+            opt->host,
+            account,
+            connection);
+        c->out_len = (size_t)head_len;
+        c->out_off = 0;
+        return;
     }
+    /* [{"sport":"cycling","pad":""}] plus a newline is 31 bytes before padding. */
+    size_t body_len = pick_payload_size(w);
+    if (body_len < 31) body_len = 31;
+    head_len = snprintf(
+        c->out,
+        256,
+        "PUT /v1/data/activities HTTP/1.1\r\nHost: %s\r\nX-Account-Id: %s\r\nContent-Type: application/json\r\n"
+        "Content-Length: %zu\r\nConnection: %s\r\n\r\n",
+        opt->host,
+        account,
+        body_len,
+        connection);
+    char *body = c->out + head_len;
+    memcpy(body, "[{\"sport\":\"cycling\",\"pad\":\"", 27);
+    memset(body + 27, 'x', body_len - 31);
+    memcpy(body + body_len - 4, "\"}]", 3);
+    body[body_len - 1] = '\n';
+    c->out_len = (size_t)head_len + body_len;
+    c->out_off = 0;
+}
 
-    char buf[1024];
-    ssize_t n = recv(fd, buf, sizeof(buf) - 1, 0);
-    close(fd);
-    if (n <= 0) return -1;
-    buf[n] = '\0';
-    return (strstr(buf, "HTTP/1.1 200") == buf || strstr(buf, "HTTP/1.1 204") == buf) ? 0 : -1;
-}
-
-static void *worker(void *arg) {
-    worker_args_t *w = (worker_args_t *)arg;
-    const char *get_req =
-        "GET /v1/data/activities HTTP/1.1\r\n"
-        "Host: 127.0.0.1\r\n"
-        "X-Account-Id: perf\r\n"
-        "Connection: close\r\n\r\n";
-    for (int i = 0; i < w->requests; i++) {
-        if (request_once(w->host, w->port, get_req) == 0) {
-            atomic_fetch_add(w->success, 1);
-        } else {
-            atomic_fetch_add(w->failed, 1);
+static void count_error(worker_t *w, long long *counter) {
+    (*counter)++;
+    w->done++;
+}
+
+static void start_request(worker_t *w, int slot, uint64_t due_ns) {
+    client_t *c = &w->clients[slot];
+    c->due_ns = due_ns;
+    c->sent_ns = now_ns();
+    c->in_len = 0;
+    c->header_len = 0;
+    c->status = 0;
+    build_request(w, c);
+    w->issued++;
+    if (c->state == CLIENT_CLOSED) {
+        if (client_connect(w, slot) != 0) {
+            count_error(w, &w->connect_errors);
+            w->idle[w->idle_len++] = slot;
         }
+        return;
+    }
+    c->state = CLIENT_SENDING;
+    if (queue_want(w->qfd, c->fd, slot, 1) != 0) {
+        count_error(w, &w->io_errors);
+        client_close(w, slot);
     }
-    return NULL;
 }
 
-int main(int argc, char **argv) {
-    int total = argc > 1 ? atoi(argv[1]) : 50000;
-    int concurrency = argc > 2 ? atoi(argv[2]) : 512;
-    const char *host = argc > 3 ? argv[3] : "127.0.0.1";
-    int port = argc > 4 ? atoi(argv[4]) : 8080;
+static void finish_response(worker_t *w, int slot) {
+    client_t *c = &w->clients[slot];
+    uint64_t end = now_ns();
+    hist_record(&w->hist, (end - c->due_ns) / 1000);
+    int status_slot = c->status == 200 ? STATUS_200 : c->status == 202 ? STATUS_202 : c->status == 204 ? STATUS_204 : STATUS_OTHER;
+    w->status_counts[status_slot]++;
+    w->done++;
+    if (!w->opt->keep_alive || c->server_closes) {
+        client_close(w, slot);
+        return;
+    }
+    c->state = CLIENT_IDLE;
+    w->idle[w->idle_len++] = slot;
+}
+
+/* Returns 1 once the whole response is in; only the header is kept, the body is skipped. */
+static int parse_response(client_t *c) {
+    if (c->header_len == 0) {
+        char *end = NULL;
+        for (size_t i = 3; i < c->in_len; i++) {
+            if (c->in[i] == '\n' && c->in[i - 1] == '\r' && c->in[i - 2] == '\n' && c->in[i - 3] == '\r') {
+                end = c->in + i + 1;
+                break;
+            }
+        }
+        if (!end) return c->in_len == sizeof(c->in) ? -1 : 0;
+        c->header_len = (size_t)(end - c->in);
+        if (c->in_len < 12 || strncmp(c->in, "HTTP/1.", 7) != 0) return -1;
+        c->status = atoi(c->in + 9);
+        size_t content_length = 0;
+        const char *cl = strcasestr(c->in, "\r\nContent-Length:");
+        if (cl && cl < end) content_length = (size_t)strtoull(cl + 17, NULL, 10);
+        const char *conn = strcasestr(c->in, "\r\nConnection: close");
+        c->server_closes = conn && conn < end;
+        size_t have = c->in_len - c->header_len;
+        c->body_left = content_length > have ? content_length - have : 0;
+        c->in_len = 0;
+        return c->body_left == 0;
+    }
+    c->body_left = c->in_len >= c->body_left ? 0 : c->body_left - c->in_len;
+    c->in_len = 0;
+    return c->body_left == 0;
+}
+
+static void handle_ready(worker_t *w, int slot) {
+    client_t *c = &w->clients[slot];
+    if (c->state == CLIENT_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+            count_error(w, &w->connect_errors);
+            client_close(w, slot);
+            return;
+        }
+        c->state = CLIENT_SENDING;
+    }
+    if (c->state == CLIENT_SENDING) {
+        while (c->out_off < c->out_len) {
+            ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, 0);
+            if (n > 0) {
+                c->out_off += (size_t)n;
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            if (n < 0 && errno == EINTR) continue;
+            count_error(w, &w->io_errors);
+            client_close(w, slot);
+            return;
+        }
+        c->state = CLIENT_READING;
+        if (queue_want(w->qfd, c->fd, slot, 0) != 0) {
+            count_error(w, &w->io_errors);
+            client_close(w, slot);
+        }
+        return;
+    }
+    if (c->state != CLIENT_READING) return;
+    while (1) {
+        ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0) {
+            count_error(w, &w->io_errors);
+            client_close(w, slot);
+            return;
+        }
+        c->in_len += (size_t)n;
+        int rc = parse_response(c);
+        if (rc < 0) {
+            count_error(w, &w->io_errors);
+            client_close(w, slot);
+            return;
+        }
+        if (rc == 1) {
+            finish_response(w, slot);
+            return;
+        }
+    }
+}
 
-    if (total <= 0 || concurrency <= 0) {
-        fprintf(stderr, "invalid args\n");
-        return 1;
+static void expire_requests(worker_t *w, uint64_t now) {
+    uint64_t limit = (uint64_t)w->opt->timeout_ms * 1000000ull;
+    for (int i = 0; i < w->conn_count; i++) {
+        client_t *c = &w->clients[i];
+        if ((c->state == CLIENT_CONNECTING || c->state == CLIENT_SENDING || c->state == CLIENT_READING) && now - c->sent_ns > limit) {
+            count_error(w, &w->timeouts);
+            client_close(w, i);
+        }
     }
+}
+
+static void *worker_main(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    const options_t *opt = w->opt;
+    uint64_t interval_ns = opt->rate > 0 ? (uint64_t)(1e9 * (double)opt->threads / opt->rate) : 0;
+    int slots[256];
+
+    /* Keep-alive connections are opened up front so connect time stays out of the measurement. */
+    if (opt->keep_alive) {
+        for (int i = w->conn_count - 1; i >= 0; i--) {
+            w->idle_len--;
+            if (client_connect(w, i) != 0) {
+                w->connect_errors++;
+                w->idle[w->idle_len++] = i;
+            }
+        }
+        int pending = w->conn_count - w->idle_len;
+        uint64_t deadline = now_ns() + 10000000000ull;
+        while (pending > 0 && now_ns() < deadline) {
+            int n = queue_wait(w->qfd, slots, 256, 100);
+            for (int i = 0; i < n; i++) {
+                client_t *c = &w->clients[slots[i]];
+                if (c->state != CLIENT_CONNECTING) continue;
+                int err = 0;
+                socklen_t len = sizeof(err);
+                pending--;
+                if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0 || queue_want(w->qfd, c->fd, slots[i], 0) != 0) {
+                    w->connect_errors++;
+                    client_close(w, slots[i]);
+                    continue;
+                }
+                c->state = CLIENT_IDLE;
+                w->idle[w->idle_len++] = slots[i];
+            }
+        }
+    }
+
+    uint64_t start = now_ns();
+    uint64_t last_expiry = start;
+    while (w->done < w->share) {
+        uint64_t now = now_ns();
+        while (w->issued < w->share && w->idle_len > 0) {
+            uint64_t due = interval_ns ? start + (uint64_t)w->issued * interval_ns : now;
+            if (due > now) break;
+            start_request(w, w->idle[--w->idle_len], due);
+        }
+
+        int timeout_ms = 100;
+        if (w->issued < w->share && w->idle_len > 0 && interval_ns) {
+            uint64_t due = start + (uint64_t)w->issued * interval_ns;
+            uint64_t wait = due > now ? due - now : 0;
+            timeout_ms = wait < SPIN_BELOW_NS ? 0 : (int)(wait / 1000000ull);
+        }
+        int n = queue_wait(w->qfd, slots, 256, timeout_ms);
+        for (int i = 0; i < n; i++) handle_ready(w, slots[i]);
 
-    const char *put_req =
-        "PUT /v1/data/activities HTTP/1.1\r\n"
-        "Host: 127.0.0.1\r\n"
-        "X-Account-Id: perf\r\n"
-        "Content-Type: application/json\r\n"
-        "Content-Length: 21\r\n"
-        "Connection: close\r\n\r\n"
-        "[{\"sport\":\"cycling\"}]";
-    if (request_once(host, port, put_req) != 0) {
-        fprintf(stderr, "warmup put failed\n");
-        return 1;
+        now = now_ns();
+        if (now - last_expiry > 100000000ull) {
+            expire_requests(w, now);
+            last_expiry = now;
+        }
     }
+    for (int i = 0; i < w->conn_count; i++) {
+        if (w->clients[i].fd >= 0) close(w->clients[i].fd);
+    }
+    return NULL;
+}
+
+static void usage(void) {
+    fprintf(
+        stderr,
+        "usage: perf-client [--host=127.0.0.1] [--port=8080] [--threads=4] [--connections=512]\n"
+        "                   [--requests=50000 | --duration=S] [--rate=RPS] [--put-ratio=0.0]\n"
+        "                   [--payload-min=64] [--payload-max=64] [--payload-dist=uniform|log]\n"
+        "                   [--accounts=1] [--keep-alive=1] [--timeout-ms=10000] [--format=text|json]\n");
+}
 
-    pthread_t *threads = calloc((size_t)concurrency, sizeof(pthread_t));
-    worker_args_t *args = calloc((size_t)concurrency, sizeof(worker_args_t));
-    if (!threads || !args) return 1;
+static int parse_options(int argc, char **argv, options_t *opt) {
+    double duration = 0;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *eq = strchr(arg, '=');
+        if (strncmp(arg, "--", 2) != 0 || !eq) return -1;
+        size_t name_len = (size_t)(eq - arg - 2);
+        const char *name = arg + 2;
+        const char *value = eq + 1;
+#define OPTION_IS(s) (name_len == strlen(s) && strncmp(name, s, name_len) == 0)
+        if (OPTION_IS("host")) {
+            opt->host = value;
+        } else if (OPTION_IS("port")) {
+            opt->port = atoi(value);
+        } else if (OPTION_IS("threads")) {
+            opt->threads = atoi(value);
+        } else if (OPTION_IS("connections")) {
+            opt->connections = atoi(value);
+        } else if (OPTION_IS("requests")) {
+            opt->requests = atoll(value);
+        } else if (OPTION_IS("duration")) {
+            duration = atof(value);
+        } else if (OPTION_IS("rate")) {
+            opt->rate = atof(value);
+        } else if (OPTION_IS("put-ratio")) {
+            opt->put_ratio = atof(value);
+        } else if (OPTION_IS("payload-min")) {
+            opt->payload_min = (size_t)atoll(value);
+        } else if (OPTION_IS("payload-max")) {
+            opt->payload_max = (size_t)atoll(value);
+        } else if (OPTION_IS("payload-dist")) {
+            if (strcmp(value, "log") != 0 && strcmp(value, "uniform") != 0) return -1;
+            opt->payload_log = strcmp(value, "log") == 0;
+        } else if (OPTION_IS("accounts")) {
+            opt->accounts = atoi(value);
+        } else if (OPTION_IS("keep-alive")) {
+            opt->keep_alive = atoi(value) != 0;
+        } else if (OPTION_IS("timeout-ms")) {
+            opt->timeout_ms = atoi(value);
+        } else if (OPTION_IS("format")) {
+            if (strcmp(value, "json") != 0 && strcmp(value, "text") != 0) return -1;
+            opt->json = strcmp(value, "json") == 0;
+        } else {
+            return -1;
+        }
+#undef OPTION_IS
+    }
+    if (duration > 0) {
+        if (opt->rate <= 0) return -1;
+        opt->requests = (long long)(duration * opt->rate);
+    }
+    if (opt->payload_max < opt->payload_min) opt->payload_max = opt->payload_min;
+    if (opt->threads <= 0 || opt->connections < opt->threads || opt->requests <= 0 || opt->accounts <= 0 ||
+        opt->payload_min < 1 || opt->payload_max > 64 * 1024 * 1024 || opt->put_ratio < 0 || opt->put_ratio > 1 ||
+        opt->timeout_ms <= 0) {
+        return -1;
+    }
+    return 0;
+}
 
-    atomic_int success = 0;
-    atomic_int failed = 0;
+int main(int argc, char **argv) {
+    options_t opt = {"127.0.0.1", 8080, 4, 512, 50000, 0, 0, 64, 64, 0, 1, 1, 10000, 0};
+    if (parse_options(argc, argv, &opt) != 0) {
+        usage();
+        return 2;
+    }
 
-    int base = total / concurrency;
-    int rem = total % concurrency;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)opt.port);
+    if (inet_pton(AF_INET, opt.host, &addr.sin_addr) <= 0) {
+        fprintf(stderr, "invalid host: %s\n", opt.host);
+        return 2;
+    }
 
-    struct timeval start, end;
-    gettimeofday(&start, NULL);
+    worker_t *workers = (worker_t *)calloc((size_t)opt.threads, sizeof(worker_t));
+    pthread_t *threads = (pthread_t *)calloc((size_t)opt.threads, sizeof(pthread_t));
+    if (!workers || !threads) return 1;
+    size_t out_cap = 256 + opt.payload_max + 32;
+    for (int t = 0; t < opt.threads; t++) {
+        worker_t *w = &workers[t];
+        w->index = t;
+        w->opt = &opt;
+        w->addr = &addr;
+        w->share = opt.requests / opt.threads + (t < opt.requests % opt.threads ? 1 : 0);
+        w->conn_count = opt.connections / opt.threads + (t < opt.connections % opt.threads ? 1 : 0);
+        w->clients = (client_t *)calloc((size_t)w->conn_count, sizeof(client_t));
+        w->idle = (int *)calloc((size_t)w->conn_count, sizeof(int));
+        w->rng = 2166136261u ^ (unsigned)t * 16777619u;
+#if defined(__linux__)
+        w->qfd = epoll_create1(0);
+#else
+        w->qfd = kqueue();
+#endif
+        if (!w->clients || !w->idle || w->qfd < 0) return 1;
+        for (int i = 0; i < w->conn_count; i++) {
+            w->clients[i].fd = -1;
+            w->clients[i].out = (char *)malloc(out_cap);
+            if (!w->clients[i].out) return 1;
+            w->idle[w->idle_len++] = w->conn_count - 1 - i;
+        }
+    }
 
-    for (int i = 0; i < concurrency; i++) {
-        args[i].host = host;
-        args[i].port = port;
-        args[i].requests = base + (i < rem ? 1 : 0);
-        args[i].success = &success;
-        args[i].failed = &failed;
-        pthread_create(&threads[i], NULL, worker, &args[i]);
+    uint64_t start = now_ns();
+    for (int t = 0; t < opt.threads; t++) {
+        if (pthread_create(&threads[t], NULL, worker_main, &workers[t]) != 0) return 1;
     }
+    for (int t = 0; t < opt.threads; t++) pthread_join(threads[t], NULL);
+    double elapsed = (double)(now_ns() - start) / 1e9;
 
-    for (int i = 0; i < concurrency; i++) pthread_join(threads[i], NULL);
+    latency_hist_t *hist = (latency_hist_t *)calloc(1, sizeof(latency_hist_t));
+    if (!hist) return 1;
+    long long status_counts[STATUS_SLOTS] = {0};
+    long long connect_errors = 0;
+    long long io_errors = 0;
+    long long timeouts = 0;
+    for (int t = 0; t < opt.threads; t++) {
+        worker_t *w = &workers[t];
+        for (int i = 0; i < HIST_BUCKETS; i++) hist->counts[i] += w->hist.counts[i];
+        hist->total += w->hist.total;
+        hist->sum += w->hist.sum;
+        if (w->hist.max > hist->max) hist->max = w->hist.max;
+        for (int i = 0; i < STATUS_SLOTS; i++) status_counts[i] += w->status_counts[i];
+        connect_errors += w->connect_errors;
+        io_errors += w->io_errors;
+        timeouts += w->timeouts;
+    }
 
-    gettimeofday(&end, NULL);
-    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+    long long success = status_counts[STATUS_200] + status_counts[STATUS_202] + status_counts[STATUS_204];
+    long long failed = status_counts[STATUS_OTHER] + connect_errors + io_errors + timeouts;
+    long long writes = status_counts[STATUS_202] + status_counts[STATUS_204];
+    double queued_ratio = writes > 0 ? (double)status_counts[STATUS_202] / (double)writes : 0.0;
+    double rps = elapsed > 0 ? (double)success / elapsed : 0.0;
+    double mean = hist->total > 0 ? hist->sum / (double)hist->total : 0.0;
+    uint64_t p50 = hist_percentile(hist, 0.50);
+    uint64_t p90 = hist_percentile(hist, 0.90);
+    uint64_t p99 = hist_percentile(hist, 0.99);
+    uint64_t p999 = hist_percentile(hist, 0.999);
 
-    int s = atomic_load(&success);
-    int f = atomic_load(&failed);
-    printf("total_requests=%d\n", total);
-    printf("success=%d\n", s);
-    printf("failed=%d\n", f);
-    printf("elapsed_ms=%.0f\n", elapsed * 1000);
-    printf("rps=%.2f\n", elapsed > 0 ? (double)s / elapsed : 0.0);
+    if (opt.json) {
+        printf(
+            "{\"total_requests\":%lld,\"success\":%lld,\"failed\":%lld,\"elapsed_ms\":%.0f,\"rps\":%.2f,\"target_rps\":%.2f,"
+            "\"status\":{\"200\":%lld,\"202\":%lld,\"204\":%lld,\"other\":%lld},"
+            "\"errors\":{\"connect\":%lld,\"io\":%lld,\"timeout\":%lld},\"queued_ratio\":%.4f,"
+            "\"latency_us\":{\"mean\":%.1f,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu},"
+            "\"config\":{\"threads\":%d,\"connections\":%d,\"put_ratio\":%.3f,\"payload_min\":%zu,\"payload_max\":%zu,"
+            "\"payload_dist\":\"%s\",\"accounts\":%d,\"keep_alive\":%s}}\n",
+            opt.requests,
+            success,
+            failed,
+            elapsed * 1000,
+            rps,
+            opt.rate,
+            status_counts[STATUS_200],
+            status_counts[STATUS_202],
+            status_counts[STATUS_204],
+            status_counts[STATUS_OTHER],
+            connect_errors,
+            io_errors,
+            timeouts,
+            queued_ratio,
+            mean,
+            (unsigned long long)p50,
+            (unsigned long long)p90,
+            (unsigned long long)p99,
+            (unsigned long long)p999,
+            (unsigned long long)hist->max,
+            opt.threads,
+            opt.connections,
+            opt.put_ratio,
+            opt.payload_min,
+            opt.payload_max,
+            opt.payload_log ? "log" : "uniform",
+            opt.accounts,
+            opt.keep_alive ? "true" : "false");
+    } else {
+        printf("total_requests=%lld\n", opt.requests);
+        printf("success=%lld\n", success);
+        printf("failed=%lld\n", failed);
+        printf("elapsed_ms=%.0f\n", elapsed * 1000);
+        printf("rps=%.2f\n", rps);
+        printf("status_200=%lld\nstatus_202=%lld\nstatus_204=%lld\nstatus_other=%lld\n",
+               status_counts[STATUS_200],
+               status_counts[STATUS_202],
+               status_counts[STATUS_204],
+               status_counts[STATUS_OTHER]);
+        printf("errors_connect=%lld\nerrors_io=%lld\nerrors_timeout=%lld\n", connect_errors, io_errors, timeouts);
+        printf("queued_ratio=%.4f\n", queued_ratio);
+        printf("latency_mean_us=%.1f\nlatency_p50_us=%llu\nlatency_p90_us=%llu\nlatency_p99_us=%llu\nlatency_p999_us=%llu\nlatency_max_us=%llu\n",
+               mean,
+               (unsigned long long)p50,
+               (unsigned long long)p90,
+               (unsigned long long)p99,
+               (unsigned long long)p999,
+               (unsigned long long)hist->max);
+    }
 
+    for (int t = 0; t < opt.threads; t++) {
+        for (int i = 0; i < workers[t].conn_count; i++) free(workers[t].clients[i].out);
+        free(workers[t].clients);
+        free(workers[t].idle);
+        close(workers[t].qfd);
+    }
+    free(hist);
+    free(workers);
     free(threads);
-    free(args);
-    return f == 0 ? 0 : 1;
+    return failed == 0 ? 0 : 1;
 }
@@ -4,6 +4,11 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,6 +19,7 @@
 
 #include <sqlite3.h>
 
+#include "../logger.h"
 #include "../server.h"
 #include "../server_internal.h"
 
@@ -30,6 +36,25 @@ static void test_valid_key(void) {
     assert(is_valid_storage_key("acct_1::profile"));
     assert(!is_valid_storage_key("acct::unknown"));
     assert(!is_valid_storage_key("::activities"));
+    assert(!is_valid_storage_key("acct:x::activities"));
+
+    /* Every registered key resolves to its own descriptor; near misses do not. */
+    for (int id = 0; id < DATA_KEY_EXPORTED_FILE; id++) {
+        const data_key_t *desc = &DATA_KEY_TABLE[id];
+        assert(desc->id == id);
+        assert(data_key_lookup(desc->name, desc->name_len) == desc);
+        assert(data_key_lookup(desc->name, desc->name_len - 1) == NULL);
+        char storage_key[64];
+        snprintf(storage_key, sizeof(storage_key), "acct-1::%s", desc->name);
+        assert(storage_key_lookup(storage_key) == desc);
+        assert(storage_key_lookup(desc->name) == desc);
+    }
+    assert(data_key_lookup("profilE", 7) == NULL);
+    assert(data_key_lookup("exported_file_x", 15)->id == DATA_KEY_EXPORTED_FILE);
+    assert(!DATA_KEY_TABLE[DATA_KEY_EXPORTED_FILE].cacheable);
+    assert(DATA_KEY_TABLE[DATA_KEY_PROFILE].kind == DATA_KEY_KIND_OBJECT);
+    assert(strcmp(DATA_KEY_TABLE[DATA_KEY_APP_SETTINGS].default_body, "{}") == 0);
+    assert(strcmp(DATA_KEY_TABLE[DATA_KEY_WORKOUTS].default_body, "[]") == 0);
 }
 
 static void test_parse_bind_addr(void) {
@@ -45,6 +70,79 @@ static void test_parse_bind_addr(void) {
     assert(parse_bind_addr("bad", host, sizeof(host), &port) != 0);
 }
 
+static void *pinned_worker_main(void *arg) {
+    int *out_cpu = (int *)arg;
+    affinity_pin_worker(0);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    assert(pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0);
+    *out_cpu = CPU_COUNT(&set) == 1 ? affinity_worker_cpu(0) : -1;
+    assert(CPU_ISSET(*out_cpu, &set));
+    return NULL;
+}
+
+static void test_reuseport_listeners_and_affinity(void) {
+    /* The kernel will not let a reuseport group form on an auto-assigned port, so pick one first. */
+    int probe = open_listen_socket("127.0.0.1", 0, 16, 0);
+    assert(probe >= 0);
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    assert(getsockname(probe, (struct sockaddr *)&addr, &addr_len) == 0);
+    int port = ntohs(addr.sin_port);
+    close(probe);
+
+    int first = open_listen_socket("127.0.0.1", port, 16, 1);
+    assert(first >= 0);
+    assert(open_listen_socket("bad host", port, 16, 1) < 0);
+#if defined(__linux__)
+    /* A second reuseport socket joins the group; a plain one cannot bind the port. */
+    int second = open_listen_socket("127.0.0.1", port, 16, 1);
+    assert(second >= 0);
+    assert(open_listen_socket("127.0.0.1", port, 16, 0) < 0);
+
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    assert(client >= 0);
+    assert(connect(client, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    struct pollfd pfds[2] = {{first, POLLIN, 0}, {second, POLLIN, 0}};
+    assert(poll(pfds, 2, 1000) == 1);
+    int accepted = accept(pfds[0].revents ? first : second, NULL, NULL);
+    assert(accepted >= 0);
+    close(accepted);
+    close(client);
+    close(second);
+#endif
+    close(first);
+
+    affinity_config_t config = {0};
+    affinity_configure(&config);
+    int cpus = affinity_cpu_count();
+    assert(cpus >= 1);
+    assert(affinity_worker_cpu(0) == -1);
+    assert(affinity_dispatcher_cpu(0) == -1);
+
+    config.pin_threads = 1;
+    config.numa_interleave = 1;
+    config.dispatcher_cpus = 1;
+    affinity_configure(&config);
+    /* With a spare CPU the dispatcher keeps one to itself and the workers get one fewer. */
+    int dispatcher_cpu = affinity_dispatcher_cpu(0);
+    assert(dispatcher_cpu >= 0);
+    assert(affinity_cpu_count() == (cpus > 1 ? cpus - 1 : 1));
+    for (int i = 0; i < 2 * cpus; i++) {
+        assert(affinity_worker_cpu(i) >= 0);
+        if (cpus > 1) assert(affinity_worker_cpu(i) != dispatcher_cpu);
+    }
+
+    pthread_t thread;
+    int pinned_cpu = -1;
+    assert(pthread_create(&thread, NULL, pinned_worker_main, &pinned_cpu) == 0);
+    assert(pthread_join(thread, NULL) == 0);
+    assert(pinned_cpu == affinity_worker_cpu(0));
+
+    memset(&config, 0, sizeof(config));
+    affinity_configure(&config);
+}
+
 static void test_read_content_length(void) {
     const char *req =
         "PUT /v1/data/activities HTTP/1.1\r\n"
@@ -68,6 +166,61 @@ static void test_read_content_length(void) {
     assert(read_content_length(mixed, mixed_end) == 2);
 }
 
+static int span_equals(const char *buf, http_span_t span, const char *expected) {
+    return span.len == strlen(expected) && memcmp(buf + span.off, expected, span.len) == 0;
+}
+
+static void test_incremental_http_parser(void) {
+    const char *req =
+        "PUT /v1/data/activities HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "x-account-id: acct_1\r\n"
+        "X-Log-Id:  lid-42 \r\n"
+        "X-Retry-Attempt: 3\r\n"
+        "Connection: keep-alive\r\n"
+        "content-length: 17\r\n\r\n"
+        "[{\"sport\":\"run\"}]";
+    size_t total = strlen(req);
+    http_parse_state_t st;
+    http_parse_reset(&st);
+    for (size_t len = 1; len < total; len++) {
+        assert(http_parse_request(&st, req, len) == HTTP_PARSE_INCOMPLETE);
+        assert(st.scan_off <= len);
+    }
+    assert(http_parse_request(&st, req, total) == HTTP_PARSE_DONE);
+    assert(st.header_len == total - 17);
+    assert(st.content_length == 17);
+    assert(span_equals(req, st.method, "PUT"));
+    assert(span_equals(req, st.path, "/v1/data/activities"));
+    assert(span_equals(req, st.version, "HTTP/1.1"));
+    assert(span_equals(req, st.account_id, "acct_1"));
+    assert(span_equals(req, st.log_id, "lid-42"));
+    assert(span_equals(req, st.retry_attempt, "3"));
+    assert(span_equals(req, st.connection, "keep-alive"));
+
+    const char *bad_length = "PUT /v1/data/profile HTTP/1.1\r\nContent-Length: -5\r\n\r\n";
+    http_parse_reset(&st);
+    assert(http_parse_request(&st, bad_length, strlen(bad_length)) == HTTP_PARSE_BAD_CONTENT_LENGTH);
+
+    /* A repeated Content-Length is only accepted when it names the same length. */
+    const char *repeated = "PUT /v1/data/profile HTTP/1.1\r\nContent-Length: 2\r\nContent-Length: 02\r\n\r\n{}";
+    http_parse_reset(&st);
+    assert(http_parse_request(&st, repeated, strlen(repeated)) == HTTP_PARSE_DONE);
+    assert(st.content_length == 2);
+    const char *conflicting =
+        "PUT /v1/data/profile HTTP/1.1\r\nContent-Length: 7\r\nContent-Length: 27\r\n\r\n{\"a\":1}GET /health HTTP/1.1\r\n\r\n";
+    http_parse_reset(&st);
+    assert(http_parse_request(&st, conflicting, strlen(conflicting)) == HTTP_PARSE_BAD_CONTENT_LENGTH);
+
+    const char *chunked = "PUT /v1/data/profile HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n2\r\n{}\r\n0\r\n\r\n";
+    http_parse_reset(&st);
+    assert(http_parse_request(&st, chunked, strlen(chunked)) == HTTP_PARSE_TRANSFER_ENCODING);
+
+    const char *bad_line = "GARBAGE\r\n\r\n";
+    http_parse_reset(&st);
+    assert(http_parse_request(&st, bad_line, strlen(bad_line)) == HTTP_PARSE_BAD_REQUEST_LINE);
+}
+
 static void test_socket_send_flags(void) {
 #ifdef MSG_NOSIGNAL
     assert(socket_send_flags() == MSG_NOSIGNAL);
@@ -141,21 +294,95 @@ static void test_put_is_journaled_and_persisted(void) {
     sqlite3_finalize(stmt);
     sqlite3_close(sqlite);
 
-    DIR *dir = opendir("pending_writes");
-    assert(dir != NULL);
-    struct dirent *ent;
-    int entries = 0;
-    while ((ent = readdir(dir)) != NULL) {
-        if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
-            entries++;
-        }
+    journal_stats_t journal;
+    journal_stats_snapshot(&journal);
+    assert(journal.appended_records == 1);
+    assert(journal.live_records == 0);
+    assert(journal.checkpoint_seq == 1);
+
+    free(conn.buf);
+    close(fds[0]);
+    close(fds[1]);
+    worker_db_close(&db);
+    assert(fchdir(old_cwd) == 0);
+    close(old_cwd);
+    char cleanup_cmd[512] = {0};
+    assert(snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf '%s' >/dev/null 2>&1", tmpdir) > 0);
+    assert(system(cleanup_cmd) == 0);
+}
+
+static void test_write_completion_resumes_connection(void) {
+    char dir_template[] = "/tmp/fricu-test-completion-XXXXXX";
+    char *tmpdir = mkdtemp(dir_template);
+    assert(tmpdir != NULL);
+
+    int old_cwd = open(".", O_RDONLY);
+    assert(old_cwd >= 0);
+    assert(chdir(tmpdir) == 0);
+
+    assert(init_db("state.db") == 0);
+    worker_db_t db;
+    assert(worker_db_open(&db, "state.db") == 0);
+    write_completion_queue_t completions;
+    assert(write_completion_queue_init(&completions) == 0);
+    db.completions = &completions;
+
+    int fds[2] = {-1, -1};
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    const char *get = "GET /v1/data/profile HTTP/1.1\r\nX-Account-Id: async\r\n\r\n";
+    const char *req =
+        "PUT /v1/data/profile HTTP/1.1\r\n"
+        "X-Account-Id: async\r\n"
+        "Content-Length: 9\r\n\r\n"
+        "{\"v\":\"a\"}"
+        "GET /v1/data/profile HTTP/1.1\r\nX-Account-Id: async\r\n\r\n";
+    conn_t conn = {0};
+    conn.handle = 42;
+    conn.cap = REQ_BUF_SIZE;
+    conn.buf = (char *)malloc(conn.cap);
+    assert(conn.buf != NULL);
+    conn.len = strlen(req);
+    memcpy(conn.buf, req, conn.len);
+
+    /* The PUT is consumed and handed off; the pipelined GET waits behind it. */
+    assert(try_process_client(fds[0], &db, &conn) == 2);
+    assert(conn.pending_write != NULL);
+    assert(conn.len == strlen(get));
+    char resp[1024] = {0};
+    assert(recv(fds[1], resp, sizeof(resp) - 1, MSG_DONTWAIT) < 0 && errno == EAGAIN);
+
+    write_completion_t *completion = NULL;
+    for (int i = 0; i < 500 && (completion = write_completion_queue_take(&completions)) == NULL; i++) {
+        assert(write_completion_queue_wait(&completions, 10) >= 0);
     }
-    closedir(dir);
-    assert(entries == 0);
+    assert(completion != NULL);
+    assert(completion->next == NULL);
+    assert(completion->owner == &conn);
+    assert(completion->owner_handle == 42);
+    assert(completion->result.status_code == 204);
+    assert(try_complete_write(fds[0], &conn, &completion->result) == 1);
+    write_completion_release(completion);
+    assert(conn.pending_write == NULL);
+    assert(conn.keep_alive == 1);
+
+    ssize_t n = read(fds[1], resp, sizeof(resp) - 1);
+    assert(n > 0);
+    assert(strstr(resp, "204 No Content") != NULL);
+    assert(strstr(resp, "ETag: \"1\"") != NULL);
+
+    assert(try_process_client(fds[0], &db, &conn) == 1);
+    memset(resp, 0, sizeof(resp));
+    n = read(fds[1], resp, sizeof(resp) - 1);
+    assert(n > 0);
+    assert(strstr(resp, "200 OK") != NULL);
+    assert(strstr(resp, "{\"v\":\"a\"}") != NULL);
+    assert(write_completion_queue_take(&completions) == NULL);
 
     free(conn.buf);
     close(fds[0]);
     close(fds[1]);
+    write_completion_queue_destroy(&completions);
     worker_db_close(&db);
     assert(fchdir(old_cwd) == 0);
     close(old_cwd);
@@ -209,6 +436,94 @@ static void test_missing_account_id_rejected(void) {
     assert(system(cleanup_cmd) == 0);
 }
 
+/* Feeds conn the headers of a write whose body has not arrived yet. */
+static int offer_write_headers(int fd, worker_db_t *db, conn_t *conn, const char *account, size_t content_length) {
+    conn->len = (size_t)snprintf(
+        conn->buf,
+        conn->cap,
+        "PUT /v1/data/app_settings HTTP/1.1\r\nX-Account-Id: %s\r\nContent-Length: %zu\r\n\r\n{",
+        account,
+        content_length);
+    http_parse_reset(&conn->parse);
+    conn->admission = CONN_ADMISSION_PENDING;
+    conn->close_after_flush = 0;
+    return try_process_client(fd, db, conn);
+}
+
+static void test_admission_rejects_before_body(void) {
+    char dir_template[] = "/tmp/fricu-test-admission-XXXXXX";
+    char *tmpdir = mkdtemp(dir_template);
+    assert(tmpdir != NULL);
+
+    int old_cwd = open(".", O_RDONLY);
+    assert(old_cwd >= 0);
+    assert(chdir(tmpdir) == 0);
+
+    assert(init_db("state.db") == 0);
+    worker_db_t db;
+    assert(worker_db_open(&db, "state.db") == 0);
+    conn_pool_t pool;
+    conn_pool_init(&pool, 0);
+    db.pool = &pool;
+    db.max_large_uploads = 1;
+    admission_config_t admission = {.account_write_rate = 1, .account_write_burst = 1};
+    admission_configure(&admission);
+
+    int fds[2] = {-1, -1};
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    conn_t conn = {0};
+    conn.cap = REQ_BUF_SIZE;
+    conn.buf = (char *)malloc(conn.cap);
+    assert(conn.buf != NULL);
+    char resp[1024] = {0};
+
+    /* Admitted on its headers: the body is awaited, and holds the one large-upload slot. */
+    assert(offer_write_headers(fds[0], &db, &conn, "adm1", 2 * 1024 * 1024) == 0);
+    assert(conn.admission == CONN_ADMISSION_LARGE);
+    assert(db.large_uploads == 1);
+    assert(recv(fds[1], resp, sizeof(resp) - 1, MSG_DONTWAIT) < 0 && errno == EAGAIN);
+
+    conn_t other = {0};
+    other.cap = REQ_BUF_SIZE;
+    other.buf = (char *)malloc(other.cap);
+    assert(other.buf != NULL);
+    assert(offer_write_headers(fds[0], &db, &other, "adm2", 2 * 1024 * 1024) == 1);
+    assert(other.close_after_flush == 1);
+    ssize_t n = read(fds[1], resp, sizeof(resp) - 1);
+    assert(n > 0);
+    resp[n] = '\0';
+    assert(strstr(resp, "503 Service Unavailable") != NULL);
+    assert(strstr(resp, "Retry-After: 1\r\n") != NULL);
+    assert(strstr(resp, "Connection: close") != NULL);
+
+    conn_admission_release(&db, &conn);
+    assert(db.large_uploads == 0);
+
+    /* adm1 spent its only token on the first write. */
+    assert(offer_write_headers(fds[0], &db, &conn, "adm1", 16) == 1);
+    n = read(fds[1], resp, sizeof(resp) - 1);
+    assert(n > 0);
+    resp[n] = '\0';
+    assert(strstr(resp, "429 Too Many Requests") != NULL);
+    assert(strstr(resp, "Retry-After: 1\r\n") != NULL);
+    assert(offer_write_headers(fds[0], &db, &conn, "adm3", 16) == 0);
+    assert(conn.admission == CONN_ADMISSION_ADMITTED);
+
+    admission.account_write_rate = 0;
+    admission_configure(&admission);
+    free(other.buf);
+    free(conn.buf);
+    close(fds[0]);
+    close(fds[1]);
+    conn_pool_destroy(&pool);
+    worker_db_close(&db);
+    assert(fchdir(old_cwd) == 0);
+    close(old_cwd);
+    char cleanup_cmd[512] = {0};
+    assert(snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf '%s' >/dev/null 2>&1", tmpdir) > 0);
+    assert(system(cleanup_cmd) == 0);
+}
+
 static void test_write_queue_diagnostics_endpoint(void) {
     char dir_template[] = "/tmp/fricu-test-diag-XXXXXX";
     char *tmpdir = mkdtemp(dir_template);
@@ -280,7 +595,20 @@ static void test_write_queue_diagnostics_endpoint(void) {
 }
 
 
-static void test_put_lock_is_queued_in_pending_writes(void) {
+static int count_journal_segments(void) {
+    DIR *dir = opendir(JOURNAL_DIR);
+    if (!dir) return 0;
+    struct dirent *ent;
+    int segments = 0;
+    while ((ent = readdir(dir)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        if (len > 4 && strcmp(ent->d_name + len - 4, ".seg") == 0) segments++;
+    }
+    closedir(dir);
+    return segments;
+}
+
+static void test_put_lock_is_queued_in_journal(void) {
     char dir_template[] = "/tmp/fricu-test-lock-XXXXXX";
     char *tmpdir = mkdtemp(dir_template);
     assert(tmpdir != NULL);
@@ -322,22 +650,12 @@ static void test_put_lock_is_queued_in_pending_writes(void) {
     assert(strstr(resp, "\"logid\":\"") != NULL);
     assert(strstr(resp, "X-Log-Id: ") != NULL);
 
-    DIR *dir = opendir("pending_writes");
-    assert(dir != NULL);
-    struct dirent *ent;
-    int entries = 0;
-    int has_app_settings = 0;
-    while ((ent = readdir(dir)) != NULL) {
-        if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0) {
-            entries++;
-            if (strncmp(ent->d_name, "tester::app_settings-", strlen("tester::app_settings-")) == 0) {
-                has_app_settings = 1;
-            }
-        }
-    }
-    closedir(dir);
-    assert(entries > 0);
-    assert(has_app_settings == 1);
+    assert(strstr(resp, "\"pending\":\"journal:1\"") != NULL);
+
+    journal_stats_t journal;
+    journal_stats_snapshot(&journal);
+    assert(journal.live_records == 1);
+    assert(count_journal_segments() == 1);
 
     assert(sqlite3_exec(locker, "ROLLBACK;", NULL, NULL, NULL) == SQLITE_OK);
     sqlite3_close(locker);
@@ -348,6 +666,7 @@ static void test_put_lock_is_queued_in_pending_writes(void) {
     worker_db_close(&db);
 
     assert(init_db("state.db") == 0);
+    assert(count_journal_segments() == 0);
 
     sqlite3 *sqlite = NULL;
     assert(sqlite3_open_v2("state.db", &sqlite, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK);
@@ -367,8 +686,21 @@ static void test_put_lock_is_queued_in_pending_writes(void) {
     assert(system(cleanup_cmd) == 0);
 }
 
-static void test_replay_pending_write_on_restart(void) {
-    char dir_template[] = "/tmp/fricu-test-replay-XXXXXX";
+static int count_rows_like(const char *db_path, const char *pattern) {
+    sqlite3 *sqlite = NULL;
+    assert(sqlite3_open_v2(db_path, &sqlite, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK);
+    sqlite3_stmt *stmt = NULL;
+    assert(sqlite3_prepare_v2(sqlite, "SELECT COUNT(*) FROM kv_store WHERE data_key LIKE ?1", -1, &stmt, NULL) == SQLITE_OK);
+    sqlite3_bind_text(stmt, 1, pattern, -1, SQLITE_STATIC);
+    int count = -1;
+    if (sqlite3_step(stmt) == SQLITE_ROW) count = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    sqlite3_close(sqlite);
+    return count;
+}
+
+static void test_queued_writes_commit_as_one_batch(void) {
+    char dir_template[] = "/tmp/fricu-test-batch-XXXXXX";
     char *tmpdir = mkdtemp(dir_template);
     assert(tmpdir != NULL);
 
@@ -377,26 +709,252 @@ static void test_replay_pending_write_on_restart(void) {
     assert(chdir(tmpdir) == 0);
 
     assert(init_db("state.db") == 0);
-    assert(mkdir("pending_writes", 0700) == 0 || errno == EEXIST);
-    FILE *f = fopen("pending_writes/tester::profile-999-1-1.json", "wb");
-    assert(f != NULL);
-    assert(fwrite("{\"name\":\"Recovered\"}", 1, 20, f) == 20);
-    assert(fclose(f) == 0);
+    worker_db_t db;
+    assert(worker_db_open(&db, "state.db") == 0);
+
+    sqlite3 *locker = NULL;
+    assert(sqlite3_open_v2("state.db", &locker, SQLITE_OPEN_READWRITE, NULL) == SQLITE_OK);
+    assert(sqlite3_exec(locker, "BEGIN EXCLUSIVE;", NULL, NULL, NULL) == SQLITE_OK);
+
+    const int writes = 5;
+    conn_t conn = {0};
+    conn.cap = REQ_BUF_SIZE;
+    conn.buf = (char *)malloc(conn.cap);
+    assert(conn.buf != NULL);
+    for (int i = 0; i < writes; i++) {
+        int fds[2] = {-1, -1};
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        conn.len = (size_t)snprintf(
+            conn.buf,
+            conn.cap,
+            "PUT /v1/data/app_settings HTTP/1.1\r\n"
+            "Host: localhost\r\n"
+            "X-Account-Id: batch%d\r\n"
+            "Content-Length: 10\r\n\r\n"
+            "{\"v\":true}",
+            i);
+        http_parse_reset(&conn.parse);
+        assert(try_process_client(fds[0], &db, &conn) == 1);
+        char resp[1024] = {0};
+        ssize_t n = read(fds[1], resp, sizeof(resp) - 1);
+        assert(n > 0);
+        assert(strstr(resp, "202 Accepted") != NULL);
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    assert(sqlite3_exec(locker, "ROLLBACK;", NULL, NULL, NULL) == SQLITE_OK);
+    sqlite3_close(locker);
+
+    for (int i = 0; i < 500 && count_rows_like("state.db", "batch%::app_settings") < writes; i++) {
+        usleep(10000);
+    }
+    assert(count_rows_like("state.db", "batch%::app_settings") == writes);
+
+    write_dispatch_diagnostics_t diag;
+    write_dispatch_diagnostics_snapshot(&diag);
+    for (int i = 0; i < 500 && diag.max_batch_size < writes - 1; i++) {
+        usleep(10000);
+        write_dispatch_diagnostics_snapshot(&diag);
+    }
+    assert(diag.queue_depth == 0);
+    assert(diag.max_batch_size >= writes - 1);
+    assert(diag.batch_count < writes);
+
+    free(conn.buf);
+    worker_db_close(&db);
+    assert(fchdir(old_cwd) == 0);
+    close(old_cwd);
+    char cleanup_cmd[512] = {0};
+    assert(snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf '%s' >/dev/null 2>&1", tmpdir) > 0);
+    assert(system(cleanup_cmd) == 0);
+}
+
+static void test_queued_put_supersedes_older_put(void) {
+    char dir_template[] = "/tmp/fricu-test-supersede-XXXXXX";
+    char *tmpdir = mkdtemp(dir_template);
+    assert(tmpdir != NULL);
+
+    int old_cwd = open(".", O_RDONLY);
+    assert(old_cwd >= 0);
+    assert(chdir(tmpdir) == 0);
 
     assert(init_db("state.db") == 0);
+    worker_db_t db;
+    assert(worker_db_open(&db, "state.db") == 0);
+    write_completion_queue_t completions;
+    assert(write_completion_queue_init(&completions) == 0);
+
+    sqlite3 *locker = NULL;
+    assert(sqlite3_open_v2("state.db", &locker, SQLITE_OPEN_READWRITE, NULL) == SQLITE_OK);
+    assert(sqlite3_exec(locker, "BEGIN EXCLUSIVE;", NULL, NULL, NULL) == SQLITE_OK);
+
+    /* The first PUT is taken and stuck on the lock; the rest wait in the queue. */
+    const char *payloads[] = {"{\"v\":0}", "{\"v\":1}", "{\"v\":2}", "{\"v\":3}"};
+    write_dispatch_diagnostics_t diag;
+    for (int i = 0; i < 4; i++) {
+        assert(write_dispatch_submit("app_settings", "sup::app_settings", payloads[i], strlen(payloads[i]), WRITE_OP_PUT,
+                                     WRITE_IF_MATCH_NONE, "sup", "sup-log", &completions, NULL, (uint64_t)i) == 0);
+        write_dispatch_diagnostics_snapshot(&diag);
+        for (int j = 0; i == 0 && j < 500 && diag.queue_depth > 0; j++) {
+            usleep(1000);
+            write_dispatch_diagnostics_snapshot(&diag);
+        }
+    }
+    write_dispatch_diagnostics_snapshot(&diag);
+    assert(diag.queue_depth == 1);
+    assert(diag.superseded_count == 2);
+
+    assert(sqlite3_exec(locker, "ROLLBACK;", NULL, NULL, NULL) == SQLITE_OK);
+    sqlite3_close(locker);
+
+    /* Every submitter is answered once; the superseded ones with the last PUT's outcome. */
+    write_dispatch_result_t results[4];
+    int seen = 0;
+    for (int i = 0; i < 500 && seen != 0xf; i++) {
+        write_completion_t *completion = write_completion_queue_take(&completions);
+        while (completion) {
+            write_completion_t *next = completion->next;
+            int id = (int)completion->owner_handle;
+            assert(!(seen & (1 << id)));
+            seen |= 1 << id;
+            results[id] = completion->result;
+            write_completion_release(completion);
+            completion = next;
+        }
+        if (seen != 0xf) assert(write_completion_queue_wait(&completions, 10) >= 0);
+    }
+    assert(seen == 0xf);
+    for (int i = 1; i < 3; i++) {
+        assert(results[i].status_code == results[3].status_code);
+        assert(results[i].version == results[3].version);
+    }
+    assert(results[3].version > results[0].version);
+
+    journal_stats_t journal;
+    journal_stats_snapshot(&journal);
+    for (int i = 0; i < 500 && journal.live_records > 0; i++) {
+        usleep(10000);
+        journal_stats_snapshot(&journal);
+    }
+    assert(journal.live_records == 0);
 
     sqlite3 *sqlite = NULL;
-    assert(sqlite3_open_v2("state.db", &sqlite, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK);
     sqlite3_stmt *stmt = NULL;
-    assert(sqlite3_prepare_v2(sqlite, "SELECT data_value FROM kv_store WHERE data_key='tester::profile'", -1, &stmt, NULL) == SQLITE_OK);
-    assert(sqlite3_step(stmt) == SQLITE_ROW);
-    const unsigned char *v = sqlite3_column_text(stmt, 0);
-    assert(v != NULL);
-    assert(strcmp((const char *)v, "{\"name\":\"Recovered\"}") == 0);
+    assert(sqlite3_open("state.db", &sqlite) == SQLITE_OK);
+    assert(sqlite3_prepare_v2(sqlite, "SELECT data_value FROM kv_store WHERE data_key='sup::app_settings'", -1, &stmt, NULL) == SQLITE_OK);
+    for (int i = 0; i < 500 && sqlite3_step(stmt) != SQLITE_ROW; i++) {
+        sqlite3_reset(stmt);
+        usleep(10000);
+    }
+    assert(strcmp((const char *)sqlite3_column_text(stmt, 0), payloads[3]) == 0);
     sqlite3_finalize(stmt);
     sqlite3_close(sqlite);
 
-    assert(access("pending_writes/tester::profile-999-1-1.json", F_OK) != 0);
+    write_completion_queue_destroy(&completions);
+    worker_db_close(&db);
+    assert(fchdir(old_cwd) == 0);
+    close(old_cwd);
+    char cleanup_cmd[512] = {0};
+    assert(snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf '%s' >/dev/null 2>&1", tmpdir) > 0);
+    assert(system(cleanup_cmd) == 0);
+}
+
+static void test_sharded_writes_route_by_account(void) {
+    char dir_template[] = "/tmp/fricu-test-shards-XXXXXX";
+    char *tmpdir = mkdtemp(dir_template);
+    assert(tmpdir != NULL);
+
+    int old_cwd = open(".", O_RDONLY);
+    assert(old_cwd >= 0);
+    assert(chdir(tmpdir) == 0);
+
+    assert(storage_key_shard("acct::profile", 1) == 0);
+    assert(storage_key_shard("acct::profile", 4) == storage_key_shard("acct::activities", 4));
+
+    write_dispatch_config_t config = {
+        .batch_max_jobs = DEFAULT_WRITE_BATCH_MAX_JOBS,
+        .batch_max_bytes = DEFAULT_WRITE_BATCH_MAX_BYTES,
+        .batch_linger_us = DEFAULT_WRITE_BATCH_LINGER_US,
+        .shard_count = 4,
+        .queued_ack_ms = DEFAULT_WRITE_QUEUED_ACK_MS,
+    };
+    write_dispatcher_configure(&config);
+    assert(init_db("state.db") == 0);
+    worker_db_t db;
+    assert(worker_db_open(&db, "state.db") == 0);
+
+    const int accounts = 16;
+    conn_t conn = {0};
+    conn.cap = REQ_BUF_SIZE;
+    conn.buf = (char *)malloc(conn.cap);
+    assert(conn.buf != NULL);
+    for (int i = 0; i < accounts * 2; i++) {
+        int fds[2] = {-1, -1};
+        assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+        int is_get = i >= accounts;
+        conn.len = (size_t)snprintf(
+            conn.buf,
+            conn.cap,
+            is_get ? "GET /v1/data/profile HTTP/1.1\r\n"
+                     "X-Account-Id: shard%d\r\n\r\n"
+                   : "PUT /v1/data/profile HTTP/1.1\r\n"
+                     "X-Account-Id: shard%d\r\n"
+                     "Content-Length: 7\r\n\r\n"
+                     "{\"v\":%d}",
+            i % accounts,
+            i % 10);
+        http_parse_reset(&conn.parse);
+        assert(try_process_client(fds[0], &db, &conn) == 1);
+        char resp[1024] = {0};
+        ssize_t n = read(fds[1], resp, sizeof(resp) - 1);
+        assert(n > 0);
+        if (is_get) {
+            char expected[16];
+            snprintf(expected, sizeof(expected), "{\"v\":%d}", (i % accounts) % 10);
+            assert(strstr(resp, "200 OK") != NULL);
+            assert(strstr(resp, expected) != NULL);
+        } else {
+            assert(strstr(resp, "204 No Content") != NULL);
+        }
+        close(fds[0]);
+        close(fds[1]);
+    }
+
+    int total = 0;
+    for (int shard = 0; shard < 4; shard++) {
+        char path[64];
+        assert(shard_db_path("state.db", shard, path, sizeof(path)) == 0);
+        int expected = 0;
+        for (int i = 0; i < accounts; i++) {
+            char key[64];
+            snprintf(key, sizeof(key), "shard%d::profile", i);
+            if (storage_key_shard(key, 4) == shard) expected++;
+        }
+        assert(count_rows_like(path, "shard%::profile") == expected);
+        total += expected;
+    }
+    assert(total == accounts);
+
+    write_dispatch_diagnostics_t diag;
+    write_dispatch_diagnostics_snapshot(&diag);
+    assert(diag.shard_count == 4);
+    long long batches = 0;
+    for (int shard = 0; shard < 4; shard++) {
+        assert(diag.shards[shard].queue_depth == 0);
+        batches += diag.shards[shard].batch_count;
+    }
+    assert(batches == diag.batch_count);
+
+    free(conn.buf);
+    worker_db_close(&db);
+
+    /* Reopening the same data dir with a different shard count must fail. */
+    config.shard_count = 2;
+    write_dispatcher_configure(&config);
+    assert(init_db("state.db") != 0);
+    config.shard_count = DEFAULT_WRITE_SHARDS;
+    write_dispatcher_configure(&config);
 
     assert(fchdir(old_cwd) == 0);
     close(old_cwd);
@@ -405,17 +963,2105 @@ static void test_replay_pending_write_on_restart(void) {
     assert(system(cleanup_cmd) == 0);
 }
 
+/* Returns the number of response bytes read; req may hold a binary body. */
+static size_t roundtrip_bytes(worker_db_t *db, conn_t *conn, const char *req, size_t req_len, char *resp, size_t resp_cap) {
+    int fds[2] = {-1, -1};
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    conn->len = req_len;
+    memcpy(conn->buf, req, conn->len);
+    http_parse_reset(&conn->parse);
+    assert(try_process_client(fds[0], db, conn) == 1);
+    memset(resp, 0, resp_cap);
+    ssize_t n = read(fds[1], resp, resp_cap - 1);
+    assert(n > 0);
+    close(fds[0]);
+    close(fds[1]);
+    return (size_t)n;
+}
+
+static void roundtrip_request(worker_db_t *db, conn_t *conn, const char *req, char *resp, size_t resp_cap) {
+    roundtrip_bytes(db, conn, req, strlen(req), resp, resp_cap);
+}
+
+static void test_value_cache_read_through_and_invalidation(void) {
+    char dir_template[] = "/tmp/fricu-test-cache-XXXXXX";
+    char *tmpdir = mkdtemp(dir_template);
+    assert(tmpdir != NULL);
+
+    int old_cwd = open(".", O_RDONLY);
+    assert(old_cwd >= 0);
+    assert(chdir(tmpdir) == 0);
+
+    assert(init_db("state.db") == 0);
+    worker_db_t db;
+    assert(worker_db_open(&db, "state.db") == 0);
+    conn_t conn = {0};
+    conn.cap = REQ_BUF_SIZE;
+    conn.buf = (char *)malloc(conn.cap);
+    assert(conn.buf != NULL);
+
+    const char *get =
+        "GET /v1/data/profile HTTP/1.1\r\n"
+        "X-Account-Id: cache\r\n\r\n";
+    char resp[1024];
+    value_cache_stats_t before;
+    value_cache_stats_snapshot(&before);
+
+    roundtrip_request(&db, &conn, get, resp, sizeof(resp));
+    assert(strstr(resp, "200 OK") != NULL);
+    assert(strstr(resp, "Content-Length: 2\r\n") != NULL);
+    assert(strstr(resp, "\r\n\r\n{}") != NULL);
+    roundtrip_request(&db, &conn, get, resp, sizeof(resp));
+    assert(strstr(resp, "X-Log-Id: ") != NULL);
+    assert(strstr(resp, "\r\n\r\n{}") != NULL);
+
+    value_cache_stats_t stats;
+    value_cache_stats_snapshot(&stats);
+    assert(stats.misses == before.misses + 1);
+    assert(stats.hits == before.hits + 1);
+
+    roundtrip_request(
+        &db,
+        &conn,
+        "PUT /v1/data/profile HTTP/1.1\r\n"
+        "X-Account-Id: cache\r\n"
+        "Content-Length: 7\r\n\r\n"
+        "{\"v\":2}",
+        resp,
+        sizeof(resp));
+    assert(strstr(resp, "204 No Content") != NULL);
+    roundtrip_request(&db, &conn, get, resp, sizeof(resp));
+    assert(strstr(resp, "\r\n\r\n{\"v\":2}") != NULL);
+    value_cache_stats_snapshot(&stats);
+    assert(stats.invalidations == before.invalidations + 1);
+    assert(stats.misses == before.misses + 2);
+
+    /* A fill that raced with a commit must not resurrect the old value. */
+    size_t body_off = 0;
+    uint64_t version = 0;
+    uint64_t ticket = 0;
+    assert(value_cache_lookup("cache::activities", 0, &body_off, &version, &ticket) == NULL);
+    value_cache_invalidate("cache::activities");
+    shared_buf_t *stale = shared_buf_copy("HTTP/1.1 200 OK\r\n[]", 19);
+    value_cache_fill("cache::activities", ticket, stale, 17, NULL, 0, 0);
+    shared_buf_release(stale);
+    assert(value_cache_lookup("cache::activities", 0, &body_off, &version, &ticket) == NULL);
+    value_cache_stats_snapshot(&stats);
+    assert(stats.stale_fills == before.stale_fills + 1);
+
+    free(conn.buf);
+    worker_db_close(&db);
+    assert(fchdir(old_cwd) == 0);
+    close(old_cwd);
+    char cleanup_cmd[512] = {0};
+    assert(snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf '%s' >/dev/null 2>&1", tmpdir) > 0);
+    assert(system(cleanup_cmd) == 0);
+}
+
+/* PUTs "profile" with body_len bytes of body under the given Content-Encoding; returns the response. */
+static void put_encoded_profile(worker_db_t *db, conn_t *conn, const char *encoding, const char *body, size_t body_len, char *resp, size_t resp_cap) {
+    char head[256];
+    int head_len = snprintf(
+        head,
+        sizeof(head),
+        "PUT /v1/data/profile HTTP/1.1\r\nX-Account-Id: gzip\r\nContent-Encoding: %s\r\nContent-Length: %zu\r\n\r\n",
+        encoding,
+        body_len);
+    char *req = (char *)malloc((size_t)head_len + body_len);
+    assert(req != NULL);
+    memcpy(req, head, (size_t)head_len);
+    memcpy(req + head_len, body, body_len);
+    roundtrip_bytes(db, conn, req, (size_t)head_len + body_len, resp, resp_cap);
+    free(req);
+}
+
+static void test_gzip_negotiation_and_encoded_writes(void) {
+    char dir_template[] = "/tmp/fricu-test-gzip-XXXXXX";
+    char *tmpdir = mkdtemp(dir_template);
+    assert(tmpdir != NULL);
+
+    int old_cwd = open(".", O_RDONLY);
+    assert(old_cwd >= 0);
+    assert(chdir(tmpdir) == 0);
+
+    assert(init_db("state.db") == 0);
+    worker_db_t db;
+    assert(worker_db_open(&db, "state.db") == 0);
+    conn_t conn = {0};
+    conn.cap = REQ_BUF_SIZE;
+    conn.buf = (char *)malloc(conn.cap);
+    assert(conn.buf != NULL);
+
+    char value[4096];
+    size_t value_len = (size_t)snprintf(value, sizeof(value), "{\"notes\":\"");
+    while (value_len < 3000) value_len += (size_t)snprintf(value + value_len, sizeof(value) - value_len, "interval %zu z2 ", value_len % 7);
+    value_len += (size_t)snprintf(value + value_len, sizeof(value) - value_len, "\"}");
+    char *packed = NULL;
+    size_t packed_len = 0;
+    assert(gzip_compress(value, value_len, &packed, &packed_len) == 0);
+    assert(packed_len < value_len);
+
+    static char resp[16384];
+    put_encoded_profile(&db, &conn, "gzip", packed, packed_len, resp, sizeof(resp));
+    assert(strstr(resp, "204 No Content") != NULL);
+
+    /* The gzip variant is built on the fill, then served from the cache. */
+    for (int round = 0; round < 2; round++) {
+        size_t n = roundtrip_bytes(
+            &db,
+            &conn,
+            "GET /v1/data/profile HTTP/1.1\r\nX-Account-Id: gzip\r\nAccept-Encoding: deflate, gzip\r\n\r\n",
+            strlen("GET /v1/data/profile HTTP/1.1\r\nX-Account-Id: gzip\r\nAccept-Encoding: deflate, gzip\r\n\r\n"),
+            resp,
+            sizeof(resp));
+        assert(strstr(resp, "200 OK") != NULL);
+        assert(strstr(resp, "Content-Encoding: gzip\r\n") != NULL);
+        assert(strstr(resp, "Vary: Accept-Encoding\r\n") != NULL);
+        char *body = strstr(resp, "\r\n\r\n") + 4;
+        char *plain = NULL;
+        size_t plain_len = 0;
+        assert(gzip_decompress(body, n - (size_t)(body - resp), REQ_BUF_SIZE, &plain, &plain_len) == 0);
+        assert(plain_len == value_len && memcmp(plain, value, value_len) == 0);
+        free(plain);
+    }
+    value_cache_stats_t stats;
+    value_cache_stats_snapshot(&stats);
+    assert(stats.gzip_entries >= 1);
+
+    const char *refusing[] = {
+        "GET /v1/data/profile HTTP/1.1\r\nX-Account-Id: gzip\r\n\r\n",
+        "GET /v1/data/profile HTTP/1.1\r\nX-Account-Id: gzip\r\nAccept-Encoding: gzip;q=0, identity\r\n\r\n",
+        "GET /v1/data/profile HTTP/1.1\r\nX-Account-Id: gzip\r\nAccept-Encoding: br\r\n\r\n",
+    };
+    for (size_t i = 0; i < sizeof(refusing) / sizeof(refusing[0]); i++) {
+        roundtrip_request(&db, &conn, refusing[i], resp, sizeof(resp));
+        assert(strstr(resp, "Content-Encoding:") == NULL);
+        assert(strstr(resp, "Vary: Accept-Encoding\r\n") != NULL);
+        char *body = strstr(resp, "\r\n\r\n") + 4;
+        assert(strlen(body) == value_len && memcmp(body, value, value_len) == 0);
+    }
+
+    /* The variants carry distinct strong ETags; either revalidates the same row version. */
+    const char *etag = strstr(resp, "ETag: \"");
+    assert(etag != NULL);
+    unsigned long long version = strtoull(etag + 7, NULL, 10);
+    char tag[64];
+    char req[256];
+    snprintf(tag, sizeof(tag), "ETag: \"%llu\"\r\n", version);
+    assert(strstr(resp, tag) != NULL);
+    roundtrip_request(&db, &conn, "GET /v1/data/profile HTTP/1.1\r\nX-Account-Id: gzip\r\nAccept-Encoding: gzip\r\n\r\n", resp, sizeof(resp));
+    snprintf(tag, sizeof(tag), "ETag: \"%llu-gz\"\r\n", version);
+    assert(strstr(resp, tag) != NULL);
+    const char *validators[] = {"\"%llu\"", "\"%llu-gz\"", "W/\"%llu-gz\""};
+    for (size_t i = 0; i < sizeof(validators) / sizeof(validators[0]); i++) {
+        char validator[32];
+        snprintf(validator, sizeof(validator), validators[i], version);
+        snprintf(req, sizeof(req), "GET /v1/data/profile HTTP/1.1\r\nX-Account-Id: gzip\r\nAccept-Encoding: gzip\r\nIf-None-Match: %s\r\n\r\n", validator);
+        roundtrip_request(&db, &conn, req, resp, sizeof(resp));
+        assert(strstr(resp, "304 Not Modified") != NULL);
+        snprintf(tag, sizeof(tag), "ETag: \"%llu%s\"\r\n", version, i > 0 ? "-gz" : "");
+        assert(strstr(resp, tag) != NULL);
+    }
+    snprintf(req, sizeof(req), "PUT /v1/data/profile HTTP/1.1\r\nX-Account-Id: gzip\r\nIf-Match: \"%llu-gz\"\r\nContent-Length: 2\r\n\r\n{}", version);
+    roundtrip_request(&db, &conn, req, resp, sizeof(resp));
+    assert(strstr(resp, "204 No Content") != NULL);
+
+    put_encoded_profile(&db, &conn, "br", packed, packed_len, resp, sizeof(resp));
+    assert(strstr(resp, "415 Unsupported Media Type") != NULL);
+    put_encoded_profile(&db, &conn, "gzip", value, value_len, resp, sizeof(resp));
+    assert(strstr(resp, "400 Bad Request") != NULL);
+    put_encoded_profile(&db, &conn, "gzip", packed, packed_len - 8, resp, sizeof(resp));
+    assert(strstr(resp, "400 Bad Request") != NULL);
+    free(packed);
+
+    /* A small body that inflates past the key's limit is refused, not buffered. */
+    size_t bomb_len = 2 * 1024 * 1024;
+    char *bomb = (char *)malloc(bomb_len);
+    assert(bomb != NULL);
+    memset(bomb, ' ', bomb_len);
+    bomb[0] = '{';
+    bomb[bomb_len - 1] = '}';
+    assert(gzip_compress(bomb, bomb_len, &packed, &packed_len) == 0);
+    free(bomb);
+    put_encoded_profile(&db, &conn, "gzip", packed, packed_len, resp, sizeof(resp));
+    assert(strstr(resp, "413 Payload Too Large") != NULL);
+    free(packed);
+
+    free(conn.buf);
+    worker_db_close(&db);
+    assert(fchdir(old_cwd) == 0);
+    close(old_cwd);
+    char cleanup_cmd[512] = {0};
+    assert(snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf '%s' >/dev/null 2>&1", tmpdir) > 0);
+    assert(system(cleanup_cmd) == 0);
+}
+
+static void test_batch_get_and_write(void) {
+    char dir_template[] = "/tmp/fricu-test-batch-XXXXXX";
+    char *tmpdir = mkdtemp(dir_template);
+    assert(tmpdir != NULL);
+
+    int old_cwd = open(".", O_RDONLY);
+    assert(old_cwd >= 0);
+    assert(chdir(tmpdir) == 0);
+
+    assert(init_db("state.db") == 0);
+    worker_db_t db;
+    assert(worker_db_open(&db, "state.db") == 0);
+    conn_t conn = {0};
+    conn.cap = REQ_BUF_SIZE;
+    conn.buf = (char *)malloc(conn.cap);
+    assert(conn.buf != NULL);
+    char resp[4096];
+    char req[1024];
+
+    const char *writes =
+        "[{\"key\":\"profile\",\"value\":{\"a\":2}},"
+        "{\"key\":\"activities\",\"op\":\"append\",\"value\":[{\"id\":1}]},"
+        "{\"key\":\"activities\",\"op\":\"patch\",\"value\":[{\"id\":1,\"d\":5}]}]";
+    snprintf(req, sizeof(req), "POST /v1/batch HTTP/1.1\r\nX-Account-Id: batch\r\nContent-Length: %zu\r\n\r\n%s", strlen(writes), writes);
+    roundtrip_request(&db, &conn, req, resp, sizeof(resp));
+    assert(strstr(resp, "204 No Content") != NULL);
+    assert(strstr(resp, "ETag: \"1\"\r\n") != NULL);
+
+    const char *get =
+        "GET /v1/batch?keys=profile,activities,app_settings HTTP/1.1\r\n"
+        "X-Account-Id: batch\r\n\r\n";
+    roundtrip_request(&db, &conn, get, resp, sizeof(resp));
+    assert(strstr(resp, "200 OK") != NULL);
+    assert(strstr(resp,
+                  "\r\n\r\n{\"profile\":{\"version\":1,\"value\":{\"a\":2}},"
+                  "\"activities\":{\"version\":1,\"value\":[{\"id\":1,\"d\":5}]},"
+                  "\"app_settings\":{\"version\":0,\"value\":{}}}") != NULL);
+
+    /* One failing precondition leaves every key of the batch untouched. */
+    writes =
+        "[{\"key\":\"app_settings\",\"value\":{\"x\":1}},"
+        "{\"key\":\"profile\",\"value\":{\"a\":3},\"if_match\":7}]";
+    snprintf(req, sizeof(req), "POST /v1/batch HTTP/1.1\r\nX-Account-Id: batch\r\nContent-Length: %zu\r\n\r\n%s", strlen(writes), writes);
+    roundtrip_request(&db, &conn, req, resp, sizeof(resp));
+    assert(strstr(resp, "412 Precondition Failed") != NULL);
+    assert(strstr(resp, "ETag: \"1\"\r\n") != NULL);
+    roundtrip_request(&db, &conn, get, resp, sizeof(resp));
+    assert(strstr(resp, "\"profile\":{\"version\":1,\"value\":{\"a\":2}}") != NULL);
+    assert(strstr(resp, "\"app_settings\":{\"version\":0,\"value\":{}}") != NULL);
+
+    const char *bad[] = {
+        "[{\"key\":\"profile\",\"op\":\"append\",\"value\":[1]}]",
+        "[{\"key\":\"nope\",\"value\":{}}]",
+        "[{\"key\":\"profile\"}]",
+        "{\"key\":\"profile\",\"value\":{}}",
+        "[]",
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        snprintf(req, sizeof(req), "POST /v1/batch HTTP/1.1\r\nX-Account-Id: batch\r\nContent-Length: %zu\r\n\r\n%s", strlen(bad[i]), bad[i]);
+        roundtrip_request(&db, &conn, req, resp, sizeof(resp));
+        assert(strstr(resp, "400 Bad Request") != NULL);
+    }
+    /* Each element is percent-decoded like any other query value. */
+    roundtrip_request(&db, &conn, "GET /v1/batch?keys=pro%66ile,app%5Fsettings HTTP/1.1\r\nX-Account-Id: batch\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "200 OK") != NULL);
+    assert(strstr(resp, "\r\n\r\n{\"profile\":{\"version\":1,\"value\":{\"a\":2}},\"app_settings\":{\"version\":0,\"value\":{}}}") != NULL);
+    roundtrip_request(&db, &conn, "GET /v1/batch?keys=profile,%70rofile HTTP/1.1\r\nX-Account-Id: batch\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "400 Bad Request") != NULL);
+    roundtrip_request(&db, &conn, "GET /v1/batch?keys=profile,%zz HTTP/1.1\r\nX-Account-Id: batch\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "400 Bad Request") != NULL);
+    roundtrip_request(&db, &conn, "GET /v1/batch?keys=profile,nope HTTP/1.1\r\nX-Account-Id: batch\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "400 Bad Request") != NULL);
+    roundtrip_request(&db, &conn, "GET /v1/batch?keys=profile,profile HTTP/1.1\r\nX-Account-Id: batch\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "400 Bad Request") != NULL);
+    roundtrip_request(&db, &conn, "GET /v1/batch?keys=profile HTTP/1.1\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "401 Unauthorized") != NULL);
+
+    /* A batch acknowledged from the journal is replayed as a whole. */
+    sqlite3 *locker = NULL;
+    assert(sqlite3_open_v2("state.db", &locker, SQLITE_OPEN_READWRITE, NULL) == SQLITE_OK);
+    assert(sqlite3_exec(locker, "BEGIN EXCLUSIVE;", NULL, NULL, NULL) == SQLITE_OK);
+    writes =
+        "[{\"key\":\"app_settings\",\"value\":{\"x\":1}},"
+        "{\"key\":\"activities\",\"op\":\"append\",\"value\":[{\"id\":2}],\"if_match\":1}]";
+    snprintf(req, sizeof(req), "POST /v1/batch HTTP/1.1\r\nX-Account-Id: batch\r\nContent-Length: %zu\r\n\r\n%s", strlen(writes), writes);
+    roundtrip_request(&db, &conn, req, resp, sizeof(resp));
+    assert(strstr(resp, "202 Accepted") != NULL);
+    assert(sqlite3_exec(locker, "ROLLBACK;", NULL, NULL, NULL) == SQLITE_OK);
+    sqlite3_close(locker);
+    worker_db_close(&db);
+
+    assert(init_db("state.db") == 0);
+    assert(worker_db_open(&db, "state.db") == 0);
+    roundtrip_request(&db, &conn, get, resp, sizeof(resp));
+    assert(strstr(resp, "\"activities\":{\"version\":3,\"value\":[{\"id\":1,\"d\":5},{\"id\":2}]}") != NULL);
+    assert(strstr(resp, "\"app_settings\":{\"version\":3,\"value\":{\"x\":1}}") != NULL);
+
+    free(conn.buf);
+    worker_db_close(&db);
+    assert(fchdir(old_cwd) == 0);
+    close(old_cwd);
+    char cleanup_cmd[512] = {0};
+    assert(snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf '%s' >/dev/null 2>&1", tmpdir) > 0);
+    assert(system(cleanup_cmd) == 0);
+}
+
+static uint64_t changes_next(const char *resp) {
+    const char *next = strstr(resp, "{\"next\":");
+    assert(next != NULL);
+    return strtoull(next + 8, NULL, 10);
+}
+
+static void test_change_feed_long_poll_and_stream(void) {
+    char dir_template[] = "/tmp/fricu-test-changes-XXXXXX";
+    char *tmpdir = mkdtemp(dir_template);
+    assert(tmpdir != NULL);
+
+    int old_cwd = open(".", O_RDONLY);
+    assert(old_cwd >= 0);
+    assert(chdir(tmpdir) == 0);
+
+    assert(init_db("state.db") == 0);
+    worker_db_t db;
+    assert(worker_db_open(&db, "state.db") == 0);
+    write_completion_queue_t completions;
+    assert(write_completion_queue_init(&completions) == 0);
+    conn_t conn = {0};
+    conn.cap = REQ_BUF_SIZE;
+    conn.buf = (char *)malloc(conn.cap);
+    assert(conn.buf != NULL);
+    char resp[4096];
+    char req[512];
+
+    /* Without since the answer is just the cursor to start from. */
+    roundtrip_request(&db, &conn, "GET /v1/changes HTTP/1.1\r\nX-Account-Id: feed\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "200 OK") != NULL);
+    assert(strstr(resp, "\"reset\":false,\"changes\":[]}") != NULL);
+    uint64_t start = changes_next(resp);
+
+    /* Parked: nothing for this account yet, and an event loop to resume it. */
+    int fds[2] = {-1, -1};
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    snprintf(req, sizeof(req), "GET /v1/changes?since=%llu&wait=30 HTTP/1.1\r\nX-Account-Id: feed\r\n\r\n", (unsigned long long)start);
+    db.completions = &completions;
+    conn.len = strlen(req);
+    memcpy(conn.buf, req, conn.len);
+    http_parse_reset(&conn.parse);
+    assert(try_process_client(fds[0], &db, &conn) == 2);
+    assert(conn.watch != NULL);
+    db.completions = NULL;
+    int64_t now = (int64_t)(metrics_now_ns() / 1000000);
+    int64_t due = 0;
+    assert(conn_watch_poll(fds[0], &conn, now, &due) == 0);
+    assert(conn.watch != NULL);
+    assert(due >= now + 29000);
+
+    conn_t writer = {0};
+    writer.cap = REQ_BUF_SIZE;
+    writer.buf = (char *)malloc(writer.cap);
+    assert(writer.buf != NULL);
+    roundtrip_request(&db, &writer, "PUT /v1/data/profile HTTP/1.1\r\nX-Account-Id: other\r\nContent-Length: 2\r\n\r\n{}", resp, sizeof(resp));
+    assert(strstr(resp, "204 No Content") != NULL);
+    assert(conn_watch_poll(fds[0], &conn, now, &due) == 0);
+    assert(conn.watch != NULL);
+    roundtrip_request(&db, &writer, "PUT /v1/data/profile HTTP/1.1\r\nX-Account-Id: feed\r\nContent-Length: 2\r\n\r\n{}", resp, sizeof(resp));
+    assert(strstr(resp, "204 No Content") != NULL);
+    assert(conn_watch_poll(fds[0], &conn, now, &due) == 0);
+    assert(conn.watch == NULL);
+    assert(conn.keep_alive == 1);
+    memset(resp, 0, sizeof(resp));
+    assert(read(fds[1], resp, sizeof(resp) - 1) > 0);
+    assert(strstr(resp, "\"changes\":[{\"seq\":") != NULL);
+    assert(strstr(resp, "\"key\":\"profile\",\"version\":2}]}") != NULL);
+    uint64_t after_put = changes_next(resp);
+    assert(after_put == start + 2);
+
+    /* A long-poll that runs out of time answers with no changes. */
+    snprintf(req, sizeof(req), "GET /v1/changes?since=%llu&wait=1 HTTP/1.1\r\nX-Account-Id: feed\r\n\r\n", (unsigned long long)after_put);
+    db.completions = &completions;
+    conn.len = strlen(req);
+    memcpy(conn.buf, req, conn.len);
+    assert(try_process_client(fds[0], &db, &conn) == 2);
+    db.completions = NULL;
+    assert(conn_watch_poll(fds[0], &conn, now, &due) == 0);
+    assert(conn.watch != NULL);
+    assert(conn_watch_poll(fds[0], &conn, due, &due) == 0);
+    assert(conn.watch == NULL);
+    memset(resp, 0, sizeof(resp));
+    assert(read(fds[1], resp, sizeof(resp) - 1) > 0);
+    assert(strstr(resp, "\"reset\":false,\"changes\":[]}") != NULL);
+    assert(changes_next(resp) == after_put);
+    close(fds[0]);
+    close(fds[1]);
+
+    /* Outside an event loop an event stream ends after the backlog; Last-Event-ID wins over since. */
+    snprintf(req, sizeof(req),
+             "GET /v1/changes?since=1 HTTP/1.1\r\nX-Account-Id: feed\r\nAccept: text/event-stream\r\nLast-Event-ID: %llu\r\n\r\n",
+             (unsigned long long)start);
+    roundtrip_request(&db, &conn, req, resp, sizeof(resp));
+    assert(strstr(resp, "Content-Type: text/event-stream\r\n") != NULL);
+    char event[128];
+    snprintf(event, sizeof(event), "\r\n\r\nid: %llu\ndata: {\"key\":\"profile\",\"version\":2}\n\n", (unsigned long long)(start + 2));
+    assert(strstr(resp, event) != NULL);
+
+    /* A cursor from before the retained window, or from the future, is a reset. */
+    roundtrip_request(&db, &conn, "GET /v1/changes?since=1 HTTP/1.1\r\nX-Account-Id: feed\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "\"reset\":true,\"changes\":[]}") != NULL);
+    assert(changes_next(resp) == after_put);
+    snprintf(req, sizeof(req), "GET /v1/changes?since=%llu HTTP/1.1\r\nX-Account-Id: feed\r\n\r\n", (unsigned long long)(after_put + 1));
+    roundtrip_request(&db, &conn, req, resp, sizeof(resp));
+    assert(strstr(resp, "\"reset\":true") != NULL);
+    roundtrip_request(&db, &conn, "GET /v1/changes?since=x HTTP/1.1\r\nX-Account-Id: feed\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "400 Bad Request") != NULL);
+    roundtrip_request(&db, &conn, "GET /v1/changes HTTP/1.1\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "401 Unauthorized") != NULL);
+
+    change_feed_config_t feed_config = {.entries = 0};
+    change_feed_configure(&feed_config);
+    roundtrip_request(&db, &conn, "GET /v1/changes HTTP/1.1\r\nX-Account-Id: feed\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "404 Not Found") != NULL);
+    feed_config.entries = DEFAULT_CHANGE_FEED_ENTRIES;
+    change_feed_configure(&feed_config);
+
+    free(writer.buf);
+    free(conn.buf);
+    write_completion_queue_destroy(&completions);
+    worker_db_close(&db);
+    assert(fchdir(old_cwd) == 0);
+    close(old_cwd);
+    char cleanup_cmd[512] = {0};
+    assert(snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf '%s' >/dev/null 2>&1", tmpdir) > 0);
+    assert(system(cleanup_cmd) == 0);
+}
+
+static void test_replay_pending_write_on_restart(void) {
+    char dir_template[] = "/tmp/fricu-test-replay-XXXXXX";
+    char *tmpdir = mkdtemp(dir_template);
+    assert(tmpdir != NULL);
+
+    int old_cwd = open(".", O_RDONLY);
+    assert(old_cwd >= 0);
+    assert(chdir(tmpdir) == 0);
+
+    assert(init_db("state.db") == 0);
+    assert(mkdir("pending_writes", 0700) == 0 || errno == EEXIST);
+    FILE *f = fopen("pending_writes/tester::profile-999-1-1.json", "wb");
+    assert(f != NULL);
+    assert(fwrite("{\"name\":\"Recovered\"}", 1, 20, f) == 20);
+    assert(fclose(f) == 0);
+    /* Older by timestamp despite the larger pid, so it is superseded. */
+    f = fopen("pending_writes/tester::profile-1000-0-5-lid-old.json", "wb");
+    assert(f != NULL);
+    assert(fwrite("{\"name\":\"Stale\"}", 1, 16, f) == 16);
+    assert(fclose(f) == 0);
+    /* Larger than the old 4 MB replay limit. */
+    size_t big_len = 5 * 1024 * 1024;
+    char *big = (char *)malloc(big_len);
+    assert(big != NULL);
+    memset(big, 'x', big_len);
+    big[0] = '"';
+    big[big_len - 1] = '"';
+    f = fopen("pending_writes/tester::activities-999-2-0.json", "wb");
+    assert(f != NULL);
+    assert(fwrite(big, 1, big_len, f) == big_len);
+    assert(fclose(f) == 0);
+    free(big);
+
+    assert(init_db("state.db") == 0);
+
+    sqlite3 *sqlite = NULL;
+    assert(sqlite3_open_v2("state.db", &sqlite, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK);
+    sqlite3_stmt *stmt = NULL;
+    assert(sqlite3_prepare_v2(sqlite, "SELECT data_value FROM kv_store WHERE data_key='tester::profile'", -1, &stmt, NULL) == SQLITE_OK);
+    assert(sqlite3_step(stmt) == SQLITE_ROW);
+    const unsigned char *v = sqlite3_column_text(stmt, 0);
+    assert(v != NULL);
+    assert(strcmp((const char *)v, "{\"name\":\"Recovered\"}") == 0);
+    sqlite3_finalize(stmt);
+    assert(sqlite3_prepare_v2(sqlite, "SELECT length(data_value) FROM kv_store WHERE data_key='tester::activities'", -1, &stmt, NULL) == SQLITE_OK);
+    assert(sqlite3_step(stmt) == SQLITE_ROW);
+    assert(sqlite3_column_int64(stmt, 0) == (sqlite3_int64)big_len);
+    sqlite3_finalize(stmt);
+    sqlite3_close(sqlite);
+
+    assert(access("pending_writes/tester::profile-999-1-1.json", F_OK) != 0);
+    assert(access("pending_writes/tester::profile-1000-0-5-lid-old.json", F_OK) != 0);
+    assert(access("pending_writes/tester::activities-999-2-0.json", F_OK) != 0);
+
+    assert(fchdir(old_cwd) == 0);
+    close(old_cwd);
+    char cleanup_cmd[512] = {0};
+    assert(snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf '%s' >/dev/null 2>&1", tmpdir) > 0);
+    assert(system(cleanup_cmd) == 0);
+}
+
+static int sqlite_json_valid(sqlite3 *db, const char *text, size_t len) {
+    sqlite3_stmt *stmt = NULL;
+    assert(sqlite3_prepare_v2(db, "SELECT json_valid(?1)", -1, &stmt, NULL) == SQLITE_OK);
+    sqlite3_bind_text(stmt, 1, text, (int)len, SQLITE_STATIC);
+    assert(sqlite3_step(stmt) == SQLITE_ROW);
+    int ok = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    return ok;
+}
+
+static void test_json_validate_matches_sqlite(void) {
+    const char *cases[] = {
+        "{}", "[]", " [ 1 , 2 ] ", "{\"a\":1,\"b\":[true,false,null]}", "\"str\"", "0", "-0.5e+10", "1E3", "null",
+        "[\"\\u00e9\\n\\\"\\\\\\/\"]", "{\"a\":{\"b\":{\"c\":[[]]}}}", "\t\r\n{}\n",
+        "", " ", "{", "[1,]", "{\"a\":1,}", "{\"a\"}", "{a:1}", "[01]", "[1.]", "[.5]", "[1e]", "[-]", "[+1]",
+        "tru", "nul", "[true false]", "\"\\x\"", "\"\\u12g4\"", "\"tab\there\"", "[1]]", "{} {}", "{\"a\":1}x",
+        "[\"unterminated]", "'single'",
+    };
+    sqlite3 *db = NULL;
+    assert(sqlite3_open(":memory:", &db) == SQLITE_OK);
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        size_t len = strlen(cases[i]);
+        int ours = json_validate(cases[i], len, NULL) == 0;
+        assert(ours == sqlite_json_valid(db, cases[i], len));
+    }
+
+    /* Specials at every offset around the 16/32-byte vector boundaries. */
+    char text[160];
+    for (int at = 1; at < 100; at++) {
+        memset(text, 'a', sizeof(text));
+        text[0] = '"';
+        text[120] = '"';
+        text[121] = '\0';
+        assert(json_validate(text, 121, NULL) == 0);
+        text[at] = '\x01';
+        assert(json_validate(text, 121, NULL) != 0);
+        text[at] = '"';
+        assert(json_validate(text, 121, NULL) != 0);
+        text[at] = '\\';
+        text[at + 1] = 'n';
+        assert(json_validate(text, 121, NULL) == 0);
+        text[at + 1] = 'q';
+        assert(json_validate(text, 121, NULL) != 0);
+    }
+    /* Bytes past len are not looked at. */
+    assert(json_validate("[1]garbage", 3, NULL) == 0);
+    assert(json_validate("[\"ab\"]", 4, NULL) != 0);
+
+    json_shape_t shape;
+    assert(json_validate("[1,{\"a\":[2,3]},\"x\",[]]", 22, &shape) == 0);
+    assert(shape.type == JSON_TYPE_ARRAY);
+    assert(shape.count == 4);
+    assert(shape.max_depth == 3);
+    assert(json_validate("{\"a\":1,\"b\":{}}", 14, &shape) == 0);
+    assert(shape.type == JSON_TYPE_OBJECT);
+    assert(shape.count == 2);
+    assert(json_validate(" \"s\" ", 5, &shape) == 0);
+    assert(shape.type == JSON_TYPE_STRING);
+    assert(shape.count == 0);
+    assert(json_validate("[]", 2, &shape) == 0);
+    assert(shape.count == 0);
+    assert(shape.max_depth == 1);
+
+    static char deep[2 * (JSON_MAX_DEPTH + 1)];
+    for (int i = 0; i < JSON_MAX_DEPTH; i++) {
+        deep[i] = '[';
+        deep[2 * JSON_MAX_DEPTH - 1 - i] = ']';
+    }
+    assert(json_validate(deep, 2 * JSON_MAX_DEPTH, &shape) == 0);
+    assert(shape.max_depth == JSON_MAX_DEPTH);
+    memmove(deep + 1, deep, 2 * JSON_MAX_DEPTH);
+    deep[0] = '[';
+    deep[2 * JSON_MAX_DEPTH + 1] = ']';
+    assert(json_validate(deep, 2 * JSON_MAX_DEPTH + 2, NULL) != 0);
+
+    sqlite3_close(db);
+}
+
+static uint64_t response_etag(const char *resp) {
+    const char *etag = strstr(resp, "ETag: \"");
+    assert(etag != NULL);
+    return strtoull(etag + 7, NULL, 10);
+}
+
+static void test_etag_conditional_requests(void) {
+    char dir_template[] = "/tmp/fricu-test-etag-XXXXXX";
+    char *tmpdir = mkdtemp(dir_template);
+    assert(tmpdir != NULL);
+
+    int old_cwd = open(".", O_RDONLY);
+    assert(old_cwd >= 0);
+    assert(chdir(tmpdir) == 0);
+
+    assert(init_db("state.db") == 0);
+    worker_db_t db;
+    assert(worker_db_open(&db, "state.db") == 0);
+    conn_t conn = {0};
+    conn.cap = REQ_BUF_SIZE;
+    conn.buf = (char *)malloc(conn.cap);
+    assert(conn.buf != NULL);
+    char req[512];
+    char resp[1024];
+
+    roundtrip_request(&db, &conn, "GET /v1/data/profile HTTP/1.1\r\nX-Account-Id: etag\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "200 OK") != NULL);
+    assert(response_etag(resp) == 0);
+    roundtrip_request(
+        &db, &conn, "GET /v1/data/profile HTTP/1.1\r\nX-Account-Id: etag\r\nIf-None-Match: \"0\"\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "304 Not Modified") != NULL);
+    assert(strstr(resp, "Content-Length") == NULL);
+
+    /* "0" on PUT means "only if nobody has written the key yet". */
+    roundtrip_request(
+        &db,
+        &conn,
+        "PUT /v1/data/profile HTTP/1.1\r\nX-Account-Id: etag\r\nIf-Match: \"7\"\r\nContent-Length: 7\r\n\r\n{\"v\":1}",
+        resp,
+        sizeof(resp));
+    assert(strstr(resp, "412 Precondition Failed") != NULL);
+    assert(response_etag(resp) == 0);
+    roundtrip_request(
+        &db,
+        &conn,
+        "PUT /v1/data/profile HTTP/1.1\r\nX-Account-Id: etag\r\nIf-Match: \"0\"\r\nContent-Length: 7\r\n\r\n{\"v\":1}",
+        resp,
+        sizeof(resp));
+    assert(strstr(resp, "204 No Content") != NULL);
+    uint64_t v1 = response_etag(resp);
+    assert(v1 > 0);
+
+    roundtrip_request(&db, &conn, "GET /v1/data/profile HTTP/1.1\r\nX-Account-Id: etag\r\n\r\n", resp, sizeof(resp));
+    assert(response_etag(resp) == v1);
+    assert(strstr(resp, "\r\n\r\n{\"v\":1}") != NULL);
+    snprintf(req, sizeof(req), "GET /v1/data/profile HTTP/1.1\r\nX-Account-Id: etag\r\nIf-None-Match: \"1\", W/\"%llu\"\r\n\r\n", (unsigned long long)v1);
+    roundtrip_request(&db, &conn, req, resp, sizeof(resp));
+    assert(strstr(resp, "304 Not Modified") != NULL);
+    /* Same answer from the version column once the cache is cold. */
+    value_cache_clear();
+    roundtrip_request(&db, &conn, req, resp, sizeof(resp));
+    assert(strstr(resp, "304 Not Modified") != NULL);
+    assert(response_etag(resp) == v1);
+
+    roundtrip_request(
+        &db,
+        &conn,
+        "PUT /v1/data/profile HTTP/1.1\r\nX-Account-Id: etag\r\nIf-Match: *\r\nContent-Length: 7\r\n\r\n{\"v\":2}",
+        resp,
+        sizeof(resp));
+    assert(strstr(resp, "204 No Content") != NULL);
+    uint64_t v2 = response_etag(resp);
+    assert(v2 > v1);
+    snprintf(req, sizeof(req), "PUT /v1/data/profile HTTP/1.1\r\nX-Account-Id: etag\r\nIf-Match: \"%llu\"\r\nContent-Length: 7\r\n\r\n{\"v\":3}", (unsigned long long)v1);
+    roundtrip_request(&db, &conn, req, resp, sizeof(resp));
+    assert(strstr(resp, "412 Precondition Failed") != NULL);
+    assert(response_etag(resp) == v2);
+    roundtrip_request(
+        &db, &conn, "PUT /v1/data/profile HTTP/1.1\r\nX-Account-Id: etag\r\nIf-Match: W/\"1\"\r\nContent-Length: 2\r\n\r\n{}", resp, sizeof(resp));
+    assert(strstr(resp, "412 Precondition Failed") != NULL);
+    journal_stats_t journal;
+    journal_stats_snapshot(&journal);
+    assert(journal.live_records == 0);
+    worker_db_close(&db);
+
+    /* Conditional records are re-evaluated on replay, after earlier records. */
+    assert(init_db("state.db") == 0);
+    assert(journal_open() == 0);
+    journal_entry_t *entries[3] = {0};
+    assert(journal_append("etag::profile", "lid-a", WRITE_OP_PUT, (int64_t)v2, "{\"v\":4}", 7, &entries[0]) == 0);
+    uint64_t v4 = journal_entry_seq(entries[0]);
+    assert(v4 > v2);
+    assert(journal_append("etag::profile", "lid-b", WRITE_OP_PUT, (int64_t)v2, "{\"v\":5}", 7, &entries[1]) == 0);
+    assert(journal_append("etag::activities", "lid-c", WRITE_OP_PUT, 0, "[1]", 3, &entries[2]) == 0);
+    journal_close();
+    assert(init_db("state.db") == 0);
+    assert(worker_db_open(&db, "state.db") == 0);
+    roundtrip_request(&db, &conn, "GET /v1/data/profile HTTP/1.1\r\nX-Account-Id: etag\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "\r\n\r\n{\"v\":4}") != NULL);
+    assert(response_etag(resp) == v4);
+    roundtrip_request(&db, &conn, "GET /v1/data/activities HTTP/1.1\r\nX-Account-Id: etag\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "\r\n\r\n[1]") != NULL);
+
+    /* Versions keep increasing across restarts. */
+    roundtrip_request(
+        &db, &conn, "PUT /v1/data/profile HTTP/1.1\r\nX-Account-Id: etag\r\nContent-Length: 2\r\n\r\n{}", resp, sizeof(resp));
+    assert(strstr(resp, "204 No Content") != NULL);
+    assert(response_etag(resp) > v4 + 2);
+
+    free(conn.buf);
+    worker_db_close(&db);
+    assert(fchdir(old_cwd) == 0);
+    close(old_cwd);
+    char cleanup_cmd[512] = {0};
+    assert(snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf '%s' >/dev/null 2>&1", tmpdir) > 0);
+    assert(system(cleanup_cmd) == 0);
+}
+
+static int count_list_items(const char *db_path, const char *storage_key) {
+    sqlite3 *db = NULL;
+    assert(sqlite3_open(db_path, &db) == SQLITE_OK);
+    sqlite3_stmt *stmt = NULL;
+    assert(sqlite3_prepare_v2(db, "SELECT COUNT(*) FROM kv_items WHERE data_key=?1", -1, &stmt, NULL) == SQLITE_OK);
+    sqlite3_bind_text(stmt, 1, storage_key, -1, SQLITE_STATIC);
+    assert(sqlite3_step(stmt) == SQLITE_ROW);
+    int count = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+    return count;
+}
+
+static void test_list_append_and_patch(void) {
+    char dir_template[] = "/tmp/fricu-test-list-XXXXXX";
+    char *tmpdir = mkdtemp(dir_template);
+    assert(tmpdir != NULL);
+
+    int old_cwd = open(".", O_RDONLY);
+    assert(old_cwd >= 0);
+    assert(chdir(tmpdir) == 0);
+
+    assert(init_db("state.db") == 0);
+    worker_db_t db;
+    assert(worker_db_open(&db, "state.db") == 0);
+    conn_t conn = {0};
+    conn.cap = REQ_BUF_SIZE;
+    conn.buf = (char *)malloc(conn.cap);
+    assert(conn.buf != NULL);
+    char resp[1024];
+    const char *get = "GET /v1/data/activities HTTP/1.1\r\nX-Account-Id: list\r\n\r\n";
+
+    roundtrip_request(
+        &db,
+        &conn,
+        "PUT /v1/data/activities HTTP/1.1\r\nX-Account-Id: list\r\nContent-Length: 35\r\n\r\n[{\"id\":1,\"v\":\"a\"},{\"id\":2,\"v\":\"b\"}]",
+        resp,
+        sizeof(resp));
+    assert(strstr(resp, "204 No Content") != NULL);
+    roundtrip_request(
+        &db,
+        &conn,
+        "POST /v1/data/activities:append HTTP/1.1\r\nX-Account-Id: list\r\nContent-Length: 18\r\n\r\n[{\"id\":3,\"v\":\"c\"}]",
+        resp,
+        sizeof(resp));
+    assert(strstr(resp, "204 No Content") != NULL);
+    uint64_t appended = response_etag(resp);
+    assert(count_list_items("state.db", "list::activities") == 3);
+
+    roundtrip_request(&db, &conn, get, resp, sizeof(resp));
+    assert(strstr(resp, "\r\n\r\n[{\"id\":1,\"v\":\"a\"},{\"id\":2,\"v\":\"b\"},{\"id\":3,\"v\":\"c\"}]") != NULL);
+    assert(response_etag(resp) == appended);
+
+    /* PATCH replaces by id and appends ids it does not know. */
+    roundtrip_request(
+        &db,
+        &conn,
+        "PATCH /v1/data/activities HTTP/1.1\r\nX-Account-Id: list\r\nContent-Length: 38\r\n\r\n[{\"id\":2,\"v\":\"B\"}, {\"id\":\"x\",\"v\":\"d\"}]",
+        resp,
+        sizeof(resp));
+    assert(strstr(resp, "204 No Content") != NULL);
+    assert(response_etag(resp) > appended);
+    value_cache_clear();
+    roundtrip_request(&db, &conn, get, resp, sizeof(resp));
+    assert(strstr(resp, "\r\n\r\n[{\"id\":1,\"v\":\"a\"},{\"id\":2,\"v\":\"B\"},{\"id\":3,\"v\":\"c\"},{\"id\":\"x\",\"v\":\"d\"}]") != NULL);
+    assert(count_list_items("state.db", "list::activities") == 4);
+
+    roundtrip_request(
+        &db, &conn, "PATCH /v1/data/activities HTTP/1.1\r\nX-Account-Id: list\r\nContent-Length: 9\r\n\r\n[{\"v\":1}]", resp, sizeof(resp));
+    assert(strstr(resp, "400 Bad Request") != NULL);
+    roundtrip_request(
+        &db, &conn, "POST /v1/data/activities:append HTTP/1.1\r\nX-Account-Id: list\r\nContent-Length: 2\r\n\r\n{}", resp, sizeof(resp));
+    assert(strstr(resp, "400 Bad Request") != NULL);
+    roundtrip_request(
+        &db, &conn, "POST /v1/data/profile:append HTTP/1.1\r\nX-Account-Id: list\r\nContent-Length: 2\r\n\r\n[]", resp, sizeof(resp));
+    assert(strstr(resp, "400 Bad Request") != NULL);
+    roundtrip_request(&db, &conn, "GET /v1/data/activities:append HTTP/1.1\r\nX-Account-Id: list\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "405 Method Not Allowed") != NULL);
+
+    /* Appending to a stored non-array is a conflict, not a rewrite. */
+    roundtrip_request(
+        &db, &conn, "PUT /v1/data/exported_file_a HTTP/1.1\r\nX-Account-Id: list\r\nContent-Length: 2\r\n\r\n{}", resp, sizeof(resp));
+    assert(strstr(resp, "204 No Content") != NULL);
+    roundtrip_request(
+        &db, &conn, "POST /v1/data/exported_file_a:append HTTP/1.1\r\nX-Account-Id: list\r\nContent-Length: 3\r\n\r\n[1]", resp, sizeof(resp));
+    assert(strstr(resp, "409 Conflict") != NULL);
+    journal_stats_t journal;
+    journal_stats_snapshot(&journal);
+    assert(journal.live_records == 0);
+
+    /* A PUT goes back to one stored value. */
+    roundtrip_request(
+        &db, &conn, "PUT /v1/data/activities HTTP/1.1\r\nX-Account-Id: list\r\nContent-Length: 3\r\n\r\n[7]", resp, sizeof(resp));
+    assert(strstr(resp, "204 No Content") != NULL);
+    assert(count_list_items("state.db", "list::activities") == 0);
+    roundtrip_request(&db, &conn, get, resp, sizeof(resp));
+    assert(strstr(resp, "\r\n\r\n[7]") != NULL);
+    worker_db_close(&db);
+
+    /* Journaled appends replay after the stored value. */
+    assert(init_db("state.db") == 0);
+    assert(journal_open() == 0);
+    journal_entry_t *entry = NULL;
+    assert(journal_append("list::activities", "lid-a", WRITE_OP_APPEND, WRITE_IF_MATCH_NONE, "[8, 9]", 6, &entry) == 0);
+    journal_close();
+    assert(init_db("state.db") == 0);
+    assert(worker_db_open(&db, "state.db") == 0);
+    roundtrip_request(&db, &conn, get, resp, sizeof(resp));
+    assert(strstr(resp, "\r\n\r\n[7,8,9]") != NULL);
+    assert(count_list_items("state.db", "list::activities") == 3);
+
+    free(conn.buf);
+    worker_db_close(&db);
+    assert(fchdir(old_cwd) == 0);
+    close(old_cwd);
+    char cleanup_cmd[512] = {0};
+    assert(snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf '%s' >/dev/null 2>&1", tmpdir) > 0);
+    assert(system(cleanup_cmd) == 0);
+}
+
+/* Decodes a chunked body in place and returns it; asserts the framing is complete. */
+static char *dechunk_body(char *resp) {
+    char *p = strstr(resp, "\r\n\r\n");
+    assert(p != NULL);
+    p += 4;
+    char *out = p;
+    char *w = p;
+    while (1) {
+        char *line_end = strstr(p, "\r\n");
+        assert(line_end != NULL);
+        size_t size = strtoul(p, NULL, 16);
+        p = line_end + 2;
+        if (size == 0) break;
+        memmove(w, p, size);
+        w += size;
+        p += size;
+        assert(p[0] == '\r' && p[1] == '\n');
+        p += 2;
+    }
+    *w = '\0';
+    return out;
+}
+
+static void test_list_paged_reads(void) {
+    char dir_template[] = "/tmp/fricu-test-page-XXXXXX";
+    char *tmpdir = mkdtemp(dir_template);
+    assert(tmpdir != NULL);
+
+    int old_cwd = open(".", O_RDONLY);
+    assert(old_cwd >= 0);
+    assert(chdir(tmpdir) == 0);
+
+    assert(init_db("state.db") == 0);
+    worker_db_t db;
+    assert(worker_db_open(&db, "state.db") == 0);
+    conn_t conn = {0};
+    conn.cap = REQ_BUF_SIZE;
+    conn.buf = (char *)malloc(conn.cap);
+    assert(conn.buf != NULL);
+    char req[1024];
+    char resp[2048];
+
+    char body[512];
+    int off = snprintf(body, sizeof(body), "[");
+    for (int i = 1; i <= 5; i++) {
+        off += snprintf(body + off, sizeof(body) - (size_t)off, "%s{\"id\":%d,\"date\":\"2024-05-0%dT08:00:00Z\"}", i > 1 ? "," : "", i, i);
+    }
+    off += snprintf(body + off, sizeof(body) - (size_t)off, "]");
+    snprintf(req, sizeof(req), "POST /v1/data/activities:append HTTP/1.1\r\nX-Account-Id: page\r\nContent-Length: %d\r\n\r\n%s", off, body);
+    roundtrip_request(&db, &conn, req, resp, sizeof(resp));
+    assert(strstr(resp, "204 No Content") != NULL);
+
+    roundtrip_request(&db, &conn, "GET /v1/data/activities?limit=2 HTTP/1.1\r\nX-Account-Id: page\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "Transfer-Encoding: chunked") != NULL);
+    assert(strcmp(
+               dechunk_body(resp),
+               "{\"items\":[{\"id\":1,\"date\":\"2024-05-01T08:00:00Z\"},{\"id\":2,\"date\":\"2024-05-02T08:00:00Z\"}],\"next_cursor\":\"2\"}") == 0);
+    roundtrip_request(&db, &conn, "GET /v1/data/activities?limit=2&cursor=4 HTTP/1.1\r\nX-Account-Id: page\r\n\r\n", resp, sizeof(resp));
+    assert(strcmp(dechunk_body(resp), "{\"items\":[{\"id\":5,\"date\":\"2024-05-05T08:00:00Z\"}],\"next_cursor\":null}") == 0);
+    roundtrip_request(
+        &db, &conn, "GET /v1/data/activities?since=2024-05-04T09:00:00%2B01:00 HTTP/1.1\r\nX-Account-Id: page\r\n\r\n", resp, sizeof(resp));
+    assert(strcmp(
+               dechunk_body(resp),
+               "{\"items\":[{\"id\":4,\"date\":\"2024-05-04T08:00:00Z\"},{\"id\":5,\"date\":\"2024-05-05T08:00:00Z\"}],\"next_cursor\":null}") == 0);
+
+    /* A value still stored as one array pages the same way; HTTP/1.0 gets a close-delimited body. */
+    snprintf(req, sizeof(req), "PUT /v1/data/wellness_samples HTTP/1.1\r\nX-Account-Id: page\r\nContent-Length: %d\r\n\r\n%s", off, body);
+    roundtrip_request(&db, &conn, req, resp, sizeof(resp));
+    assert(strstr(resp, "204 No Content") != NULL);
+    roundtrip_request(
+        &db, &conn, "GET /v1/data/wellness_samples?since=1714636801&limit=1 HTTP/1.0\r\nX-Account-Id: page\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "Transfer-Encoding") == NULL);
+    assert(strstr(resp, "Connection: close") != NULL);
+    assert(strstr(resp, "\r\n\r\n{\"items\":[{\"id\":3,\"date\":\"2024-05-03T08:00:00Z\"}],\"next_cursor\":\"3\"}") != NULL);
+
+    roundtrip_request(&db, &conn, "GET /v1/data/activities?limit=0 HTTP/1.1\r\nX-Account-Id: page\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "400 Bad Request") != NULL);
+    roundtrip_request(&db, &conn, "GET /v1/data/activities?since=yesterday HTTP/1.1\r\nX-Account-Id: page\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "400 Bad Request") != NULL);
+    roundtrip_request(&db, &conn, "GET /v1/data/profile?limit=1 HTTP/1.1\r\nX-Account-Id: page\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "400 Bad Request") != NULL);
+
+    /* A long list is produced as the socket drains, never all at once. */
+    const int count = 4000;
+    size_t big_cap = (size_t)count * 160 + 256;
+    char *big = (char *)malloc(big_cap);
+    assert(big != NULL);
+    int big_len = snprintf(big, big_cap, "POST /v1/data/workouts:append HTTP/1.1\r\nX-Account-Id: page\r\nContent-Length: 0000000\r\n\r\n[");
+    int body_start = big_len - 1;
+    for (int i = 0; i < count; i++) {
+        big_len += snprintf(big + big_len, big_cap - (size_t)big_len, "%s{\"id\":%d,\"pad\":\"%0100d\"}", i > 0 ? "," : "", i, i);
+    }
+    big_len += snprintf(big + big_len, big_cap - (size_t)big_len, "]");
+    assert(big_len - body_start < 10000000);
+    char length[12];
+    snprintf(length, sizeof(length), "%07d", big_len - body_start);
+    memcpy(strstr(big, "0000000"), length, 7);
+    roundtrip_request(&db, &conn, big, resp, sizeof(resp));
+    assert(strstr(resp, "204 No Content") != NULL);
+
+    int fds[2] = {-1, -1};
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    assert(set_nonblocking(fds[0]) == 0);
+    const char *get = "GET /v1/data/workouts?cursor=0 HTTP/1.1\r\nX-Account-Id: page\r\n\r\n";
+    conn.len = strlen(get);
+    memcpy(conn.buf, get, conn.len);
+    http_parse_reset(&conn.parse);
+    assert(try_process_client(fds[0], &db, &conn) == 1);
+    assert(conn.stream != NULL);
+    size_t received_cap = (size_t)big_len + 65536;
+    char *received = (char *)malloc(received_cap);
+    assert(received != NULL);
+    size_t received_len = 0;
+    int resumes = 0;
+    while (conn.stream || conn.out_head) {
+        assert(conn.out_bytes < 2 * 1024 * 1024);
+        ssize_t n = read(fds[1], received + received_len, received_cap - received_len - 1);
+        assert(n > 0);
+        received_len += (size_t)n;
+        assert(conn_output_flush(fds[0], &conn) >= 0);
+        if (!conn.out_head && conn.stream) {
+            assert(conn_stream_resume(&db, &conn) >= 0);
+            resumes++;
+        }
+    }
+    ssize_t n;
+    while ((n = recv(fds[1], received + received_len, received_cap - received_len - 1, MSG_DONTWAIT)) > 0) received_len += (size_t)n;
+    received[received_len] = '\0';
+    assert(resumes > 0);
+    char *items = dechunk_body(received);
+    assert(strncmp(items, "{\"items\":[{\"id\":0,", 18) == 0);
+    assert(strstr(items, "{\"id\":3999,") != NULL);
+    assert(strcmp(items + strlen(items) - 21, "],\"next_cursor\":null}") == 0);
+    close(fds[0]);
+    close(fds[1]);
+    free(received);
+    free(big);
+
+    free(conn.buf);
+    worker_db_close(&db);
+    assert(fchdir(old_cwd) == 0);
+    close(old_cwd);
+    char cleanup_cmd[512] = {0};
+    assert(snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf '%s' >/dev/null 2>&1", tmpdir) > 0);
+    assert(system(cleanup_cmd) == 0);
+}
+
+static size_t put_ride_sample(unsigned char *p, int64_t t, float power) {
+    uint64_t bits = (uint64_t)t;
+    for (int i = 0; i < 8; i++) p[i] = (unsigned char)(bits >> (8 * i));
+    for (int f = 0; f < RIDE_FIELD_COUNT; f++) {
+        float value = f == RIDE_FIELD_POWER ? power : NAN;
+        uint32_t v = 0;
+        memcpy(&v, &value, 4);
+        for (int i = 0; i < 4; i++) p[8 + 4 * f + i] = (unsigned char)(v >> (8 * i));
+    }
+    return RIDE_SAMPLE_WIRE_BYTES;
+}
+
+static void test_ride_stream_ingest_and_range_read(void) {
+    char dir_template[] = "/tmp/fricu-test-ride-XXXXXX";
+    char *tmpdir = mkdtemp(dir_template);
+    assert(tmpdir != NULL);
+
+    int old_cwd = open(".", O_RDONLY);
+    assert(old_cwd >= 0);
+    assert(chdir(tmpdir) == 0);
+
+    assert(init_db("state.db") == 0);
+    worker_db_t db;
+    assert(worker_db_open(&db, "state.db") == 0);
+    conn_t conn = {0};
+    conn.cap = REQ_BUF_SIZE;
+    conn.buf = (char *)malloc(conn.cap);
+    assert(conn.buf != NULL);
+    char req[2048];
+    char resp[4096];
+
+    const char *chunk =
+        "{\"t\":1000,\"power\":210,\"heart_rate\":140}\n"
+        "{\"t\":2000,\"power\":215.5,\"cadence\":null}\n"
+        "\n"
+        "{\"t\":3000,\"power\":220,\"speed\":9.25}\n";
+    snprintf(req, sizeof(req), "POST /v1/streams/r1 HTTP/1.1\r\nX-Account-Id: ride\r\nContent-Length: %zu\r\n\r\n%s", strlen(chunk), chunk);
+    roundtrip_request(&db, &conn, req, resp, sizeof(resp));
+    assert(strstr(resp, "200 OK") != NULL);
+    assert(strstr(resp, "ETag: \"1\"\r\n") != NULL);
+    char ack[128];
+    snprintf(ack, sizeof(ack), "{\"samples\":3,\"from\":1000,\"to\":3000,\"crc32\":\"%08x\"}", (unsigned)ride_chunk_crc32(chunk, strlen(chunk)));
+    assert(strstr(resp, ack) != NULL);
+
+    /* A resent chunk adds nothing, and an overlapping one only what lies past the last sample. */
+    roundtrip_request(&db, &conn, req, resp, sizeof(resp));
+    assert(strstr(resp, "200 OK") != NULL);
+    chunk = "{\"t\":3000,\"power\":999}\n{\"t\":4000,\"power\":230}\n";
+    snprintf(
+        req, sizeof(req), "POST /v1/streams/r1 HTTP/1.1\r\nX-Account-Id: ride\r\nX-Chunk-CRC32: %08X\r\nContent-Length: %zu\r\n\r\n%s",
+        (unsigned)ride_chunk_crc32(chunk, strlen(chunk)), strlen(chunk), chunk);
+    roundtrip_request(&db, &conn, req, resp, sizeof(resp));
+    assert(strstr(resp, "200 OK") != NULL);
+    assert(strstr(resp, "ETag: \"3\"\r\n") != NULL);
+
+    int head_len = snprintf(
+        req, sizeof(req), "POST /v1/streams/r1 HTTP/1.1\r\nX-Account-Id: ride\r\nContent-Type: application/octet-stream\r\nContent-Length: %d\r\n\r\n",
+        2 * RIDE_SAMPLE_WIRE_BYTES);
+    size_t req_len = (size_t)head_len;
+    req_len += put_ride_sample((unsigned char *)req + req_len, 5000, 240.0f);
+    req_len += put_ride_sample((unsigned char *)req + req_len, 6000, 250.0f);
+    roundtrip_bytes(&db, &conn, req, req_len, resp, sizeof(resp));
+    assert(strstr(resp, "200 OK") != NULL);
+    assert(strstr(resp, "{\"samples\":2,\"from\":5000,\"to\":6000,") != NULL);
+
+    roundtrip_request(&db, &conn, "GET /v1/streams/r1?from=2000&to=5000 HTTP/1.1\r\nX-Account-Id: ride\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "Content-Type: application/x-ndjson\r\n") != NULL);
+    assert(strstr(resp, "ETag: \"4\"\r\n") != NULL);
+    assert(strcmp(
+               dechunk_body(resp),
+               "{\"t\":2000,\"power\":215.5}\n"
+               "{\"t\":3000,\"power\":220,\"speed\":9.25}\n"
+               "{\"t\":4000,\"power\":230}\n") == 0);
+
+    roundtrip_request(&db, &conn, "GET /v1/streams/r1?from=6000 HTTP/1.1\r\nX-Account-Id: ride\r\nAccept: application/octet-stream\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "Content-Type: application/octet-stream\r\n") != NULL);
+    char *body = strstr(resp, "\r\n\r\n") + 4;
+    unsigned char expected[RIDE_SAMPLE_WIRE_BYTES];
+    put_ride_sample(expected, 6000, 250.0f);
+    assert(strtoul(body, NULL, 16) == RIDE_SAMPLE_WIRE_BYTES);
+    assert(memcmp(strstr(body, "\r\n") + 2, expected, sizeof(expected)) == 0);
+
+    roundtrip_request(&db, &conn, "GET /v1/streams/r1 HTTP/1.1\r\nX-Account-Id: ride\r\nIf-None-Match: \"4\"\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "304 Not Modified") != NULL);
+    roundtrip_request(&db, &conn, "GET /v1/streams/r2 HTTP/1.1\r\nX-Account-Id: ride\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "404 Not Found") != NULL);
+    roundtrip_request(&db, &conn, "GET /v1/streams/r1?from=5&to=4 HTTP/1.1\r\nX-Account-Id: ride\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "400 Bad Request") != NULL);
+    roundtrip_request(&db, &conn, "GET /v1/streams/r1 HTTP/1.1\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "401 Unauthorized") != NULL);
+
+    const char *bad[] = {
+        "{\"t\":7000,\"power\":\"high\"}\n",
+        "{\"t\":-1}\n",
+        "{\"t\":8000}\n{\"t\":7500}\n",
+        "\n",
+    };
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        snprintf(req, sizeof(req), "POST /v1/streams/r1 HTTP/1.1\r\nX-Account-Id: ride\r\nContent-Length: %zu\r\n\r\n%s", strlen(bad[i]), bad[i]);
+        roundtrip_request(&db, &conn, req, resp, sizeof(resp));
+        assert(strstr(resp, "400 Bad Request") != NULL);
+    }
+    snprintf(req, sizeof(req), "POST /v1/streams/r1 HTTP/1.1\r\nX-Account-Id: ride\r\nX-Chunk-CRC32: 00000000\r\nContent-Length: 11\r\n\r\n{\"t\":9000}\n");
+    roundtrip_request(&db, &conn, req, resp, sizeof(resp));
+    assert(strstr(resp, "400 Bad Request") != NULL);
+    assert(strstr(resp, "checksum mismatch") != NULL);
+
+    /* The head counts only what was kept; a chunk that no longer matches its checksum is never sent. */
+    char path[512];
+    assert(shard_db_path("state.db", storage_key_shard("ride::stream:r1", db.shard_count), path, sizeof(path)) == 0);
+    sqlite3 *raw = NULL;
+    assert(sqlite3_open_v2(path, &raw, SQLITE_OPEN_READWRITE, NULL) == SQLITE_OK);
+    sqlite3_stmt *stmt = NULL;
+    assert(sqlite3_prepare_v2(raw, "SELECT data_value FROM kv_store WHERE data_key='ride::stream:r1'", -1, &stmt, NULL) == SQLITE_OK);
+    assert(sqlite3_step(stmt) == SQLITE_ROW);
+    ride_head_t head;
+    assert(ride_head_parse((const char *)sqlite3_column_text(stmt, 0), (size_t)sqlite3_column_bytes(stmt, 0), &head) == 0);
+    assert(head.chunks == 3 && head.samples == 6 && head.from == 1000 && head.to == 6000);
+    sqlite3_finalize(stmt);
+    assert(sqlite3_exec(raw, "UPDATE ride_chunks SET crc32=crc32+1 WHERE version=3", NULL, NULL, NULL) == SQLITE_OK);
+    sqlite3_close(raw);
+    roundtrip_request(&db, &conn, "GET /v1/streams/r1 HTTP/1.1\r\nX-Account-Id: ride\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "200 OK") != NULL);
+    assert(strstr(resp, "\"t\":4000") == NULL);
+    assert(strstr(resp, "0\r\n\r\n") == NULL);
+    conn_stream_free(&conn);
+
+    free(conn.buf);
+    worker_db_close(&db);
+    assert(fchdir(old_cwd) == 0);
+    close(old_cwd);
+    char cleanup_cmd[512] = {0};
+    assert(snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf '%s' >/dev/null 2>&1", tmpdir) > 0);
+    assert(system(cleanup_cmd) == 0);
+}
+
+/* Submits one write and waits for it to be applied; returns its version. */
+static uint64_t replicated_write(write_completion_queue_t *completions, int op, const char *storage_key, const char *payload, size_t payload_len) {
+    assert(write_dispatch_submit("profile", storage_key, payload, payload_len, op, WRITE_IF_MATCH_NONE, "repl", "repl-log", completions, NULL, 0) == 0);
+    write_completion_t *completion = NULL;
+    for (int i = 0; i < 500 && (completion = write_completion_queue_take(completions)) == NULL; i++) {
+        assert(write_completion_queue_wait(completions, 10) >= 0);
+    }
+    assert(completion != NULL && completion->next == NULL);
+    assert(completion->result.status_code == 204);
+    uint64_t version = completion->result.version;
+    write_completion_release(completion);
+    return version;
+}
+
+static uint64_t row_version(const char *db_path, const char *storage_key) {
+    sqlite3 *sqlite = NULL;
+    assert(sqlite3_open_v2(db_path, &sqlite, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK);
+    sqlite3_busy_timeout(sqlite, 1000);
+    sqlite3_stmt *stmt = NULL;
+    assert(sqlite3_prepare_v2(sqlite, "SELECT version FROM kv_store WHERE data_key=?1", -1, &stmt, NULL) == SQLITE_OK);
+    sqlite3_bind_text(stmt, 1, storage_key, -1, SQLITE_STATIC);
+    uint64_t version = sqlite3_step(stmt) == SQLITE_ROW ? (uint64_t)sqlite3_column_int64(stmt, 0) : 0;
+    sqlite3_finalize(stmt);
+    sqlite3_close(sqlite);
+    return version;
+}
+
+/* Replay skips a PUT superseded by a later one only if no batch in between depends on it. */
+static void test_replay_keeps_writes_a_batch_depends_on(void) {
+    char dir_template[] = "/tmp/fricu-test-replay-batch-XXXXXX";
+    char *tmpdir = mkdtemp(dir_template);
+    assert(tmpdir != NULL);
+
+    int old_cwd = open(".", O_RDONLY);
+    assert(old_cwd >= 0);
+    assert(chdir(tmpdir) == 0);
+
+    assert(init_db("state.db") == 0);
+    assert(journal_open() == 0);
+    journal_entry_t *entries[3] = {0};
+    assert(journal_append("tester::profile", "lid-a", WRITE_OP_PUT, WRITE_IF_MATCH_NONE, "{\"v\":1}", 7, &entries[0]) == 0);
+    uint64_t v1 = journal_entry_seq(entries[0]);
+    char *batch = NULL;
+    size_t batch_len = 0;
+    size_t batch_cap = 0;
+    kv_batch_entry_t entry = {WRITE_OP_PUT, (int64_t)v1, "profile", 7, "{\"v\":2}", 7};
+    assert(kv_batch_append(&batch, &batch_len, &batch_cap, &entry) == 0);
+    kv_batch_entry_t blind = {WRITE_OP_PUT, WRITE_IF_MATCH_NONE, "app_settings", 12, "{\"x\":1}", 7};
+    assert(kv_batch_append(&batch, &batch_len, &batch_cap, &blind) == 0);
+    assert(journal_append("tester::", "lid-b", WRITE_OP_BATCH, WRITE_IF_MATCH_NONE, batch, batch_len, &entries[1]) == 0);
+    uint64_t v2 = journal_entry_seq(entries[1]);
+    free(batch);
+    assert(journal_append("tester::profile", "lid-c", WRITE_OP_PUT, WRITE_IF_MATCH_NONE, "{\"v\":3}", 7, &entries[2]) == 0);
+    uint64_t v3 = journal_entry_seq(entries[2]);
+    journal_close();
+
+    assert(init_db("state.db") == 0);
+    assert(row_version("state.db", "tester::app_settings") == v2);
+    assert(row_version("state.db", "tester::profile") == v3);
+
+    assert(fchdir(old_cwd) == 0);
+    close(old_cwd);
+    char cleanup_cmd[512] = {0};
+    assert(snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf '%s' >/dev/null 2>&1", tmpdir) > 0);
+    assert(system(cleanup_cmd) == 0);
+}
+
+static int wait_for_replica_version(const char *storage_key, uint64_t version) {
+    for (int i = 0; i < 500; i++) {
+        if (row_version("replica.db", storage_key) == version) return 1;
+        usleep(10 * 1000);
+    }
+    return 0;
+}
+
+static void test_replication_streams_to_follower(void) {
+    char dir_template[] = "/tmp/fricu-test-replication-XXXXXX";
+    char *tmpdir = mkdtemp(dir_template);
+    assert(tmpdir != NULL);
+
+    int old_cwd = open(".", O_RDONLY);
+    assert(old_cwd >= 0);
+    assert(chdir(tmpdir) == 0);
+
+    /* One process plays both ends: the primary on state.db streams into replica.db. */
+    assert(init_db("replica.db") == 0);
+    assert(init_db("state.db") == 0);
+    worker_db_t db;
+    assert(worker_db_open(&db, "state.db") == 0);
+    write_completion_queue_t completions;
+    assert(write_completion_queue_init(&completions) == 0);
+
+    /* Written before the log exists, so it can only reach the follower in a snapshot. */
+    uint64_t v1 = replicated_write(&completions, WRITE_OP_PUT, "repl::profile", "{\"n\":1}", 7);
+    char *chunk = NULL;
+    size_t chunk_len = 0;
+    const char *chunk_error = NULL;
+    assert(ride_chunk_build("{\"t\":1}\n{\"t\":2}\n", 16, 0, &chunk, &chunk_len, &chunk_error) == 0);
+    replicated_write(&completions, WRITE_OP_RIDE_CHUNK, "repl::stream:r", chunk, chunk_len);
+    free(chunk);
+
+    int probe = open_listen_socket("127.0.0.1", 0, 16, 0);
+    assert(probe >= 0);
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    assert(getsockname(probe, (struct sockaddr *)&addr, &addr_len) == 0);
+    close(probe);
+    replication_config_t config;
+    memset(&config, 0, sizeof(config));
+    snprintf(config.listen_host, sizeof(config.listen_host), "127.0.0.1");
+    config.listen_port = ntohs(addr.sin_port);
+    snprintf(config.primary_host, sizeof(config.primary_host), "127.0.0.1");
+    config.primary_port = config.listen_port;
+    snprintf(config.token, sizeof(config.token), "t0k");
+    replication_configure(&config);
+    assert(replication_primary_start("state.db") == 0);
+
+    /* A wrong token is turned away before anything is sent. */
+    int intruder = socket(AF_INET, SOCK_STREAM, 0);
+    assert(intruder >= 0);
+    assert(connect(intruder, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    const char *hello = "FRICU-REPLICATE 0 nope\n";
+    assert(write(intruder, hello, strlen(hello)) == (ssize_t)strlen(hello));
+    char byte = 0;
+    assert(read(intruder, &byte, 1) == 0);
+    close(intruder);
+
+    assert(replication_follower_start("replica.db") == 0);
+    assert(wait_for_replica_version("repl::profile", v1));
+
+    /* Then the stream: a list append, a batch and a PUT, each at the primary's version. */
+    const char *elements = "[{\"id\":\"a\"},{\"id\":\"b\"}]";
+    uint64_t v2 = replicated_write(&completions, WRITE_OP_APPEND, "repl::activities", elements, strlen(elements));
+    char *batch = NULL;
+    size_t batch_len = 0;
+    size_t batch_cap = 0;
+    kv_batch_entry_t entry = {WRITE_OP_PUT, WRITE_IF_MATCH_NONE, "app_settings", 12, "{}", 2};
+    assert(kv_batch_append(&batch, &batch_len, &batch_cap, &entry) == 0);
+    entry.key = "profile";
+    entry.key_len = 7;
+    entry.value = "{\"n\":2}";
+    entry.value_len = 7;
+    assert(kv_batch_append(&batch, &batch_len, &batch_cap, &entry) == 0);
+    uint64_t v3 = replicated_write(&completions, WRITE_OP_BATCH, "repl::", batch, batch_len);
+    free(batch);
+    assert(wait_for_replica_version("repl::profile", v3));
+    assert(row_version("replica.db", "repl::app_settings") == v3);
+    assert(row_version("replica.db", "repl::activities") == v2);
+    assert(count_list_items("replica.db", "repl::activities") == 2);
+
+    /* A ride's chunks come with its head in the snapshot and as records after it. */
+    assert(ride_chunk_build("{\"t\":2}\n{\"t\":3}\n", 16, 0, &chunk, &chunk_len, &chunk_error) == 0);
+    uint64_t v4 = replicated_write(&completions, WRITE_OP_RIDE_CHUNK, "repl::stream:r", chunk, chunk_len);
+    free(chunk);
+    assert(wait_for_replica_version("repl::stream:r", v4));
+    sqlite3 *replica = NULL;
+    assert(sqlite3_open("replica.db", &replica) == SQLITE_OK);
+    sqlite3_stmt *stmt = NULL;
+    assert(sqlite3_prepare_v2(replica, "SELECT COUNT(*), SUM(samples), MAX(t_last) FROM ride_chunks WHERE stream_key='repl::stream:r'", -1, &stmt, NULL) == SQLITE_OK);
+    assert(sqlite3_step(stmt) == SQLITE_ROW);
+    assert(sqlite3_column_int(stmt, 0) == 2 && sqlite3_column_int(stmt, 1) == 3 && sqlite3_column_int(stmt, 2) == 3);
+    sqlite3_finalize(stmt);
+    sqlite3_close(replica);
+
+    replication_stats_t stats;
+    for (int i = 0; i < 500; i++) {
+        replication_stats_snapshot(&stats);
+        if (stats.applied_records == 3 && stats.position == stats.primary_position) break;
+        usleep(10 * 1000);
+    }
+    assert(stats.role == REPLICATION_ROLE_FOLLOWER);
+    assert(stats.connected == 1);
+    assert(stats.snapshots == 1);
+    assert(stats.applied_records == 3);
+    assert(stats.position == stats.primary_position);
+    assert(stats.lag_seconds == 0.0);
+    size_t metrics_len = 0;
+    char *metrics = metrics_render(&metrics_len);
+    assert(metrics != NULL);
+    assert(strstr(metrics, "fricu_replica_lag_seconds 0.000000\n") != NULL);
+    assert(strstr(metrics, "fricu_replica_snapshots_total 1\n") != NULL);
+    free(metrics);
+
+    /* A follower reads, but writes go to the primary: 503 with nowhere to send them, else 307. */
+    conn_t conn = {0};
+    conn.cap = REQ_BUF_SIZE;
+    conn.buf = (char *)malloc(conn.cap);
+    assert(conn.buf != NULL);
+    char resp[2048];
+    const char *put = "PUT /v1/data/profile HTTP/1.1\r\nX-Account-Id: repl\r\nContent-Length: 2\r\n\r\n{}";
+    roundtrip_request(&db, &conn, put, resp, sizeof(resp));
+    assert(strstr(resp, "503 Service Unavailable") != NULL);
+    assert(strstr(resp, "read-only replica") != NULL);
+    replication_stop();
+    snprintf(config.primary_url, sizeof(config.primary_url), "http://primary:8080");
+    replication_configure(&config);
+    roundtrip_request(&db, &conn, put, resp, sizeof(resp));
+    assert(strstr(resp, "307 Temporary Redirect") != NULL);
+    assert(strstr(resp, "Location: http://primary:8080/v1/data/profile\r\n") != NULL);
+    assert(strstr(resp, "Connection: close\r\n") != NULL);
+    roundtrip_request(&db, &conn, "GET /v1/data/profile HTTP/1.1\r\nX-Account-Id: repl\r\n\r\n", resp, sizeof(resp));
+    assert(strstr(resp, "200 OK") != NULL);
+    assert(strstr(resp, "{\"n\":2}") != NULL);
+    memset(&config, 0, sizeof(config));
+    replication_configure(&config);
+
+    free(conn.buf);
+    write_completion_queue_destroy(&completions);
+    worker_db_close(&db);
+    assert(fchdir(old_cwd) == 0);
+    close(old_cwd);
+    char cleanup_cmd[512] = {0};
+    assert(snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf '%s' >/dev/null 2>&1", tmpdir) > 0);
+    assert(system(cleanup_cmd) == 0);
+}
+
+typedef struct {
+    int applied;
+    uint64_t last_seq;
+    int last_op;
+    int64_t last_if_match;
+    char last_key[256];
+    char last_payload[64];
+} journal_replay_capture_t;
+
+static int capture_journal_record(
+    void *arg,
+    uint64_t seq,
+    const char *storage_key,
+    const char *log_id,
+    int op,
+    int64_t if_match,
+    const char *payload,
+    size_t payload_len) {
+    (void)log_id;
+    journal_replay_capture_t *capture = (journal_replay_capture_t *)arg;
+    capture->applied++;
+    capture->last_seq = seq;
+    capture->last_op = op;
+    capture->last_if_match = if_match;
+    snprintf(capture->last_key, sizeof(capture->last_key), "%s", storage_key);
+    snprintf(capture->last_payload, sizeof(capture->last_payload), "%.*s", (int)payload_len, payload);
+    return 0;
+}
+
+static void test_journal_checkpoint_recycles_segments(void) {
+    char dir_template[] = "/tmp/fricu-test-journal-XXXXXX";
+    char *tmpdir = mkdtemp(dir_template);
+    assert(tmpdir != NULL);
+
+    int old_cwd = open(".", O_RDONLY);
+    assert(old_cwd >= 0);
+    assert(chdir(tmpdir) == 0);
+
+    journal_config_t config = {.segment_bytes = 4096};
+    journal_configure(&config);
+    journal_reserve_seq(1);
+    assert(journal_open() == 0);
+
+    char payload[1500];
+    memset(payload, 'x', sizeof(payload));
+    payload[0] = '"';
+    payload[sizeof(payload) - 1] = '"';
+    journal_entry_t *entries[4] = {0};
+    for (int i = 0; i < 4; i++) {
+        assert(journal_append("tester::activities", "lid", WRITE_OP_PUT, WRITE_IF_MATCH_NONE, payload, sizeof(payload), &entries[i]) == 0);
+        assert(journal_entry_seq(entries[i]) == (uint64_t)i + 1);
+    }
+    assert(count_journal_segments() == 2);
+
+    /* Retiring out of order must not advance the checkpoint past seq 1. */
+    journal_retire(entries[1]);
+    journal_checkpoint();
+    journal_stats_t stats;
+    journal_stats_snapshot(&stats);
+    assert(stats.checkpoint_seq == 0);
+    assert(stats.segments == 2);
+
+    journal_retire(entries[0]);
+    journal_checkpoint();
+    journal_stats_snapshot(&stats);
+    assert(stats.checkpoint_seq == 2);
+    assert(stats.segments == 1);
+    assert(count_journal_segments() == 1);
+
+    journal_entry_t *last = NULL;
+    assert(journal_append("tester::activities", "lid-last", WRITE_OP_APPEND, 3, "[{\"v\":1}]", 9, &last) == 0);
+    journal_close();
+
+    journal_replay_capture_t capture = {0};
+    journal_replay_stats_t replay;
+    assert(journal_replay(capture_journal_record, NULL, &capture, &replay) == 0);
+    /* seq 3 is overwritten by the PUT at seq 4. */
+    assert(capture.applied == 2);
+    assert(replay.skipped == 0);
+    assert(replay.superseded == 1);
+    assert(strcmp(capture.last_key, "tester::activities") == 0);
+    assert(strcmp(capture.last_payload, "[{\"v\":1}]") == 0);
+    assert(capture.last_seq == 5);
+    assert(capture.last_op == WRITE_OP_APPEND);
+    assert(capture.last_if_match == 3);
+    assert(count_journal_segments() == 0);
+
+    config.segment_bytes = DEFAULT_JOURNAL_SEGMENT_BYTES;
+    journal_configure(&config);
+
+    assert(fchdir(old_cwd) == 0);
+    close(old_cwd);
+    char cleanup_cmd[512] = {0};
+    assert(snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf '%s' >/dev/null 2>&1", tmpdir) > 0);
+    assert(system(cleanup_cmd) == 0);
+}
+
+static void test_keep_alive_pipelined_requests(void) {
+    char dir_template[] = "/tmp/fricu-test-keepalive-XXXXXX";
+    char *tmpdir = mkdtemp(dir_template);
+    assert(tmpdir != NULL);
+
+    int old_cwd = open(".", O_RDONLY);
+    assert(old_cwd >= 0);
+    assert(chdir(tmpdir) == 0);
+
+    assert(init_db("state.db") == 0);
+    worker_db_t db;
+    assert(worker_db_open(&db, "state.db") == 0);
+
+    int fds[2] = {-1, -1};
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+    const char *first =
+        "PUT /v1/data/profile HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "X-Account-Id: tester\r\n"
+        "Content-Length: 14\r\n\r\n"
+        "{\"name\":\"Ana\"}";
+    const char *second =
+        "GET /v1/data/profile HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "X-Account-Id: tester\r\n"
+        "Connection: close\r\n\r\n";
+    const char *partial = "GET /health HTTP/1.1\r\n";
+    conn_t conn = {0};
+    conn.cap = REQ_BUF_SIZE;
+    conn.buf = (char *)malloc(conn.cap);
+    assert(conn.buf != NULL);
+    conn.len = strlen(first) + strlen(second) + strlen(partial);
+    snprintf(conn.buf, conn.cap, "%s%s%s", first, second, partial);
+
+    assert(try_process_client(fds[0], &db, &conn) == 1);
+    assert(conn.keep_alive == 1);
+    assert(conn.requests_served == 1);
+    assert(conn.len == strlen(second) + strlen(partial));
+    assert(memcmp(conn.buf, second, strlen(second)) == 0);
+
+    char resp[1024] = {0};
+    ssize_t n = read(fds[1], resp, sizeof(resp) - 1);
+    assert(n > 0);
+    assert(strstr(resp, "204 No Content") != NULL);
+    assert(strstr(resp, "Connection: keep-alive") != NULL);
+
+    assert(try_process_client(fds[0], &db, &conn) == 1);
+    assert(conn.keep_alive == 0);
+    assert(conn.len == strlen(partial));
+    assert(try_process_client(fds[0], &db, &conn) == 0);
+
+    memset(resp, 0, sizeof(resp));
+    n = read(fds[1], resp, sizeof(resp) - 1);
+    assert(n > 0);
+    assert(strstr(resp, "200 OK") != NULL);
+    assert(strstr(resp, "Connection: close") != NULL);
+    assert(strstr(resp, "{\"name\":\"Ana\"}") != NULL);
+
+    conn.len = 0;
+    conn.requests_served = 0;
+    conn.max_requests = 1;
+    const char *limited = "GET /health HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    conn.len = strlen(limited);
+    memcpy(conn.buf, limited, conn.len);
+    assert(try_process_client(fds[0], &db, &conn) == 1);
+    assert(conn.keep_alive == 0);
+    memset(resp, 0, sizeof(resp));
+    n = read(fds[1], resp, sizeof(resp) - 1);
+    assert(n > 0);
+    assert(strstr(resp, "Connection: close") != NULL);
+
+    /* A chunked body is refused and the connection closed, so its chunks are never read as the next request. */
+    conn.requests_served = 0;
+    conn.max_requests = 0;
+    const char *smuggled =
+        "PUT /v1/data/profile HTTP/1.1\r\nX-Account-Id: tester\r\nTransfer-Encoding: chunked\r\n\r\n"
+        "2\r\n{}\r\n0\r\n\r\n"
+        "GET /health HTTP/1.1\r\n\r\n";
+    conn.len = strlen(smuggled);
+    memcpy(conn.buf, smuggled, conn.len);
+    http_parse_reset(&conn.parse);
+    assert(try_process_client(fds[0], &db, &conn) == 1);
+    assert(conn.keep_alive == 0);
+    assert(conn.close_after_flush == 1);
+    memset(resp, 0, sizeof(resp));
+    n = read(fds[1], resp, sizeof(resp) - 1);
+    assert(n > 0);
+    assert(strstr(resp, "501 Not Implemented") != NULL);
+    assert(strstr(resp, "Connection: close") != NULL);
+    assert(strstr(resp, "\"status\":\"ok\"") == NULL);
+    conn.close_after_flush = 0;
+
+    const char *conflicting =
+        "PUT /v1/data/profile HTTP/1.1\r\nX-Account-Id: tester\r\nContent-Length: 7\r\nContent-Length: 27\r\n\r\n"
+        "{\"a\":1}GET /health HTTP/1.1\r\n\r\n";
+    conn.len = strlen(conflicting);
+    memcpy(conn.buf, conflicting, conn.len);
+    http_parse_reset(&conn.parse);
+    assert(try_process_client(fds[0], &db, &conn) == 1);
+    assert(conn.keep_alive == 0);
+    assert(conn.close_after_flush == 1);
+    memset(resp, 0, sizeof(resp));
+    n = read(fds[1], resp, sizeof(resp) - 1);
+    assert(n > 0);
+    assert(strstr(resp, "400 Bad Request") != NULL);
+    assert(strstr(resp, "Connection: close") != NULL);
+    assert(strstr(resp, "\"status\":\"ok\"") == NULL);
+    conn.close_after_flush = 0;
+
+    free(conn.buf);
+    close(fds[0]);
+    close(fds[1]);
+    worker_db_close(&db);
+    assert(fchdir(old_cwd) == 0);
+    close(old_cwd);
+    char cleanup_cmd[512] = {0};
+    assert(snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf '%s' >/dev/null 2>&1", tmpdir) > 0);
+    assert(system(cleanup_cmd) == 0);
+}
+
+static void test_large_response_is_queued_until_writable(void) {
+    char dir_template[] = "/tmp/fricu-test-outq-XXXXXX";
+    char *tmpdir = mkdtemp(dir_template);
+    assert(tmpdir != NULL);
+
+    int old_cwd = open(".", O_RDONLY);
+    assert(old_cwd >= 0);
+    assert(chdir(tmpdir) == 0);
+
+    assert(init_db("state.db") == 0);
+    worker_db_t db;
+    assert(worker_db_open(&db, "state.db") == 0);
+
+    size_t value_len = 2 * 1024 * 1024;
+    char *value = (char *)malloc(value_len + 1);
+    assert(value != NULL);
+    value[0] = '[';
+    for (size_t i = 1; i + 1 < value_len; i++) value[i] = (i % 2) ? '1' : ',';
+    value[value_len - 2] = '1';
+    value[value_len - 1] = ']';
+    value[value_len] = '\0';
+
+    sqlite3 *sqlite = NULL;
+    assert(sqlite3_open_v2("state.db", &sqlite, SQLITE_OPEN_READWRITE, NULL) == SQLITE_OK);
+    sqlite3_stmt *stmt = NULL;
+    assert(sqlite3_prepare_v2(sqlite, "INSERT INTO kv_store (data_key, data_value, updated_at) VALUES ('tester::activities', ?1, 0)", -1, &stmt, NULL) == SQLITE_OK);
+    assert(sqlite3_bind_text(stmt, 1, value, (int)value_len, SQLITE_STATIC) == SQLITE_OK);
+    assert(sqlite3_step(stmt) == SQLITE_DONE);
+    sqlite3_finalize(stmt);
+    sqlite3_close(sqlite);
+
+    int fds[2] = {-1, -1};
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    assert(set_nonblocking(fds[0]) == 0);
+
+    const char *req =
+        "GET /v1/data/activities HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "X-Account-Id: tester\r\n\r\n";
+    conn_t conn = {0};
+    conn.cap = REQ_BUF_SIZE;
+    conn.buf = (char *)malloc(conn.cap);
+    assert(conn.buf != NULL);
+    conn.len = strlen(req);
+    memcpy(conn.buf, req, conn.len);
+    assert(try_process_client(fds[0], &db, &conn) == 1);
+    assert(conn.keep_alive == 1);
+    assert(conn.out_head != NULL);
+    assert(conn.out_bytes > 0);
+
+    size_t total = 0;
+    size_t cap = value_len + 1024;
+    char *resp = (char *)malloc(cap);
+    assert(resp != NULL);
+    int pending = 1;
+    while (1) {
+        ssize_t n = read(fds[1], resp + total, cap - total);
+        assert(n > 0);
+        total += (size_t)n;
+        if (pending) pending = conn_output_flush(fds[0], &conn);
+        assert(pending >= 0);
+        if (!pending && conn.out_bytes == 0) {
+            char *body = strstr(resp, "\r\n\r\n");
+            if (body && (size_t)(resp + total - (body + 4)) == value_len) break;
+        }
+    }
+    assert(conn.out_head == NULL);
+    char *body = strstr(resp, "\r\n\r\n");
+    assert(body != NULL);
+    assert(memcmp(body + 4, value, value_len) == 0);
+
+    free(resp);
+    free(value);
+    free(conn.buf);
+    close(fds[0]);
+    close(fds[1]);
+    worker_db_close(&db);
+    assert(fchdir(old_cwd) == 0);
+    close(old_cwd);
+    char cleanup_cmd[512] = {0};
+    assert(snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf '%s' >/dev/null 2>&1", tmpdir) > 0);
+    assert(system(cleanup_cmd) == 0);
+}
+
+static void test_zerocopy_output_holds_buffers_until_completion(void) {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    assert(listener >= 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    assert(listen(listener, 1) == 0);
+    socklen_t addr_len = sizeof(addr);
+    assert(getsockname(listener, (struct sockaddr *)&addr, &addr_len) == 0);
+
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    assert(client >= 0);
+    assert(connect(client, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    int server = accept(listener, NULL, NULL);
+    assert(server >= 0);
+    assert(set_nonblocking(server) == 0);
+
+    conn_t conn = {0};
+    int zerocopy = conn_output_enable_zerocopy(server, &conn, 64 * 1024) == 0;
+
+    const size_t total = 1024 * 1024;
+    shared_buf_t *body = shared_buf_new(total);
+    assert(body != NULL);
+    for (size_t i = 0; i < total; i++) body->data[i] = (char)('a' + i % 26);
+    assert(conn_output_append(&conn, shared_buf_copy("HEAD", 4), 0, 4) == 0);
+    assert(conn_output_append(&conn, shared_buf_retain(body), 0, total) == 0);
+
+    char *received = (char *)malloc(total + 4);
+    assert(received != NULL);
+    size_t got = 0;
+    int rc = 1;
+    while (rc == 1 || got < total + 4) {
+        rc = conn_output_flush(server, &conn);
+        assert(rc >= 0);
+        ssize_t n = recv(client, received + got, total + 4 - got, rc == 0 ? 0 : MSG_DONTWAIT);
+        if (n > 0) got += (size_t)n;
+        if (got == total + 4 && rc == 0) break;
+    }
+    assert(memcmp(received, "HEAD", 4) == 0);
+    assert(memcmp(received + 4, body->data, total) == 0);
+
+    if (zerocopy) {
+        for (int i = 0; i < 200 && conn_output_zerocopy_pending(&conn); i++) {
+            assert(conn_output_reap_zerocopy(server, &conn) == 0);
+            if (conn_output_zerocopy_pending(&conn)) usleep(5000);
+        }
+    }
+    assert(!conn_output_zerocopy_pending(&conn));
+    assert(atomic_load(&body->refcount) == 1);
+
+    shared_buf_release(body);
+    free(received);
+    conn_output_reset(&conn);
+    close(client);
+    close(server);
+    close(listener);
+}
+
+static void test_io_ring_recv_uses_provided_buffers(void) {
+    io_ring_t *ring = io_ring_create(8, 2, 64);
+    /* Kernels without io_uring (or with it disabled) run the epoll loop instead. */
+    if (!ring) return;
+
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    assert(send(fds[1], "hello", 5, 0) == 5);
+    assert(io_ring_prep_recv(ring, fds[0], 7) == 0);
+    assert(io_ring_wait(ring, 1000) == 0);
+
+    io_ring_cqe_t cqe;
+    assert(io_ring_next(ring, &cqe) == 1);
+    assert(cqe.user_data == 7);
+    assert(cqe.res == 5);
+    assert(cqe.buf != NULL && memcmp(cqe.buf, "hello", 5) == 0);
+    io_ring_recycle(ring, cqe.buf_id);
+    assert(io_ring_next(ring, &cqe) == 0);
+
+    /* A cancelled recv still completes, with -ECANCELED and no buffer. */
+    assert(io_ring_prep_recv(ring, fds[0], 8) == 0);
+    assert(io_ring_prep_cancel(ring, 8, 9) == 0);
+    int seen = 0;
+    for (int i = 0; i < 10 && seen != 3; i++) {
+        assert(io_ring_wait(ring, 1000) == 0);
+        while (io_ring_next(ring, &cqe)) {
+            if (cqe.user_data == 8) {
+                assert(cqe.res == -ECANCELED && cqe.buf == NULL);
+                seen |= 1;
+            } else {
+                assert(cqe.user_data == 9);
+                seen |= 2;
+            }
+        }
+    }
+    assert(seen == 3);
+
+    io_ring_destroy(ring);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void test_conn_table_rejects_stale_handles(void) {
+    conn_table_t table;
+    conn_table_init(&table);
+    conn_t first = {0};
+    conn_t second = {0};
+    assert(conn_table_insert(&table, &first) == 0);
+    uint64_t old_handle = first.handle;
+    assert(conn_table_lookup(&table, old_handle) == &first);
+    conn_table_remove(&table, &first);
+    assert(conn_table_lookup(&table, old_handle) == NULL);
+
+    /* The freed slot is reused at once, under the next generation. */
+    assert(conn_table_insert(&table, &second) == 0);
+    assert((uint32_t)second.handle == (uint32_t)old_handle);
+    assert(second.handle >> 32 == (old_handle >> 32) + 1);
+    assert(conn_table_lookup(&table, old_handle) == NULL);
+    assert(conn_table_lookup(&table, second.handle) == &second);
+    assert(conn_table_lookup(&table, (uint64_t)table.slot_count) == NULL);
+    conn_table_destroy(&table);
+}
+
+static void test_conn_pool_recycles_and_caps_buffers(void) {
+    conn_pool_t pool;
+    conn_pool_init(&pool, 0);
+    conn_t *a = conn_pool_get(&pool);
+    conn_t *b = conn_pool_get(&pool);
+    assert(a != NULL && b != NULL && a != b);
+    assert(a->cap == CONN_INIT_BUF && pool.buffered_bytes == 2 * (CONN_INIT_BUF + 1));
+    char *a_buf = a->buf;
+    conn_pool_put(&pool, a);
+    conn_t *c = conn_pool_get(&pool);
+    assert(c == a && c->buf == a_buf && c->len == 0);
+
+    memcpy(c->buf, "GET / HTTP/1.1", 14);
+    c->len = 14;
+    assert(conn_pool_grow(&pool, c, 20000) == 0);
+    assert(c->cap == 64 * 1024 && memcmp(c->buf, "GET / HTTP/1.1", 14) == 0);
+    assert(conn_pool_grow(&pool, c, 3 * 1024 * 1024 + 7) == 0);
+    assert(c->cap == 3 * 1024 * 1024 + 7 && memcmp(c->buf, "GET / HTTP/1.1", 14) == 0);
+    c->buf[c->cap] = '\0';
+    assert(conn_pool_grow(&pool, c, 2 * REQ_BUF_SIZE) == 0);
+    assert(c->cap == REQ_BUF_SIZE && memcmp(c->buf, "GET / HTTP/1.1", 14) == 0);
+    conn_pool_shrink(&pool, c);
+    assert(c->cap == CONN_INIT_BUF && memcmp(c->buf, "GET / HTTP/1.1", 14) == 0);
+    conn_pool_put(&pool, b);
+    conn_pool_put(&pool, c);
+    assert(pool.buffered_bytes == 0 && pool.live_conns == 0);
+    conn_pool_destroy(&pool);
+
+    conn_pool_init(&pool, (CONN_INIT_BUF + 1) + (64 * 1024 + 1));
+    a = conn_pool_get(&pool);
+    assert(a != NULL);
+    assert(conn_pool_grow(&pool, a, CONN_INIT_BUF + 1) == 0);
+    b = conn_pool_get(&pool);
+    assert(b != NULL);
+    assert(conn_pool_get(&pool) == NULL);
+    assert(conn_pool_grow(&pool, b, CONN_INIT_BUF + 1) == CONN_POOL_OVER_BUDGET);
+    assert(b->cap == CONN_INIT_BUF && pool.over_budget == 2);
+    conn_pool_put(&pool, a);
+    assert(conn_pool_grow(&pool, b, CONN_INIT_BUF + 1) == 0);
+    conn_pool_put(&pool, b);
+    conn_pool_destroy(&pool);
+}
+
+static void *log_ring_lines(void *arg) {
+    int id = *(int *)arg;
+    for (int i = 0; i < 500; i++) log_info("ring test thread=%d line=%d", id, i);
+    return NULL;
+}
+
+static size_t count_occurrences(const char *haystack, const char *needle) {
+    size_t count = 0;
+    for (const char *p = strstr(haystack, needle); p; p = strstr(p + 1, needle)) count++;
+    return count;
+}
+
+static void test_async_logger_drains_rings(void) {
+    char path[] = "/tmp/fricu-test-log-XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    int saved_stderr = dup(STDERR_FILENO);
+    assert(saved_stderr >= 0);
+    assert(dup2(fd, STDERR_FILENO) >= 0);
+
+    logger_config_t config = {LOG_LEVEL_INFO, 1};
+    logger_configure(&config);
+    assert(logger_start() == 0);
+    pthread_t threads[4];
+    int ids[4];
+    for (int i = 0; i < 4; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, log_ring_lines, &ids[i]) == 0);
+    }
+    for (int i = 0; i < 4; i++) pthread_join(threads[i], NULL);
+    logger_stop();
+
+    config.level = LOG_LEVEL_WARN;
+    logger_configure(&config);
+    log_info("filtered by level");
+    log_warn("direct warn");
+    config.level = LOG_LEVEL_INFO;
+    config.info_sample_every = 10;
+    logger_configure(&config);
+    for (int i = 0; i < 100; i++) log_info("sampled line");
+    config.info_sample_every = 1;
+    logger_configure(&config);
+
+    assert(dup2(saved_stderr, STDERR_FILENO) >= 0);
+    close(saved_stderr);
+    off_t size = lseek(fd, 0, SEEK_END);
+    assert(size > 0);
+    char *text = (char *)malloc((size_t)size + 1);
+    assert(text != NULL);
+    assert(pread(fd, text, (size_t)size, 0) == size);
+    text[size] = '\0';
+    close(fd);
+    unlink(path);
+
+    assert(logger_dropped_lines() == 0);
+    assert(count_occurrences(text, "] [INFO] ring test thread=") == 2000);
+    assert(strstr(text, "ring test thread=3 line=499\n") != NULL);
+    assert(strstr(text, "filtered by level") == NULL);
+    assert(strstr(text, "[WARN] direct warn\n") != NULL);
+    assert(count_occurrences(text, "sampled line") == 10);
+    free(text);
+}
+
+/* Returns the sample value of the exposition line that starts with series, or -1. */
+static double metrics_sample(const char *text, const char *series) {
+    size_t len = strlen(series);
+    for (const char *line = text; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+        if (strncmp(line, series, len) == 0 && line[len] == ' ') return strtod(line + len + 1, NULL);
+    }
+    return -1;
+}
+
+static void *record_slow_send(void *arg) {
+    (void)arg;
+    metrics_observe_stage(METRICS_STAGE_SEND, metrics_now_ns() - 3000000);
+    return NULL;
+}
+
+static void test_metrics_endpoint(void) {
+    worker_db_t db;
+    memset(&db, 0, sizeof(db));
+    conn_t conn = {0};
+    conn.cap = REQ_BUF_SIZE;
+    conn.buf = (char *)malloc(conn.cap);
+    assert(conn.buf != NULL);
+    size_t resp_cap = 512 * 1024;
+    char *resp = (char *)malloc(resp_cap);
+    assert(resp != NULL);
+
+    size_t len = 0;
+    char *before = metrics_render(&len);
+    assert(before != NULL && len == strlen(before));
+    double health_before = metrics_sample(before, "fricu_http_requests_total{route=\"health\",status=\"200\"}");
+    double sends_before = metrics_sample(before, "fricu_stage_seconds_count{stage=\"send\"}");
+    if (health_before < 0) health_before = 0;
+
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, record_slow_send, NULL) == 0);
+    pthread_join(thread, NULL);
+    roundtrip_request(&db, &conn, "GET /health HTTP/1.1\r\n\r\n", resp, resp_cap);
+    roundtrip_request(&db, &conn, "GET /health HTTP/1.1\r\n\r\n", resp, resp_cap);
+    roundtrip_request(&db, &conn, "GET /metrics HTTP/1.1\r\n\r\n", resp, resp_cap);
+    assert(strncmp(resp, "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n", 58) == 0);
+    char *text = strstr(resp, "\r\n\r\n");
+    assert(text != NULL);
+    text += 4;
+
+    assert(metrics_sample(text, "fricu_http_requests_total{route=\"health\",status=\"200\"}") == health_before + 2);
+    /* The slow send from the other thread plus one per response queued above. */
+    assert(metrics_sample(text, "fricu_stage_seconds_count{stage=\"send\"}") >= sends_before + 3);
+    assert(metrics_sample(text, "fricu_stage_seconds_sum{stage=\"send\"}") >= 0.003);
+    assert(metrics_sample(text, "fricu_stage_seconds_bucket{stage=\"send\",le=\"0.000255\"}") <
+           metrics_sample(text, "fricu_stage_seconds_bucket{stage=\"send\",le=\"+Inf\"}"));
+    assert(metrics_sample(text, "fricu_stage_seconds_count{stage=\"parse\"}") >= 3);
+    assert(metrics_sample(text, "fricu_write_batch_jobs_bucket{le=\"+Inf\"}") >= 0);
+    assert(strstr(text, "# TYPE fricu_open_connections gauge\n") != NULL);
+
+    free(before);
+    free(resp);
+    free(conn.buf);
+}
+
+typedef struct {
+    int listen_fd;
+    char db_path[PATH_MAX];
+    worker_config_t config;
+} slow_reader_server_t;
+
+static void *slow_reader_worker_main(void *arg) {
+    slow_reader_server_t *server = (slow_reader_server_t *)arg;
+    run_worker_loop(server->listen_fd, server->db_path, &server->config);
+    return NULL;
+}
+
+/* Reads one GET with a small receive window, pausing pause_ms after every pause_every bytes. */
+static size_t slow_read_response(const struct sockaddr_in *addr, char *resp, size_t cap, size_t body_len, size_t pause_every, int pause_ms) {
+    assert(resp != NULL);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    assert(fd >= 0);
+    int rcvbuf = 4096;
+    assert(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == 0);
+    assert(connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == 0);
+    const char *req =
+        "GET /v1/data/activities HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "X-Account-Id: tester\r\n\r\n";
+    assert(write(fd, req, strlen(req)) == (ssize_t)strlen(req));
+
+    size_t total = 0;
+    size_t since_pause = 0;
+    while (total < cap) {
+        ssize_t n = read(fd, resp + total, cap - total < 4096 ? cap - total : 4096);
+        if (n <= 0) break;
+        total += (size_t)n;
+        since_pause += (size_t)n;
+        char *body = memmem(resp, total, "\r\n\r\n", 4);
+        if (body && (size_t)(resp + total - (body + 4)) == body_len) break;
+        if (since_pause >= pause_every) {
+            usleep((useconds_t)pause_ms * 1000);
+            since_pause = 0;
+        }
+    }
+    close(fd);
+    return total;
+}
+
+/* Runs last: the worker loop it starts never returns. */
+static void test_idle_sweep_spares_slow_readers(void) {
+    char dir_template[] = "/tmp/fricu-test-slow-XXXXXX";
+    char *tmpdir = mkdtemp(dir_template);
+    assert(tmpdir != NULL);
+
+    static slow_reader_server_t server;
+    memset(&server, 0, sizeof(server));
+    assert(snprintf(server.db_path, sizeof(server.db_path), "%s/state.db", tmpdir) > 0);
+    assert(init_db(server.db_path) == 0);
+
+    size_t value_len = 4 * 1024 * 1024;
+    char *value = (char *)malloc(value_len + 1);
+    assert(value != NULL);
+    value[0] = '[';
+    for (size_t i = 1; i + 1 < value_len; i++) value[i] = (i % 2) ? '1' : ',';
+    value[value_len - 2] = '1';
+    value[value_len - 1] = ']';
+    value[value_len] = '\0';
+
+    sqlite3 *sqlite = NULL;
+    assert(sqlite3_open_v2(server.db_path, &sqlite, SQLITE_OPEN_READWRITE, NULL) == SQLITE_OK);
+    sqlite3_stmt *stmt = NULL;
+    assert(sqlite3_prepare_v2(sqlite, "INSERT INTO kv_store (data_key, data_value, updated_at) VALUES ('tester::activities', ?1, 0)", -1, &stmt, NULL) == SQLITE_OK);
+    assert(sqlite3_bind_text(stmt, 1, value, (int)value_len, SQLITE_STATIC) == SQLITE_OK);
+    assert(sqlite3_step(stmt) == SQLITE_DONE);
+    sqlite3_finalize(stmt);
+    sqlite3_close(sqlite);
+
+    server.listen_fd = open_listen_socket("127.0.0.1", 0, 16, 0);
+    assert(server.listen_fd >= 0);
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    assert(getsockname(server.listen_fd, (struct sockaddr *)&addr, &addr_len) == 0);
+    server.config.keepalive_idle_ms = 100;
+    server.config.keepalive_max_requests = 100;
+    server.config.send_timeout_ms = 800;
+    server.config.backend = WORKER_BACKEND_EPOLL;
+    pthread_t thread;
+    assert(pthread_create(&thread, NULL, slow_reader_worker_main, &server) == 0);
+    assert(pthread_detach(thread) == 0);
+
+    size_t cap = value_len + 4096;
+    char *resp = (char *)malloc(cap);
+    assert(resp != NULL);
+
+    /* Pauses longer than the keep-alive idle time must not cut the body short. */
+    size_t total = slow_read_response(&addr, resp, cap, value_len, 512 * 1024, 300);
+    char *body = memmem(resp, total, "\r\n\r\n", 4);
+    assert(body != NULL);
+    assert(strncmp(resp, "HTTP/1.1 200 OK\r\n", 17) == 0);
+    assert((size_t)(resp + total - (body + 4)) == value_len);
+    assert(memcmp(body + 4, value, value_len) == 0);
+
+    /* A reader that stops for longer than the send timeout is dropped mid-body. */
+    total = slow_read_response(&addr, resp, cap, value_len, 64 * 1024, 2000);
+    body = memmem(resp, total, "\r\n\r\n", 4);
+    assert(body != NULL);
+    assert((size_t)(resp + total - (body + 4)) < value_len);
+
+    /* Zerocopy sends stay in flight until their completions are reaped; that is progress too. */
+    static slow_reader_server_t zerocopy_server;
+    zerocopy_server = server;
+    zerocopy_server.config.zerocopy_min_bytes = DEFAULT_ZEROCOPY_MIN_BYTES;
+    zerocopy_server.listen_fd = open_listen_socket("127.0.0.1", 0, 16, 0);
+    assert(zerocopy_server.listen_fd >= 0);
+    addr_len = sizeof(addr);
+    assert(getsockname(zerocopy_server.listen_fd, (struct sockaddr *)&addr, &addr_len) == 0);
+    assert(pthread_create(&thread, NULL, slow_reader_worker_main, &zerocopy_server) == 0);
+    assert(pthread_detach(thread) == 0);
+    total = slow_read_response(&addr, resp, cap, value_len, 512 * 1024, 300);
+    body = memmem(resp, total, "\r\n\r\n", 4);
+    assert(body != NULL);
+    assert((size_t)(resp + total - (body + 4)) == value_len);
+    assert(memcmp(body + 4, value, value_len) == 0);
+
+    free(resp);
+    free(value);
+    char cleanup_cmd[512] = {0};
+    assert(snprintf(cleanup_cmd, sizeof(cleanup_cmd), "rm -rf '%s' >/dev/null 2>&1", tmpdir) > 0);
+    assert(system(cleanup_cmd) == 0);
+}
+
 int main(void) {
     test_valid_key();
     test_parse_bind_addr();
+    test_reuseport_listeners_and_affinity();
     test_read_content_length();
+    test_incremental_http_parser();
     test_socket_send_flags();
     test_configure_socket_after_accept();
+    test_conn_table_rejects_stale_handles();
+    test_conn_pool_recycles_and_caps_buffers();
+    test_async_logger_drains_rings();
     test_put_is_journaled_and_persisted();
+    test_write_completion_resumes_connection();
     test_missing_account_id_rejected();
+    test_admission_rejects_before_body();
     test_write_queue_diagnostics_endpoint();
+    test_sharded_writes_route_by_account();
+    test_value_cache_read_through_and_invalidation();
+    test_gzip_negotiation_and_encoded_writes();
+    test_batch_get_and_write();
+    test_change_feed_long_poll_and_stream();
+    test_replication_streams_to_follower();
+    test_etag_conditional_requests();
+    test_list_append_and_patch();
+    test_list_paged_reads();
+    test_ride_stream_ingest_and_range_read();
+    test_json_validate_matches_sqlite();
     test_replay_pending_write_on_restart();
-    test_put_lock_is_queued_in_pending_writes();
+    test_replay_keeps_writes_a_batch_depends_on();
+    test_put_lock_is_queued_in_journal();
+    test_queued_writes_commit_as_one_batch();
+    test_queued_put_supersedes_older_put();
+    test_journal_checkpoint_recycles_segments();
+    test_keep_alive_pipelined_requests();
+    test_large_response_is_queued_until_writable();
+    test_zerocopy_output_holds_buffers_until_completion();
+    test_io_ring_recv_uses_provided_buffers();
+    test_metrics_endpoint();
+    test_idle_sweep_spares_slow_readers();
     puts("unit tests passed");
     return 0;
 }
@@ -1,59 +1,248 @@
+#define _GNU_SOURCE
 #include "server.h"
 #include "server_internal.h"
+#include "logger.h"
 
+#include <arpa/inet.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
-const char *DATA_KEYS[] = {
-    "activities",
-    "activity_metric_insights",
-    "meal_plans",
-    "custom_foods",
-    "workouts",
-    "events",
-    "wellness_samples",
-    "profile",
-    "app_settings",
-    "lactate_history_records",
+/*
+ * Registry of the logical keys under /v1/data. Ids index this table; the
+ * exported_file_<name> family shares the last entry. Lookups go through a
+ * perfect hash over the key's length and three sampled bytes: when the
+ * process starts, data_key_registry_build tries seeds until every entry gets
+ * its own slot, so adding a key here needs no other change. The lookup then
+ * costs one hash, one slot load and one memcmp regardless of table size.
+ */
+#define OBJECT_KEY_MAX_BYTES (1024 * 1024)
+
+const data_key_t DATA_KEY_TABLE[DATA_KEY_ID_COUNT] = {
+    {DATA_KEY_ACTIVITIES, DATA_KEY_KIND_LIST, 1, "activities", 10, "[]", REQ_BUF_SIZE},
+    {DATA_KEY_ACTIVITY_METRIC_INSIGHTS, DATA_KEY_KIND_LIST, 1, "activity_metric_insights", 24, "[]", REQ_BUF_SIZE},
+    {DATA_KEY_MEAL_PLANS, DATA_KEY_KIND_LIST, 1, "meal_plans", 10, "[]", REQ_BUF_SIZE},
+    {DATA_KEY_CUSTOM_FOODS, DATA_KEY_KIND_LIST, 1, "custom_foods", 12, "[]", REQ_BUF_SIZE},
+    {DATA_KEY_WORKOUTS, DATA_KEY_KIND_LIST, 1, "workouts", 8, "[]", REQ_BUF_SIZE},
+    {DATA_KEY_EVENTS, DATA_KEY_KIND_LIST, 1, "events", 6, "[]", REQ_BUF_SIZE},
+    {DATA_KEY_WELLNESS_SAMPLES, DATA_KEY_KIND_LIST, 1, "wellness_samples", 16, "[]", REQ_BUF_SIZE},
+    {DATA_KEY_PROFILE, DATA_KEY_KIND_OBJECT, 1, "profile", 7, "{}", OBJECT_KEY_MAX_BYTES},
+    {DATA_KEY_APP_SETTINGS, DATA_KEY_KIND_OBJECT, 1, "app_settings", 12, "{}", OBJECT_KEY_MAX_BYTES},
+    {DATA_KEY_LACTATE_HISTORY_RECORDS, DATA_KEY_KIND_LIST, 1, "lactate_history_records", 23, "[]", REQ_BUF_SIZE},
+    /* Uploaded files are large and read back rarely, so they would only push hot values out of the cache. */
+    {DATA_KEY_EXPORTED_FILE, DATA_KEY_KIND_LIST, 0, "exported_file_", 14, "[]", REQ_BUF_SIZE},
 };
-const size_t DATA_KEYS_COUNT = sizeof(DATA_KEYS) / sizeof(DATA_KEYS[0]);
 
-bool is_valid_key(const char *key) {
-    if (!key || key[0] == '\0') return false;
-    const char *exported_prefix = "exported_file_";
-    size_t exported_prefix_len = strlen(exported_prefix);
-    if (strncmp(key, exported_prefix, exported_prefix_len) == 0 && key[exported_prefix_len] != '\0') {
-        return true;
+#define DATA_KEY_SLOTS 32
+#define DATA_KEY_SLOT_EMPTY 0xFF
+
+static uint8_t g_key_slots[DATA_KEY_SLOTS];
+static uint32_t g_key_seed;
+static int g_key_hash_ready;
+
+static uint32_t data_key_hash(const char *key, size_t len, uint32_t seed) {
+    uint32_t h = seed ^ (uint32_t)len * 0x9E3779B1u;
+    h = (h ^ (unsigned char)key[0]) * 0x85EBCA6Bu;
+    h = (h ^ (unsigned char)key[len / 2]) * 0xC2B2AE35u;
+    h = (h ^ (unsigned char)key[len - 1]) * 0x27D4EB2Fu;
+    return (h ^ (h >> 15)) & (DATA_KEY_SLOTS - 1);
+}
+
+__attribute__((constructor)) static void data_key_registry_build(void) {
+    for (uint32_t seed = 1; seed < (1u << 20); seed++) {
+        memset(g_key_slots, DATA_KEY_SLOT_EMPTY, sizeof(g_key_slots));
+        int collided = 0;
+        for (int id = 0; id < DATA_KEY_EXPORTED_FILE && !collided; id++) {
+            uint32_t slot = data_key_hash(DATA_KEY_TABLE[id].name, DATA_KEY_TABLE[id].name_len, seed);
+            if (g_key_slots[slot] != DATA_KEY_SLOT_EMPTY) collided = 1;
+            g_key_slots[slot] = (uint8_t)id;
+        }
+        if (!collided) {
+            g_key_seed = seed;
+            g_key_hash_ready = 1;
+            return;
+        }
     }
-    for (size_t i = 0; i < DATA_KEYS_COUNT; i++) {
-        if (strcmp(DATA_KEYS[i], key) == 0) return true;
+}
+
+const data_key_t *data_key_lookup(const char *key, size_t len) {
+    if (!key || len == 0) return NULL;
+    const data_key_t *exported = &DATA_KEY_TABLE[DATA_KEY_EXPORTED_FILE];
+    if (len > exported->name_len && memcmp(key, exported->name, exported->name_len) == 0) return exported;
+    if (!g_key_hash_ready) {
+        for (int id = 0; id < DATA_KEY_EXPORTED_FILE; id++) {
+            if (DATA_KEY_TABLE[id].name_len == len && memcmp(DATA_KEY_TABLE[id].name, key, len) == 0) return &DATA_KEY_TABLE[id];
+        }
+        return NULL;
     }
-    return false;
+    uint8_t id = g_key_slots[data_key_hash(key, len, g_key_seed)];
+    if (id == DATA_KEY_SLOT_EMPTY) return NULL;
+    const data_key_t *desc = &DATA_KEY_TABLE[id];
+    return desc->name_len == len && memcmp(desc->name, key, len) == 0 ? desc : NULL;
+}
+
+bool is_valid_key(const char *key) {
+    return key && data_key_lookup(key, strlen(key)) != NULL;
+}
+
+/* Bytes allowed in the account part of "<account>::<key>". */
+static const uint8_t ACCOUNT_CHARS[256] = {
+    ['-'] = 1, ['.'] = 1, ['_'] = 1,
+    ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1,
+    ['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1, ['G'] = 1, ['H'] = 1, ['I'] = 1, ['J'] = 1, ['K'] = 1, ['L'] = 1, ['M'] = 1,
+    ['N'] = 1, ['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1, ['S'] = 1, ['T'] = 1, ['U'] = 1, ['V'] = 1, ['W'] = 1, ['X'] = 1, ['Y'] = 1, ['Z'] = 1,
+    ['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1, ['h'] = 1, ['i'] = 1, ['j'] = 1, ['k'] = 1, ['l'] = 1, ['m'] = 1,
+    ['n'] = 1, ['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1, ['s'] = 1, ['t'] = 1, ['u'] = 1, ['v'] = 1, ['w'] = 1, ['x'] = 1, ['y'] = 1, ['z'] = 1,
+};
+
+const data_key_t *storage_key_lookup(const char *key) {
+    if (!key || key[0] == '\0') return NULL;
+    const char *p = key;
+    while (ACCOUNT_CHARS[(unsigned char)*p]) p++;
+    if (p != key && p[0] == ':' && p[1] == ':') {
+        const char *logical = p + 2;
+        const data_key_t *desc = data_key_lookup(logical, strlen(logical));
+        if (desc) return desc;
+    }
+    /* Keys written before accounts existed carry no prefix. */
+    return data_key_lookup(key, strlen(key));
 }
 
 bool is_valid_storage_key(const char *key) {
-    if (!key || key[0] == '\0') return false;
-    if (is_valid_key(key)) return true;
-
-    const char *sep = strstr(key, "::");
-    if (!sep || sep == key) return false;
-    const char *logical = sep + 2;
-    if (logical[0] == '\0') return false;
-
-    for (const char *p = key; p < sep; p++) {
-        unsigned char ch = (unsigned char)(*p);
-        if (!(isalnum(ch) || ch == '-' || ch == '_' || ch == '.')) {
-            return false;
+    return storage_key_lookup(key) != NULL;
+}
+
+/*
+ * FNV-1a over the account prefix of a storage key ("<account>::<key>"), so
+ * every key of one account lands on the same write shard. Keys without an
+ * account prefix hash as a whole.
+ */
+int storage_key_shard(const char *storage_key, int shard_count) {
+    if (!storage_key || shard_count <= 1) return 0;
+    const char *sep = strstr(storage_key, "::");
+    const char *end = sep ? sep : storage_key + strlen(storage_key);
+    uint32_t hash = 2166136261u;
+    for (const char *p = storage_key; p < end; p++) {
+        hash ^= (unsigned char)*p;
+        hash *= 16777619u;
+    }
+    return (int)(hash % (uint32_t)shard_count);
+}
+
+/* version is the row's current version, 0 when the row does not exist. */
+int write_precondition_holds(int64_t if_match, uint64_t version) {
+    if (if_match == WRITE_IF_MATCH_NONE) return 1;
+    if (if_match == WRITE_IF_MATCH_ANY) return version > 0;
+    return version == (uint64_t)if_match;
+}
+
+static int parse_fixed_digits(const char *s, const char *end, int count, int *out) {
+    if (end - s < count) return -1;
+    int value = 0;
+    for (int i = 0; i < count; i++) {
+        if (!isdigit((unsigned char)s[i])) return -1;
+        value = value * 10 + (s[i] - '0');
+    }
+    *out = value;
+    return 0;
+}
+
+/* Days since 1970-01-01 of a proleptic Gregorian date. */
+static int64_t days_from_civil(int64_t y, int m, int d) {
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+/*
+ * Accepts unix seconds ("1714557600", a fraction is dropped) or an ISO 8601
+ * date/time ("2024-05-01", "2024-05-01T10:00:00.5Z", "...+08:00"); times
+ * without an offset are taken as UTC.
+ */
+int parse_timestamp(const char *s, size_t len, int64_t *out_ts) {
+    const char *p = s;
+    const char *end = s + len;
+    if (len == 0) return -1;
+
+    const char *digits = p < end && *p == '-' ? p + 1 : p;
+    const char *q = digits;
+    while (q < end && isdigit((unsigned char)*q)) q++;
+    if (q > digits && (q == end || *q == '.')) {
+        if (q < end) {
+            const char *frac = ++q;
+            while (q < end && isdigit((unsigned char)*q)) q++;
+            if (q == frac || q != end) return -1;
+        }
+        char buf[32];
+        size_t n = (size_t)(q - s);
+        if (n >= sizeof(buf)) return -1;
+        memcpy(buf, s, n);
+        buf[n] = '\0';
+        errno = 0;
+        long long value = strtoll(buf, NULL, 10);
+        if (errno != 0) return -1;
+        *out_ts = (int64_t)value;
+        return 0;
+    }
+
+    int year, month, day, hour = 0, minute = 0, second = 0;
+    if (parse_fixed_digits(p, end, 4, &year) != 0 || end - p < 10 || p[4] != '-' || p[7] != '-' ||
+        parse_fixed_digits(p + 5, end, 2, &month) != 0 || parse_fixed_digits(p + 8, end, 2, &day) != 0) {
+        return -1;
+    }
+    p += 10;
+    if (p < end && (*p == 'T' || *p == ' ')) {
+        p++;
+        if (parse_fixed_digits(p, end, 2, &hour) != 0 || end - p < 5 || p[2] != ':' || parse_fixed_digits(p + 3, end, 2, &minute) != 0) {
+            return -1;
+        }
+        p += 5;
+        if (p < end && *p == ':') {
+            if (parse_fixed_digits(p + 1, end, 2, &second) != 0) return -1;
+            p += 3;
+            if (p < end && (*p == '.' || *p == ',')) {
+                p++;
+                const char *frac = p;
+                while (p < end && isdigit((unsigned char)*p)) p++;
+                if (p == frac) return -1;
+            }
         }
     }
-    return is_valid_key(logical);
+    int offset_sec = 0;
+    if (p < end && (*p == 'Z' || *p == 'z')) {
+        p++;
+    } else if (p < end && (*p == '+' || *p == '-')) {
+        int sign = *p == '-' ? -1 : 1;
+        int off_h, off_m;
+        p++;
+        if (parse_fixed_digits(p, end, 2, &off_h) != 0) return -1;
+        p += 2;
+        if (p < end && *p == ':') p++;
+        if (parse_fixed_digits(p, end, 2, &off_m) != 0) return -1;
+        p += 2;
+        offset_sec = sign * (off_h * 3600 + off_m * 60);
+    }
+    if (p != end || month < 1 || month > 12 || day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60) return -1;
+
+    *out_ts = days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second - offset_sec;
+    return 0;
+}
+
+int shard_db_path(const char *db_path, int shard, char *out, size_t out_len) {
+    int written = shard == 0 ? snprintf(out, out_len, "%s", db_path) : snprintf(out, out_len, "%s.shard%d", db_path, shard);
+    if (written <= 0 || (size_t)written >= out_len) return -1;
+    return 0;
 }
 
 int parse_bind_addr(const char *bind_addr_str, char *host, size_t host_len, int *port) {
@@ -99,6 +288,52 @@ int set_nonblocking(int fd) {
     return 0;
 }
 
+int open_listen_socket(const char *host, int port, int backlog, int reuse_port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) <= 0) {
+        log_error("invalid bind host: %s", host);
+        return -1;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        log_error("socket creation failed: errno=%d", errno);
+        return -1;
+    }
+
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+#ifdef SO_REUSEPORT
+    if (reuse_port) setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+#else
+    (void)reuse_port;
+#endif
+
+    int buf_bytes = 65535;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf_bytes, sizeof(buf_bytes));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buf_bytes, sizeof(buf_bytes));
+
+    if (set_nonblocking(fd) != 0) {
+        log_error("set_nonblocking failed: errno=%d", errno);
+        close(fd);
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        log_error("bind failed: errno=%d", errno);
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, backlog) < 0) {
+        log_error("listen failed: errno=%d", errno);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
 int socket_send_flags(void) {
 #ifdef MSG_NOSIGNAL
     return MSG_NOSIGNAL;
@@ -0,0 +1,291 @@
+#include "server_internal.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VALUE_CACHE_SHARDS 64
+#define VALUE_CACHE_INIT_BUCKETS 256
+
+typedef struct cache_entry {
+    uint32_t hash;
+    shared_buf_t *response;
+    size_t body_off;
+    /* The same value gzip-encoded, or NULL when it is not worth compressing. */
+    shared_buf_t *gzip_response;
+    size_t gzip_body_off;
+    uint64_t version;
+    size_t charge;
+    struct cache_entry *hash_next;
+    struct cache_entry *lru_prev;
+    struct cache_entry *lru_next;
+    char key[];
+} cache_entry_t;
+
+/*
+ * Each shard is an independent chained hash table plus an LRU list (head is
+ * most recently used) under one mutex. invalidate_seq counts invalidations
+ * in the shard; a miss hands it out as a ticket, and a fill whose ticket is
+ * stale is dropped, because the value it read may predate a commit.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    cache_entry_t **buckets;
+    size_t bucket_count;
+    size_t entries;
+    size_t gzip_entries;
+    size_t bytes;
+    uint64_t invalidate_seq;
+    cache_entry_t *lru_head;
+    cache_entry_t *lru_tail;
+    long long hits;
+    long long misses;
+    long long evictions;
+    long long invalidations;
+    long long stale_fills;
+} cache_shard_t;
+
+typedef struct {
+    pthread_once_t once;
+    size_t max_bytes;
+    cache_shard_t shards[VALUE_CACHE_SHARDS];
+} value_cache_t;
+
+static value_cache_t g_cache = {
+    .once = PTHREAD_ONCE_INIT,
+    .max_bytes = DEFAULT_VALUE_CACHE_BYTES,
+};
+
+static void init_shards(void) {
+    for (int i = 0; i < VALUE_CACHE_SHARDS; i++) {
+        pthread_mutex_init(&g_cache.shards[i].mutex, NULL);
+    }
+}
+
+static uint32_t hash_key(const char *key) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static cache_shard_t *shard_for(uint32_t hash) {
+    pthread_once(&g_cache.once, init_shards);
+    return &g_cache.shards[(hash >> 16) % VALUE_CACHE_SHARDS];
+}
+
+static size_t shard_budget(void) {
+    return g_cache.max_bytes / VALUE_CACHE_SHARDS;
+}
+
+static void lru_unlink(cache_shard_t *shard, cache_entry_t *entry) {
+    if (entry->lru_prev) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void lru_push_front(cache_shard_t *shard, cache_entry_t *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head) {
+        shard->lru_head->lru_prev = entry;
+    } else {
+        shard->lru_tail = entry;
+    }
+    shard->lru_head = entry;
+}
+
+static cache_entry_t **find_slot(cache_shard_t *shard, uint32_t hash, const char *key) {
+    if (!shard->buckets) return NULL;
+    cache_entry_t **slot = &shard->buckets[hash & (shard->bucket_count - 1)];
+    while (*slot && ((*slot)->hash != hash || strcmp((*slot)->key, key) != 0)) {
+        slot = &(*slot)->hash_next;
+    }
+    return slot;
+}
+
+static void remove_entry(cache_shard_t *shard, cache_entry_t **slot) {
+    cache_entry_t *entry = *slot;
+    *slot = entry->hash_next;
+    lru_unlink(shard, entry);
+    shard->entries--;
+    if (entry->gzip_response) shard->gzip_entries--;
+    shard->bytes -= entry->charge;
+    shared_buf_release(entry->response);
+    shared_buf_release(entry->gzip_response);
+    free(entry);
+}
+
+static int grow_buckets(cache_shard_t *shard) {
+    size_t count = shard->bucket_count ? shard->bucket_count * 2 : VALUE_CACHE_INIT_BUCKETS;
+    cache_entry_t **buckets = (cache_entry_t **)calloc(count, sizeof(cache_entry_t *));
+    if (!buckets) return -1;
+    for (size_t i = 0; i < shard->bucket_count; i++) {
+        cache_entry_t *entry = shard->buckets[i];
+        while (entry) {
+            cache_entry_t *next = entry->hash_next;
+            size_t idx = entry->hash & (count - 1);
+            entry->hash_next = buckets[idx];
+            buckets[idx] = entry;
+            entry = next;
+        }
+    }
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->bucket_count = count;
+    return 0;
+}
+
+static void evict_to_budget(cache_shard_t *shard, size_t budget) {
+    while (shard->bytes > budget && shard->lru_tail) {
+        cache_entry_t *victim = shard->lru_tail;
+        remove_entry(shard, find_slot(shard, victim->hash, victim->key));
+        shard->evictions++;
+    }
+}
+
+void value_cache_configure(const value_cache_config_t *config) {
+    if (!config) return;
+    g_cache.max_bytes = config->max_bytes;
+    value_cache_clear();
+}
+
+shared_buf_t *value_cache_lookup(
+    const char *storage_key, int want_gzip, size_t *out_body_off, uint64_t *out_version, uint64_t *out_ticket) {
+    uint32_t hash = hash_key(storage_key);
+    cache_shard_t *shard = shard_for(hash);
+    shared_buf_t *response = NULL;
+
+    pthread_mutex_lock(&shard->mutex);
+    cache_entry_t **slot = find_slot(shard, hash, storage_key);
+    if (slot && *slot) {
+        cache_entry_t *entry = *slot;
+        lru_unlink(shard, entry);
+        lru_push_front(shard, entry);
+        if (want_gzip && entry->gzip_response) {
+            response = shared_buf_retain(entry->gzip_response);
+            *out_body_off = entry->gzip_body_off;
+        } else {
+            response = shared_buf_retain(entry->response);
+            *out_body_off = entry->body_off;
+        }
+        *out_version = entry->version;
+        shard->hits++;
+    } else {
+        shard->misses++;
+    }
+    *out_ticket = shard->invalidate_seq;
+    pthread_mutex_unlock(&shard->mutex);
+    return response;
+}
+
+void value_cache_fill(
+    const char *storage_key,
+    uint64_t ticket,
+    shared_buf_t *response,
+    size_t body_off,
+    shared_buf_t *gzip_response,
+    size_t gzip_body_off,
+    uint64_t version) {
+    size_t key_len = strlen(storage_key);
+    size_t charge = sizeof(cache_entry_t) + key_len + 1 + response->len + (gzip_response ? gzip_response->len : 0);
+    size_t budget = shard_budget();
+    if (charge > budget) return;
+
+    uint32_t hash = hash_key(storage_key);
+    cache_shard_t *shard = shard_for(hash);
+    pthread_mutex_lock(&shard->mutex);
+    if (shard->invalidate_seq != ticket) {
+        shard->stale_fills++;
+        pthread_mutex_unlock(&shard->mutex);
+        return;
+    }
+    if (shard->entries >= shard->bucket_count && grow_buckets(shard) != 0) {
+        pthread_mutex_unlock(&shard->mutex);
+        return;
+    }
+
+    cache_entry_t **slot = find_slot(shard, hash, storage_key);
+    if (*slot) remove_entry(shard, slot);
+
+    cache_entry_t *entry = (cache_entry_t *)malloc(sizeof(cache_entry_t) + key_len + 1);
+    if (!entry) {
+        pthread_mutex_unlock(&shard->mutex);
+        return;
+    }
+    entry->hash = hash;
+    entry->response = shared_buf_retain(response);
+    entry->body_off = body_off;
+    entry->gzip_response = shared_buf_retain(gzip_response);
+    entry->gzip_body_off = gzip_body_off;
+    entry->version = version;
+    entry->charge = charge;
+    memcpy(entry->key, storage_key, key_len + 1);
+    slot = find_slot(shard, hash, storage_key);
+    entry->hash_next = *slot;
+    *slot = entry;
+    lru_push_front(shard, entry);
+    shard->entries++;
+    if (gzip_response) shard->gzip_entries++;
+    shard->bytes += charge;
+    evict_to_budget(shard, budget);
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void value_cache_invalidate(const char *storage_key) {
+    uint32_t hash = hash_key(storage_key);
+    cache_shard_t *shard = shard_for(hash);
+    pthread_mutex_lock(&shard->mutex);
+    shard->invalidate_seq++;
+    cache_entry_t **slot = find_slot(shard, hash, storage_key);
+    if (slot && *slot) {
+        remove_entry(shard, slot);
+        shard->invalidations++;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void value_cache_clear(void) {
+    pthread_once(&g_cache.once, init_shards);
+    for (int i = 0; i < VALUE_CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &g_cache.shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        shard->invalidate_seq++;
+        while (shard->lru_head) {
+            cache_entry_t *entry = shard->lru_head;
+            remove_entry(shard, find_slot(shard, entry->hash, entry->key));
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+void value_cache_stats_snapshot(value_cache_stats_t *out_stats) {
+    if (!out_stats) return;
+    memset(out_stats, 0, sizeof(*out_stats));
+    pthread_once(&g_cache.once, init_shards);
+    out_stats->max_bytes = g_cache.max_bytes;
+    for (int i = 0; i < VALUE_CACHE_SHARDS; i++) {
+        cache_shard_t *shard = &g_cache.shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        out_stats->entries += shard->entries;
+        out_stats->gzip_entries += shard->gzip_entries;
+        out_stats->bytes += shard->bytes;
+        out_stats->hits += shard->hits;
+        out_stats->misses += shard->misses;
+        out_stats->evictions += shard->evictions;
+        out_stats->invalidations += shard->invalidations;
+        out_stats->stale_fills += shard->stale_fills;
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
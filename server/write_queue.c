@@ -3,10 +3,10 @@
 #include "server_internal.h"
 #include "logger.h"
 
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <pthread.h>
 #include <sqlite3.h>
 #include <stdio.h>
@@ -18,67 +18,110 @@
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#endif
+
+/*
+ * A job is referenced by its dispatcher and by whoever takes its completion
+ * from the completion queue; the last of the two to let go frees it. A job
+ * superseded while queued hands its dispatcher reference to the job that
+ * replaced it, and is answered with that job's outcome.
+ */
 typedef struct write_job {
     char logical_key[128];
     char storage_key[256];
     char account_id[128];
     char log_id[96];
-    char pending_path[512];
+    journal_entry_t *journal_entry;
+    uint64_t version;
+    int op;
+    int64_t if_match;
     char *payload;
     size_t payload_len;
-    int refcount;
-    int completed;
-    int abandoned;
+    atomic_int refcount;
+    /* The completion was pushed; set early when the job is answered 202. */
+    int acked;
     int status_code;
     int sqlite_rc;
     int sqlite_ext;
     int retry_count;
+    int journal_error;
     char backup_path[512];
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
+    uint64_t submit_ns;
+    /* Of the oldest job it supersedes; when the queued-ack policy starts counting. */
+    uint64_t first_submit_ns;
+    write_completion_queue_t *completions;
+    write_completion_t completion;
+    uint32_t key_hash;
+    int indexed;
     struct write_job *next;
+    struct write_job *prev;
+    struct write_job *index_next;
+    /* Jobs this one superseded, newest first, linked through merged_next. */
+    struct write_job *merged;
+    struct write_job *merged_next;
 } write_job_t;
 
+#define WRITE_QUEUE_INDEX_BUCKETS 1024
+
 typedef struct {
     pthread_mutex_t mutex;
     pthread_cond_t cond;
     pthread_t thread;
+    int shard;
     int running;
     int stopping;
-    int refcount;
     sqlite3 *db;
-    sqlite3_stmt *upsert_stmt;
+    kv_writer_t writer;
     char db_path[512];
     int queue_depth;
+    size_t queue_bytes;
+    write_dispatch_config_t config;
+    int last_batch_size;
+    int max_batch_size;
+    long long batch_count;
     char last_success_logid[96];
     char last_error_logid[96];
+    long long last_success_seq;
+    long long last_error_seq;
+    long long superseded_count;
     write_job_t *head;
     write_job_t *tail;
+    /* Queued jobs that a later unconditional PUT of the same key may supersede. */
+    write_job_t *index[WRITE_QUEUE_INDEX_BUCKETS];
 } write_dispatcher_t;
 
-static write_dispatcher_t g_dispatcher = {
+/*
+ * One dispatcher per shard, each with its own queue, thread and database
+ * file. Jobs are routed by storage_key_shard(), so every write of one
+ * account goes through the same FIFO and stays ordered.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    int refcount;
+    atomic_int shard_count;
+    write_dispatch_config_t config;
+    char db_path[512];
+    write_dispatcher_t shards[MAX_WRITE_SHARDS];
+} write_dispatch_pool_t;
+
+static write_dispatch_pool_t g_pool = {
     .mutex = PTHREAD_MUTEX_INITIALIZER,
-    .cond = PTHREAD_COND_INITIALIZER,
+    .shard_count = DEFAULT_WRITE_SHARDS,
+    .config = {
+        .batch_max_jobs = DEFAULT_WRITE_BATCH_MAX_JOBS,
+        .batch_max_bytes = DEFAULT_WRITE_BATCH_MAX_BYTES,
+        .batch_linger_us = DEFAULT_WRITE_BATCH_LINGER_US,
+        .shard_count = DEFAULT_WRITE_SHARDS,
+        .queued_ack_ms = DEFAULT_WRITE_QUEUED_ACK_MS,
+        .queue_max_jobs = DEFAULT_WRITE_QUEUE_MAX_JOBS,
+        .queue_max_bytes = DEFAULT_WRITE_QUEUE_MAX_BYTES,
+    },
 };
 
-static int fsync_directory(const char *dir_path) {
-    DIR *d = opendir(dir_path);
-    if (!d) return -1;
-    int fd = dirfd(d);
-    if (fd < 0) {
-        closedir(d);
-        return -1;
-    }
-    int rc = fsync(fd);
-    closedir(d);
-    return rc;
-}
-
-static int remove_pending_write(const char *path) {
-    if (!path || path[0] == '\0') return -1;
-    if (unlink(path) != 0) return -1;
-    return fsync_directory("pending_writes");
-}
+/* Orders last_success/last_error updates across shards for diagnostics. */
+static atomic_llong g_event_seq;
 
 static int persist_failed_payload(
     const char *key,
@@ -126,31 +169,162 @@ static int persist_failed_payload(
 }
 
 static void write_job_release(write_job_t *job) {
-    int should_free = 0;
-    pthread_mutex_lock(&job->mutex);
-    job->refcount--;
-    should_free = (job->refcount == 0);
-    pthread_mutex_unlock(&job->mutex);
-    if (!should_free) return;
-
-    pthread_cond_destroy(&job->cond);
-    pthread_mutex_destroy(&job->mutex);
+    if (atomic_fetch_sub(&job->refcount, 1) != 1) return;
+    write_job_t *merged = job->merged;
+    while (merged) {
+        write_job_t *next = merged->merged_next;
+        write_job_release(merged);
+        merged = next;
+    }
     free(job->payload);
     free(job);
 }
 
-static void finalize_job(write_job_t *job) {
-    pthread_mutex_lock(&job->mutex);
-    job->completed = 1;
-    pthread_cond_broadcast(&job->cond);
-    pthread_mutex_unlock(&job->mutex);
+int write_completion_queue_init(write_completion_queue_t *queue) {
+    if (!queue) return -1;
+    memset(queue, 0, sizeof(*queue));
+    atomic_init(&queue->head, NULL);
+    atomic_init(&queue->signaled, 0);
+    queue->fd = -1;
+    queue->signal_fd = -1;
+#if defined(__linux__)
+    queue->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->fd < 0) return -1;
+    queue->signal_fd = queue->fd;
+#else
+    int fds[2];
+    if (pipe(fds) != 0) return -1;
+    for (int i = 0; i < 2; i++) {
+        if (set_nonblocking(fds[i]) != 0 || fcntl(fds[i], F_SETFD, FD_CLOEXEC) != 0) {
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+    }
+    queue->fd = fds[0];
+    queue->signal_fd = fds[1];
+#endif
+    return 0;
 }
 
+void write_completion_queue_destroy(write_completion_queue_t *queue) {
+    if (!queue) return;
+    write_completion_t *completion = write_completion_queue_take(queue);
+    while (completion) {
+        write_completion_t *next = completion->next;
+        write_completion_release(completion);
+        completion = next;
+    }
+    if (queue->signal_fd >= 0 && queue->signal_fd != queue->fd) close(queue->signal_fd);
+    if (queue->fd >= 0) close(queue->fd);
+    queue->fd = -1;
+    queue->signal_fd = -1;
+}
+
+/*
+ * Lock-free push onto the consumer's stack. Only the push that finds the
+ * queue unsignaled writes to the wakeup fd, so a burst of completions costs
+ * the owner one wakeup.
+ */
+static void completion_push(write_completion_queue_t *queue, write_completion_t *completion) {
+    write_completion_t *head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    do {
+        completion->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(
+        &queue->head, &head, completion, memory_order_release, memory_order_relaxed));
+    write_completion_queue_signal(queue);
+}
+
+void write_completion_queue_signal(write_completion_queue_t *queue) {
+    if (atomic_exchange(&queue->signaled, 1) == 0) {
+        uint64_t one = 1;
+        ssize_t n;
+        do {
+            n = write(queue->signal_fd, &one, sizeof(one));
+        } while (n < 0 && errno == EINTR);
+    }
+}
+
+write_completion_t *write_completion_queue_take(write_completion_queue_t *queue) {
+    uint64_t drain[8];
+    while (read(queue->fd, drain, sizeof(drain)) > 0) {
+    }
+    /* Cleared before the swap: a push that misses this take signals again. */
+    atomic_store(&queue->signaled, 0);
+    write_completion_t *completion = atomic_exchange_explicit(&queue->head, NULL, memory_order_acquire);
+    write_completion_t *fifo = NULL;
+    while (completion) {
+        write_completion_t *next = completion->next;
+        completion->next = fifo;
+        fifo = completion;
+        completion = next;
+    }
+    return fifo;
+}
+
+int write_completion_queue_wait(write_completion_queue_t *queue, int timeout_ms) {
+    if (atomic_load_explicit(&queue->head, memory_order_acquire)) return 1;
+    struct pollfd pfd = {.fd = queue->fd, .events = POLLIN};
+    int rc;
+    do {
+        rc = poll(&pfd, 1, timeout_ms);
+    } while (rc < 0 && errno == EINTR);
+    return rc;
+}
+
+void write_completion_release(write_completion_t *completion) {
+    if (!completion) return;
+    write_job_release((write_job_t *)((char *)completion - offsetof(write_job_t, completion)));
+}
+
+static void push_result(write_job_t *job, const write_job_t *outcome, int status_code) {
+    if (job->acked) return;
+    job->acked = 1;
+    write_dispatch_result_t *result = &job->completion.result;
+    result->status_code = status_code;
+    result->sqlite_rc = outcome->sqlite_rc;
+    result->sqlite_ext = outcome->sqlite_ext;
+    result->retry_count = outcome->retry_count;
+    result->journal_error = outcome->journal_error;
+    result->version = outcome->version;
+    snprintf(result->backup_path, sizeof(result->backup_path), "%s", outcome->backup_path);
+    metrics_observe_stage(METRICS_STAGE_DISPATCH_WAIT, job->submit_ns);
+    completion_push(job->completions, &job->completion);
+}
+
+/*
+ * Hands the job's outcome, or a 202 for a job still being applied, to its
+ * submitter and to those of the jobs it superseded.
+ */
+static void post_completion(write_job_t *job, int status_code) {
+    for (write_job_t *merged = job->merged; merged; merged = merged->merged_next) {
+        push_result(merged, job, status_code);
+    }
+    push_result(job, job, status_code);
+}
+
+/* The superseded jobs' records go with the job's: replaying them alone would undo it. */
+static void retire_journal_records(write_job_t *job) {
+    journal_retire(job->journal_entry);
+    job->journal_entry = NULL;
+    for (write_job_t *merged = job->merged; merged; merged = merged->merged_next) {
+        journal_retire(merged->journal_entry);
+        merged->journal_entry = NULL;
+    }
+}
+
+/*
+ * A job the dispatcher will not apply, because the shard is shutting down.
+ * Its record is replayed on the next start, so once durable it is queued.
+ */
 static void abandon_job(write_job_t *job) {
-    pthread_mutex_lock(&job->mutex);
-    job->abandoned = 1;
-    pthread_cond_broadcast(&job->cond);
-    pthread_mutex_unlock(&job->mutex);
+    if (job->acked) return;
+    if (journal_sync(job->version) != 0) {
+        job->journal_error = 1;
+        post_completion(job, 500);
+        return;
+    }
+    post_completion(job, 202);
 }
 
 static int dispatcher_open_db(write_dispatcher_t *dispatcher) {
@@ -161,7 +335,10 @@ static int dispatcher_open_db(write_dispatcher_t *dispatcher) {
             &dispatcher->db,
             SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX,
             NULL) != SQLITE_OK) {
-        log_error("write dispatcher failed to open db: %s", dispatcher->db ? sqlite3_errmsg(dispatcher->db) : "unknown");
+        log_error(
+            "write dispatcher shard=%d failed to open db: %s",
+            dispatcher->shard,
+            dispatcher->db ? sqlite3_errmsg(dispatcher->db) : "unknown");
         if (dispatcher->db) sqlite3_close(dispatcher->db);
         dispatcher->db = NULL;
         return -1;
@@ -175,14 +352,10 @@ static int dispatcher_open_db(write_dispatcher_t *dispatcher) {
     sqlite3_exec(dispatcher->db, "PRAGMA mmap_size=268435456;", NULL, NULL, NULL);
     sqlite3_exec(dispatcher->db, "PRAGMA cache_size=-32768;", NULL, NULL, NULL);
 
-    const char *upsert_sql =
-        "INSERT INTO kv_store (data_key, data_value, updated_at) VALUES (?1, ?2, strftime('%s', 'now'))"
-        " ON CONFLICT(data_key) DO UPDATE SET data_value=excluded.data_value, updated_at=excluded.updated_at";
-    if (sqlite3_prepare_v2(dispatcher->db, upsert_sql, -1, &dispatcher->upsert_stmt, NULL) != SQLITE_OK) {
-        log_error("write dispatcher failed to prepare statements: %s", sqlite3_errmsg(dispatcher->db));
+    if (kv_writer_prepare(&dispatcher->writer, dispatcher->db) != 0) {
+        log_error("write dispatcher shard=%d failed to prepare statements: %s", dispatcher->shard, sqlite3_errmsg(dispatcher->db));
         sqlite3_close(dispatcher->db);
         dispatcher->db = NULL;
-        dispatcher->upsert_stmt = NULL;
         return -1;
     }
 
@@ -190,14 +363,484 @@ static int dispatcher_open_db(write_dispatcher_t *dispatcher) {
 }
 
 static void dispatcher_close_db(write_dispatcher_t *dispatcher) {
-    sqlite3_finalize(dispatcher->upsert_stmt);
-    dispatcher->upsert_stmt = NULL;
+    kv_writer_finalize(&dispatcher->writer);
     if (dispatcher->db) sqlite3_close(dispatcher->db);
     dispatcher->db = NULL;
 }
 
+static int is_busy_code(int rc, int ext) {
+    return rc == SQLITE_BUSY || rc == SQLITE_LOCKED || ext == SQLITE_BUSY_SNAPSHOT || ext == SQLITE_BUSY_TIMEOUT;
+}
+
+static int is_busy_rc(sqlite3 *db, int rc) {
+    return is_busy_code(rc, sqlite3_extended_errcode(db));
+}
+
+static int dispatcher_is_stopping(write_dispatcher_t *dispatcher) {
+    pthread_mutex_lock(&dispatcher->mutex);
+    int stopping = dispatcher->stopping;
+    pthread_mutex_unlock(&dispatcher->mutex);
+    return stopping;
+}
+
+static void dispatcher_note_error(write_dispatcher_t *dispatcher, const write_job_t *job) {
+    pthread_mutex_lock(&dispatcher->mutex);
+    snprintf(dispatcher->last_error_logid, sizeof(dispatcher->last_error_logid), "%s", job->log_id);
+    dispatcher->last_error_seq = atomic_fetch_add(&g_event_seq, 1) + 1;
+    pthread_mutex_unlock(&dispatcher->mutex);
+}
+
+static void fail_job(write_dispatcher_t *dispatcher, write_job_t *job, int rc, int ext) {
+    job->status_code = 500;
+    job->sqlite_rc = rc;
+    job->sqlite_ext = ext;
+    if (persist_failed_payload(
+            job->logical_key,
+            job->payload,
+            job->payload_len,
+            rc,
+            ext,
+            job->backup_path,
+            sizeof(job->backup_path)) != 0) {
+        job->backup_path[0] = '\0';
+    } else {
+        /* The payload is safe in failed_writes; don't pin the journal on it. */
+        retire_journal_records(job);
+    }
+    log_error(
+        "DATA WRITE failed key=%s reason=sqlite_step_error rc=%d rc_name=%s ext=%d ext_name=%s errmsg=%s bytes=%zu backup=%s account=%s logid=%s retries=%d",
+        job->logical_key,
+        rc,
+        sqlite3_errstr(rc),
+        ext,
+        sqlite3_errstr(ext),
+        dispatcher->db ? sqlite3_errmsg(dispatcher->db) : "unknown",
+        job->payload_len,
+        job->backup_path[0] != '\0' ? job->backup_path : "none",
+        job->account_id,
+        job->log_id,
+        job->retry_count);
+    dispatcher_note_error(dispatcher, job);
+}
+
+static void reject_job(write_job_t *job, uint64_t current_version) {
+    job->status_code = 412;
+    job->version = current_version;
+    retire_journal_records(job);
+    log_warn(
+        "DATA WRITE rejected key=%s reason=precondition_failed if_match=%lld version=%llu bytes=%zu account=%s logid=%s",
+        job->logical_key,
+        (long long)job->if_match,
+        (unsigned long long)current_version,
+        job->payload_len,
+        job->account_id,
+        job->log_id);
+}
+
+/* An APPEND/PATCH against a key whose stored value is not an array. */
+static void conflict_job(write_job_t *job) {
+    job->status_code = 409;
+    retire_journal_records(job);
+    log_warn(
+        "DATA WRITE rejected key=%s reason=not_a_list op=%d bytes=%zu account=%s logid=%s",
+        job->logical_key,
+        job->op,
+        job->payload_len,
+        job->account_id,
+        job->log_id);
+}
+
+static int job_is_overdue(const write_job_t *job, uint64_t now_ns, uint64_t ack_ns) {
+    return !job->acked && now_ns - job->first_submit_ns >= ack_ns;
+}
+
+/*
+ * The queued-ack policy: a job not applied within queued_ack_ms of its
+ * submission is answered 202 once its journal record is durable, and is
+ * still applied (or replayed) afterwards. batch has already been synced.
+ * Queued jobs are in seq order, so one sync up to the last overdue one
+ * covers them all; a job that superseded older ones counts from the
+ * oldest, so the overdue jobs need not be a prefix of the queue.
+ */
+static void dispatcher_ack_overdue(write_dispatcher_t *dispatcher, write_job_t *batch) {
+    int ack_ms = dispatcher->config.queued_ack_ms;
+    if (ack_ms <= 0) return;
+    uint64_t ack_ns = (uint64_t)ack_ms * 1000000ULL;
+    uint64_t now_ns = metrics_now_ns();
+    for (write_job_t *job = batch; job; job = job->next) {
+        if (job->status_code == 0 && job_is_overdue(job, now_ns, ack_ns)) post_completion(job, 202);
+    }
+
+    uint64_t last_seq = 0;
+    pthread_mutex_lock(&dispatcher->mutex);
+    for (write_job_t *job = dispatcher->head; job; job = job->next) {
+        if (job_is_overdue(job, now_ns, ack_ns)) last_seq = job->version;
+    }
+    pthread_mutex_unlock(&dispatcher->mutex);
+    if (last_seq == 0 || journal_sync(last_seq) != 0) return;
+
+    pthread_mutex_lock(&dispatcher->mutex);
+    for (write_job_t *job = dispatcher->head; job && job->version <= last_seq; job = job->next) {
+        if (job_is_overdue(job, now_ns, ack_ns)) post_completion(job, 202);
+    }
+    pthread_mutex_unlock(&dispatcher->mutex);
+}
+
+/* Bumps every still-pending job's retry count and backs off. Returns 0 to retry. */
+static int batch_backoff(write_dispatcher_t *dispatcher, write_job_t *batch, int *attempt, int rc) {
+    (*attempt)++;
+    for (write_job_t *job = batch; job; job = job->next) {
+        if (job->status_code != 0) continue;
+        job->retry_count++;
+        metrics_count_retry();
+        log_warn(
+            "DATA WRITE retrying key=%s account=%s logid=%s attempt=%d rc=%d bytes=%zu",
+            job->logical_key,
+            job->account_id,
+            job->log_id,
+            job->retry_count,
+            rc,
+            job->payload_len);
+    }
+    if (dispatcher_is_stopping(dispatcher)) return -1;
+    dispatcher_ack_overdue(dispatcher, batch);
+    struct timespec ts = {.tv_sec = 0, .tv_nsec = (long)(20000000 * (*attempt < 10 ? *attempt : 10))};
+    nanosleep(&ts, NULL);
+    return 0;
+}
+
+static int exec_with_retry(write_dispatcher_t *dispatcher, const char *sql, write_job_t *batch, int *attempt) {
+    while (1) {
+        int rc = sqlite3_exec(dispatcher->db, sql, NULL, NULL, NULL);
+        if (rc == SQLITE_OK) return SQLITE_OK;
+        if (!is_busy_rc(dispatcher->db, rc)) return rc;
+        if (batch_backoff(dispatcher, batch, attempt, rc) != 0) return rc;
+    }
+}
+
+static void fail_pending_jobs(write_dispatcher_t *dispatcher, write_job_t *batch, int rc) {
+    int ext = dispatcher->db ? sqlite3_extended_errcode(dispatcher->db) : rc;
+    for (write_job_t *job = batch; job; job = job->next) {
+        if (job->status_code == 0) fail_job(dispatcher, job, rc, ext);
+    }
+}
+
+/* Drops the cached value of a committed key and records the change in the feed. */
+static void publish_storage_key(const char *storage_key, uint64_t version) {
+    const data_key_t *desc = storage_key_lookup(storage_key);
+    if (!desc || desc->cacheable) value_cache_invalidate(storage_key);
+    change_feed_append(storage_key, version);
+}
+
+void write_publish_committed(int op, const char *storage_key, const char *payload, size_t payload_len, uint64_t version) {
+    if (op != WRITE_OP_BATCH) {
+        publish_storage_key(storage_key, version);
+        return;
+    }
+    size_t pos = 0;
+    kv_batch_entry_t entry;
+    while (kv_batch_next(payload, payload_len, &pos, &entry) == 1) {
+        char entry_key[256];
+        if (kv_batch_storage_key(storage_key, &entry, entry_key, sizeof(entry_key)) == 0) {
+            publish_storage_key(entry_key, version);
+        }
+    }
+}
+
+/*
+ * Applies every job of the batch inside one BEGIN IMMEDIATE ... COMMIT so
+ * the whole batch costs a single WAL sync. A job whose write fails is
+ * completed with 500 on its own; if SQLite rolled the transaction back
+ * because of it, the batch is replayed without that job. If-Match is checked
+ * inside the transaction, so it sees every earlier job of the same shard.
+ */
+static void dispatcher_apply_batch(write_dispatcher_t *dispatcher, write_job_t *batch) {
+    int attempt = 0;
+
+    while (1) {
+        int rc = exec_with_retry(dispatcher, "BEGIN IMMEDIATE", batch, &attempt);
+        if (rc != SQLITE_OK) {
+            if (!is_busy_rc(dispatcher->db, rc)) fail_pending_jobs(dispatcher, batch, rc);
+            return;
+        }
+
+        int restart = 0;
+        for (write_job_t *job = batch; job; job = job->next) {
+            if (job->status_code != 0) continue;
+            rc = SQLITE_DONE;
+            int ext = SQLITE_OK;
+            if (job->if_match != WRITE_IF_MATCH_NONE) {
+                uint64_t current = 0;
+                rc = kv_read_version(&dispatcher->writer, job->storage_key, &current);
+                ext = sqlite3_extended_errcode(dispatcher->db);
+                if (rc == SQLITE_DONE && !write_precondition_holds(job->if_match, current)) {
+                    reject_job(job, current);
+                    continue;
+                }
+            }
+            if (rc == SQLITE_DONE && job->op == WRITE_OP_BATCH) {
+                uint64_t current = 0;
+                uint64_t step_start = metrics_now_ns();
+                rc = kv_write_apply_batch(&dispatcher->writer, job->storage_key, job->payload, job->payload_len, job->version, &current);
+                metrics_observe_stage(METRICS_STAGE_SQLITE_STEP, step_start);
+                ext = dispatcher->writer.last_ext;
+                if (rc == KV_WRITE_PRECONDITION_FAILED) {
+                    reject_job(job, current);
+                    continue;
+                }
+            } else if (rc == SQLITE_DONE) {
+                uint64_t step_start = metrics_now_ns();
+                rc = kv_write_apply(&dispatcher->writer, job->op, job->storage_key, job->payload, job->payload_len, job->version);
+                metrics_observe_stage(METRICS_STAGE_SQLITE_STEP, step_start);
+                ext = dispatcher->writer.last_ext;
+            }
+            if (rc == SQLITE_DONE) continue;
+            if (rc == KV_WRITE_NOT_LIST) {
+                conflict_job(job);
+                continue;
+            }
+
+            if (is_busy_code(rc, ext)) {
+                sqlite3_exec(dispatcher->db, "ROLLBACK", NULL, NULL, NULL);
+                if (batch_backoff(dispatcher, batch, &attempt, rc) != 0) return;
+                restart = 1;
+                break;
+            }
+
+            fail_job(dispatcher, job, rc, ext);
+            if (sqlite3_get_autocommit(dispatcher->db)) {
+                restart = 1;
+                break;
+            }
+        }
+        if (restart) continue;
+
+        rc = exec_with_retry(dispatcher, "COMMIT", batch, &attempt);
+        if (rc != SQLITE_OK) {
+            if (!sqlite3_get_autocommit(dispatcher->db)) {
+                sqlite3_exec(dispatcher->db, "ROLLBACK", NULL, NULL, NULL);
+            }
+            if (!is_busy_rc(dispatcher->db, rc)) fail_pending_jobs(dispatcher, batch, rc);
+            return;
+        }
+        break;
+    }
+
+    const write_job_t *last_success = NULL;
+    for (write_job_t *job = batch; job; job = job->next) {
+        if (job->status_code != 0) continue;
+        retire_journal_records(job);
+        /* Before the submitter sees 204, so no later GET, change read or follower can miss it. */
+        write_publish_committed(job->op, job->storage_key, job->payload, job->payload_len, job->version);
+        replication_publish(job->op, job->storage_key, job->payload, job->payload_len, job->version);
+        job->status_code = 204;
+        last_success = job;
+        log_info(
+            "DATA WRITE key=%s status=stored bytes=%zu account=%s logid=%s retries=%d",
+            job->logical_key,
+            job->payload_len,
+            job->account_id,
+            job->log_id,
+            job->retry_count);
+    }
+    if (last_success) {
+        change_feed_notify();
+        pthread_mutex_lock(&dispatcher->mutex);
+        snprintf(dispatcher->last_success_logid, sizeof(dispatcher->last_success_logid), "%s", last_success->log_id);
+        dispatcher->last_success_seq = atomic_fetch_add(&g_event_seq, 1) + 1;
+        pthread_mutex_unlock(&dispatcher->mutex);
+    }
+}
+
+static uint32_t hash_storage_key(const char *key) {
+    uint32_t hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        hash ^= *p;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Only a blind full replace makes every earlier write of its key irrelevant to the outcome. */
+static int job_supersedes(const write_job_t *job) {
+    return job->op == WRITE_OP_PUT && job->if_match == WRITE_IF_MATCH_NONE;
+}
+
+static write_job_t **index_find(write_dispatcher_t *dispatcher, const char *storage_key, uint32_t hash) {
+    write_job_t **slot = &dispatcher->index[hash & (WRITE_QUEUE_INDEX_BUCKETS - 1)];
+    while (*slot && ((*slot)->key_hash != hash || strcmp((*slot)->storage_key, storage_key) != 0)) {
+        slot = &(*slot)->index_next;
+    }
+    return slot;
+}
+
+static void index_remove(write_dispatcher_t *dispatcher, write_job_t *job) {
+    if (!job->indexed) return;
+    write_job_t **slot = index_find(dispatcher, job->storage_key, job->key_hash);
+    if (*slot == job) *slot = job->index_next;
+    job->index_next = NULL;
+    job->indexed = 0;
+}
+
+static void queue_unlink(write_dispatcher_t *dispatcher, write_job_t *job) {
+    if (job->prev) {
+        job->prev->next = job->next;
+    } else {
+        dispatcher->head = job->next;
+    }
+    if (job->next) {
+        job->next->prev = job->prev;
+    } else {
+        dispatcher->tail = job->prev;
+    }
+    job->next = NULL;
+    job->prev = NULL;
+    if (dispatcher->queue_depth > 0) dispatcher->queue_depth--;
+    dispatcher->queue_bytes -= job->payload_len;
+}
+
+/*
+ * Queues job behind everything already submitted to its shard. A blind PUT
+ * takes the place of the still-queued write of the same key it replaces;
+ * any other write keeps the ones before it from being merged into later
+ * ones, so their outcomes stay their own. Called with the dispatcher mutex
+ * held.
+ */
+static void dispatcher_enqueue(write_dispatcher_t *dispatcher, write_job_t *job) {
+    if (job->op == WRITE_OP_BATCH) {
+        /* A batch counts as a write of each of its keys. */
+        size_t pos = 0;
+        kv_batch_entry_t entry;
+        while (kv_batch_next(job->payload, job->payload_len, &pos, &entry) == 1) {
+            char storage_key[256];
+            if (kv_batch_storage_key(job->storage_key, &entry, storage_key, sizeof(storage_key)) != 0) continue;
+            write_job_t *older = *index_find(dispatcher, storage_key, hash_storage_key(storage_key));
+            if (older) index_remove(dispatcher, older);
+        }
+    }
+    job->key_hash = hash_storage_key(job->storage_key);
+    write_job_t *older = *index_find(dispatcher, job->storage_key, job->key_hash);
+    if (older) index_remove(dispatcher, older);
+
+    if (older && job_supersedes(job)) {
+        queue_unlink(dispatcher, older);
+        job->first_submit_ns = older->first_submit_ns;
+        older->merged_next = older->merged;
+        older->merged = NULL;
+        job->merged = older;
+        /* Nothing reads a superseded payload again. */
+        free(older->payload);
+        older->payload = NULL;
+        dispatcher->superseded_count++;
+        log_info(
+            "DATA WRITE key=%s status=superseded bytes=%zu account=%s logid=%s by=%s",
+            older->logical_key,
+            older->payload_len,
+            older->account_id,
+            older->log_id,
+            job->log_id);
+    }
+
+    job->prev = dispatcher->tail;
+    if (dispatcher->tail) {
+        dispatcher->tail->next = job;
+    } else {
+        dispatcher->head = job;
+    }
+    dispatcher->tail = job;
+    dispatcher->queue_depth++;
+    dispatcher->queue_bytes += job->payload_len;
+
+    if (job_supersedes(job)) {
+        write_job_t **bucket = &dispatcher->index[job->key_hash & (WRITE_QUEUE_INDEX_BUCKETS - 1)];
+        job->index_next = *bucket;
+        *bucket = job;
+        job->indexed = 1;
+    }
+}
+
+/*
+ * Detaches up to batch_max_jobs / batch_max_bytes jobs from the queue head,
+ * waiting up to batch_linger_us for more work to arrive when the queue is
+ * short. Called with the dispatcher mutex held; always takes at least one job.
+ */
+static write_job_t *dispatcher_take_batch(write_dispatcher_t *dispatcher, int *out_count) {
+    const write_dispatch_config_t *cfg = &dispatcher->config;
+    if (cfg->batch_linger_us > 0 && dispatcher->queue_depth < cfg->batch_max_jobs &&
+        dispatcher->queue_bytes < cfg->batch_max_bytes) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)cfg->batch_linger_us * 1000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (!dispatcher->stopping && dispatcher->queue_depth < cfg->batch_max_jobs &&
+               dispatcher->queue_bytes < cfg->batch_max_bytes) {
+            if (pthread_cond_timedwait(&dispatcher->cond, &dispatcher->mutex, &deadline) == ETIMEDOUT) break;
+        }
+    }
+
+    write_job_t *batch = NULL;
+    write_job_t *batch_tail = NULL;
+    int count = 0;
+    size_t bytes = 0;
+    while (dispatcher->head) {
+        write_job_t *job = dispatcher->head;
+        if (count > 0 && (count >= cfg->batch_max_jobs || bytes + job->payload_len > cfg->batch_max_bytes)) break;
+        /* Once taken it is being applied; a later PUT no longer replaces it. */
+        index_remove(dispatcher, job);
+        queue_unlink(dispatcher, job);
+        if (batch_tail) {
+            batch_tail->next = job;
+        } else {
+            batch = job;
+        }
+        batch_tail = job;
+        count++;
+        bytes += job->payload_len;
+    }
+    *out_count = count;
+    return batch;
+}
+
+static void release_batch(write_job_t *batch) {
+    while (batch) {
+        write_job_t *next = batch->next;
+        batch->next = NULL;
+        if (batch->status_code == 0) {
+            abandon_job(batch);
+        } else {
+            post_completion(batch, batch->status_code);
+        }
+        write_job_release(batch);
+        batch = next;
+    }
+}
+
+/*
+ * Makes the batch's journal records durable before any of it is applied;
+ * one sync covers every record appended so far, on all shards.
+ */
+static int dispatcher_sync_batch(write_dispatcher_t *dispatcher, write_job_t *batch) {
+    uint64_t last_seq = 0;
+    for (write_job_t *job = batch; job; job = job->next) last_seq = job->version;
+    if (journal_sync(last_seq) == 0) return 0;
+    for (write_job_t *job = batch; job; job = job->next) {
+        job->status_code = 500;
+        job->journal_error = 1;
+        log_error(
+            "DATA WRITE failed key=%s reason=journal_sync_failed bytes=%zu account=%s logid=%s",
+            job->logical_key,
+            job->payload_len,
+            job->account_id,
+            job->log_id);
+        dispatcher_note_error(dispatcher, job);
+    }
+    return -1;
+}
+
 static void *write_dispatcher_thread_entry(void *arg) {
     write_dispatcher_t *dispatcher = (write_dispatcher_t *)arg;
+    affinity_pin_dispatcher(dispatcher->shard);
 
     while (1) {
         pthread_mutex_lock(&dispatcher->mutex);
@@ -210,206 +853,193 @@ static void *write_dispatcher_thread_entry(void *arg) {
             break;
         }
 
-        write_job_t *job = dispatcher->head;
-        if (job) {
-            dispatcher->head = job->next;
-            if (!dispatcher->head) dispatcher->tail = NULL;
-            job->next = NULL;
-            if (dispatcher->queue_depth > 0) {
-                dispatcher->queue_depth--;
-            }
-        }
+        int count = 0;
+        write_job_t *batch = dispatcher_take_batch(dispatcher, &count);
         int stopping = dispatcher->stopping;
         pthread_mutex_unlock(&dispatcher->mutex);
 
-        if (!job) continue;
-        if (stopping) {
-            abandon_job(job);
-            write_job_release(job);
+        if (!batch) continue;
+        if (stopping || dispatcher_sync_batch(dispatcher, batch) != 0) {
+            release_batch(batch);
             continue;
         }
 
         if (dispatcher_open_db(dispatcher) != 0) {
-            job->status_code = 500;
-            pthread_mutex_lock(&dispatcher->mutex);
-            snprintf(dispatcher->last_error_logid, sizeof(dispatcher->last_error_logid), "%s", job->log_id);
-            pthread_mutex_unlock(&dispatcher->mutex);
-            finalize_job(job);
-            write_job_release(job);
+            for (write_job_t *job = batch; job; job = job->next) {
+                job->status_code = 500;
+                dispatcher_note_error(dispatcher, job);
+            }
+            release_batch(batch);
             continue;
         }
 
-        while (1) {
-            sqlite3_reset(dispatcher->upsert_stmt);
-            sqlite3_clear_bindings(dispatcher->upsert_stmt);
-            sqlite3_bind_text(dispatcher->upsert_stmt, 1, job->storage_key, -1, SQLITE_TRANSIENT);
-            sqlite3_bind_text(dispatcher->upsert_stmt, 2, job->payload, -1, SQLITE_TRANSIENT);
-
-            int rc = sqlite3_step(dispatcher->upsert_stmt);
-            int ext = sqlite3_extended_errcode(dispatcher->db);
-
-            if (rc == SQLITE_DONE) {
-                if (remove_pending_write(job->pending_path) != 0) {
-                    job->status_code = 500;
-                    pthread_mutex_lock(&dispatcher->mutex);
-                    snprintf(dispatcher->last_error_logid, sizeof(dispatcher->last_error_logid), "%s", job->log_id);
-                    pthread_mutex_unlock(&dispatcher->mutex);
-                    log_error(
-                        "DATA WRITE failed key=%s reason=pending_write_cleanup_failed path=%s account=%s logid=%s",
-                        job->logical_key,
-                        job->pending_path,
-                        job->account_id,
-                        job->log_id);
-                } else {
-                    job->status_code = 204;
-                    pthread_mutex_lock(&dispatcher->mutex);
-                    snprintf(dispatcher->last_success_logid, sizeof(dispatcher->last_success_logid), "%s", job->log_id);
-                    pthread_mutex_unlock(&dispatcher->mutex);
-                    log_info(
-                        "DATA WRITE key=%s status=stored bytes=%zu account=%s logid=%s retries=%d",
-                        job->logical_key,
-                        job->payload_len,
-                        job->account_id,
-                        job->log_id,
-                        job->retry_count);
-                }
-                finalize_job(job);
-                break;
-            }
-
-            if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED || ext == SQLITE_BUSY_SNAPSHOT || ext == SQLITE_BUSY_TIMEOUT) {
-                job->retry_count++;
-                log_warn(
-                    "DATA WRITE retrying key=%s account=%s logid=%s attempt=%d rc=%d bytes=%zu",
-                    job->logical_key,
-                    job->account_id,
-                    job->log_id,
-                    job->retry_count,
-                    rc,
-                    job->payload_len);
-
-                pthread_mutex_lock(&dispatcher->mutex);
-                int should_stop = dispatcher->stopping;
-                pthread_mutex_unlock(&dispatcher->mutex);
-                if (should_stop) {
-                    abandon_job(job);
-                    break;
-                }
+        dispatcher_apply_batch(dispatcher, batch);
+        journal_checkpoint();
+        metrics_observe_batch(count);
 
-                struct timespec ts = {.tv_sec = 0, .tv_nsec = (long)(20000000 * (job->retry_count < 10 ? job->retry_count : 10))};
-                nanosleep(&ts, NULL);
-                continue;
-            }
-
-            job->status_code = 500;
-            job->sqlite_rc = rc;
-            job->sqlite_ext = ext;
-            if (persist_failed_payload(
-                    job->logical_key,
-                    job->payload,
-                    job->payload_len,
-                    rc,
-                    ext,
-                    job->backup_path,
-                    sizeof(job->backup_path)) != 0) {
-                job->backup_path[0] = '\0';
-            }
-            log_error(
-                "DATA WRITE failed key=%s reason=sqlite_step_error rc=%d rc_name=%s ext=%d ext_name=%s errmsg=%s bytes=%zu backup=%s account=%s logid=%s retries=%d",
-                job->logical_key,
-                rc,
-                sqlite3_errstr(rc),
-                ext,
-                sqlite3_errstr(ext),
-                sqlite3_errmsg(dispatcher->db),
-                job->payload_len,
-                job->backup_path[0] != '\0' ? job->backup_path : "none",
-                job->account_id,
-                job->log_id,
-                job->retry_count);
-            pthread_mutex_lock(&dispatcher->mutex);
-            snprintf(dispatcher->last_error_logid, sizeof(dispatcher->last_error_logid), "%s", job->log_id);
-            pthread_mutex_unlock(&dispatcher->mutex);
-            finalize_job(job);
-            break;
-        }
+        pthread_mutex_lock(&dispatcher->mutex);
+        dispatcher->last_batch_size = count;
+        if (count > dispatcher->max_batch_size) dispatcher->max_batch_size = count;
+        dispatcher->batch_count++;
+        pthread_mutex_unlock(&dispatcher->mutex);
 
-        write_job_release(job);
+        release_batch(batch);
+        dispatcher_ack_overdue(dispatcher, NULL);
     }
 
     dispatcher_close_db(dispatcher);
     return NULL;
 }
 
+void write_dispatcher_configure(const write_dispatch_config_t *config) {
+    if (!config) return;
+    pthread_mutex_lock(&g_pool.mutex);
+    g_pool.config = *config;
+    if (g_pool.config.batch_max_jobs <= 0) g_pool.config.batch_max_jobs = 1;
+    if (g_pool.config.batch_max_bytes == 0) g_pool.config.batch_max_bytes = DEFAULT_WRITE_BATCH_MAX_BYTES;
+    if (g_pool.config.batch_linger_us < 0) g_pool.config.batch_linger_us = 0;
+    if (g_pool.config.queued_ack_ms < 0) g_pool.config.queued_ack_ms = 0;
+    if (g_pool.config.queue_max_jobs < 0) g_pool.config.queue_max_jobs = 0;
+    if (g_pool.config.shard_count <= 0) g_pool.config.shard_count = DEFAULT_WRITE_SHARDS;
+    if (g_pool.config.shard_count > MAX_WRITE_SHARDS) g_pool.config.shard_count = MAX_WRITE_SHARDS;
+    if (g_pool.refcount == 0) atomic_store(&g_pool.shard_count, g_pool.config.shard_count);
+    pthread_mutex_unlock(&g_pool.mutex);
+}
+
+int write_dispatch_shard_count(void) {
+    return atomic_load(&g_pool.shard_count);
+}
+
+/* An empty queue always takes one write, however large. Called with the dispatcher mutex held. */
+static int queue_has_room(const write_dispatcher_t *dispatcher, size_t payload_len) {
+    const write_dispatch_config_t *cfg = &dispatcher->config;
+    if (cfg->queue_max_jobs > 0 && dispatcher->queue_depth >= cfg->queue_max_jobs) return 0;
+    if (cfg->queue_max_bytes > 0 && dispatcher->queue_bytes > 0 && dispatcher->queue_bytes + payload_len > cfg->queue_max_bytes) return 0;
+    return 1;
+}
+
+static void stop_shard(write_dispatcher_t *dispatcher) {
+    pthread_mutex_lock(&dispatcher->mutex);
+    dispatcher->stopping = 1;
+    pthread_cond_broadcast(&dispatcher->cond);
+    write_job_t *jobs = dispatcher->head;
+    dispatcher->head = NULL;
+    dispatcher->tail = NULL;
+    memset(dispatcher->index, 0, sizeof(dispatcher->index));
+    pthread_mutex_unlock(&dispatcher->mutex);
+
+    while (jobs) {
+        write_job_t *next = jobs->next;
+        jobs->next = NULL;
+        abandon_job(jobs);
+        write_job_release(jobs);
+        jobs = next;
+    }
+
+    if (dispatcher->running) {
+        pthread_join(dispatcher->thread, NULL);
+    }
+
+    pthread_mutex_lock(&dispatcher->mutex);
+    dispatcher->running = 0;
+    dispatcher->stopping = 0;
+    dispatcher->db_path[0] = '\0';
+    pthread_mutex_unlock(&dispatcher->mutex);
+}
+
+static pthread_once_t g_shards_once = PTHREAD_ONCE_INIT;
+
+static void init_shard_locks(void) {
+    for (int i = 0; i < MAX_WRITE_SHARDS; i++) {
+        pthread_mutex_init(&g_pool.shards[i].mutex, NULL);
+        pthread_cond_init(&g_pool.shards[i].cond, NULL);
+        g_pool.shards[i].shard = i;
+    }
+}
+
+static int start_shard(write_dispatcher_t *dispatcher, const char *db_path) {
+    pthread_mutex_lock(&dispatcher->mutex);
+    dispatcher->stopping = 0;
+    dispatcher->config = g_pool.config;
+    dispatcher->queue_depth = 0;
+    dispatcher->queue_bytes = 0;
+    dispatcher->last_batch_size = 0;
+    dispatcher->max_batch_size = 0;
+    dispatcher->batch_count = 0;
+    dispatcher->last_success_logid[0] = '\0';
+    dispatcher->last_error_logid[0] = '\0';
+    dispatcher->last_success_seq = 0;
+    dispatcher->last_error_seq = 0;
+    dispatcher->superseded_count = 0;
+    dispatcher->head = NULL;
+    dispatcher->tail = NULL;
+    memset(dispatcher->index, 0, sizeof(dispatcher->index));
+    if (shard_db_path(db_path, dispatcher->shard, dispatcher->db_path, sizeof(dispatcher->db_path)) != 0 ||
+        pthread_create(&dispatcher->thread, NULL, write_dispatcher_thread_entry, dispatcher) != 0) {
+        dispatcher->db_path[0] = '\0';
+        pthread_mutex_unlock(&dispatcher->mutex);
+        log_error("failed to start write dispatcher shard=%d", dispatcher->shard);
+        return -1;
+    }
+    dispatcher->running = 1;
+    pthread_mutex_unlock(&dispatcher->mutex);
+    return 0;
+}
+
 int write_dispatcher_acquire(const char *db_path) {
     if (!db_path || db_path[0] == '\0') return -1;
+    pthread_once(&g_shards_once, init_shard_locks);
 
-    pthread_mutex_lock(&g_dispatcher.mutex);
-    if (g_dispatcher.refcount > 0 && strcmp(g_dispatcher.db_path, db_path) != 0) {
-        pthread_mutex_unlock(&g_dispatcher.mutex);
-        log_error("write dispatcher path mismatch existing=%s requested=%s", g_dispatcher.db_path, db_path);
+    pthread_mutex_lock(&g_pool.mutex);
+    if (g_pool.refcount > 0 && strcmp(g_pool.db_path, db_path) != 0) {
+        pthread_mutex_unlock(&g_pool.mutex);
+        log_error("write dispatcher path mismatch existing=%s requested=%s", g_pool.db_path, db_path);
         return -1;
     }
 
-    if (g_dispatcher.refcount == 0) {
-        snprintf(g_dispatcher.db_path, sizeof(g_dispatcher.db_path), "%s", db_path);
-        g_dispatcher.stopping = 0;
-        g_dispatcher.queue_depth = 0;
-        g_dispatcher.last_success_logid[0] = '\0';
-        g_dispatcher.last_error_logid[0] = '\0';
-        g_dispatcher.head = NULL;
-        g_dispatcher.tail = NULL;
-        if (pthread_create(&g_dispatcher.thread, NULL, write_dispatcher_thread_entry, &g_dispatcher) != 0) {
-            g_dispatcher.db_path[0] = '\0';
-            pthread_mutex_unlock(&g_dispatcher.mutex);
-            log_error("failed to start write dispatcher thread");
+    if (g_pool.refcount == 0) {
+        if (journal_open() != 0) {
+            pthread_mutex_unlock(&g_pool.mutex);
+            log_error("failed to open write journal");
             return -1;
         }
-        g_dispatcher.running = 1;
+        int shard_count = g_pool.config.shard_count;
+        atomic_store(&g_pool.shard_count, shard_count);
+        for (int i = 0; i < shard_count; i++) {
+            if (start_shard(&g_pool.shards[i], db_path) != 0) {
+                while (--i >= 0) stop_shard(&g_pool.shards[i]);
+                pthread_mutex_unlock(&g_pool.mutex);
+                journal_close();
+                return -1;
+            }
+        }
+        snprintf(g_pool.db_path, sizeof(g_pool.db_path), "%s", db_path);
     }
 
-    g_dispatcher.refcount++;
-    pthread_mutex_unlock(&g_dispatcher.mutex);
+    g_pool.refcount++;
+    pthread_mutex_unlock(&g_pool.mutex);
     return 0;
 }
 
 void write_dispatcher_release(void) {
-    pthread_mutex_lock(&g_dispatcher.mutex);
-    if (g_dispatcher.refcount == 0) {
-        pthread_mutex_unlock(&g_dispatcher.mutex);
+    pthread_mutex_lock(&g_pool.mutex);
+    if (g_pool.refcount == 0) {
+        pthread_mutex_unlock(&g_pool.mutex);
         return;
     }
 
-    g_dispatcher.refcount--;
-    if (g_dispatcher.refcount > 0) {
-        pthread_mutex_unlock(&g_dispatcher.mutex);
+    g_pool.refcount--;
+    if (g_pool.refcount > 0) {
+        pthread_mutex_unlock(&g_pool.mutex);
         return;
     }
 
-    g_dispatcher.stopping = 1;
-    pthread_cond_broadcast(&g_dispatcher.cond);
-    write_job_t *jobs = g_dispatcher.head;
-    g_dispatcher.head = NULL;
-    g_dispatcher.tail = NULL;
-    pthread_mutex_unlock(&g_dispatcher.mutex);
+    int shard_count = atomic_load(&g_pool.shard_count);
+    for (int i = 0; i < shard_count; i++) stop_shard(&g_pool.shards[i]);
+    g_pool.db_path[0] = '\0';
+    pthread_mutex_unlock(&g_pool.mutex);
 
-    while (jobs) {
-        write_job_t *next = jobs->next;
-        jobs->next = NULL;
-        abandon_job(jobs);
-        write_job_release(jobs);
-        jobs = next;
-    }
-
-    if (g_dispatcher.running) {
-        pthread_join(g_dispatcher.thread, NULL);
-    }
-
-    pthread_mutex_lock(&g_dispatcher.mutex);
-    g_dispatcher.running = 0;
-    g_dispatcher.stopping = 0;
-    g_dispatcher.db_path[0] = '\0';
-    pthread_mutex_unlock(&g_dispatcher.mutex);
+    journal_close();
 }
 
 int write_dispatch_submit(
@@ -417,13 +1047,14 @@ int write_dispatch_submit(
     const char *storage_key,
     const char *payload,
     size_t payload_len,
-    const char *pending_path,
+    int op,
+    int64_t if_match,
     const char *account_id,
     const char *log_id,
-    int wait_timeout_ms,
-    write_dispatch_result_t *out_result) {
-    if (!logical_key || !storage_key || !payload || !pending_path || !account_id || !log_id || !out_result) return -1;
-    memset(out_result, 0, sizeof(*out_result));
+    write_completion_queue_t *completions,
+    void *owner,
+    uint64_t owner_handle) {
+    if (!logical_key || !storage_key || !payload || !account_id || !log_id || !completions) return -1;
 
     write_job_t *job = (write_job_t *)calloc(1, sizeof(write_job_t));
     if (!job) return -1;
@@ -437,73 +1068,93 @@ int write_dispatch_submit(
     memcpy(job->payload, payload, payload_len);
     job->payload[payload_len] = '\0';
     job->payload_len = payload_len;
-    job->refcount = 2;
+    atomic_init(&job->refcount, 2);
     snprintf(job->logical_key, sizeof(job->logical_key), "%s", logical_key);
     snprintf(job->storage_key, sizeof(job->storage_key), "%s", storage_key);
     snprintf(job->account_id, sizeof(job->account_id), "%s", account_id);
     snprintf(job->log_id, sizeof(job->log_id), "%s", log_id);
-    snprintf(job->pending_path, sizeof(job->pending_path), "%s", pending_path);
-    pthread_mutex_init(&job->mutex, NULL);
-    pthread_cond_init(&job->cond, NULL);
-
-    pthread_mutex_lock(&g_dispatcher.mutex);
-    if (!g_dispatcher.running || g_dispatcher.stopping) {
-        pthread_mutex_unlock(&g_dispatcher.mutex);
-        write_job_release(job);
-        write_job_release(job);
+    job->op = op;
+    job->if_match = if_match;
+    job->completions = completions;
+    job->completion.owner = owner;
+    job->completion.owner_handle = owner_handle;
+
+    pthread_once(&g_shards_once, init_shard_locks);
+    write_dispatcher_t *dispatcher = &g_pool.shards[storage_key_shard(storage_key, atomic_load(&g_pool.shard_count))];
+    pthread_mutex_lock(&dispatcher->mutex);
+    if (!dispatcher->running || dispatcher->stopping) {
+        pthread_mutex_unlock(&dispatcher->mutex);
+        free(job->payload);
+        free(job);
         return -1;
     }
-
-    if (g_dispatcher.tail) {
-        g_dispatcher.tail->next = job;
-    } else {
-        g_dispatcher.head = job;
-    }
-    g_dispatcher.tail = job;
-    g_dispatcher.queue_depth++;
-    pthread_cond_signal(&g_dispatcher.cond);
-    pthread_mutex_unlock(&g_dispatcher.mutex);
-
-    pthread_mutex_lock(&job->mutex);
-    if (!job->completed && !job->abandoned && wait_timeout_ms > 0) {
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec += wait_timeout_ms / 1000;
-        ts.tv_nsec += (long)(wait_timeout_ms % 1000) * 1000000L;
-        if (ts.tv_nsec >= 1000000000L) {
-            ts.tv_sec += 1;
-            ts.tv_nsec -= 1000000000L;
-        }
-
-        while (!job->completed && !job->abandoned) {
-            int wait_rc = pthread_cond_timedwait(&job->cond, &job->mutex, &ts);
-            if (wait_rc == ETIMEDOUT) break;
-        }
+    if (!queue_has_room(dispatcher, payload_len)) {
+        pthread_mutex_unlock(&dispatcher->mutex);
+        free(job->payload);
+        free(job);
+        return WRITE_DISPATCH_OVERLOADED;
     }
 
-    int completed = job->completed;
-    if (completed) {
-        out_result->completed = 1;
-        out_result->status_code = job->status_code;
-        out_result->sqlite_rc = job->sqlite_rc;
-        out_result->sqlite_ext = job->sqlite_ext;
-        out_result->retry_count = job->retry_count;
-        snprintf(out_result->backup_path, sizeof(out_result->backup_path), "%s", job->backup_path);
+    /*
+     * Appended under the shard lock so seq order is queue order. The record
+     * is only written here; the dispatcher syncs it before applying the job.
+     */
+    if (journal_write(storage_key, log_id, op, if_match, payload, payload_len, &job->journal_entry) != 0) {
+        pthread_mutex_unlock(&dispatcher->mutex);
+        free(job->payload);
+        free(job);
+        return WRITE_DISPATCH_JOURNAL_FAILED;
     }
-    pthread_mutex_unlock(&job->mutex);
+    job->version = journal_entry_seq(job->journal_entry);
+    job->submit_ns = metrics_now_ns();
+    job->first_submit_ns = job->submit_ns;
+    dispatcher_enqueue(dispatcher, job);
+    pthread_cond_signal(&dispatcher->cond);
+    pthread_mutex_unlock(&dispatcher->mutex);
+    return 0;
+}
 
-    write_job_release(job);
-    return completed ? 0 : 1;
+int write_dispatch_has_room(const char *account_id, size_t payload_len) {
+    pthread_once(&g_shards_once, init_shard_locks);
+    write_dispatcher_t *dispatcher = &g_pool.shards[storage_key_shard(account_id, atomic_load(&g_pool.shard_count))];
+    pthread_mutex_lock(&dispatcher->mutex);
+    int room = !dispatcher->running || queue_has_room(dispatcher, payload_len);
+    pthread_mutex_unlock(&dispatcher->mutex);
+    return room;
 }
 
 void write_dispatch_diagnostics_snapshot(write_dispatch_diagnostics_t *out_diag) {
     if (!out_diag) return;
     memset(out_diag, 0, sizeof(*out_diag));
 
-    pthread_mutex_lock(&g_dispatcher.mutex);
-    out_diag->running = g_dispatcher.running && !g_dispatcher.stopping;
-    out_diag->queue_depth = g_dispatcher.queue_depth;
-    snprintf(out_diag->last_success_logid, sizeof(out_diag->last_success_logid), "%s", g_dispatcher.last_success_logid);
-    snprintf(out_diag->last_error_logid, sizeof(out_diag->last_error_logid), "%s", g_dispatcher.last_error_logid);
-    pthread_mutex_unlock(&g_dispatcher.mutex);
+    pthread_mutex_lock(&g_pool.mutex);
+    int shard_count = g_pool.refcount > 0 ? atomic_load(&g_pool.shard_count) : 0;
+    out_diag->shard_count = atomic_load(&g_pool.shard_count);
+    out_diag->running = shard_count > 0;
+    long long success_seq = 0;
+    long long error_seq = 0;
+    for (int i = 0; i < shard_count; i++) {
+        write_dispatcher_t *dispatcher = &g_pool.shards[i];
+        pthread_mutex_lock(&dispatcher->mutex);
+        if (!dispatcher->running || dispatcher->stopping) out_diag->running = 0;
+        out_diag->queue_depth += dispatcher->queue_depth;
+        out_diag->batch_count += dispatcher->batch_count;
+        out_diag->superseded_count += dispatcher->superseded_count;
+        if (dispatcher->last_batch_size > out_diag->last_batch_size) out_diag->last_batch_size = dispatcher->last_batch_size;
+        if (dispatcher->max_batch_size > out_diag->max_batch_size) out_diag->max_batch_size = dispatcher->max_batch_size;
+        if (dispatcher->last_success_seq > success_seq) {
+            success_seq = dispatcher->last_success_seq;
+            snprintf(out_diag->last_success_logid, sizeof(out_diag->last_success_logid), "%s", dispatcher->last_success_logid);
+        }
+        if (dispatcher->last_error_seq > error_seq) {
+            error_seq = dispatcher->last_error_seq;
+            snprintf(out_diag->last_error_logid, sizeof(out_diag->last_error_logid), "%s", dispatcher->last_error_logid);
+        }
+        out_diag->shards[i].queue_depth = dispatcher->queue_depth;
+        out_diag->shards[i].last_batch_size = dispatcher->last_batch_size;
+        out_diag->shards[i].batch_count = dispatcher->batch_count;
+        out_diag->shards[i].superseded_count = dispatcher->superseded_count;
+        pthread_mutex_unlock(&dispatcher->mutex);
+    }
+    pthread_mutex_unlock(&g_pool.mutex);
 }